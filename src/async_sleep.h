@@ -1,5 +1,6 @@
 #pragma once
 
+#include <boost/asio/spawn.hpp>
 #include <boost/asio/steady_timer.hpp>
 #include "namespaces.h"
 
@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+#include "admission_filter.h"
+
+using namespace std;
+using namespace ouinet;
+
+static size_t round_up_to_power_of_two(size_t n)
+{
+    size_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+AdmissionFilter::AdmissionFilter(Config config)
+    : _config(move(config))
+{
+    _config.width = round_up_to_power_of_two(max<size_t>(_config.width, 16));
+    _config.depth = max(_config.depth, 1u);
+
+    _mask = _config.width - 1;
+    _sample_size = _config.sample_size ? _config.sample_size
+                                       : 10 * _config.width;
+
+    _counters.assign(_config.width * _config.depth, 0);
+}
+
+// FNV-1a, since the row hashes need 64 bits of hash everywhere
+// (`std::hash` is only as wide as `size_t`) and the same key must get
+// the same counters in any build.
+static uint64_t key_hash(const string& key)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+
+    for (unsigned char c : key) {
+        hash ^= c;
+        hash *= 0x100000001b3;
+    }
+
+    return hash;
+}
+
+// Derive the row hashes from a single one (Kirsch-Mitzenmacher).
+size_t AdmissionFilter::index(uint64_t hash, unsigned int row) const
+{
+    uint64_t h1 = hash;
+    uint64_t h2 = (hash >> 32) | (hash << 32) | 1;
+    return row * _config.width + ((h1 + row * h2) & _mask);
+}
+
+void AdmissionFilter::record(const string& key)
+{
+    // Admitting everything, do not bother counting.
+    if (_config.min_hits <= 1) return;
+
+    uint64_t hash = key_hash(key);
+
+    for (unsigned int row = 0; row < _config.depth; ++row) {
+        auto& c = _counters[index(hash, row)];
+        if (c < numeric_limits<uint8_t>::max()) ++c;
+    }
+
+    if (++_additions >= _sample_size) reset();
+}
+
+unsigned int AdmissionFilter::estimate(const string& key) const
+{
+    uint64_t hash = key_hash(key);
+
+    unsigned int ret = numeric_limits<uint8_t>::max();
+
+    for (unsigned int row = 0; row < _config.depth; ++row) {
+        ret = min<unsigned int>(ret, _counters[index(hash, row)]);
+    }
+
+    return ret;
+}
+
+bool AdmissionFilter::admit( const string& key
+                           , size_t size
+                           , Clock::duration fetch_cost)
+{
+    if (_config.min_hits <= 1 || estimate(key) >= _config.min_hits) {
+        ++_stats.admitted;
+        return true;
+    }
+
+    if (_config.min_cost_ms_per_kib) {
+        using namespace std::chrono;
+        auto cost_ms = duration_cast<milliseconds>(fetch_cost).count();
+
+        if (uint64_t(cost_ms) * 1024 >= uint64_t(_config.min_cost_ms_per_kib)
+                                        * max<size_t>(size, 1)) {
+            ++_stats.admitted;
+            ++_stats.admitted_by_cost;
+            return true;
+        }
+    }
+
+    ++_stats.rejected;
+    return false;
+}
+
+void AdmissionFilter::reset()
+{
+    for (auto& c : _counters) c >>= 1;
+    _additions /= 2;
+    ++_stats.resets;
+}
+
+std::ostream&
+ouinet::operator<<(std::ostream& os, const AdmissionFilter::Stats& s)
+{
+    return os << "admitted:"          << s.admitted
+              << " admitted_by_cost:" << s.admitted_by_cost
+              << " rejected:"         << s.rejected
+              << " resets:"           << s.resets;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace ouinet {
+
+/*
+ * Decides which contents are worth storing (and pinning) in the cache,
+ * so that contents requested only once do not churn the IPFS repository.
+ *
+ * Request frequencies are estimated TinyLFU-style: keys are counted in
+ * a count-min sketch whose counters are halved periodically, so that
+ * the estimate favours recent popularity while using constant memory.
+ *
+ * A content is admitted when its key has been seen `min_hits` times,
+ * or when it was expensive to fetch for its size.
+ */
+class AdmissionFilter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Config {
+        // Number of requests for a key before its content is admitted
+        // (one admits everything).
+        unsigned int min_hits = 1;
+        // Counters per row of the sketch, rounded up to a power of two.
+        size_t width = 64 * 1024;
+        // Rows (independent hashes) of the sketch.
+        unsigned int depth = 4;
+        // Counters are halved after this many requests
+        // (zero uses ten times the width).
+        size_t sample_size = 0;
+        // Contents taking at least this many milliseconds per KiB to fetch
+        // are admitted regardless of their frequency (zero disables).
+        unsigned int min_cost_ms_per_kib = 0;
+    };
+
+    struct Stats {
+        size_t admitted = 0;
+        // Contents admitted because of their cost, not their frequency.
+        size_t admitted_by_cost = 0;
+        size_t rejected = 0;
+        // Times that counters were halved.
+        size_t resets = 0;
+    };
+
+public:
+    AdmissionFilter(Config);
+
+    // Count a request for `key`.
+    void record(const std::string& key);
+
+    // Estimate the number of recent requests for `key`.
+    unsigned int estimate(const std::string& key) const;
+
+    // Whether the content for `key` of the given size, which took
+    // `fetch_cost` to get, should be stored.  Updates the statistics.
+    bool admit( const std::string& key
+              , size_t size
+              , Clock::duration fetch_cost);
+
+    const Config& config() const { return _config; }
+    const Stats& stats() const { return _stats; }
+
+private:
+    size_t index(uint64_t hash, unsigned int row) const;
+    void reset();
+
+private:
+    Config _config;
+    size_t _mask;
+    size_t _sample_size;
+    size_t _additions = 0;
+    // `depth` rows of `width` saturating counters.
+    std::vector<uint8_t> _counters;
+    Stats _stats;
+};
+
+std::ostream& operator<<(std::ostream&, const AdmissionFilter::Stats&);
+
+} // namespace
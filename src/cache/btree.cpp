@@ -2,6 +2,7 @@
 #include "../or_throw.h"
 #include <json.hpp>
 #include <iostream>
+#include <vector>
 
 using namespace ouinet;
 
@@ -248,6 +249,13 @@ Node::insert(Key key, Value value, asio::yield_context yield)
         }
     }
     else {
+        auto i = Entries::find(key);
+
+        if (i != Entries::end()) {
+            i->second.value = move(value);
+            return boost::none;
+        }
+
         Entries::insert(make_pair(move(key), Entry{move(value)}));
     }
 
@@ -542,6 +550,46 @@ BTree::find(const Key& key, asio::yield_context yield)
     return lazy_find(root->hash, root->node, key, CatOp(_cat_op), yield);
 }
 
+void BTree::walk( const OnNode& on_node
+                , const OnEntry& on_entry
+                , asio::yield_context yield)
+{
+    auto d = _was_destroyed;
+
+    for (auto& kv : _insert_buffer) {
+        on_entry(kv.first, kv.second);
+    }
+
+    if (!_root || _root->hash.empty()) return;
+
+    // Copies, in case the tree gets modified or destroyed while walking.
+    CatOp cat_op(_cat_op);
+    std::vector<Hash> pending{_root->hash};
+
+    while (!pending.empty()) {
+        auto hash = std::move(pending.back());
+        pending.pop_back();
+
+        on_node(hash);
+
+        Node n(this);
+
+        sys::error_code ec;
+        n.restore(hash, cat_op, yield[ec]);
+
+        if (!ec && *d) ec = asio::error::operation_aborted;
+        if (ec) return or_throw(yield, ec);
+
+        for (auto& e : n) {
+            if (e.first) on_entry(*e.first, e.second.value);
+
+            if (!e.second.child_hash.empty()) {
+                pending.push_back(std::move(e.second.child_hash));
+            }
+        }
+    }
+}
+
 void BTree::raw_insert(Key key, Value value, asio::yield_context yield)
 {
     if (!_root) _root = std::make_shared<Root>();
@@ -558,16 +606,22 @@ void BTree::raw_insert(Key key, Value value, asio::yield_context yield)
 
 void BTree::insert(Key key, Value value, asio::yield_context yield)
 {
-    if (_is_inserting) {
-        _insert_buffer.insert(std::make_pair(key, std::move(value)));
-        return;
+    std::map<Key, Value> batch;
+    batch.emplace(std::move(key), std::move(value));
+    insert(std::move(batch), yield);
+}
+
+void BTree::insert(std::map<Key, Value> batch, asio::yield_context yield)
+{
+    for (auto& kv : batch) {
+        _insert_buffer[kv.first] = std::move(kv.second);
     }
 
+    if (_is_inserting) return;
+
     _is_inserting = true;
     auto on_exit = defer([&] { _is_inserting = false; });
 
-    _insert_buffer.insert(make_pair(std::move(key), std::move(value)));
-
     auto d = _was_destroyed;
 
     sys::error_code ec;
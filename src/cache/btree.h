@@ -21,6 +21,9 @@ public:
     using AddOp    = std::function<Hash (const Value&, asio::yield_context)>;
     using RemoveOp = std::function<void (const Hash&,  asio::yield_context)>;
 
+    using OnNode  = std::function<void(const Hash&)>;
+    using OnEntry = std::function<void(const Key&, const Value&)>;
+
     struct Node; // public, but opaque
 
 public:
@@ -33,6 +36,15 @@ public:
 
     void insert(Key, Value, asio::yield_context);
 
+    // Insert all entries of the batch and store the resulting tree once.
+    // Later values in the batch override earlier values of the same key.
+    void insert(std::map<Key, Value>, asio::yield_context);
+
+    // Visit the hashes of all stored nodes reachable from the root and all
+    // entries of the tree (including buffered ones).  Nodes are read using
+    // the cat operation, the tree in memory is left untouched.
+    void walk(const OnNode&, const OnEntry&, asio::yield_context);
+
     bool check_invariants() const;
 
     std::string root_hash() const {
@@ -66,9 +66,11 @@ string CacheClient::ipfs_add(const string& data, asio::yield_context yield)
     return _ipfs_node->add(data, yield);
 }
 
-CachedContent CacheClient::get_content(string url, asio::yield_context yield)
+CachedContent CacheClient::get_content( string url
+                                      , const VariantKey& variant_key
+                                      , asio::yield_context yield)
 {
-    return ouinet::get_content(*_db, url, yield);
+    return ouinet::get_content(*_db, url, variant_key, yield);
 }
 
 void CacheClient::wait_for_db_update(boost::asio::yield_context yield)
@@ -9,6 +9,7 @@
 #include <json.hpp>
 
 #include "cached_content.h"
+#include "variants.h"
 
 namespace asio_ipfs {
     class node;
@@ -48,7 +49,11 @@ public:
     // Basically it does this: Look into the database to find the IPFS_ID
     // correspoinding to the `url`, when found, fetch the content corresponding
     // to that IPFS_ID from IPFS.
-    CachedContent get_content(std::string url, boost::asio::yield_context);
+    //
+    // `variant_key` selects the variant to get if the URL has several.
+    CachedContent get_content( std::string url
+                             , const VariantKey& variant_key
+                             , boost::asio::yield_context);
 
     void wait_for_db_update(boost::asio::yield_context);
 
@@ -1,6 +1,7 @@
 #include <boost/asio/io_service.hpp>
 #include <assert.h>
 #include <iostream>
+#include <fstream>
 #include <chrono>
 
 #include "cache_injector.h"
@@ -14,12 +15,36 @@ using namespace ouinet;
 
 namespace asio = boost::asio;
 namespace sys  = boost::system;
+namespace fs   = boost::filesystem;
+
+// Variants of the same URL are accounted for separately.
+static string storage_key(const string& url, const Variant& variant)
+{
+    if (variant.vary.empty()) return url;
+    return url + ' ' + variant.key;
+}
+
+// URLs contain no spaces.
+static string storage_key_url(const string& key)
+{
+    return key.substr(0, key.find(' '));
+}
 
 CacheInjector::CacheInjector(asio::io_service& ios, string path_to_repo)
     : _ipfs_node(new asio_ipfs::node(ios, path_to_repo))
-    , _db(new InjectorDb(*_ipfs_node, path_to_repo))
+    , _storage(new StorageManager(*_ipfs_node, path_to_repo + "/pins"))
+    , _db(new InjectorDb(*_ipfs_node, path_to_repo, _storage.get()))
+    , _storage_timer(ios)
+    , _concurrency(_queue_config.max_concurrency)
+    , _disk_work(new asio::io_service::work(_disk_ios))
     , _was_destroyed(make_shared<bool>(false))
 {
+    _disk_thread = thread([this] { _disk_ios.run(); });
+
+    asio::spawn(ios, [this, wd = _was_destroyed] (asio::yield_context yield) {
+            if (*wd) return;
+            manage_storage(yield);
+        });
 }
 
 string CacheInjector::id() const
@@ -27,33 +52,346 @@ string CacheInjector::id() const
     return _ipfs_node->id();
 }
 
+void CacheInjector::set_db_commit_window( chrono::steady_clock::duration window
+                                        , size_t max_updates)
+{
+    _db->commit_window(window);
+    _db->commit_max_updates(max_updates);
+}
+
+void CacheInjector::set_queue_config(QueueConfig config)
+{
+    _queue_config = move(config);
+    _concurrency = max(1u, _queue_config.max_concurrency);
+
+    if (!_queue_config.spill_dir.empty()) {
+        // Callbacks for contents spilled by a previous run are long gone,
+        // so there is nobody to insert them for.
+        sys::error_code ec;
+        fs::remove_all(_queue_config.spill_dir, ec);
+        fs::create_directories(_queue_config.spill_dir, ec);
+
+        if (ec) {
+            cerr << "Failed to create insert queue spill directory "
+                 << _queue_config.spill_dir << ": " << ec.message() << endl;
+            _queue_config.spill_dir.clear();
+        }
+    }
+
+    start_queued_jobs();
+}
+
+void CacheInjector::set_storage_config(StorageManager::Config config)
+{
+    _storage->set_config(move(config));
+}
+
+StorageManager::Stats CacheInjector::storage_stats() const
+{
+    return _storage->stats();
+}
+
+void CacheInjector::manage_storage(asio::yield_context yield)
+{
+    auto wd = _was_destroyed;
+    auto last_gc = Clock::now();
+
+    while (true) {
+        sys::error_code ec;
+
+        _storage_timer.expires_from_now(chrono::minutes(1));
+        _storage_timer.async_wait(yield[ec]);
+        if (*wd) return;
+
+        enforce_storage_budget(yield);
+        if (*wd) return;
+
+        auto gc_interval = _storage->config().gc_interval;
+
+        if ( gc_interval > StorageManager::Clock::duration(0)
+          && Clock::now() - last_gc >= gc_interval) {
+            last_gc = Clock::now();
+
+            auto reachable = _db->reachable_objects(yield[ec]);
+            if (*wd) return;
+
+            // An empty set means that the index is not available (yet),
+            // collecting now would unpin everything.
+            if (!ec && !reachable.empty()) {
+                _storage->collect(reachable, yield);
+                if (*wd) return;
+            }
+        }
+
+        _storage->save();
+    }
+}
+
+void CacheInjector::enforce_storage_budget(asio::yield_context yield)
+{
+    auto wd = _was_destroyed;
+
+    _storage->enforce_budget(
+        [this, wd] ( const string& key, const string& cid
+                   , asio::yield_context yield) {
+            if (*wd) return or_throw(yield, asio::error::operation_aborted);
+            _db->unreference(storage_key_url(key), cid, yield);
+        }, yield);
+}
+
+CacheInjector::QueueStats CacheInjector::insert_queue_stats() const
+{
+    return QueueStats{ _insert_queue.size()
+                     , _queued_bytes
+                     , _spilled_entries
+                     , _spilled_bytes
+                     , _dropped_entries
+                     , _job_count
+                     , _concurrency };
+}
+
+ostream& ouinet::operator<<(ostream& os, const CacheInjector::QueueStats& s)
+{
+    return os << "queued=" << s.queued_entries
+              << " queued_bytes=" << s.queued_bytes
+              << " spilled=" << s.spilled_entries
+              << " spilled_bytes=" << s.spilled_bytes
+              << " dropped=" << s.dropped_entries
+              << " jobs=" << s.running_jobs << "/" << s.concurrency;
+}
+
+bool CacheInjector::has_room_in_memory(size_t size) const
+{
+    // A single entry bigger than the limit is still accepted
+    // when nothing else is waiting in memory.
+    return _queued_bytes == 0
+        || _queued_bytes + size <= _queue_config.max_queued_bytes;
+}
+
+bool CacheInjector::can_spill(size_t size) const
+{
+    return !_queue_config.spill_dir.empty()
+        && _spilled_bytes + size <= _queue_config.max_spilled_bytes;
+}
+
+// Write the content to a new file in the spill directory (in the disk
+// thread), it is queued once written.
+void CacheInjector::spill(InsertEntry e)
+{
+    e.spill_path = _queue_config.spill_dir / to_string(_next_spill_id++);
+    _spilled_bytes += e.size;
+
+    auto value = move(e.value);
+    e.value = string();
+
+    _disk_ios.post([ this
+                   , &ios = _ipfs_node->get_io_service()
+                   , wd = _was_destroyed
+                   , value = move(value)
+                   , e = move(e)
+                   ] () mutable {
+            ofstream file(e.spill_path.native(), ofstream::binary | ofstream::trunc);
+            file.write(value.data(), value.size());
+            file.close();
+            bool ok = bool(file);
+
+            ios.post([this, wd, ok, e = move(e)] () mutable {
+                    if (*wd) return;
+                    spilled(move(e), ok);
+                });
+        });
+}
+
+// The content of `e` was written to its spill file (if `ok`).
+void CacheInjector::spilled(InsertEntry e, bool ok)
+{
+    if (!ok) {
+        cerr << "Failed to spill insert queue entry to "
+             << e.spill_path << endl;
+        _spilled_bytes -= e.size;
+        remove_spill_file(nullptr, move(e.spill_path));
+        ++_dropped_entries;
+        return e.on_insert(asio::error::no_buffer_space, string());
+    }
+
+    ++_spilled_entries;
+    enqueue(move(e));
+}
+
+// Read the content of `e` back (in the disk thread) and add it.
+// The job is already counted.
+void CacheInjector::unspill(InsertEntry e)
+{
+    --_spilled_entries;
+    _spilled_bytes -= e.size;
+
+    _disk_ios.post([ this
+                   , &ios = _ipfs_node->get_io_service()
+                   , wd = _was_destroyed
+                   , e = move(e)
+                   ] () mutable {
+            e.value.resize(e.size);
+
+            ifstream file(e.spill_path.native(), ifstream::binary);
+            file.read(&e.value[0], e.value.size());
+            bool ok = bool(file);
+            file.close();
+
+            sys::error_code ec;
+            fs::remove(e.spill_path, ec);
+
+            ios.post([this, wd, ok, e = move(e)] () mutable {
+                    if (*wd) return;
+
+                    if (!ok) {
+                        --_job_count;
+                        ++_dropped_entries;
+                        e.on_insert(asio::error::not_found, string());
+                        return start_queued_jobs();
+                    }
+
+                    add(move(e));
+                });
+        });
+}
+
+void CacheInjector::enqueue(InsertEntry e)
+{
+    // Contents inserted piece by piece may already be on disk,
+    // where they wait like deferred ones (see `spill`).
+    if (!e.spill_path.empty()) {
+        if ( _queue_config.overflow != QueueOverflow::drop
+          || has_room_in_memory(e.size)) {
+            _insert_queue.push(move(e));
+            return start_queued_jobs();
+        }
+
+        return drop(move(e));
+    }
+
+    if (has_room_in_memory(e.size)) {
+        _queued_bytes += e.size;
+        _insert_queue.push(move(e));
+        return start_queued_jobs();
+    }
+
+    if (_queue_config.overflow != QueueOverflow::drop && can_spill(e.size)) {
+        return spill(move(e));
+    }
+
+    drop(move(e));
+}
+
+void CacheInjector::drop(InsertEntry e)
+{
+    if (!e.spill_path.empty()) {
+        --_spilled_entries;
+        _spilled_bytes -= e.size;
+        remove_spill_file(nullptr, move(e.spill_path));
+    }
+
+    ++_dropped_entries;
+
+    cerr << "Insert queue full, dropping " << e.key
+         << " (" << e.size << " bytes)" << endl;
+
+    _ipfs_node->get_io_service().post(
+        [cb = move(e.on_insert)] {
+            cb(asio::error::no_buffer_space, string());
+        });
+}
+
+// Close the file (once pending writes are done) and remove it.
+void CacheInjector::remove_spill_file( shared_ptr<ofstream> file
+                                     , fs::path path)
+{
+    _disk_ios.post([file = move(file), path = move(path)] {
+            if (file) file->close();
+            sys::error_code ec;
+            fs::remove(path, ec);
+        });
+}
+
+void CacheInjector::start_queued_jobs()
+{
+    while (_job_count < _concurrency && !_insert_queue.empty()) {
+        insert_content_from_queue();
+    }
+}
+
+void CacheInjector::adapt_concurrency(Clock::duration add_latency)
+{
+    auto target = _queue_config.target_add_latency;
+
+    if (target <= Clock::duration(0)) return;
+
+    if (add_latency > target) {
+        if (_concurrency > 1) --_concurrency;
+    }
+    else if (add_latency < target / 2) {
+        if (_concurrency < _queue_config.max_concurrency) ++_concurrency;
+    }
+}
+
 void CacheInjector::insert_content_from_queue()
 {
     if (_insert_queue.empty()) return;
 
-    ++_job_count;
-
     auto e = move(_insert_queue.front());
     _insert_queue.pop();
 
+    ++_job_count;
+
+    if (!e.spill_path.empty()) return unspill(move(e));
+
+    _queued_bytes -= e.size;
+
+    // Wake up coroutines waiting for room in memory.
+    auto waiters = move(_room_waiters);
+    for (auto& w : waiters) {
+        _ipfs_node->get_io_service().post([w = move(w)] {
+                w(sys::error_code());
+            });
+    }
+
+    add(move(e));
+}
+
+// Add the content of `e` to IPFS and the index, the job is already counted.
+void CacheInjector::add(InsertEntry e)
+{
     auto wd = _was_destroyed;
 
     auto value = move(e.value);
 
     _ipfs_node->add( value
-                 , [this, e = move(e), wd]
+                 , [this, e = move(e), wd, start = Clock::now()]
                    (sys::error_code eca, string ipfs_id) {
                         if (*wd) return;
 
                         --_job_count;
-                        insert_content_from_queue();
+                        adapt_concurrency(Clock::now() - start);
+                        start_queued_jobs();
 
                         if (eca) {
                             return e.on_insert(eca, move(ipfs_id));
                         }
 
+                        _storage->on_pinned( ipfs_id, e.size
+                                           , StorageManager::Kind::content
+                                           , storage_key(e.key, e.variant));
+
+                        if (_storage->is_over_budget()) {
+                            asio::spawn( _ipfs_node->get_io_service()
+                                       , [this, wd] (asio::yield_context yield) {
+                                             if (*wd) return;
+                                             enforce_storage_budget(yield);
+                                         });
+                        }
+
                         asio::spawn( _ipfs_node->get_io_service()
                                    , [ key     = move(e.key)
+                                     , variant = move(e.variant)
                                      , ipfs_id = move(ipfs_id)
                                      , ts      = e.ts
                                      , cb      = move(e.on_insert)
@@ -69,7 +407,15 @@ void CacheInjector::insert_content_from_queue()
                                          json["value"] = ipfs_id;
                                          json["ts"]    = boost::posix_time::to_iso_extended_string(ts) + 'Z';
 
-                                         _db->update(move(key), json.dump(), yield[ec]);
+                                         if (variant.vary.empty()) {
+                                             _db->update(move(key), json.dump(), yield[ec]);
+                                         }
+                                         else {
+                                             _db->update( move(key)
+                                                        , wrap_variant(move(json), variant).dump()
+                                                        , merge_variants
+                                                        , yield[ec]);
+                                         }
                                          cb(ec, ipfs_id);
                                      });
                    });
@@ -77,19 +423,16 @@ void CacheInjector::insert_content_from_queue()
 
 void CacheInjector::insert_content( string key
                                   , const string& value
-                                  , function<void(sys::error_code, string)> cb)
+                                  , function<void(sys::error_code, string)> cb
+                                  , Variant variant)
 {
-    _insert_queue.push(
-            InsertEntry{ move(key)
-                       , move(value)
+    enqueue(InsertEntry{ move(key)
+                       , move(variant)
+                       , value
                        , boost::posix_time::microsec_clock::universal_time()
-                       , move(cb)});
-
-    if (_job_count >= _concurrency) {
-        return;
-    }
-
-    insert_content_from_queue();
+                       , move(cb)
+                       , value.size()
+                       , fs::path()});
 }
 
 string CacheInjector::insert_content( string key
@@ -100,6 +443,30 @@ string CacheInjector::insert_content( string key
                            < asio::yield_context
                            , void(sys::error_code, string)>::type;
 
+    if (_queue_config.overflow == QueueOverflow::block) {
+        auto wd = _was_destroyed;
+
+        while (!has_room_in_memory(value.size())) {
+            using room_handler_type = typename asio::handler_type
+                                        < asio::yield_context
+                                        , void(sys::error_code)>::type;
+
+            room_handler_type handler(yield);
+            asio::async_result<room_handler_type> result(handler);
+
+            _room_waiters.push_back(
+                    [h = move(handler)] (sys::error_code ec) mutable {
+                        h(ec);
+                    });
+
+            result.get();
+
+            if (*wd) {
+                return or_throw<string>(yield, asio::error::operation_aborted);
+            }
+        }
+    }
+
     handler_type handler(yield);
     asio::async_result<handler_type> result(handler);
 
@@ -110,12 +477,183 @@ string CacheInjector::insert_content( string key
     return result.get();
 }
 
-CachedContent CacheInjector::get_content(string url, asio::yield_context yield)
+unique_ptr<CacheInjector::Insertion>
+CacheInjector::begin_insert(string url, Variant variant)
+{
+    return unique_ptr<Insertion>(new Insertion(*this, move(url), move(variant)));
+}
+
+CacheInjector::Insertion::Insertion( CacheInjector& injector
+                                   , string url
+                                   , Variant variant)
+    : _injector(injector)
+    , _was_destroyed(injector._was_destroyed)
+    , _url(move(url))
+    , _variant(move(variant))
+{
+}
+
+CacheInjector::Insertion::~Insertion()
+{
+    if (!_done) discard();
+}
+
+// Move the pieces kept in memory to a new file in the spill directory.
+// The file is written by the disk thread, errors are found on `commit`.
+bool CacheInjector::Insertion::spill()
+{
+    if (!_injector.can_spill(_value.size())) return false;
+
+    auto& config = _injector._queue_config;
+
+    _spill_path = config.spill_dir / to_string(_injector._next_spill_id++);
+    _spill_file = make_shared<ofstream>();
+
+    _injector._spilled_bytes += _value.size();
+
+    _injector._disk_ios.post([ file  = _spill_file
+                             , path  = _spill_path
+                             , value = move(_value)
+                             ] {
+            file->open(path.native(), ofstream::binary | ofstream::trunc);
+            file->write(value.data(), value.size());
+        });
+
+    _value = string();
+
+    return true;
+}
+
+void CacheInjector::Insertion::append(asio::const_buffer piece)
+{
+    if (_failed || _done || *_was_destroyed) return;
+
+    auto data = asio::buffer_cast<const char*>(piece);
+    auto size = asio::buffer_size(piece);
+
+    // Without room on disk, keep everything in memory like `insert_content`.
+    if (_spill_path.empty() && _value.size() + size > insertion_memory) {
+        spill();
+    }
+
+    if (_spill_path.empty()) {
+        _value.append(data, size);
+        _size += size;
+        return;
+    }
+
+    auto& config = _injector._queue_config;
+
+    if (_injector._spilled_bytes + size > config.max_spilled_bytes) {
+        cerr << "Spill directory full, dropping " << _url << endl;
+        return discard();
+    }
+
+    _injector._spilled_bytes += size;
+    _size += size;
+
+    _injector._disk_ios.post([file = _spill_file, piece = string(data, size)] {
+            file->write(piece.data(), piece.size());
+        });
+}
+
+void CacheInjector::Insertion::discard()
+{
+    _failed = true;
+
+    if (_spill_path.empty()) {
+        string().swap(_value);
+        return;
+    }
+
+    // The spill directory is gone with the injector.
+    if (*_was_destroyed) return;
+
+    _injector._spilled_bytes -= _size;
+    _injector.remove_spill_file(move(_spill_file), move(_spill_path));
+    _spill_path.clear();
+}
+
+void CacheInjector::Insertion::commit(OnInsert on_insert)
 {
-    return ouinet::get_content(*_db, url, yield);
+    if (_done || *_was_destroyed) return;
+
+    _done = true;
+
+    auto& ios = _injector._ipfs_node->get_io_service();
+
+    if (_failed) {
+        ++_injector._dropped_entries;
+        ios.post([cb = move(on_insert)] {
+                cb(asio::error::no_buffer_space, string());
+            });
+        return;
+    }
+
+    InsertEntry e{ move(_url)
+                 , move(_variant)
+                 , move(_value)
+                 , boost::posix_time::microsec_clock::universal_time()
+                 , move(on_insert)
+                 , _size
+                 , move(_spill_path)};
+
+    if (e.spill_path.empty()) return _injector.enqueue(move(e));
+
+    // Wait for the pending writes before queueing the content.
+    _injector._disk_ios.post([ &ios
+                             , &injector = _injector
+                             , wd = _was_destroyed
+                             , file = move(_spill_file)
+                             , e = move(e)
+                             ] () mutable {
+            file->close();
+            bool ok = bool(*file);
+
+            ios.post([&injector, wd, ok, e = move(e)] () mutable {
+                    if (*wd) return;
+                    injector.spilled(move(e), ok);
+                });
+        });
+}
+
+CachedContent CacheInjector::get_content( string url
+                                        , const VariantKey& variant_key
+                                        , asio::yield_context yield)
+{
+    Variant variant;
+
+    auto content = ouinet::get_content(*_db, url
+        , [&] (const vector<string>& vary) {
+              variant.vary = vary;
+              variant.key  = variant_key ? variant_key(vary) : string();
+              return variant.key;
+          }
+        , yield);
+
+    _storage->touch(storage_key(url, variant));
+
+    return content;
 }
 
 CacheInjector::~CacheInjector()
 {
     *_was_destroyed = true;
+
+    _storage_timer.cancel();
+
+    // Let pending writes finish before the spill directory is removed.
+    _disk_work.reset();
+    _disk_thread.join();
+
+    auto& ios = _ipfs_node->get_io_service();
+
+    for (auto& w : _room_waiters) {
+        ios.post([w = move(w)] { w(asio::error::operation_aborted); });
+    }
+
+    if (!_queue_config.spill_dir.empty()) {
+        sys::error_code ec;
+        fs::remove_all(_queue_config.spill_dir, ec);
+    }
 }
@@ -1,13 +1,23 @@
 #pragma once
 
+#include <boost/asio/buffer.hpp>
 #include <boost/asio/spawn.hpp>
 #include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/system/error_code.hpp>
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <fstream>
 #include <functional>
+#include <iosfwd>
+#include <list>
 #include <memory>
 #include <queue>
+#include <thread>
 
 #include "cached_content.h"
+#include "storage_manager.h"
+#include "variants.h"
 
 namespace asio_ipfs { class node; }
 
@@ -18,13 +28,95 @@ class InjectorDb;
 class CacheInjector {
 public:
     using OnInsert = std::function<void(boost::system::error_code, std::string)>;
+    using Clock = std::chrono::steady_clock;
+
+    // What to do with a new insertion when the in-memory queue is full.
+    enum class QueueOverflow {
+        // Fail the insertion with `no_buffer_space`.
+        drop,
+        // Keep the content in the spill directory until a job is free
+        // (or drop it if the spill directory is full too).
+        defer,
+        // Make coroutine callers wait until there is room in memory,
+        // callers passing a callback have their content deferred.
+        block,
+    };
+
+    struct QueueConfig {
+        // Limit to the size of contents waiting for insertion in memory.
+        size_t max_queued_bytes = 64 * 1024 * 1024;
+        QueueOverflow overflow = QueueOverflow::defer;
+        // Where deferred contents are kept, no deferring if empty.
+        boost::filesystem::path spill_dir;
+        size_t max_spilled_bytes = 1024 * 1024 * 1024;
+        // Maximum number of simultaneous IPFS additions.
+        unsigned int max_concurrency = 8;
+        // The number of simultaneous IPFS additions is reduced when they take
+        // longer than this, and increased again when they take less than
+        // half of it (zero keeps `max_concurrency` additions).
+        Clock::duration target_add_latency = std::chrono::seconds(2);
+    };
+
+    struct QueueStats {
+        size_t queued_entries;
+        size_t queued_bytes;
+        size_t spilled_entries;
+        size_t spilled_bytes;
+        size_t dropped_entries;
+        unsigned int running_jobs;
+        unsigned int concurrency;
+    };
+
+    // A content which is given piece by piece, see `begin_insert`.
+    class Insertion {
+    public:
+        Insertion(const Insertion&) = delete;
+        Insertion& operator=(const Insertion&) = delete;
+
+        // Drops the content unless it was committed.
+        ~Insertion();
+
+        void append(boost::asio::const_buffer);
+
+        // Bytes appended so far.
+        size_t size() const { return _size; }
+
+        // Queue the content for insertion, like `insert_content` does.
+        void commit(OnInsert);
+
+    private:
+        friend class CacheInjector;
+
+        Insertion(CacheInjector&, std::string url, Variant);
+
+        bool spill();
+        void discard();
+
+    private:
+        CacheInjector& _injector;
+        std::shared_ptr<bool> _was_destroyed;
+        std::string _url;
+        Variant _variant;
+        // The first pieces, or all of them if they are small.
+        std::string _value;
+        // Not empty once the pieces are written to disk.
+        boost::filesystem::path _spill_path;
+        std::shared_ptr<std::ofstream> _spill_file;
+        size_t _size = 0;
+        bool _failed = false;
+        bool _done = false;
+    };
 
 private:
     struct InsertEntry {
         std::string key;
+        Variant variant;
         std::string value;
         boost::posix_time::ptime ts;
         OnInsert on_insert;
+        size_t size;
+        // Not empty if the value was moved to disk.
+        boost::filesystem::path spill_path;
     };
 
 public:
@@ -38,41 +130,107 @@ public:
     // "https://ipfs.io/ipns/" + ipfs.id()
     std::string id() const;
 
+    // Database updates arriving within `window` of each other are committed
+    // (stored, saved and published) together, up to `max_updates` at a time.
+    void set_db_commit_window( std::chrono::steady_clock::duration window
+                             , size_t max_updates);
+
+    void set_queue_config(QueueConfig);
+
+    QueueStats insert_queue_stats() const;
+
+    // Set the storage budget and garbage collection of pinned objects.
+    void set_storage_config(StorageManager::Config);
+
+    StorageManager::Stats storage_stats() const;
+
     // Insert `content` into IPFS and store its IPFS ID under the `url` in the
     // database. The IPFS ID is also returned as a parameter to the callback
     // function.
     //
     // When testing or debugging, the content can be found here:
     // "https://ipfs.io/ipfs/" + <IPFS ID>
+    //
+    // If the content is a `variant` of the URL (see "variants.h"), it is
+    // stored along the other variants already in the database.
     void insert_content( std::string url
                        , const std::string& content
-                       , OnInsert);
+                       , OnInsert
+                       , Variant variant = Variant());
 
     std::string insert_content( std::string url
                               , const std::string& content
                               , boost::asio::yield_context);
 
+    // Start inserting a content which is only available in pieces,
+    // e.g. while it is being received.  Only the first pieces are kept
+    // in memory: once they take more than `insertion_memory` bytes
+    // they go to the spill directory (if there is one),
+    // so that the content need not be held as a whole until it is added.
+    // Nothing is inserted unless `Insertion::commit` is called.
+    std::unique_ptr<Insertion> begin_insert( std::string url
+                                           , Variant variant = Variant());
+
+    static const size_t insertion_memory = 256 * 1024;
+
     // Find the content previously stored by the injector under `url`.
     // The content is returned in the parameter of the callback function.
     //
     // Basically it does this: Look into the database to find the IPFS_ID
     // correspoinding to the `url`, when found, fetch the content corresponding
     // to that IPFS_ID from IPFS.
-    CachedContent get_content(std::string url, boost::asio::yield_context);
+    CachedContent get_content( std::string url
+                             , const VariantKey&
+                             , boost::asio::yield_context);
 
     ~CacheInjector();
 
 private:
     void insert_content_from_queue();
+    void start_queued_jobs();
+
+    bool has_room_in_memory(size_t) const;
+    void enqueue(InsertEntry);
+    bool can_spill(size_t) const;
+    void spill(InsertEntry);
+    void spilled(InsertEntry, bool ok);
+    void unspill(InsertEntry);
+    void add(InsertEntry);
+    void drop(InsertEntry);
+    void remove_spill_file( std::shared_ptr<std::ofstream>
+                          , boost::filesystem::path);
+
+    void adapt_concurrency(Clock::duration add_latency);
+
+    void manage_storage(boost::asio::yield_context);
+    void enforce_storage_budget(boost::asio::yield_context);
 
 private:
     std::unique_ptr<asio_ipfs::node> _ipfs_node;
+    std::unique_ptr<StorageManager> _storage;
     std::unique_ptr<InjectorDb> _db;
+    boost::asio::steady_timer _storage_timer;
     std::queue<InsertEntry> _insert_queue;
-    const unsigned int _concurrency = 8;
+    QueueConfig _queue_config;
+    size_t _queued_bytes = 0;
+    size_t _spilled_entries = 0;
+    size_t _spilled_bytes = 0;
+    size_t _dropped_entries = 0;
+    uint64_t _next_spill_id = 0;
+    // Coroutines blocked until there is room in the queue.
+    std::list<std::function<void(boost::system::error_code)>> _room_waiters;
+    unsigned int _concurrency;
     unsigned int _job_count = 0;
+    // Contents (and pieces of insertions) are written to and read from
+    // the spill directory by this thread, in order, so that the I/O service
+    // is not blocked.
+    boost::asio::io_service _disk_ios;
+    std::unique_ptr<boost::asio::io_service::work> _disk_work;
+    std::thread _disk_thread;
     std::shared_ptr<bool> _was_destroyed;
 };
 
+std::ostream& operator<<(std::ostream&, const CacheInjector::QueueStats&);
+
 } // namespace
 
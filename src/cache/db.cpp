@@ -2,6 +2,8 @@
 #include <asio_ipfs.h>
 #include "republisher.h"
 #include "btree.h"
+#include "storage_manager.h"
+#include "variants.h"
 #include "../or_throw.h"
 
 #include <boost/asio/io_service.hpp>
@@ -21,9 +23,11 @@ static BTree::CatOp make_cat_operation(asio_ipfs::node& ipfs_node)
     };
 }
 
-static BTree::AddOp make_add_operation(asio_ipfs::node& ipfs_node)
+static BTree::AddOp make_add_operation( asio_ipfs::node& ipfs_node
+                                      , StorageManager* storage)
 {
-    return [&ipfs_node] (const BTree::Value& value, asio::yield_context yield) {
+    return [&ipfs_node, storage]
+           (const BTree::Value& value, asio::yield_context yield) {
         sys::error_code ec;
 
         auto ret = ipfs_node.add(value, yield[ec]);
@@ -32,14 +36,24 @@ static BTree::AddOp make_add_operation(asio_ipfs::node& ipfs_node)
         ipfs_node.pin(ret, yield[ec]);
         if (ec) return or_throw(yield, ec, move(ret));
 
+        if (storage) {
+            storage->on_pinned(ret, value.size(), StorageManager::Kind::node);
+        }
+
         return ret;
     };
 }
 
-static BTree::RemoveOp make_remove_operation(asio_ipfs::node& ipfs_node)
+static BTree::RemoveOp make_remove_operation( asio_ipfs::node& ipfs_node
+                                            , StorageManager* storage)
 {
-    return [&ipfs_node] (const BTree::Value& hash, asio::yield_context yield) {
-        ipfs_node.unpin(hash, yield);
+    return [&ipfs_node, storage]
+           (const BTree::Value& hash, asio::yield_context yield) {
+        sys::error_code ec;
+        ipfs_node.unpin(hash, yield[ec]);
+        if (ec) return or_throw(yield, ec);
+
+        if (storage) storage->on_unpinned(hash);
     };
 }
 
@@ -121,16 +135,19 @@ ClientDb::ClientDb(asio_ipfs::node& ipfs_node, string path_to_repo, string ipns)
         });
 }
 
-InjectorDb::InjectorDb(asio_ipfs::node& ipfs_node, string path_to_repo)
+InjectorDb::InjectorDb( asio_ipfs::node& ipfs_node
+                      , string path_to_repo
+                      , StorageManager* storage)
     : _path_to_repo(move(path_to_repo))
     , _ipns(ipfs_node.id())
     , _ipfs_node(ipfs_node)
     , _republisher(new Republisher(_ipfs_node))
     , _has_callbacks(_ipfs_node.get_io_service())
+    , _commit_timer(_ipfs_node.get_io_service())
     , _was_destroyed(make_shared<bool>(false))
     , _db_map(make_unique<BTree>( make_cat_operation(ipfs_node)
-                                , make_add_operation(ipfs_node)
-                                , make_remove_operation(ipfs_node)
+                                , make_add_operation(ipfs_node, storage)
+                                , make_remove_operation(ipfs_node, storage)
                                 , BTREE_NODE_SIZE))
 {
     auto d = _was_destroyed;
@@ -138,6 +155,8 @@ InjectorDb::InjectorDb(asio_ipfs::node& ipfs_node, string path_to_repo)
     asio::spawn(get_io_service(), [=](asio::yield_context yield) {
             if (*d) return;
             load_db(*_db_map, _path_to_repo, _ipns, yield);
+            if (*d) return;
+            continuously_upload_db(yield);
         });
 }
 
@@ -145,18 +164,186 @@ const string ipfs_uri_prefix = "ipfs:/ipfs/";
 
 void InjectorDb::update(string key, string value, asio::yield_context yield)
 {
-    auto wd = _was_destroyed;
+    update(move(key), move(value), nullptr, yield);
+}
+
+void InjectorDb::update( string key
+                       , string value
+                       , Merge merge
+                       , asio::yield_context yield)
+{
     sys::error_code ec;
+    wait_for_room(yield[ec]);
+    if (ec) return or_throw(yield, ec);
+
+    // A newer value for the same key replaces (or is merged with)
+    // the pending one, both callers are notified when the batch is committed.
+    auto& pending = _pending_updates[move(key)];
+
+    if (merge) {
+        if (!pending.value.empty()) value = merge(pending.value, move(value));
+        // Merging with the value in the database is left for the commit,
+        // unless a pending value without merge already replaces it.
+        if (pending.value.empty() || pending.merge) pending.merge = move(merge);
+    }
+    else {
+        pending.merge = nullptr;
+    }
+
+    pending.value = move(value);
 
-    _db_map->insert(move(key), move(value), yield[ec]);
+    wait_for_commit(yield);
+}
 
-    if (!ec && *wd) ec = asio::error::operation_aborted;
+void InjectorDb::unreference(string key, string cid, asio::yield_context yield)
+{
+    sys::error_code ec;
+    wait_for_room(yield[ec]);
     if (ec) return or_throw(yield, ec);
 
-    upload_database(yield[ec]);
+    _pending_updates[move(key)].unreferenced.insert(move(cid));
 
-    if (!ec && *wd) ec = asio::error::operation_aborted;
-    return or_throw(yield, ec);
+    wait_for_commit(yield);
+}
+
+void InjectorDb::wait_for_room(asio::yield_context yield)
+{
+    using Handler = asio::handler_type<asio::yield_context,
+          void(sys::error_code)>::type;
+
+    auto max_updates = max<size_t>(_commit_max_updates, 1);
+
+    // Other updates may fill the next batch before we get to run.
+    while (_upload_callbacks.size() >= max_updates) {
+        // Close the commit window early.
+        _commit_timer.cancel();
+
+        sys::error_code ec;
+        Handler h(yield[ec]);
+        asio::async_result<Handler> result(h);
+
+        _on_batch_taken.push_back([ h = move(h)
+                                  , w = asio::io_service::work(get_io_service())
+                                  ] (auto ec) mutable { h(ec); });
+
+        result.get();
+
+        // The database may be gone.
+        if (ec) return or_throw(yield, ec);
+    }
+}
+
+void InjectorDb::wait_for_commit(asio::yield_context yield)
+{
+    using Handler = asio::handler_type<asio::yield_context,
+          void(sys::error_code)>::type;
+
+    Handler h(yield);
+    asio::async_result<Handler> result(h);
+
+    _upload_callbacks.push_back([ h = move(h)
+                                , w = asio::io_service::work(get_io_service())
+                                ] (auto ec) mutable { h(ec); });
+
+    _has_callbacks.notify_one();
+
+    if (_upload_callbacks.size() >= _commit_max_updates) {
+        // Close the commit window early.
+        _commit_timer.cancel();
+    }
+
+    result.get();
+}
+
+void InjectorDb::continuously_upload_db(asio::yield_context yield)
+{
+    auto wd = _was_destroyed;
+    auto& ios = get_io_service();
+
+    while (true) {
+        sys::error_code ec;
+
+        if (_upload_callbacks.empty()) {
+            _has_callbacks.wait(yield[ec]);
+            if (*wd) return;
+            continue;
+        }
+
+        if ( _upload_callbacks.size() < _commit_max_updates
+          && _commit_window > Timer::duration(0)) {
+            _commit_timer.expires_from_now(_commit_window);
+            _commit_timer.async_wait(yield[ec]);
+            if (*wd) return;
+        }
+
+        auto pending   = move(_pending_updates);
+        auto callbacks = move(_upload_callbacks);
+        _pending_updates.clear();
+        _upload_callbacks.clear();
+
+        // Updates held back by the full batch can start the next one.
+        flush_upload_callbacks(ios, _on_batch_taken, sys::error_code());
+
+        map<string, string> updates;
+
+        for (auto& kv : pending) {
+            auto& u = kv.second;
+
+            // Only dropping contents from the entry in the database.
+            bool drop_only = u.value.empty() && !u.merge;
+
+            if (u.merge || drop_only) {
+                ec = sys::error_code();
+                auto older = _db_map->find(kv.first, yield[ec]);
+
+                if (*wd) {
+                    return flush_upload_callbacks( ios, callbacks
+                                                 , asio::error::operation_aborted);
+                }
+
+                if (!ec) {
+                    if (drop_only) u.value = move(older);
+                    else           u.value = u.merge(older, move(u.value));
+                }
+            }
+
+            if (!u.unreferenced.empty() && !u.value.empty()) {
+                u.value = drop_contents(u.value, u.unreferenced);
+            }
+
+            // Nothing stored for the key to drop contents from.
+            if (u.value.empty()) continue;
+
+            updates[kv.first] = move(u.value);
+        }
+
+        ec = sys::error_code();
+
+        _db_map->insert(move(updates), yield[ec]);
+
+        if (*wd) {
+            return flush_upload_callbacks( ios, callbacks
+                                         , asio::error::operation_aborted);
+        }
+
+        if (!ec) upload_database(yield[ec]);
+
+        if (*wd) ec = asio::error::operation_aborted;
+
+        flush_upload_callbacks(ios, callbacks, ec);
+
+        if (*wd) return;
+    }
+}
+
+void InjectorDb::flush_upload_callbacks( asio::io_service& ios
+                                       , list<OnUpload>& callbacks
+                                       , const sys::error_code& ec)
+{
+    for (auto& cb : callbacks) {
+        ios.post([cb = move(cb), ec] { cb(ec); });
+    }
+    callbacks.clear();
 }
 
 void InjectorDb::upload_database(asio::yield_context yield)
@@ -188,6 +375,33 @@ string InjectorDb::query(string key, asio::yield_context yield)
     return query_(move(key), *_db_map, yield);
 }
 
+set<string> InjectorDb::reachable_objects(asio::yield_context yield)
+{
+    set<string> ret;
+
+    auto add_content = [&ret] (const string& raw_json) {
+        try {
+            for_each_variant(Json::parse(raw_json), [&ret] (const Json& json) {
+                    auto i = json.find("value");
+                    if (i != json.end() && i->is_string()) ret.insert(*i);
+                });
+        }
+        catch (const std::exception&) {
+            // Not a content entry, nothing to keep.
+        }
+    };
+
+    for (auto& kv : _pending_updates) add_content(kv.second.value);
+
+    sys::error_code ec;
+
+    _db_map->walk( [&ret] (const BTree::Hash& h) { ret.insert(h); }
+                 , [&] (const BTree::Key&, const BTree::Value& v) { add_content(v); }
+                 , yield[ec]);
+
+    return or_throw(yield, ec, move(ret));
+}
+
 string ClientDb::query(string key, asio::yield_context yield)
 {
     return query_(move(key), *_db_map, yield);
@@ -268,9 +482,10 @@ ClientDb::~ClientDb() {
 InjectorDb::~InjectorDb() {
     *_was_destroyed = true;
 
-    for (auto& cb : _upload_callbacks) {
-        get_io_service().post([cb = move(cb)] {
-                cb(asio::error::operation_aborted);
-            });
-    }
+    flush_upload_callbacks( get_io_service()
+                          , _upload_callbacks
+                          , asio::error::operation_aborted);
+    flush_upload_callbacks( get_io_service()
+                          , _on_batch_taken
+                          , asio::error::operation_aborted);
 }
@@ -8,6 +8,8 @@
 #include <string>
 #include <queue>
 #include <list>
+#include <map>
+#include <set>
 #include <json.hpp>
 
 #include "../namespaces.h"
@@ -19,6 +21,7 @@ namespace ouinet {
 
 class BTree;
 class Republisher;
+class StorageManager;
 using Json = nlohmann::json;
 
 class ClientDb {
@@ -60,13 +63,53 @@ private:
 };
 
 class InjectorDb {
+    using OnUpload = std::function<void(const sys::error_code&)>;
+
 public:
-    InjectorDb(asio_ipfs::node&, std::string path_to_repo);
+    using Timer = asio::steady_timer;
 
+public:
+    // Pins and unpins of index nodes are reported to `storage` if not null.
+    InjectorDb( asio_ipfs::node&
+              , std::string path_to_repo
+              , StorageManager* storage = nullptr);
+
+    // Returns once the update has been stored in the database, the database
+    // has been saved and published.  Updates are committed in groups: the
+    // first pending update opens a commit window of `commit_window`, and all
+    // updates arriving before it closes (or until `commit_max_updates` of
+    // them are pending) are committed together.  Updates beyond that wait
+    // for the full batch to be taken and go to the next one.
     void update(std::string key, std::string content_hash, asio::yield_context);
 
+    // Computes the value to store given the current and the updated one.
+    using Merge = std::function<std::string( const std::string& older
+                                           , std::string newer)>;
+
+    // Like the above, but the value stored is `merge(<current>, value)`,
+    // where the current value is the one in the database when the update
+    // is committed (or a pending update for the same key).
+    void update( std::string key
+               , std::string value
+               , Merge
+               , asio::yield_context);
+
+    // Drop references to the content `cid` from the entry for `key`
+    // (see `drop_contents`), returning like `update`.
+    void unreference(std::string key, std::string cid, asio::yield_context);
+
+    void commit_window(Timer::duration d) { _commit_window = d; }
+    Timer::duration commit_window() const { return _commit_window; }
+
+    void commit_max_updates(size_t n) { _commit_max_updates = n; }
+    size_t commit_max_updates() const { return _commit_max_updates; }
+
     std::string query(std::string key, asio::yield_context);
 
+    // The hashes of all index nodes reachable from the current root
+    // and of the contents they (or pending updates) point to.
+    std::set<std::string> reachable_objects(asio::yield_context);
+
     boost::asio::io_service& get_io_service();
 
     const std::string& ipns() const { return _ipns; }
@@ -76,16 +119,40 @@ public:
     ~InjectorDb();
 
 private:
+    // Returns once the pending batch has room for another update,
+    // closing its commit window early if it is full.
+    void wait_for_room(asio::yield_context);
+
+    // Returns once the pending updates have been committed.
+    void wait_for_commit(asio::yield_context);
+
     void upload_database(asio::yield_context);
     void continuously_upload_db(asio::yield_context);
 
+    static void flush_upload_callbacks( asio::io_service&
+                                      , std::list<OnUpload>&
+                                      , const sys::error_code&);
+
 private:
     const std::string _path_to_repo;
     std::string _ipns;
     asio_ipfs::node& _ipfs_node;
     std::unique_ptr<Republisher> _republisher;
     ConditionVariable _has_callbacks;
-    std::list<std::function<void(sys::error_code)>> _upload_callbacks;
+    Timer _commit_timer;
+    Timer::duration _commit_window = std::chrono::seconds(1);
+    size_t _commit_max_updates = 256;
+    struct PendingUpdate {
+        std::string value;
+        Merge merge;
+        // Contents to drop from the entry once the value is computed.
+        std::set<std::string> unreferenced;
+    };
+
+    std::map<std::string, PendingUpdate> _pending_updates;
+    std::list<OnUpload> _upload_callbacks;
+    // Updates waiting for a full batch to be taken for commit.
+    std::list<OnUpload> _on_batch_taken;
     std::shared_ptr<bool> _was_destroyed;
     std::unique_ptr<BTree> _db_map;
 };
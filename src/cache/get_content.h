@@ -1,13 +1,20 @@
 #pragma once
 
 #include "cached_content.h"
+#include "variants.h"
 #include "../or_throw.h"
 
 namespace ouinet {
 
+// `variant_key` selects the variant to get if the URL has several
+// (see "variants.h"), it may be null if the caller does not know
+// the request.
 template<class Db>
 inline
-CachedContent get_content(Db& db, std::string url, asio::yield_context yield)
+CachedContent get_content( Db& db
+                         , std::string url
+                         , const VariantKey& variant_key
+                         , asio::yield_context yield)
 {
     sys::error_code ec;
 
@@ -23,7 +30,20 @@ CachedContent get_content(Db& db, std::string url, asio::yield_context yield)
     try {
         auto json = Json::parse(raw_json);
 
-        ts           = boost::posix_time::from_iso_extended_string(json["ts"]);
+        json = select_variant(json, variant_key);
+
+        // Entries for contents dropped from storage are left empty.
+        if (json.is_null() || !json.count("value")) {
+            return or_throw<CachedContent>(yield, asio::error::not_found);
+        }
+
+        std::string ts_str = json["ts"];
+
+        // Time stamps are in UTC with a trailing "Z", which the parser
+        // does not accept when fractional seconds are missing.
+        if (!ts_str.empty() && ts_str.back() == 'Z') ts_str.pop_back();
+
+        ts           = boost::posix_time::from_iso_extended_string(ts_str);
         content_hash = json["value"];
     }
     catch(const std::exception& e) {
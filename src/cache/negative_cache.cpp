@@ -0,0 +1,181 @@
+#include <boost/asio/error.hpp>
+#include <boost/asio/buffer.hpp>
+#include <iostream>
+
+#include "negative_cache.h"
+#include "../cache_meta.h"
+
+using namespace std;
+using namespace ouinet;
+
+NegativeCache::NegativeCache(Config config)
+    : _config(move(config))
+{
+}
+
+// Errors which may be cached using heuristic freshness
+// (https://tools.ietf.org/html/rfc7231#section-6.1).
+bool NegativeCache::is_negative(const http::response_header<>& rs)
+{
+    switch (rs.result()) {
+        case http::status::not_found:
+        case http::status::method_not_allowed:
+        case http::status::gone:
+        case http::status::uri_too_long:
+        case http::status::not_implemented:
+            break;
+        default:
+            return false;
+    }
+
+    // Heuristic freshness only applies if the origin says nothing against
+    // keeping or reusing the response (RFC 7234 section 4.2.2).
+    auto meta = CacheMeta::parse(rs);
+
+    if (meta.no_store || meta.no_cache || meta.is_private) return false;
+
+    auto max_age = meta.shared_max_age();
+    if (max_age && *max_age == 0) return false;
+
+    if (!meta.expires.is_not_a_date_time()) {
+        auto now = meta.date.is_not_a_date_time()
+                 ? boost::posix_time::second_clock::universal_time()
+                 : meta.date;
+        if (meta.expires <= now) return false;
+    }
+
+    return true;
+}
+
+// Failures which are not likely to go away in the next few seconds.
+bool NegativeCache::is_negative(const sys::error_code& ec)
+{
+    namespace err = asio::error;
+
+    return ec == err::host_not_found
+        || ec == err::connection_refused;
+}
+
+static size_t approximate_size(const NegativeCache::Response& rs)
+{
+    size_t size = asio::buffer_size(rs.body().data());
+
+    for (auto& f : rs) {
+        size += f.name_string().size() + f.value().size();
+    }
+
+    return size;
+}
+
+NegativeCache::Entry& NegativeCache::touch(const string& key)
+{
+    auto i = _index.find(key);
+
+    if (i != _index.end()) {
+        _entries.splice(_entries.begin(), _entries, i->second);
+        return *i->second;
+    }
+
+    _entries.emplace_front();
+    auto& e = _entries.front();
+    e.key = key;
+    _index.emplace(key, _entries.begin());
+    ++_stats.entries;
+    ++_stats.inserted;
+    return e;
+}
+
+void NegativeCache::resize(Entry& e)
+{
+    _stats.size -= e.size;
+    // The key is stored twice, in the entry and in the index.
+    e.size = sizeof(Entry) + 2 * e.key.size() + approximate_size(e.error.response);
+    _stats.size += e.size;
+
+    // Do not evict the entry which was just touched.
+    while (_stats.size > _config.max_size && _entries.size() > 1) {
+        remove(prev(_entries.end()));
+        ++_stats.evicted;
+    }
+}
+
+void NegativeCache::remove(Entries::iterator i)
+{
+    _stats.size -= i->size;
+    --_stats.entries;
+    _index.erase(i->key);
+    _entries.erase(i);
+}
+
+void NegativeCache::insert_error(const string& key, Error error)
+{
+    if (_config.error_ttl == Clock::duration::zero()) return;
+
+    auto& e = touch(key);
+    e.error = move(error);
+    e.error_expiry = Clock::now() + _config.error_ttl;
+    resize(e);
+}
+
+void NegativeCache::insert_miss(const string& key)
+{
+    if (_config.miss_ttl == Clock::duration::zero()) return;
+
+    auto& e = touch(key);
+    e.miss_expiry = Clock::now() + _config.miss_ttl;
+    resize(e);
+}
+
+NegativeCache::Entry*
+NegativeCache::find(const string& key, Clock::time_point Entry::* expiry)
+{
+    auto i = _index.find(key);
+    if (i == _index.end()) return nullptr;
+
+    auto& e = *i->second;
+    auto now = Clock::now();
+
+    if (e.error_expiry <= now && e.miss_expiry <= now) {
+        remove(i->second);
+        ++_stats.expired;
+        return nullptr;
+    }
+
+    if (e.*expiry <= now) return nullptr;
+
+    _entries.splice(_entries.begin(), _entries, i->second);
+    return &e;
+}
+
+const NegativeCache::Error* NegativeCache::find_error(const string& key)
+{
+    auto e = find(key, &Entry::error_expiry);
+    if (!e) return nullptr;
+    ++_stats.error_hits;
+    return &e->error;
+}
+
+bool NegativeCache::is_miss(const string& key)
+{
+    if (!find(key, &Entry::miss_expiry)) return false;
+    ++_stats.miss_hits;
+    return true;
+}
+
+void NegativeCache::erase(const string& key)
+{
+    auto i = _index.find(key);
+    if (i != _index.end()) remove(i->second);
+}
+
+std::ostream&
+ouinet::operator<<(std::ostream& os, const NegativeCache::Stats& s)
+{
+    return os << "error_hits:" << s.error_hits
+              << " miss_hits:" << s.miss_hits
+              << " inserted:"  << s.inserted
+              << " expired:"   << s.expired
+              << " evicted:"   << s.evicted
+              << " entries:"   << s.entries
+              << " size:"      << s.size;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <boost/beast/http/dynamic_body.hpp>
+#include <boost/beast/http/message.hpp>
+#include <boost/system/error_code.hpp>
+#include <chrono>
+#include <iosfwd>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+#include "../namespaces.h"
+
+namespace ouinet {
+
+/*
+ * Remembers for a short while the keys (URLs) whose retrieval failed,
+ * so that repeated requests for a broken resource do not go through
+ * the whole chain of cache lookup, injector and origin every time.
+ *
+ * Two kinds of failures are kept: origin errors (either an error response
+ * or a failure like an unknown host) and misses in the cache index.
+ * Entries expire after a fixed time and the least recently used ones
+ * are dropped to keep the whole under a memory budget.
+ */
+class NegativeCache {
+public:
+    using Clock    = std::chrono::steady_clock;
+    using Response = http::response<http::dynamic_body>;
+
+    struct Config {
+        // How long origin errors are remembered (zero disables).
+        Clock::duration error_ttl = std::chrono::seconds(30);
+        // How long cache index misses are remembered (zero disables).
+        Clock::duration miss_ttl = std::chrono::seconds(30);
+        // Approximate size in bytes of all entries.
+        size_t max_size = 1024 * 1024;
+    };
+
+    struct Stats {
+        size_t error_hits = 0;
+        size_t miss_hits = 0;
+        size_t inserted = 0;
+        size_t expired = 0;
+        size_t evicted = 0;
+        // Current number of entries and their approximate size in bytes.
+        size_t entries = 0;
+        size_t size = 0;
+    };
+
+    // What a failed retrieval from the origin yielded:
+    // an error code, or else an error response.
+    struct Error {
+        sys::error_code ec;
+        Response response;
+    };
+
+public:
+    NegativeCache(Config);
+
+    // Whether the origin error is worth remembering.
+    static bool is_negative(const http::response_header<>&);
+    static bool is_negative(const sys::error_code&);
+
+    void insert_error(const std::string& key, Error);
+    void insert_miss(const std::string& key);
+
+    // The remembered origin error for `key`, null if none.
+    // The pointer is valid until the next change to the cache.
+    const Error* find_error(const std::string& key);
+
+    // Whether `key` is known to be missing from the cache index.
+    bool is_miss(const std::string& key);
+
+    // Forget everything about `key`, e.g. because it was retrieved.
+    void erase(const std::string& key);
+
+    const Config& config() const { return _config; }
+    const Stats& stats() const { return _stats; }
+
+private:
+    struct Entry {
+        std::string key;
+        Clock::time_point error_expiry;
+        Clock::time_point miss_expiry;
+        Error error;
+        size_t size = 0;
+    };
+
+    using Entries = std::list<Entry>;
+
+    Entry& touch(const std::string& key);
+    void resize(Entry&);
+    void remove(Entries::iterator);
+    Entry* find(const std::string& key, Clock::time_point Entry::* expiry);
+
+private:
+    Config _config;
+    // Most recently used first.
+    Entries _entries;
+    std::unordered_map<std::string, Entries::iterator> _index;
+    Stats _stats;
+};
+
+std::ostream& operator<<(std::ostream&, const NegativeCache::Stats&);
+
+} // namespace
@@ -0,0 +1,350 @@
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include "storage_manager.h"
+
+#include <asio_ipfs.h>
+#include "../defer.h"
+#include "../or_throw.h"
+#include "../util/wait_condition.h"
+
+using namespace std;
+using namespace ouinet;
+
+namespace fs = boost::filesystem;
+
+using Clock = StorageManager::Clock;
+
+StorageManager::StorageManager(asio_ipfs::node& ipfs_node, fs::path state_file)
+    : _ipfs_node(ipfs_node)
+    , _state_file(move(state_file))
+    , _was_destroyed(make_shared<bool>(false))
+{
+    load();
+}
+
+void StorageManager::on_pinned( const string& cid
+                              , size_t size
+                              , Kind kind
+                              , const string& key)
+{
+    auto i = _objects.find(cid);
+
+    if (i != _objects.end()) {
+        // Pinned again (e.g. the same content under another URL).
+        i->second.pinned_at = Clock::now();
+
+        if (kind == Kind::content) {
+            _lru.splice(_lru.end(), _lru, i->second.lru);
+            add_key(cid, i->second, key);
+        }
+
+        _dirty = true;
+        return;
+    }
+
+    Object o{kind, size, Clock::now(), {}, _lru.end()};
+
+    if (kind == Kind::content) {
+        o.lru = _lru.insert(_lru.end(), cid);
+        _content_bytes += size;
+    }
+    else {
+        _node_bytes += size;
+        ++_node_objects;
+    }
+
+    auto& added = _objects.emplace(cid, move(o)).first->second;
+    if (kind == Kind::content) add_key(cid, added, key);
+
+    _dirty = true;
+}
+
+void StorageManager::add_key(const string& cid, Object& o, const string& key)
+{
+    if (key.empty()) return;
+
+    auto& current = _key_to_cid[key];
+
+    // The URL no longer refers to its former content.
+    if (!current.empty() && current != cid) {
+        auto i = _objects.find(current);
+        if (i != _objects.end()) i->second.keys.erase(key);
+    }
+
+    current = cid;
+    o.keys.insert(key);
+}
+
+void StorageManager::forget(map<string, Object>::iterator i)
+{
+    auto& o = i->second;
+
+    if (o.kind == Kind::content) {
+        _lru.erase(o.lru);
+        _content_bytes -= o.size;
+
+        for (auto& key : o.keys) {
+            auto k = _key_to_cid.find(key);
+            if (k != _key_to_cid.end() && k->second == i->first) {
+                _key_to_cid.erase(k);
+            }
+        }
+    }
+    else {
+        _node_bytes -= o.size;
+        --_node_objects;
+    }
+
+    _objects.erase(i);
+    _dirty = true;
+}
+
+void StorageManager::on_unpinned(const string& cid)
+{
+    auto i = _objects.find(cid);
+    if (i == _objects.end()) return;
+
+    ++_unpinned_objects;
+    _unpinned_bytes += i->second.size;
+
+    forget(i);
+}
+
+void StorageManager::touch(const string& key)
+{
+    auto k = _key_to_cid.find(key);
+    if (k == _key_to_cid.end()) return;
+
+    auto i = _objects.find(k->second);
+    if (i == _objects.end()) return;
+
+    _lru.splice(_lru.end(), _lru, i->second.lru);
+}
+
+bool StorageManager::is_over_budget() const
+{
+    return _config.max_bytes && _content_bytes > _config.max_bytes;
+}
+
+bool StorageManager::unpin(const string& cid, asio::yield_context yield)
+{
+    auto wd = _was_destroyed;
+
+    sys::error_code ec;
+    _ipfs_node.unpin(cid, yield[ec]);
+
+    if (*wd) return false;
+
+    if (ec) {
+        cerr << "Failed to unpin " << cid << ": " << ec.message() << endl;
+        ++_unpin_failures;
+        return false;
+    }
+
+    on_unpinned(cid);
+    return true;
+}
+
+void StorageManager::enforce_budget(Unindex unindex, asio::yield_context yield)
+{
+    if (_is_enforcing) return;
+
+    auto wd = _was_destroyed;
+    auto& ios = _ipfs_node.get_io_service();
+
+    _is_enforcing = true;
+    auto on_exit = defer([&] { if (!*wd) _is_enforcing = false; });
+
+    // Objects failing to unpin are retried in the next run.
+    set<string> failed;
+
+    while (is_over_budget()) {
+        // The least recently used contents which free enough room.
+        vector<string> victims;
+        size_t freed = 0;
+
+        for (auto& cid : _lru) {
+            if (_content_bytes - freed <= _config.max_bytes) break;
+            if (failed.count(cid)) continue;
+            victims.push_back(cid);
+            freed += _objects.at(cid).size;
+        }
+
+        if (victims.empty()) break;
+
+        WaitCondition unindexed(ios);
+
+        for (auto& cid : victims) {
+            if (!unindex) break;
+
+            // Every URL still pointing at the content must forget it.
+            for (auto& key : _objects.at(cid).keys) {
+                asio::spawn(ios, [ unindex, key, cid
+                                 , lock = unindexed.lock()
+                                 ] (asio::yield_context yield) {
+                        sys::error_code ec;
+                        unindex(key, cid, yield[ec]);
+                    });
+            }
+        }
+
+        unindexed.wait(yield);
+        if (*wd) return;
+
+        for (auto& cid : victims) {
+            // It may have been unpinned while we were unpinning others.
+            if (!_objects.count(cid)) continue;
+
+            if (!unpin(cid, yield)) {
+                if (*wd) return;
+                failed.insert(cid);
+            }
+        }
+    }
+
+    save();
+}
+
+void StorageManager::collect( const set<string>& reachable
+                            , asio::yield_context yield)
+{
+    auto wd = _was_destroyed;
+    auto pinned_before = Clock::now() - _config.gc_grace;
+
+    vector<string> garbage;
+
+    for (auto& p : _objects) {
+        if (p.second.pinned_at > pinned_before) continue;
+        if (reachable.count(p.first)) continue;
+        garbage.push_back(p.first);
+    }
+
+    for (auto& cid : garbage) {
+        // It may have been unpinned while we were unpinning others.
+        if (!_objects.count(cid)) continue;
+        unpin(cid, yield);
+        if (*wd) return;
+    }
+
+    ++_gc_runs;
+
+    save();
+}
+
+StorageManager::Stats StorageManager::stats() const
+{
+    return Stats{ _lru.size()
+                , _content_bytes
+                , _node_objects
+                , _node_bytes
+                , _unpinned_objects
+                , _unpinned_bytes
+                , _unpin_failures
+                , _gc_runs };
+}
+
+// Line format: <c|n> <CID> <size> <seconds since epoch pinned> [<URL>...]
+// Contents are written least recently used first.
+void StorageManager::save()
+{
+    if (!_dirty || _state_file.empty()) return;
+
+    auto tmp_path = _state_file;
+    tmp_path += ".tmp";
+
+    ofstream file(tmp_path.native(), ofstream::trunc);
+
+    if (!file.is_open()) {
+        cerr << "ERROR: Saving " << tmp_path << endl;
+        return;
+    }
+
+    auto write = [&] (char kind, const string& cid, const Object& o) {
+        auto pinned_at = chrono::duration_cast<chrono::seconds>
+                            (o.pinned_at.time_since_epoch()).count();
+
+        file << kind << ' ' << cid << ' ' << o.size << ' ' << pinned_at;
+        for (auto& key : o.keys) file << ' ' << key;
+        file << '\n';
+    };
+
+    for (auto& cid : _lru) {
+        write('c', cid, _objects.at(cid));
+    }
+
+    for (auto& p : _objects) {
+        if (p.second.kind == Kind::node) write('n', p.first, p.second);
+    }
+
+    file.close();
+
+    sys::error_code ec;
+    fs::rename(tmp_path, _state_file, ec);
+
+    if (ec) {
+        cerr << "ERROR: Saving " << _state_file << ": " << ec.message() << endl;
+        return;
+    }
+
+    _dirty = false;
+}
+
+void StorageManager::load()
+{
+    ifstream file(_state_file.native());
+
+    if (!file.is_open()) return;
+
+    string line;
+
+    while (getline(file, line)) {
+        istringstream ss(line);
+
+        char kind;
+        string cid;
+        size_t size;
+        int64_t pinned_at;
+
+        if (!(ss >> kind >> cid >> size >> pinned_at)) {
+            cerr << "Warning: Ignoring malformed line in "
+                 << _state_file << endl;
+            continue;
+        }
+
+        auto k = kind == 'n' ? Kind::node : Kind::content;
+
+        on_pinned(cid, size, k);
+
+        // URLs have no white space.
+        string key;
+        while (ss >> key) on_pinned(cid, size, k, key);
+
+        _objects.at(cid).pinned_at
+            = Clock::time_point(chrono::seconds(pinned_at));
+    }
+
+    _dirty = false;
+}
+
+StorageManager::~StorageManager()
+{
+    *_was_destroyed = true;
+    save();
+}
+
+std::ostream&
+ouinet::operator<<(std::ostream& os, const StorageManager::Stats& s)
+{
+    return os << "contents:"        << s.content_objects
+              << "/"                << s.content_bytes << "B"
+              << " nodes:"          << s.node_objects
+              << "/"                << s.node_bytes << "B"
+              << " unpinned:"       << s.unpinned_objects
+              << "/"                << s.unpinned_bytes << "B"
+              << " unpin_failures:" << s.unpin_failures
+              << " gc_runs:"        << s.gc_runs;
+}
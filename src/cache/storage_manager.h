@@ -0,0 +1,145 @@
+#pragma once
+
+#include <boost/asio/spawn.hpp>
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <functional>
+#include <iosfwd>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+
+#include "../namespaces.h"
+
+namespace asio_ipfs { class node; }
+
+namespace ouinet {
+
+/*
+ * Keeps track of the objects pinned by the injector (contents and index
+ * nodes) and of their sizes, so that:
+ *
+ *   - Pinned contents can be kept within a storage budget by unpinning
+ *     the least recently used ones.
+ *   - Objects which are no longer reachable from the current index root
+ *     (old versions of contents, orphaned index nodes) can be unpinned.
+ *
+ * Unpinned objects are removed from disk by the IPFS node's own repository
+ * garbage collection.  The state is saved to a file so that pins made by
+ * previous runs can still be collected.
+ */
+class StorageManager {
+public:
+    using Clock = std::chrono::system_clock;
+
+    enum class Kind { content, node };
+
+    struct Config {
+        // Limit to the size of pinned contents (zero for no limit).
+        size_t max_bytes = 0;
+        // Period of reachability collection (zero disables it).
+        Clock::duration gc_interval = std::chrono::hours(1);
+        // Objects pinned more recently than this are never collected
+        // since they may not have made it to the index yet.
+        Clock::duration gc_grace = std::chrono::minutes(10);
+    };
+
+    struct Stats {
+        size_t content_objects;
+        size_t content_bytes;
+        size_t node_objects;
+        size_t node_bytes;
+        size_t unpinned_objects;
+        size_t unpinned_bytes;
+        size_t unpin_failures;
+        size_t gc_runs;
+    };
+
+public:
+    StorageManager(asio_ipfs::node&, boost::filesystem::path state_file);
+
+    StorageManager(const StorageManager&) = delete;
+    StorageManager& operator=(const StorageManager&) = delete;
+
+    void set_config(Config c) { _config = std::move(c); }
+    const Config& config() const { return _config; }
+
+    // Record that the object was pinned, `key` is the URL of a content.
+    // The same content may be pinned for several URLs.
+    void on_pinned( const std::string& cid
+                  , size_t size
+                  , Kind
+                  , const std::string& key = std::string());
+
+    // Record that the object was unpinned by someone else.
+    void on_unpinned(const std::string& cid);
+
+    // Mark the content currently stored for the URL as recently used.
+    void touch(const std::string& key);
+
+    bool is_over_budget() const;
+
+    // Removes the reference to the content `cid` stored for `key`
+    // (as given to `on_pinned`) from the index.  It is called for every
+    // URL which the content is stored for.
+    using Unindex = std::function<void( const std::string& key
+                                      , const std::string& cid
+                                      , asio::yield_context)>;
+
+    // Unpin least recently used contents until the budget is met.
+    // They are dropped from the index with `unindex` before being unpinned,
+    // so that lookups do not find contents which are about to be removed.
+    void enforce_budget(Unindex, asio::yield_context);
+
+    // Unpin objects not in `reachable` pinned longer than the grace period.
+    void collect(const std::set<std::string>& reachable, asio::yield_context);
+
+    Stats stats() const;
+
+    // Write the state file if there were changes since the last save.
+    void save();
+
+    ~StorageManager();
+
+private:
+    struct Object {
+        Kind kind;
+        size_t size;
+        Clock::time_point pinned_at;
+        // URLs whose latest content this is (contents only).
+        std::set<std::string> keys;
+        // Position in `_lru` (contents only).
+        std::list<std::string>::iterator lru;
+    };
+
+    void add_key(const std::string& cid, Object&, const std::string& key);
+    void forget(std::map<std::string, Object>::iterator);
+    bool unpin(const std::string& cid, asio::yield_context);
+    void load();
+
+private:
+    asio_ipfs::node& _ipfs_node;
+    boost::filesystem::path _state_file;
+    Config _config;
+    std::map<std::string, Object> _objects;
+    // Content CIDs, least recently used first.
+    std::list<std::string> _lru;
+    // URL to the CID of its latest content.
+    std::map<std::string, std::string> _key_to_cid;
+    size_t _content_bytes = 0;
+    size_t _node_bytes = 0;
+    size_t _node_objects = 0;
+    size_t _unpinned_objects = 0;
+    size_t _unpinned_bytes = 0;
+    size_t _unpin_failures = 0;
+    size_t _gc_runs = 0;
+    bool _is_enforcing = false;
+    bool _dirty = false;
+    std::shared_ptr<bool> _was_destroyed;
+};
+
+std::ostream& operator<<(std::ostream&, const StorageManager::Stats&);
+
+} // namespace
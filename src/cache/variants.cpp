@@ -0,0 +1,132 @@
+#include <algorithm>
+
+#include "variants.h"
+
+using namespace std;
+using namespace ouinet;
+
+const size_t ouinet::max_variants_per_entry = 16;
+
+static bool has_variants(const Json& entry)
+{
+    return entry.is_object() && entry.count("variants")
+        && entry["variants"].is_object();
+}
+
+Json ouinet::wrap_variant(Json content, const Variant& variant)
+{
+    Json entry;
+
+    entry["vary"] = variant.vary;
+    entry["variants"][variant.key] = move(content);
+
+    return entry;
+}
+
+// The "ts" values are ISO 8601 date strings, which sort chronologically.
+static void drop_oldest_variants(Json& variants)
+{
+    while (variants.size() > max_variants_per_entry) {
+        auto oldest = variants.begin();
+
+        for (auto i = variants.begin(); i != variants.end(); ++i) {
+            if (i->value("ts", string()) < oldest->value("ts", string())) {
+                oldest = i;
+            }
+        }
+
+        variants.erase(oldest);
+    }
+}
+
+string ouinet::merge_variants(const string& older_str, string newer_str)
+{
+    Json older, newer;
+
+    try {
+        older = Json::parse(older_str);
+        newer = Json::parse(newer_str);
+    }
+    catch (const std::exception&) {
+        return newer_str;
+    }
+
+    if (!has_variants(older) || !has_variants(newer)) return newer_str;
+
+    // The origin changed the header fields the response varies on,
+    // older variants may not be selected correctly any more.
+    if (older["vary"] != newer["vary"]) return newer_str;
+
+    auto& variants = older["variants"];
+
+    for (auto i = newer["variants"].begin(); i != newer["variants"].end(); ++i) {
+        variants[i.key()] = i.value();
+    }
+
+    drop_oldest_variants(variants);
+
+    return older.dump();
+}
+
+Json ouinet::select_variant(const Json& entry, const VariantKey& variant_key)
+{
+    if (!has_variants(entry)) return entry;
+    if (!variant_key) return Json();
+
+    vector<string> vary;
+
+    auto vary_i = entry.find("vary");
+
+    if (vary_i != entry.end() && vary_i->is_array()) {
+        for (auto& name : *vary_i) {
+            if (name.is_string()) vary.push_back(name);
+        }
+    }
+
+    auto& variants = entry["variants"];
+    auto i = variants.find(variant_key(vary));
+
+    if (i == variants.end()) return Json();
+
+    return *i;
+}
+
+void ouinet::for_each_variant( const Json& entry
+                             , const function<void(const Json&)>& f)
+{
+    if (!has_variants(entry)) return f(entry);
+
+    for (auto& content : entry["variants"]) f(content);
+}
+
+string ouinet::drop_contents(const string& entry_str, const set<string>& cids)
+{
+    Json entry;
+
+    try {
+        entry = Json::parse(entry_str);
+    }
+    catch (const std::exception&) {
+        return entry_str;
+    }
+
+    auto is_dropped = [&cids] (const Json& content) {
+        auto i = content.find("value");
+        return i != content.end() && i->is_string() && cids.count(*i);
+    };
+
+    if (!has_variants(entry)) {
+        return is_dropped(entry) ? Json::object().dump() : entry_str;
+    }
+
+    auto& variants = entry["variants"];
+
+    for (auto i = variants.begin(); i != variants.end();) {
+        if (is_dropped(*i)) i = variants.erase(i);
+        else ++i;
+    }
+
+    if (variants.empty()) return Json::object().dump();
+
+    return entry.dump();
+}
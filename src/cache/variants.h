@@ -0,0 +1,63 @@
+#pragma once
+
+#include <functional>
+#include <set>
+#include <string>
+#include <vector>
+#include <json.hpp>
+
+namespace ouinet {
+
+using Json = nlohmann::json;
+
+/*
+ * Responses carrying a "Vary" header field are stored as variants under
+ * the same index key (the URL).  Each variant is identified by the values
+ * of the request header fields named in "Vary", so that a single index
+ * lookup finds the right variant for a request:
+ *
+ *     { "vary": ["accept-encoding", ...]
+ *     , "variants": { "<variant key>": {"value": <CID>, "ts": <time>}
+ *                   , ... } }
+ *
+ * Other responses are stored as a single `{"value": <CID>, "ts": <time>}`.
+ */
+
+// Given the (lower case) names of the header fields in "Vary",
+// compute the variant key of the current request.
+using VariantKey = std::function<std::string(const std::vector<std::string>& vary)>;
+
+struct Variant {
+    // Empty if the response does not vary.
+    std::vector<std::string> vary;
+    std::string key;
+};
+
+// At most this many variants are kept per index entry,
+// the oldest ones are dropped first.
+extern const size_t max_variants_per_entry;
+
+// Make an index entry holding `content` (a `{value, ts}` object)
+// as the given variant.
+Json wrap_variant(Json content, const Variant&);
+
+// Combine the stored index entry for a key with a newer one: the variants
+// of the latter are added to those of the former if both vary on
+// the same header fields, otherwise the newer entry replaces the older one.
+std::string merge_variants(const std::string& older, std::string newer);
+
+// Find the `{value, ts}` object of the index entry which applies to the
+// current request.  Returns null if the entry has no such variant
+// (or if it has variants and `variant_key` is null).
+// `variant_key` is only called if the entry has variants.
+Json select_variant(const Json& entry, const VariantKey& variant_key);
+
+// Call `f` on every `{value, ts}` object of the index entry.
+void for_each_variant(const Json& entry, const std::function<void(const Json&)>& f);
+
+// Drop the contents of the index entry whose value is in `cids`.
+// An entry left without contents becomes an empty object,
+// which lookups take as missing.
+std::string drop_contents(const std::string& entry, const std::set<std::string>& cids);
+
+} // namespace
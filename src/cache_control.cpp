@@ -1,10 +1,15 @@
 #include <boost/algorithm/string.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/optional.hpp>
+#include <algorithm>
+#include <chrono>
 
 #include "cache_control.h"
+#include "cache_meta.h"
 #include "or_throw.h"
 #include "split_string.h"
 #include "util.h"
+#include "util/condition_variable.h"
 
 using namespace std;
 using namespace ouinet;
@@ -16,24 +21,6 @@ using boost::optional;
 
 namespace posix_time = boost::posix_time;
 
-// Look for a literal directive (like "no-cache" but not "max-age=N")
-// in the "Cache-Control" header field
-// of a request or response.
-template <bool isRequest, class Body>
-static
-bool has_cache_control_directive( const http::message<isRequest, Body>& request
-                                , const beast::string_view& directive)
-{
-    auto cache_control_i = request.find(http::field::cache_control);
-    if (cache_control_i == request.end()) return false;
-
-    for (auto kv : SplitString(cache_control_i->value(), ',')) {
-        if (boost::iequals(kv, directive)) return true;
-    }
-
-    return false;
-}
-
 template<class R>
 static optional<beast::string_view> get(const R& r, http::field f)
 {
@@ -42,135 +29,182 @@ static optional<beast::string_view> get(const R& r, http::field f)
     return i->value();
 }
 
-inline void trim_quotes(beast::string_view& v) {
-    while (v.starts_with('"')) v.remove_prefix(1);
-    while (v.ends_with  ('"')) v.remove_suffix(1);
-};
-
 posix_time::ptime CacheControl::parse_date(beast::string_view s)
 {
-    // Trim quotes from the beginning
-    while (s.starts_with('"')) s.remove_prefix(1);
+    return parse_http_date(s);
+}
 
-    namespace bt = boost::posix_time;
+static posix_time::ptime now()
+{
+    return posix_time::second_clock::universal_time();
+}
 
-    static const auto format = [](const char* fmt) {
-        using std::locale;
-        return locale(locale::classic(), new bt::time_input_facet(fmt));
-    };
+// Status codes of responses which may be cached using heuristic freshness
+// (https://tools.ietf.org/html/rfc7231#section-6.1).
+static bool is_cacheable_by_default(http::status status)
+{
+    switch (status) {
+        case http::status::ok:
+        case http::status::non_authoritative_information:
+        case http::status::no_content:
+        case http::status::partial_content:
+        case http::status::multiple_choices:
+        case http::status::moved_permanently:
+        case http::status::not_found:
+        case http::status::method_not_allowed:
+        case http::status::gone:
+        case http::status::uri_too_long:
+        case http::status::not_implemented:
+            return true;
+        default:
+            return false;
+    }
+}
 
-    // https://www.w3.org/Protocols/rfc2616/rfc2616-sec3.html#sec3.3
+// https://tools.ietf.org/html/rfc7234#section-4.2.2
+optional<posix_time::time_duration>
+CacheControl::heuristic_freshness_lifetime(const CacheEntry& entry) const
+{
+    auto& meta = entry.meta;
 
-    // Format spec:
-    // http://www.boost.org/doc/libs/1_60_0/doc/html/date_time/date_time_io.html
-    static const std::locale formats[] = {
-        format("%a, %d %b %Y %H:%M:%S"),
-        format("%A, %d-%b-%y %H:%M:%S"),
-        // TODO: ANSI C's format not done yet because Boost doesn't seem
-        // to support parsing days of month in 1-digit format.
-    };
+    if (_heuristic_freshness == 0) return boost::none;
+    if (meta.last_modified.is_not_a_date_time()) return boost::none;
 
-    const size_t formats_n = sizeof(formats)/sizeof(formats[0]);
+    if (!meta.is_public && !is_cacheable_by_default(entry.response.result())) {
+        return boost::none;
+    }
 
-    bt::ptime pt;
+    auto date = meta.date.is_not_a_date_time() ? entry.time_stamp : meta.date;
 
-    // https://stackoverflow.com/a/13059195/273348
-    struct membuf: std::streambuf {
-        membuf(char const* base, size_t size) {
-            char* p(const_cast<char*>(base));
-            this->setg(p, p, p + size);
-        }
-    };
+    if (meta.last_modified >= date) return posix_time::seconds(0);
 
-    struct imemstream: virtual membuf, std::istream {
-        imemstream(beast::string_view s)
-            : membuf(s.data(), s.size())
-            , std::istream(static_cast<std::streambuf*>(this)) {
-        }
-    };
+    auto lifetime = (date - meta.last_modified) / 100 * _heuristic_freshness;
 
-    for(size_t i=0; i<formats_n; ++i) {
-        imemstream is(s);
-        is.istream::imbue(formats[i]);
-        is >> pt;
-        if(pt != bt::ptime()) return pt;
+    return min(lifetime, _max_heuristic_freshness);
+}
+
+// https://tools.ietf.org/html/rfc7234#section-4.2.1
+optional<posix_time::time_duration>
+CacheControl::freshness_lifetime(const CacheEntry& entry) const
+{
+    auto& meta = entry.meta;
+
+    // FIXME: Only use s-maxage if the cache is shared.
+    if (auto max_age = meta.shared_max_age()) {
+        return posix_time::time_duration(posix_time::seconds(*max_age));
+    }
+
+    if (!meta.expires.is_not_a_date_time()) {
+        // Use the origin's clock if possible to avoid clock skew.
+        auto date = meta.date.is_not_a_date_time() ? entry.time_stamp : meta.date;
+        if (meta.expires <= date) return posix_time::time_duration(posix_time::seconds(0));
+        return meta.expires - date;
     }
 
-    return pt;
+    return heuristic_freshness_lifetime(entry);
 }
 
+// The age of the response when it was stored at `entry.time_stamp`
+// (https://tools.ietf.org/html/rfc7234#section-4.2.3).  The time stamp is
+// taken right after the response is received, so the response delay
+// is already included in it.
 static
-optional<unsigned> get_max_age(const beast::string_view& cache_control_value)
+posix_time::time_duration initial_age(const CacheControl::CacheEntry& entry)
 {
-    using boost::optional;
+    auto& meta = entry.meta;
 
-    optional<unsigned> max_age;
-    optional<unsigned> s_maxage;
+    posix_time::time_duration age = posix_time::seconds(0);
 
-    auto update_max_age = [] ( optional<unsigned>& max_age
-                             , beast::string_view value) {
-        trim_quotes(value);
+    if (!meta.date.is_not_a_date_time() && entry.time_stamp > meta.date) {
+        age = entry.time_stamp - meta.date;  // apparent age
+    }
 
-        unsigned delta = util::parse_num<unsigned>(value, unsigned(-1));
+    if (meta.age) {
+        age = max(age, posix_time::time_duration(posix_time::seconds(*meta.age)));
+    }
 
-        // TODO: What does RFC say about malformed entries?
-        if (delta == unsigned(-1)) return;
+    return age;
+}
 
-        if (!max_age || *max_age < delta) {
-            max_age = delta;
-        }
-    };
+posix_time::time_duration
+CacheControl::current_age(const CacheEntry& entry)
+{
+    auto resident_time = now() - entry.time_stamp;
 
-    for (auto kv : SplitString(cache_control_value, ',')) {
-        beast::string_view key, val;
-        std::tie(key, val) = split_string_pair(kv, '=');
+    // The entry may have been stored by a host with a clock ahead of ours.
+    if (resident_time.is_negative()) resident_time = posix_time::seconds(0);
 
-        // FIXME: Only if the cache is shared.
-        if (boost::iequals(key, "s-maxage")) {
-            update_max_age(s_maxage, val);
-        }
+    return initial_age(entry) + resident_time;
+}
 
-        if (boost::iequals(key, "max-age")) {
-            update_max_age(max_age, val);
-        }
-    }
+// Returns ptime() if the response has no freshness information.
+posix_time::ptime
+CacheControl::expiration_time(const CacheEntry& entry) const
+{
+    auto lifetime = freshness_lifetime(entry);
+    if (!lifetime) return posix_time::ptime();
+    return entry.time_stamp - initial_age(entry) + *lifetime;
+}
 
-    if (s_maxage) return s_maxage;
-    return max_age;
+bool CacheControl::is_expired(const CacheEntry& entry) const
+{
+    auto expiration = expiration_time(entry);
+    if (expiration.is_not_a_date_time()) return true;
+    // Fresh while the freshness lifetime is greater than the current age.
+    return now() >= expiration;
 }
 
+// Whether the expired entry is still within the stale window given by the
+// response's `directive` or by `default_window`, whichever is longer.
 static
-bool is_expired(const CacheControl::CacheEntry& entry)
+bool is_within_stale_window( const CacheControl::CacheEntry& entry
+                           , posix_time::ptime expiration
+                           , const optional<unsigned>& directive
+                           , posix_time::time_duration default_window)
 {
-    // RFC2616: https://www.w3.org/Protocols/rfc2616/rfc2616-sec14.html#sec14.9.3
+    auto window = default_window;
 
-    static const auto now = [] {
-        return posix_time::second_clock::universal_time();
-    };
+    if (directive) {
+        window = max(window, posix_time::time_duration(posix_time::seconds(*directive)));
+    }
 
-    static const auto http10_is_expired = [](const auto& entry) {
-        auto expires = get(entry.response, http::field::expires);
+    if (window <= posix_time::seconds(0)) return false;
 
-        if (expires) {
-            auto exp_date = CacheControl::parse_date(*expires);
-            if (exp_date != posix_time::ptime()) {
-                return exp_date < now();
-            }
-        }
+    // Without freshness information, the entry expired when it was stored.
+    if (expiration.is_not_a_date_time()) expiration = entry.time_stamp;
 
-        return true;
-    };
-
-    auto cache_control_value = get(entry.response, http::field::cache_control);
+    return now() <= expiration + window;
+}
 
-    if (!cache_control_value) {
-        return http10_is_expired(entry);
-    }
+// Whether the origin forbids serving the entry once stale, whatever
+// the stale windows say (RFC 7234 sections 4.2.4, 5.2.2.1 and 5.2.2.2).
+static bool forbids_stale(const CacheControl::CacheEntry& entry)
+{
+    return entry.meta.must_revalidate || entry.meta.no_cache;
+}
 
-    optional<unsigned> max_age = get_max_age(*cache_control_value);
-    if (!max_age) return http10_is_expired(entry);
+bool
+CacheControl::can_serve_stale_while_revalidate(const CacheEntry& entry) const
+{
+    if (forbids_stale(entry)) return false;
+    return is_within_stale_window( entry
+                                 , expiration_time(entry)
+                                 , entry.meta.stale_while_revalidate
+                                 , _stale_while_revalidate);
+}
 
-    return now() > entry.time_stamp + posix_time::seconds(*max_age);
+bool
+CacheControl::can_serve_stale_on_error(const CacheEntry& entry) const
+{
+    // A "no-cache" response may never be used without revalidation.
+    if (entry.meta.no_cache) return false;
+    if (!is_expired(entry)) return true;
+    if (forbids_stale(entry)) return false;
+    if (_stale_if_error < posix_time::seconds(0)) return true;
+    return is_within_stale_window( entry
+                                 , expiration_time(entry)
+                                 , entry.meta.stale_if_error
+                                 , _stale_if_error);
 }
 
 bool
@@ -219,6 +253,191 @@ Response bad_gateway(const Request& req)
     return res;
 }
 
+// Server errors count as failures to get a fresh response
+// (RFC 5861 section 4).
+static bool is_server_error(const Response& rs)
+{
+    switch (rs.result()) {
+        case http::status::internal_server_error:
+        case http::status::bad_gateway:
+        case http::status::service_unavailable:
+        case http::status::gateway_timeout:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// To be used when fetching a fresh response failed.
+Response
+CacheControl::stale_or_bad_gateway(const Request& req, CacheEntry entry) const
+{
+    if (!can_serve_stale_on_error(entry)) {
+        return bad_gateway(req);
+    }
+
+    return is_expired(entry)
+         ? add_stale_warning(move(entry.response))
+         : move(entry.response);
+}
+
+// Like `stale_or_bad_gateway`, but the origin's own server error
+// (if `ec` is not set) is returned if the entry may not be served.
+Response
+CacheControl::stale_or_error( const Request& req
+                            , CacheEntry entry
+                            , const sys::error_code& ec
+                            , Response error) const
+{
+    if (!ec && !can_serve_stale_on_error(entry)) return error;
+    return stale_or_bad_gateway(req, move(entry));
+}
+
+//------------------------------------------------------------------------------
+// Conditional requests (https://tools.ietf.org/html/rfc7232).
+static bool is_conditional(const Request& rq)
+{
+    return rq.count(http::field::if_none_match)
+        || rq.count(http::field::if_modified_since);
+}
+
+// https://tools.ietf.org/html/rfc7232#section-2.3.2
+static bool weak_etag_match(beast::string_view a, beast::string_view b)
+{
+    if (a.starts_with("W/")) a.remove_prefix(2);
+    if (b.starts_with("W/")) b.remove_prefix(2);
+    return a == b;
+}
+
+// Whether the response described by `meta` satisfies the validators of the
+// conditional request, so that "304 Not Modified" may be sent instead of it
+// (https://tools.ietf.org/html/rfc7232#section-6).
+static bool is_not_modified(const Request& rq, const CacheMeta& meta)
+{
+    if (rq.method() != http::verb::get && rq.method() != http::verb::head) {
+        return false;
+    }
+
+    // If-None-Match takes precedence over If-Modified-Since.
+    if (auto inm = get(rq, http::field::if_none_match)) {
+        for (auto tag : SplitString(*inm, ',')) {
+            if (tag == "*") return true;
+            if (!meta.etag.empty() && weak_etag_match(tag, meta.etag)) return true;
+        }
+        return false;
+    }
+
+    auto ims = get(rq, http::field::if_modified_since);
+    if (!ims) return false;
+
+    auto since = parse_http_date(*ims);
+    if (since.is_not_a_date_time()) return false;
+
+    auto modified = meta.last_modified.is_not_a_date_time() ? meta.date
+                                                            : meta.last_modified;
+    if (modified.is_not_a_date_time()) return false;
+
+    return modified <= since;
+}
+
+// https://tools.ietf.org/html/rfc7232#section-4.1
+static Response not_modified(const Request& rq, const Response& rs)
+{
+    Response ret{http::status::not_modified, rq.version()};
+
+    bool has_etag = rs.count(http::field::etag);
+
+    for (auto& f : rs) {
+        switch (f.name()) {
+            case http::field::cache_control:
+            case http::field::content_location:
+            case http::field::date:
+            case http::field::etag:
+            case http::field::expires:
+            case http::field::vary:
+            case http::field::age:
+            case http::field::warning:
+                ret.insert(f.name(), f.value());
+                break;
+            case http::field::last_modified:
+                if (!has_etag) ret.insert(f.name(), f.value());
+                break;
+            default:
+                break;
+        }
+    }
+
+    ret.keep_alive(rq.keep_alive());
+    return ret;
+}
+
+// The request to revalidate a stored response with: the user agent's own
+// validators (if any) are replaced by those of the stored response, so that
+// the answer can update the cache.  The user agent's validators are checked
+// against the outcome afterwards.
+static Request revalidation_request( const Request& request
+                                   , const CacheControl::CacheEntry& entry)
+{
+    auto rq = request; // Make a copy because `request` is const&.
+
+    rq.erase(http::field::if_none_match);
+    rq.erase(http::field::if_modified_since);
+
+    if (!entry.meta.etag.empty()) {
+        rq.set(http::field::if_none_match, entry.meta.etag);
+    }
+
+    if (auto lm = get(entry.response, http::field::last_modified)) {
+        rq.set(http::field::if_modified_since, *lm);
+    }
+
+    return rq;
+}
+
+// Update the head of a stored response with the fields of a 304 response
+// to its revalidation (https://tools.ietf.org/html/rfc7234#section-4.3.4).
+static Response merge_not_modified(Response stored, const Response& rs)
+{
+    // These describe the message or the connection,
+    // not the stored representation.
+    static const auto is_message_field = [](const http::fields::value_type& f) {
+        return util::field_is_one_of( f
+                                    , http::field::content_length
+                                    , http::field::content_encoding
+                                    , http::field::transfer_encoding
+                                    , http::field::connection
+                                    , http::field::keep_alive
+                                    , http::field::proxy_connection
+                                    , http::field::te
+                                    , http::field::upgrade);
+    };
+
+    // The age was that of the stored entry, the 304 has its own if any.
+    stored.erase(http::field::age);
+
+    // Fields may be repeated, so replace all of them at once.
+    for (auto& f : rs) {
+        if (!is_message_field(f)) stored.erase(f.name_string());
+    }
+
+    for (auto& f : rs) {
+        if (!is_message_field(f)) stored.insert(f.name_string(), f.value());
+    }
+
+    return stored;
+}
+
+CacheControl::CacheControl()
+    : _latencies(make_shared<Latencies>())
+{
+}
+
+CacheControl::CacheControl(asio::io_service& ios)
+    : CacheControl()
+{
+    _ios = &ios;
+}
+
 Response
 CacheControl::fetch(const Request& request, asio::yield_context yield)
 {
@@ -233,33 +452,152 @@ CacheControl::fetch(const Request& request, asio::yield_context yield)
 #endif
     }
 
+    // Let the user agent reuse its own copy if it still matches.
+    if (!ec && is_conditional(request)
+            && response.result() == http::status::ok
+            && is_not_modified(request, CacheMeta::parse(response))) {
+        response = not_modified(request, response);
+    }
+
     return or_throw(yield, ec, move(response));
 }
 
-static bool must_revalidate(const Request& request)
+bool CacheControl::must_revalidate(const http::request_header<>& request)
 {
-    if (get(request, http::field::if_none_match))
-        return true;
+    auto meta = CacheMeta::parse(request);
+
+    if (meta.max_age && *meta.max_age == 0) return true;
+    if (meta.no_cache || meta.no_store) return true;
+
+    return false;
+}
 
-    auto cache_control = get(request, http::field::cache_control);
+//------------------------------------------------------------------------------
+void LatencyHistory::add(Duration d)
+{
+    _samples.push_back(d);
+    if (_samples.size() > max_samples) _samples.pop_front();
+}
 
-    if (cache_control) {
-        auto max_age = get_max_age(*cache_control);
+boost::optional<LatencyHistory::Duration>
+LatencyHistory::percentile(unsigned p) const
+{
+    if (_samples.size() < min_samples) return boost::none;
 
-        if (max_age && *max_age == 0) {
-            return true;
-        }
+    vector<Duration> sorted(_samples.begin(), _samples.end());
+    auto nth = sorted.begin() + (sorted.size() - 1) * min(p, 100u) / 100;
+    nth_element(sorted.begin(), nth, sorted.end());
 
-        for (auto kv : SplitString(*cache_control, ',')) {
-            if (boost::iequals(kv, "no-cache")) return true;
-            if (boost::iequals(kv, "no-store")) return true;
-        }
-    }
+    return *nth;
+}
 
-    return false;
+//------------------------------------------------------------------------------
+namespace {
+
+// Wakes up the coroutine running a hedged fetch when one of its jobs
+// finishes or the hedging delay elapses.
+struct Race {
+    Race(asio::io_service& ios) : ios(ios), on_change(ios), timer(ios) {}
+
+    asio::io_service& ios;
+    ConditionVariable on_change;
+    asio::steady_timer timer;
+    bool timed_out = false;
+};
+
+template<class Until>
+void wait_until( const shared_ptr<Race>& race
+               , Until until
+               , asio::yield_context yield)
+{
+    while (!until()) race->on_change.wait(yield);
+}
+
+// Only one timed wait may be done per race.
+template<class Until>
+void wait_until( const shared_ptr<Race>& race
+               , Until until
+               , const posix_time::time_duration& timeout
+               , asio::yield_context yield)
+{
+    race->timer.expires_from_now
+        (chrono::microseconds(timeout.total_microseconds()));
+
+    // The handler may run after we are done waiting.
+    race->timer.async_wait([race] (const sys::error_code& ec) {
+        if (ec) return;
+        race->timed_out = true;
+        race->on_change.notify();
+    });
+
+    while (!until() && !race->timed_out) race->on_change.wait(yield);
+
+    race->timer.cancel();
 }
 
-// TODO: This function is unfinished.
+} // namespace
+
+// A fetch running in its own coroutine so that it can be raced against
+// another one.  Once started, it must be waited for before it is destroyed.
+template<class T>
+class CacheControl::Job {
+public:
+    bool started() const { return _started; }
+    bool done()    const { return _done; }
+
+    const sys::error_code& ec() const { return _ec; }
+
+    template<class F>
+    void start(shared_ptr<Race> race, LatencyHistory& latency, F fetch)
+    {
+        assert(!_started);
+
+        _started = true;
+        _race = move(race);
+
+        asio::spawn(_race->ios, [this, &latency, fetch]
+                                (asio::yield_context yield) {
+            using Clock = chrono::steady_clock;
+            auto start = Clock::now();
+
+            _result = fetch(_cancel, yield[_ec]);
+
+            if (!_cancel.call_count()) {
+                auto us = chrono::duration_cast<chrono::microseconds>
+                    (Clock::now() - start).count();
+                latency.add(posix_time::microseconds(us));
+            }
+
+            _done = true;
+            _race->on_change.notify();
+        });
+    }
+
+    void cancel()
+    {
+        if (_started && !_done) _cancel();
+    }
+
+    void wait(asio::yield_context yield)
+    {
+        if (_started) wait_until(_race, [&] { return _done; }, yield);
+    }
+
+    T result(asio::yield_context yield)
+    {
+        wait(yield);
+        return or_throw(yield, _ec, move(_result));
+    }
+
+private:
+    bool _started = false;
+    bool _done = false;
+    shared_ptr<Race> _race;
+    Cancel _cancel;
+    sys::error_code _ec;
+    T _result;
+};
+
 Response
 CacheControl::do_fetch(const Request& request, asio::yield_context yield)
 {
@@ -267,27 +605,101 @@ CacheControl::do_fetch(const Request& request, asio::yield_context yield)
 
     sys::error_code ec;
 
+    // Jobs are only started when hedging, otherwise the hooks
+    // are called in turn.
+    shared_ptr<Race> race;
+    if (is_hedging()) race = make_shared<Race>(*_ios);
+
+    Job<Response>   fresh_job;
+    Job<CacheEntry> stored_job;
+
+    auto start_fresh = [&] {
+        fresh_job.start(race, _latencies->fresh, [&] (Cancel& c, asio::yield_context y) {
+            return do_fetch_fresh(request, c, y);
+        });
+    };
+
+    auto start_stored = [&] {
+        stored_job.start(race, _latencies->stored, [&] (Cancel& c, asio::yield_context y) {
+            return do_fetch_stored(request, c, y);
+        });
+    };
+
+    // These use the result of a job if it was started.
+    auto get_fresh = [&] (const Request& rq, asio::yield_context y) -> Response {
+        if (fresh_job.started()) return fresh_job.result(y);
+        Cancel cancel;
+        return do_fetch_fresh(rq, cancel, y);
+    };
+
+    auto get_stored = [&] (asio::yield_context y) -> CacheEntry {
+        if (stored_job.started()) return stored_job.result(y);
+        Cancel cancel;
+        return do_fetch_stored(request, cancel, y);
+    };
+
+    auto drop = [&] (auto& job) {
+        job.cancel();
+        job.wait(yield);
+    };
+
     if (must_revalidate(request)) {
         sys::error_code ec1, ec2;
 
-        auto res = do_fetch_fresh(request, yield[ec1]);
-        if (!ec1) return res;
+        if (race) {
+            start_fresh();
+            wait_until( race, [&] { return fresh_job.done(); }
+                      , hedge_delay_after(_latencies->fresh), yield);
+            // Have the stored entry at hand in case the origin fails.
+            if (!fresh_job.done()) start_stored();
+        }
+
+        auto res = get_fresh(request, yield[ec1]);
+
+        if (!ec1 && !is_server_error(res)) {
+            drop(stored_job);
+            return res;
+        }
 
-        auto cache_entry = do_fetch_stored(request, yield[ec2]);
-        if (!ec2) return add_warning( move(cache_entry.response)
-                                    , "111 Ouinet \"Revalidation Failed\"");
+        auto cache_entry = get_stored(yield[ec2]);
+        if (!ec2 && can_serve_stale_on_error(cache_entry))
+            return add_warning( move(cache_entry.response)
+                              , "111 Ouinet \"Revalidation Failed\"");
 
         if (ec1 == err::operation_aborted || ec2 == err::operation_aborted) {
             return or_throw(yield, err::operation_aborted, move(res));
         }
 
+        if (!ec1) return res;
+
         return bad_gateway(request);
     }
 
-    auto cache_entry = do_fetch_stored(request, yield[ec]);
+    if (race) {
+        start_stored();
+        wait_until( race, [&] { return stored_job.done(); }
+                  , hedge_delay_after(_latencies->stored), yield);
+
+        if (!stored_job.done()) {
+            start_fresh();
+            wait_until(race, [&] {
+                    return stored_job.done()
+                        || (fresh_job.done() && !fresh_job.ec());
+                }, yield);
+
+            if (!stored_job.done()) {
+                // The origin answered first.
+                drop(stored_job);
+                return fresh_job.result(yield);
+            }
+        }
+    }
+
+    auto cache_entry = get_stored(yield[ec]);
 
     if (ec && ec != err::operation_not_supported
            && ec != err::not_found) {
+        drop(fresh_job);
         return or_throw<Response>(yield, ec);
     }
 
@@ -295,7 +707,7 @@ CacheControl::do_fetch(const Request& request, asio::yield_context yield)
         // Retrieving from cache failed.
         sys::error_code fetch_ec;
 
-        auto res = do_fetch_fresh(request, yield[fetch_ec]);
+        auto res = get_fresh(request, yield[fetch_ec]);
 
         if (!fetch_ec) return res;
 
@@ -309,47 +721,58 @@ CacheControl::do_fetch(const Request& request, asio::yield_context yield)
     // If we're here that means that we were able to retrieve something
     // from the cache.
 
-    if (has_cache_control_directive(cache_entry.response, "private")
+    if (cache_entry.meta.is_private
         || is_older_than_max_cache_age(cache_entry.time_stamp)) {
-        auto response = do_fetch_fresh(request, yield[ec]);
+        auto response = get_fresh(request, yield[ec]);
 
-        if (!ec) return response;
+        if (!ec && !is_server_error(response)) return response;
 
-        return is_expired(cache_entry)
-             ? add_stale_warning(move(cache_entry.response))
-             : cache_entry.response;
+        return stale_or_error(request, move(cache_entry), ec, move(response));
     }
 
     if (!is_expired(cache_entry)) {
+        drop(fresh_job);
         return cache_entry.response;
     }
 
-    auto cache_etag  = get(cache_entry.response, http::field::etag);
-    auto rq_etag = get(request, http::field::if_none_match);
-
-    if (cache_etag && !rq_etag) {
-        auto rq = request; // Make a copy because `request` is const&.
+    if (revalidate && can_serve_stale_while_revalidate(cache_entry)) {
+        drop(fresh_job);
+        revalidate(revalidation_request(request, cache_entry), cache_entry);
+        return add_stale_warning(move(cache_entry.response));
+    }
 
-        rq.set(http::field::if_none_match, *cache_etag);
+    // When hedging, the origin has already been asked for
+    // the full response.
+    auto response = get_fresh( fresh_job.started()
+                               ? request
+                               : revalidation_request(request, cache_entry)
+                             , yield[ec]);
 
-        auto response = do_fetch_fresh(rq, yield[ec]);
+    if (ec || is_server_error(response)) {
+        return stale_or_error(request, move(cache_entry), ec, move(response));
+    }
 
-        if (ec) {
-            return add_stale_warning(move(cache_entry.response));
-        }
+    // Only merge the response to our own validators.
+    if (response.result() == http::status::not_modified
+        && !fresh_job.started()) {
+        auto merged = merge_not_modified(move(cache_entry.response), response);
+        try_to_cache(request, merged);
+        return merged;
+    }
 
-        if (response.result() == http::status::not_modified) {
-            return move(cache_entry.response);
-        }
+    return response;
+}
 
-        return response;
+void CacheControl::revalidated( const Request& request
+                              , CacheEntry entry
+                              , const Response& response) const
+{
+    if (response.result() == http::status::not_modified) {
+        return try_to_cache( request
+                           , merge_not_modified(move(entry.response), response));
     }
 
-    auto response = do_fetch_fresh(request, yield[ec]);
-
-    return ec
-         ? add_stale_warning(move(cache_entry.response))
-         : response;
+    try_to_cache(request, response);
 }
 
 void CacheControl::max_cached_age(const posix_time::time_duration& d)
@@ -362,23 +785,169 @@ posix_time::time_duration CacheControl::max_cached_age() const
     return _max_cached_age;
 }
 
+void CacheControl::stale_while_revalidate(const posix_time::time_duration& d)
+{
+    _stale_while_revalidate = d;
+}
+
+posix_time::time_duration CacheControl::stale_while_revalidate() const
+{
+    return _stale_while_revalidate;
+}
+
+void CacheControl::stale_if_error(const posix_time::time_duration& d)
+{
+    _stale_if_error = d;
+}
+
+posix_time::time_duration CacheControl::stale_if_error() const
+{
+    return _stale_if_error;
+}
+
+void CacheControl::heuristic_freshness(unsigned percent)
+{
+    _heuristic_freshness = percent;
+}
+
+unsigned CacheControl::heuristic_freshness() const
+{
+    return _heuristic_freshness;
+}
+
+void CacheControl::max_heuristic_freshness(const posix_time::time_duration& d)
+{
+    _max_heuristic_freshness = d;
+}
+
+posix_time::time_duration CacheControl::max_heuristic_freshness() const
+{
+    return _max_heuristic_freshness;
+}
+
+void CacheControl::hedge_delay(const posix_time::time_duration& d)
+{
+    _hedge_delay = d;
+}
+
+posix_time::time_duration CacheControl::hedge_delay() const
+{
+    return _hedge_delay;
+}
+
+void CacheControl::hedge_percentile(unsigned p)
+{
+    _hedge_percentile = p;
+}
+
+unsigned CacheControl::hedge_percentile() const
+{
+    return _hedge_percentile;
+}
+
+void CacheControl::latencies(shared_ptr<Latencies> l)
+{
+    assert(l);
+    _latencies = move(l);
+}
+
+const CacheControl::Latencies& CacheControl::latencies() const
+{
+    return *_latencies;
+}
+
+void CacheControl::negative_cache(shared_ptr<NegativeCache> nc)
+{
+    _negative_cache = move(nc);
+}
+
+NegativeCache* CacheControl::negative_cache_for(const Request& rq) const
+{
+    if (rq.method() != http::verb::get) return nullptr;
+    return _negative_cache.get();
+}
+
+bool CacheControl::is_hedging() const
+{
+    return _ios && _hedge_delay > posix_time::seconds(0);
+}
+
+posix_time::time_duration
+CacheControl::hedge_delay_after(const LatencyHistory& history) const
+{
+    if (_hedge_percentile) {
+        auto d = history.percentile(_hedge_percentile);
+        if (d) return *d;
+    }
+
+    return _hedge_delay;
+}
+
 Response
-CacheControl::do_fetch_fresh(const Request& rq, asio::yield_context yield)
+CacheControl::do_fetch_fresh( const Request& rq
+                            , Cancel& cancel
+                            , asio::yield_context yield)
 {
     if (fetch_fresh) {
+        auto negative = negative_cache_for(rq);
+
+        // A reload gets past remembered errors (but still updates them).
+        if (negative && !must_revalidate(rq)) {
+            if (auto error = negative->find_error(rq.target().to_string())) {
+                if (error->ec) return or_throw<Response>(yield, error->ec);
+                return error->response;
+            }
+        }
+
         sys::error_code ec;
-        auto rs = fetch_fresh(rq, yield[ec]);
+        auto rs = fetch_fresh(rq, cancel, yield[ec]);
         if (!ec) { try_to_cache(rq, rs); }
+
+        // Error codes may come from reaching something other than
+        // the origin, so only `fetch_fresh` can tell whether to remember them.
+        if (negative && !ec) {
+            auto key = rq.target().to_string();
+
+            if (NegativeCache::is_negative(rs)) {
+                negative->insert_error(key, {ec, rs});
+            }
+            else {
+                negative->erase(key);
+            }
+        }
+
         return or_throw(yield, ec, move(rs));
     }
     return or_throw<Response>(yield, asio::error::operation_not_supported);
 }
 
 CacheControl::CacheEntry
-CacheControl::do_fetch_stored(const Request& rq, asio::yield_context yield)
+CacheControl::do_fetch_stored( const Request& rq
+                             , Cancel& cancel
+                             , asio::yield_context yield)
 {
     if (fetch_stored) {
-        return fetch_stored(rq, yield);
+        auto negative = negative_cache_for(rq);
+
+        if (negative && negative->is_miss(rq.target().to_string())) {
+            return or_throw<CacheEntry>(yield, asio::error::not_found);
+        }
+
+        sys::error_code ec;
+        auto entry = fetch_stored(rq, cancel, yield[ec]);
+
+        if (negative && ec == asio::error::not_found) {
+            negative->insert_miss(rq.target().to_string());
+        }
+
+        if (!ec) {
+            entry.meta = CacheMeta::parse(entry.response);
+            // https://tools.ietf.org/html/rfc7234#section-4
+            entry.response.set( http::field::age
+                              , to_string(current_age(entry).total_seconds()));
+        }
+
+        return or_throw(yield, ec, move(entry));
     }
     return or_throw<CacheEntry>(yield, asio::error::operation_not_supported);
 }
@@ -433,8 +1002,6 @@ bool CacheControl::ok_to_cache( const http::request_header<>&  request
                               , const http::response_header<>& response
                               , const char** reason)
 {
-    using boost::iequals;
-
     switch (response.result()) {
         case http::status::ok:
         case http::status::moved_permanently:
@@ -445,38 +1012,18 @@ bool CacheControl::ok_to_cache( const http::request_header<>&  request
             return false;
     }
 
-    auto req_cache_control_i = request.find(http::field::cache_control);
-
-    if (req_cache_control_i != request.end()) {
-        for (auto v : SplitString(req_cache_control_i->value(), ',')) {
-            // https://tools.ietf.org/html/rfc7234#section-3 (bullet #3)
-            if (iequals(v, "no-store")) {
-                if (reason) *reason = "request has no-store";
-                return false;
-            }
-        }
+    // https://tools.ietf.org/html/rfc7234#section-3 (bullet #3)
+    if (CacheMeta::parse(request).no_store) {
+        if (reason) *reason = "request has no-store";
+        return false;
     }
 
-    auto res_cache_control_i = response.find(http::field::cache_control);
+    auto meta = CacheMeta::parse(response);
 
     // https://tools.ietf.org/html/rfc7234#section-3 (bullet #5)
     if (request.count(http::field::authorization)) {
         // https://tools.ietf.org/html/rfc7234#section-3.2
-        if (res_cache_control_i == response.end()) {
-            if (reason) *reason = "request has auth";
-            return false;
-        }
-
-        bool allowed = false;
-
-        for (auto v : SplitString(res_cache_control_i->value(), ',')) {
-            // FIXME: s-maxage contains '='
-            if (iequals(v,"must-revalidate")) { allowed = true; break; }
-            if (iequals(v,"public"))          { allowed = true; break; }
-            if (iequals(v,"s-maxage"))        { allowed = true; break; }
-        }
-
-        if (!allowed) {
+        if (!meta.must_revalidate && !meta.is_public && !meta.s_maxage) {
             if (reason)
                 *reason = "request contains auth, but response's cache control "
                           "header field contains none of "
@@ -486,39 +1033,41 @@ bool CacheControl::ok_to_cache( const http::request_header<>&  request
         }
     }
 
-    if (res_cache_control_i == response.end()) return true;
+    // https://tools.ietf.org/html/rfc7234#section-3 (bullet #3)
+    if (meta.no_store) {
+        if (reason) *reason = "response contains cache-control: no-store";
 
-    for (auto kv : SplitString(res_cache_control_i->value(), ','))
-    {
-        beast::string_view key, val;
-        std::tie(key, val) = split_string_pair(kv, '=');
+        return false;
+    }
 
-        // https://tools.ietf.org/html/rfc7234#section-3 (bullet #3)
-        if (iequals(key, "no-store")) {
-            if (reason) *reason = "response contains cache-control: no-store";
+    // Responses with "Vary" are stored as variants of the URL, but
+    // "Vary: *" never matches a later request
+    // (https://tools.ietf.org/html/rfc7234#section-4.1).
+    if (find(meta.vary.begin(), meta.vary.end(), "*") != meta.vary.end()) {
+        if (reason) *reason = "response contains vary: *";
+
+        return false;
+    }
+
+    // https://tools.ietf.org/html/rfc7234#section-3 (bullet #4)
+    if (meta.is_private) {
+        // NOTE: This decision based on the request having private data is
+        // our extension (NOT part of RFC). Some servers (e.g.
+        // www.bbc.com/) sometimes respond with 'Cache-Control: private'
+        // even though the request doesn't contain any private data (e.g.
+        // Cookies, {GET,POST,...} variables,...).  We believe this happens
+        // when the server serves different content depending on the
+        // client's geo location. While we don't necessarily want to break
+        // this intent, we believe serving _some_ content is better than
+        // none. As such, the client should always check for presence of
+        // this 'private' field when fetching from distributed cache and
+        // - if present - re-fetch from origin if possible.
+        if (contains_private_data(request)) {
+            if (reason)
+                *reason = "response contains cache-control: private";
 
             return false;
         }
-        // https://tools.ietf.org/html/rfc7234#section-3 (bullet #4)
-        if (iequals(key, "private"))  {
-            // NOTE: This decision based on the request having private data is
-            // our extension (NOT part of RFC). Some servers (e.g.
-            // www.bbc.com/) sometimes respond with 'Cache-Control: private'
-            // even though the request doesn't contain any private data (e.g.
-            // Cookies, {GET,POST,...} variables,...).  We believe this happens
-            // when the server serves different content depending on the
-            // client's geo location. While we don't necessarily want to break
-            // this intent, we believe serving _some_ content is better than
-            // none. As such, the client should always check for presence of
-            // this 'private' field when fetching from distributed cache and
-            // - if present - re-fetch from origin if possible.
-            if (contains_private_data(request)) {
-                if (reason)
-                    *reason = "response contains cache-control: private";
-
-                return false;
-            }
-        }
     }
 
     return true;
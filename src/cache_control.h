@@ -1,13 +1,38 @@
 #pragma once
 
 #include <boost/asio/error.hpp>
+#include <boost/asio/io_service.hpp>
 #include <boost/asio/spawn.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/optional.hpp>
+#include <deque>
+#include <memory>
+#include "cache/negative_cache.h"
+#include "cache_meta.h"
 #include "namespaces.h"
+#include "util/signal.h"
 
 namespace ouinet {
 
+// The latencies of the latest operations of some kind.
+class LatencyHistory {
+public:
+    using Duration = boost::posix_time::time_duration;
+
+    void add(Duration);
+
+    // The given percentile (0-100) of the recorded latencies,
+    // none if too few have been recorded yet.
+    boost::optional<Duration> percentile(unsigned) const;
+
+private:
+    static const size_t min_samples = 16;
+    static const size_t max_samples = 128;
+
+    std::deque<Duration> _samples;
+};
+
 class CacheControl {
 public:
     using Request  = http::request<http::string_body>;
@@ -16,25 +41,100 @@ public:
     struct CacheEntry {
         boost::posix_time::ptime time_stamp;
         Response response;
+        // Parsed from `response` by `fetch` once it is retrieved.
+        CacheMeta meta;
     };
 
-    // TODO: Add cancellation support
-    using FetchStored = std::function<CacheEntry(const Request&, asio::yield_context)>;
-    using FetchFresh  = std::function<Response(const Request&, asio::yield_context)>;
+    // Fetch hooks are given a signal which is called if their result
+    // is no longer needed, they should then fail with `operation_aborted`
+    // as soon as possible.
+    using Cancel      = Signal<void()>;
+    using FetchStored = std::function<CacheEntry(const Request&, Cancel&, asio::yield_context)>;
+    using FetchFresh  = std::function<Response(const Request&, Cancel&, asio::yield_context)>;
     using Store       = std::function<void(const Request&, const Response&)>;
+    // Fetch a fresh response for the request, which carries the validators
+    // of the given stored entry, and pass it to `revalidated`
+    // without making the caller wait for it.
+    using Revalidate  = std::function<void(const Request&, CacheEntry)>;
+
+    // Recent latencies of the fetch hooks.  They may be shared
+    // by several objects (see `latencies`) so that what is learned
+    // about them outlives a single request.
+    struct Latencies {
+        LatencyHistory stored;
+        LatencyHistory fresh;
+    };
 
 public:
+    CacheControl();
+    // Hedging (see `hedge_delay`) needs an I/O service to run
+    // both fetch hooks at the same time.
+    explicit CacheControl(asio::io_service&);
+
     Response fetch(const Request&, asio::yield_context);
 
     FetchStored  fetch_stored;
     FetchFresh   fetch_fresh;
     Store        store;
+    // If set, an expired entry still within its stale-while-revalidate
+    // window is returned right away while this revalidates it.
+    Revalidate   revalidate;
 
     void try_to_cache(const Request&, const Response&) const;
 
+    // Store the response to a revalidation of the stored `entry`
+    // (see `Revalidate`), or the entry updated with it
+    // if it is a "304 Not Modified".
+    void revalidated(const Request&, CacheEntry entry, const Response&) const;
+
     void max_cached_age(const boost::posix_time::time_duration&);
     boost::posix_time::time_duration max_cached_age() const;
 
+    // RFC 5861 windows used when the response does not specify a longer one.
+    // A negative stale-if-error window allows serving stale entries
+    // on errors regardless of their age.
+    void stale_while_revalidate(const boost::posix_time::time_duration&);
+    boost::posix_time::time_duration stale_while_revalidate() const;
+
+    void stale_if_error(const boost::posix_time::time_duration&);
+    boost::posix_time::time_duration stale_if_error() const;
+
+    // Responses without explicit freshness information but with
+    // a "Last-Modified" date are considered fresh for this percentage
+    // of the time since they were last modified (zero: never),
+    // up to the given maximum.
+    void heuristic_freshness(unsigned percent);
+    unsigned heuristic_freshness() const;
+
+    void max_heuristic_freshness(const boost::posix_time::time_duration&);
+    boost::posix_time::time_duration max_heuristic_freshness() const;
+
+    // If the source tried first (the cache, or the origin if the request
+    // asks for revalidation) has not answered after this delay, the other
+    // one is tried at the same time, the first acceptable response is used
+    // and the other fetch is cancelled.  Zero (default) disables hedging.
+    void hedge_delay(const boost::posix_time::time_duration&);
+    boost::posix_time::time_duration hedge_delay() const;
+
+    // If not zero, hedge after this percentile (1-100) of the recent
+    // latencies of the source tried first instead, once enough of them
+    // are known.  `hedge_delay` must still be set to enable hedging.
+    void hedge_percentile(unsigned);
+    unsigned hedge_percentile() const;
+
+    void latencies(std::shared_ptr<Latencies>);
+    const Latencies& latencies() const;
+
+    // If set, failed fetches of GET requests (origin error responses and
+    // cache misses) are remembered there and not retried while they last.
+    // Errors which the origin reports as error codes (e.g. an unknown host)
+    // are only replayed, `fetch_fresh` must insert them itself.
+    void negative_cache(std::shared_ptr<NegativeCache>);
+
+    // The time since the entry's response was generated by the origin
+    // (RFC 7234 section 4.2.3).
+    static boost::posix_time::time_duration current_age(const CacheEntry&);
+
     // Returns ptime() if parsing fails.
     static boost::posix_time::ptime parse_date(beast::string_view);
 
@@ -44,20 +144,67 @@ public:
 
     static Response filter_before_store(Response);
 
+    // Whether the request wants a response validated by the origin
+    // (e.g. a user agent reloading a page).
+    static bool must_revalidate(const http::request_header<>&);
+
 private:
-    // TODO: Add cancellation support
+    template<class T> class Job;
+
     Response do_fetch(const Request&, asio::yield_context);
-    Response do_fetch_fresh(const Request&, asio::yield_context);
-    CacheEntry do_fetch_stored(const Request&, asio::yield_context);
+    Response do_fetch_fresh(const Request&, Cancel&, asio::yield_context);
+    CacheEntry do_fetch_stored(const Request&, Cancel&, asio::yield_context);
+
+    NegativeCache* negative_cache_for(const Request&) const;
 
-    bool is_stale( const boost::posix_time::ptime& time_stamp
-                 , const Response&) const;
+    bool is_hedging() const;
+    boost::posix_time::time_duration hedge_delay_after(const LatencyHistory&) const;
+
+    boost::optional<boost::posix_time::time_duration>
+    freshness_lifetime(const CacheEntry&) const;
+
+    boost::optional<boost::posix_time::time_duration>
+    heuristic_freshness_lifetime(const CacheEntry&) const;
+
+    boost::posix_time::ptime expiration_time(const CacheEntry&) const;
+    bool is_expired(const CacheEntry&) const;
 
     bool is_older_than_max_cache_age(const boost::posix_time::ptime&) const;
 
+    bool can_serve_stale_while_revalidate(const CacheEntry&) const;
+    bool can_serve_stale_on_error(const CacheEntry&) const;
+
+    Response stale_or_bad_gateway(const Request&, CacheEntry) const;
+    Response stale_or_error( const Request&
+                           , CacheEntry
+                           , const sys::error_code&
+                           , Response error) const;
+
 private:
     boost::posix_time::time_duration _max_cached_age
         = boost::posix_time::hours(7*24);  // one week
+
+    boost::posix_time::time_duration _stale_while_revalidate
+        = boost::posix_time::seconds(0);
+
+    boost::posix_time::time_duration _stale_if_error
+        = boost::posix_time::seconds(-1);  // no limit
+
+    unsigned _heuristic_freshness = 10;
+
+    boost::posix_time::time_duration _max_heuristic_freshness
+        = boost::posix_time::hours(24);
+
+    asio::io_service* _ios = nullptr;
+
+    boost::posix_time::time_duration _hedge_delay
+        = boost::posix_time::seconds(0);
+
+    unsigned _hedge_percentile = 0;
+
+    std::shared_ptr<Latencies> _latencies;
+
+    std::shared_ptr<NegativeCache> _negative_cache;
 };
 
 } // ouinet namespace
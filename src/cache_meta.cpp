@@ -0,0 +1,276 @@
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/range/iterator_range.hpp>
+#include <boost/date_time/gregorian/gregorian_types.hpp>
+
+#include "cache_meta.h"
+#include "split_string.h"
+
+using namespace std;
+using namespace ouinet;
+
+namespace posix_time = boost::posix_time;
+namespace gregorian  = boost::gregorian;
+
+//------------------------------------------------------------------------------
+namespace {
+
+// A minimal scanner over the characters of a date.
+struct Scanner {
+    const char* p;
+    const char* end;
+
+    bool done() const { return p == end; }
+
+    bool skip(char c) {
+        if (done() || *p != c) return false;
+        ++p;
+        return true;
+    }
+
+    void skip_all(char c) {
+        while (!done() && *p == c) ++p;
+    }
+
+    void skip_letters() {
+        while (!done() && ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z')))
+            ++p;
+    }
+
+    // Between `min` and `max` decimal digits.
+    bool digits(unsigned min, unsigned max, unsigned& out) {
+        unsigned n = 0;
+        out = 0;
+
+        while (n < max && !done() && *p >= '0' && *p <= '9') {
+            out = out * 10 + (*p - '0');
+            ++p; ++n;
+        }
+
+        return n >= min;
+    }
+
+    // Three letter month name (case-insensitive), 1 to 12.
+    bool month(unsigned& out) {
+        static const char names[] = "janfebmaraprmayjunjulaugsepoctnovdec";
+
+        if (end - p < 3) return false;
+
+        char m[3];
+        for (int i = 0; i < 3; ++i) m[i] = p[i] | 0x20;  // lower case
+
+        for (unsigned i = 0; i < 12; ++i) {
+            if ( m[0] == names[3*i]
+              && m[1] == names[3*i+1]
+              && m[2] == names[3*i+2]) {
+                out = i + 1;
+                p += 3;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // HH:MM:SS
+    bool time(unsigned& h, unsigned& m, unsigned& s) {
+        return digits(2, 2, h) && skip(':')
+            && digits(2, 2, m) && skip(':')
+            && digits(2, 2, s);
+    }
+};
+
+} // namespace
+
+// RFC 7231 section 7.1.1.1: a two-digit year which appears to be more than
+// 50 years in the future is in the most recent past year with those digits.
+static unsigned expand_two_digit_year(unsigned yy)
+{
+    static const unsigned this_year
+        = posix_time::second_clock::universal_time().date().year();
+
+    unsigned year = this_year - this_year % 100 + yy;
+    if (year > this_year + 50) year -= 100;
+    return year;
+}
+
+posix_time::ptime ouinet::parse_http_date(beast::string_view s)
+{
+    Scanner in{s.data(), s.data() + s.size()};
+
+    while (!in.done() && (*in.p == '"' || *in.p == ' ')) ++in.p;
+
+    unsigned year, month, day, hour, minute, second;
+
+    in.skip_letters();  // day name
+
+    if (in.skip(',')) {
+        in.skip_all(' ');
+
+        if (!in.digits(1, 2, day)) return {};
+
+        if (in.skip(' ')) {
+            // IMF-fixdate: Sun, 06 Nov 1994 08:49:37 GMT
+            if (!in.month(month) || !in.skip(' ')) return {};
+            if (!in.digits(4, 4, year)) return {};
+        }
+        else if (in.skip('-')) {
+            // RFC 850: Sunday, 06-Nov-94 08:49:37 GMT
+            if (!in.month(month) || !in.skip('-')) return {};
+            auto start = in.p;
+            if (!in.digits(2, 4, year)) return {};
+            if (in.p - start == 2) year = expand_two_digit_year(year);
+            else if (in.p - start != 4) return {};
+        }
+        else {
+            return {};
+        }
+
+        if (!in.skip(' ') || !in.time(hour, minute, second)) return {};
+    }
+    else {
+        // ANSI C: Sun Nov  6 08:49:37 1994
+        if (!in.skip(' ') || !in.month(month)) return {};
+        in.skip_all(' ');
+        if (!in.digits(1, 2, day) || !in.skip(' ')) return {};
+        if (!in.time(hour, minute, second)) return {};
+        in.skip_all(' ');
+        if (!in.digits(4, 4, year)) return {};
+    }
+
+    // Anything after the date (like " GMT") is ignored.
+
+    if (year < 1400 || year > 9999) return {};
+    if (hour > 23 || minute > 59 || second > 60) return {};
+    if (second == 60) second = 59;  // leap second
+    if (day < 1 || day > gregorian::gregorian_calendar::end_of_month_day(year, month))
+        return {};
+
+    return posix_time::ptime( gregorian::date(year, month, day)
+                            , posix_time::time_duration(hour, minute, second));
+}
+
+//------------------------------------------------------------------------------
+// Delta seconds (RFC 7234 section 1.2.1), returns none if malformed.
+static boost::optional<unsigned> parse_delta_seconds(beast::string_view v)
+{
+    // Values are sometimes quoted even if they should not.
+    while (v.starts_with('"')) v.remove_prefix(1);
+    while (v.ends_with  ('"')) v.remove_suffix(1);
+
+    if (v.empty()) return boost::none;
+
+    // Larger values are to be taken as this one.
+    static const unsigned max_delta = 2147483648u;
+
+    unsigned delta = 0;
+
+    for (char c : v) {
+        if (c < '0' || c > '9') return boost::none;
+        unsigned d = c - '0';
+        // Saturate before `delta * 10 + d` could wrap around.
+        if (delta > (max_delta - d) / 10) delta = max_delta;
+        else delta = delta * 10 + d;
+    }
+
+    return delta;
+}
+
+static void keep_largest(boost::optional<unsigned>& dst, beast::string_view v)
+{
+    auto delta = parse_delta_seconds(v);
+    if (!delta) return;  // ignore malformed directives
+    if (!dst || *dst < *delta) dst = delta;
+}
+
+void CacheMeta::parse_cache_control(beast::string_view value)
+{
+    using boost::iequals;
+
+    for (auto kv : SplitString(value, ',')) {
+        beast::string_view key, val;
+        std::tie(key, val) = split_string_pair(kv, '=');
+
+        if      (iequals(key, "max-age"))                keep_largest(max_age, val);
+        else if (iequals(key, "s-maxage"))               keep_largest(s_maxage, val);
+        else if (iequals(key, "stale-while-revalidate")) keep_largest(stale_while_revalidate, val);
+        else if (iequals(key, "stale-if-error"))         keep_largest(stale_if_error, val);
+        else if (iequals(key, "no-cache"))               no_cache = true;
+        else if (iequals(key, "no-store"))               no_store = true;
+        else if (iequals(key, "must-revalidate"))        must_revalidate = true;
+        // We are a shared cache (RFC 7234 section 5.2.2.7).
+        else if (iequals(key, "proxy-revalidate"))       must_revalidate = true;
+        else if (iequals(key, "public"))                 is_public = true;
+        else if (iequals(key, "private"))                is_private = true;
+    }
+}
+
+CacheMeta CacheMeta::parse(const http::fields& fields)
+{
+    CacheMeta meta;
+
+    for (auto& f : fields) {
+        switch (f.name()) {
+            case http::field::cache_control:
+                meta.parse_cache_control(f.value());
+                break;
+            case http::field::expires:
+                meta.expires = parse_http_date(f.value());
+                // Invalid dates like "0" mean that the response has expired
+                // (https://tools.ietf.org/html/rfc7234#section-5.3).
+                if (meta.expires.is_not_a_date_time())
+                    meta.expires = posix_time::ptime(posix_time::min_date_time);
+                break;
+            case http::field::date:
+                meta.date = parse_http_date(f.value());
+                break;
+            case http::field::last_modified:
+                meta.last_modified = parse_http_date(f.value());
+                break;
+            case http::field::age: {
+                auto age = parse_delta_seconds(f.value());
+                if (age) meta.age = age;
+                break;
+            }
+            case http::field::etag:
+                meta.etag = f.value().to_string();
+                break;
+            case http::field::vary:
+                for (auto name : SplitString(f.value(), ',')) {
+                    if (name.empty()) continue;
+                    auto n = name.to_string();
+                    boost::algorithm::to_lower(n);
+                    meta.vary.push_back(move(n));
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    return meta;
+}
+
+//------------------------------------------------------------------------------
+string ouinet::variant_key( const http::fields& request
+                          , const vector<string>& vary)
+{
+    string key;
+
+    for (auto& name : vary) {
+        if (&name != &vary.front()) key += ' ';
+
+        bool first = true;
+
+        for (auto& f : boost::make_iterator_range(request.equal_range(name))) {
+            if (!first) key += ',';
+            first = false;
+
+            for (char c : f.value()) {
+                if (c != ' ' && c != '\t') key += c;
+            }
+        }
+    }
+
+    return key;
+}
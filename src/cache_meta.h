@@ -0,0 +1,71 @@
+#pragma once
+
+#include <boost/beast/http/fields.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/optional.hpp>
+#include <string>
+#include <vector>
+
+#include "namespaces.h"
+
+namespace ouinet {
+
+// Parse a date in any of the three formats accepted by RFC 7231
+// (section 7.1.1.1), i.e. IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"),
+// the obsolete RFC 850 format ("Sunday, 06-Nov-94 08:49:37 GMT")
+// and ANSI C's asctime() format ("Sun Nov  6 08:49:37 1994").
+//
+// Leading quotes and spaces are skipped.  Returns ptime() if parsing fails.
+// It does not allocate memory.
+boost::posix_time::ptime parse_http_date(beast::string_view);
+
+// The header fields of a request or response which are relevant to caching,
+// parsed once so that they need not be looked up and split again
+// each time a caching decision is made.
+struct CacheMeta {
+    // Cache-Control directives (RFC 7234 section 5.2 and RFC 5861).
+    // If a delta directive is repeated, the largest value is kept.
+    boost::optional<unsigned> max_age;
+    boost::optional<unsigned> s_maxage;
+    boost::optional<unsigned> stale_while_revalidate;
+    boost::optional<unsigned> stale_if_error;
+    bool no_cache = false;
+    bool no_store = false;
+    // Also set by "proxy-revalidate", since we are a shared cache.
+    bool must_revalidate = false;
+    bool is_public = false;
+    bool is_private = false;
+
+    // These are not_a_date_time if missing or malformed,
+    // except for a malformed `expires` which is a date in the past.
+    boost::posix_time::ptime expires;
+    boost::posix_time::ptime date;
+    boost::posix_time::ptime last_modified;
+
+    boost::optional<unsigned> age;
+
+    // Empty if missing.
+    std::string etag;
+
+    // Lower case names of the header fields in "Vary" ("*" included).
+    std::vector<std::string> vary;
+
+    // `s-maxage` if present (we are a shared cache), otherwise `max-age`.
+    boost::optional<unsigned> shared_max_age() const {
+        return s_maxage ? s_maxage : max_age;
+    }
+
+    static CacheMeta parse(const http::fields&);
+
+    // Add the directives in a "Cache-Control" header field value.
+    void parse_cache_control(beast::string_view);
+};
+
+// The key identifying the variant of a response to `request`
+// which varies on the given (lower case) header fields:
+// the values of those fields in `request` with white space removed
+// and separated by single spaces.
+std::string variant_key( const http::fields& request
+                       , const std::vector<std::string>& vary);
+
+} // ouinet namespace
@@ -8,9 +8,12 @@
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/asio/ssl.hpp>
 #include <boost/asio/ssl/stream.hpp>
+#include <boost/filesystem/fstream.hpp>
 #include <lrucache.hpp>
 #include <iostream>
 #include <fstream>
+#include <set>
+#include <thread>
 #include <cstdlib>  // for atexit()
 
 #include "cache/cache_client.h"
@@ -30,8 +33,11 @@
 #include "client.h"
 #include "authenticate.h"
 #include "defer.h"
+#include "prefixed_connection.h"
 #include "ssl/ca_certificate.h"
-#include "ssl/dummy_certificate.h"
+#include "ssl/certificate_store.h"
+#include "ssl/client_hello.h"
+#include "tls_workers.h"
 
 #ifndef __ANDROID__
 #  include "force_exit_on_signal.h"
@@ -41,6 +47,7 @@
 #include "ouiservice/i2p.h"
 #include "ouiservice/tcp.h"
 
+#include "util/run_detached.h"
 #include "util/signal.h"
 
 #include "logger.h"
@@ -59,6 +66,7 @@ static const boost::filesystem::path OUINET_PID_FILE = "pid";
 static const boost::filesystem::path OUINET_CA_CERT_FILE = "ssl-ca-cert.pem";
 static const boost::filesystem::path OUINET_CA_KEY_FILE = "ssl-ca-key.pem";
 static const boost::filesystem::path OUINET_CA_DH_FILE = "ssl-ca-dh.pem";
+static const boost::filesystem::path OUINET_CERT_STORE_FILE = "ssl-certificates";
 
 //------------------------------------------------------------------------------
 #define ASYNC_DEBUG(code, ...) [&] () mutable {\
@@ -73,10 +81,12 @@ class Client::State : public enable_shared_from_this<Client::State> {
 public:
     State(asio::io_service& ios)
         : _ios(ios)
-        // A certificate chain with OUINET_CA + SUBJECT_CERT
-        // can be around 2 KiB, so this would be around 2 MiB.
+        // A context holds a certificate chain with OUINET_CA + SUBJECT_CERT,
+        // the CA key and up to `max_tls_sessions_per_context` TLS sessions
+        // (see `setup_ssl_context`), a few KiB and at most some tens of KiB,
+        // so this would be a few MiB and at most some tens of MiB.
         // TODO: Fine tune if necessary.
-        , _ssl_certificate_cache(1000)
+        , _ssl_server_contexts(1000)
     { }
 
     void start(int argc, char* argv[]);
@@ -84,6 +94,7 @@ public:
     void stop() {
         _ipfs_cache = nullptr;
         _shutdown_signal();
+        if (_tls_workers) _tls_workers->stop();
     }
 
     void setup_ipfs_cache();
@@ -91,10 +102,16 @@ public:
 
 private:
     GenericConnection ssl_mitm_handshake( GenericConnection&&
+                                        , tcp::socket::native_handle_type
                                         , const Request&
                                         , asio::yield_context);
 
-    void serve_request(GenericConnection&& con, asio::yield_context yield);
+    std::shared_ptr<asio::ssl::context>
+    ssl_server_context(const string& base_domain, asio::yield_context);
+
+    void serve_request( GenericConnection&& con
+                      , tcp::socket::native_handle_type
+                      , asio::yield_context yield);
 
     void handle_connect_request( GenericConnection& client_c
                                , const Request& req
@@ -103,17 +120,73 @@ private:
     CacheControl::CacheEntry
     fetch_stored( const Request& request
                 , request_route::Config& request_config
+                , Signal<void()>& cancel
                 , asio::yield_context yield);
 
     Response fetch_fresh( const Request& request
                         , request_route::Config& request_config
+                        , Signal<void()>& cancel
+                        , asio::yield_context yield);
+
+    Response fetch_from_injector( const Request& request
+                                , Signal<void()>& cancel
+                                , asio::yield_context yield);
+
+    template<class Exchange>
+    auto with_injector_connection( const Request& request
+                                 , Signal<void()>& cancel
+                                 , Exchange exchange
+                                 , bool& responded
+                                 , asio::yield_context yield);
+
+    bool is_cache_enabled(const request_route::Config&) const;
+
+    // Where `fetch_fresh` of the cache control forwards the response
+    // to the current request as it arrives (see `stream_fresh`),
+    // null if it must be returned whole.
+    struct Streaming {
+        GenericConnection* con = nullptr;
+        bool head_sent = false;
+        bool body_kept = true;
+        // Set if the response broke after its head was sent.
+        sys::error_code ec;
+    };
+
+    Response stream_fresh( GenericConnection& con
+                         , const Request& request
+                         , request_route::Config& request_config
+                         , bool& head_sent
+                         , bool& body_kept
+                         , Signal<void()>& cancel
+                         , asio::yield_context yield);
+
+    bool stream_uncached( GenericConnection& con
+                        , const Request& request
+                        , request_route::Config& request_config
+                        , bool& head_sent
+                        , Signal<void()>& cancel
                         , asio::yield_context yield);
 
-    CacheControl build_cache_control(request_route::Config& request_config);
+    // Remember a failure to reach the origin itself (e.g. an unknown host)
+    // in the negative cache.
+    void remember_origin_error(const Request&, const sys::error_code&);
+
+    void seed_in_background(const Request&, Response);
+
+    CacheControl build_cache_control( request_route::Config& request_config
+                                    , Streaming& streaming);
+
+    void revalidate_in_background( const Request&
+                                 , const request_route::Config&);
+
+    // The handler also gets the socket descriptor of the connection.
+    using ConnectionHandler = function<void( GenericConnection
+                                           , tcp::socket::native_handle_type
+                                           , asio::yield_context)>;
 
     void listen_tcp( asio::yield_context
                    , tcp::endpoint
-                   , function<void(GenericConnection, asio::yield_context)>);
+                   , ConnectionHandler);
 
     void setup_injector(asio::yield_context);
 
@@ -132,7 +205,12 @@ private:
 private:
     asio::io_service& _ios;
     std::unique_ptr<CACertificate> _ca_certificate;
-    cache::lru_cache<string, string> _ssl_certificate_cache;
+    std::unique_ptr<CertificateStore> _certificate_store;
+    // Only with more than one thread.
+    std::unique_ptr<TlsWorkers> _tls_workers;
+    // TLS contexts used to impersonate origins, by base domain.
+    cache::lru_cache<string, std::shared_ptr<asio::ssl::context>>
+        _ssl_server_contexts;
     ClientConfig _config;
     std::unique_ptr<OuiServiceClient> _injector;
     std::unique_ptr<CacheClient> _ipfs_cache;
@@ -143,6 +221,22 @@ private:
     unique_ptr<util::PidFile> _pid_file;
 
     bool _is_ipns_being_setup = false;
+
+    // Targets of stale entries currently being revalidated.
+    std::set<std::string> _revalidating;
+
+    // Shared by the cache controls of all requests to learn hedging delays.
+    std::shared_ptr<CacheControl::Latencies> _fetch_latencies
+        = std::make_shared<CacheControl::Latencies>();
+
+    // Failed fetches of all requests, set up once the configuration is known.
+    std::shared_ptr<NegativeCache> _negative_cache;
+
+    // Expressions to test requests against and mechanisms to be used.
+    request_route::RoutingTable _routing_table;
+
+    std::unique_ptr<OriginPool> _origin_pool;
+    std::unique_ptr<DnsCache> _dns_cache;
 };
 
 //------------------------------------------------------------------------------
@@ -254,25 +348,33 @@ void Client::State::handle_connect_request( GenericConnection& client_c
 CacheControl::CacheEntry
 Client::State::fetch_stored( const Request& request
                            , request_route::Config& request_config
+                           , Signal<void()>& cancel
                            , asio::yield_context yield)
 {
     using CacheEntry = CacheControl::CacheEntry;
 
-    const bool cache_is_disabled
-        = !request_config.enable_cache
-       || !_ipfs_cache
-       || !_front_end.is_ipfs_cache_enabled();
-
-    if (cache_is_disabled) {
+    if (!is_cache_enabled(request_config)) {
         return or_throw<CacheControl::CacheEntry>( yield ,
                 asio::error::operation_not_supported);
     }
 
     sys::error_code ec;
-    // Get the content from cache
-    auto key = request.target();
-
-    auto content = _ipfs_cache->get_content(key.to_string(), yield[ec]);
+    // Get the content from cache.  IPFS lookups can not be cancelled,
+    // so stop waiting for it instead.
+    auto content = run_detached<CachedContent>(_ios, cancel,
+        [ self = shared_from_this()
+        , key = request.target().to_string()
+        , rq = request.base()
+        ] (asio::yield_context yield) {
+            if (!self->_ipfs_cache) {
+                return or_throw<CachedContent>(yield, asio::error::operation_aborted);
+            }
+            return self->_ipfs_cache->get_content( key
+                                                 , [&rq] (auto& vary) {
+                                                       return variant_key(rq, vary);
+                                                   }
+                                                 , yield);
+        }, yield[ec]);
 
     if (ec) return or_throw<CacheEntry>(yield, ec);
 
@@ -305,6 +407,7 @@ Client::State::fetch_stored( const Request& request
 //------------------------------------------------------------------------------
 Response Client::State::fetch_fresh( const Request& request
                                    , request_route::Config& request_config
+                                   , Signal<void()>& cancel
                                    , asio::yield_context yield)
 {
     using namespace asio::error;
@@ -315,6 +418,10 @@ Response Client::State::fetch_fresh( const Request& request
     LOG_DEBUG("fetching fresh");
 
     while (!request_config.responders.empty()) {
+        if (cancel.call_count()) {
+            return or_throw<Response>(yield, operation_aborted);
+        }
+
         auto r = request_config.responders.front();
         request_config.responders.pop();
 
@@ -327,9 +434,11 @@ Response Client::State::fetch_fresh( const Request& request
                 Response res;
 
                 // Send the request straight to the origin
-                res = fetch_http_page(_ios, request, _shutdown_signal, yield[ec]);
+                res = fetch_http_page( _ios, *_origin_pool, *_dns_cache
+                                     , request, cancel, yield[ec]);
 
                 if (ec) {
+                    remember_origin_error(request, ec);
                     last_error = ec;
                     continue;
                 }
@@ -353,7 +462,7 @@ Response Client::State::fetch_fresh( const Request& request
 
                     // Connect to the injector/proxy.
                     sys::error_code ec;
-                    auto inj = _injector->connect(yield[ec], _shutdown_signal);
+                    auto inj = _injector->connect(yield[ec], cancel);
                     if (ec) {
                         last_error = ec;
                         continue;
@@ -378,7 +487,7 @@ Response Client::State::fetch_fresh( const Request& request
                     auto connres = fetch_http_head( _ios
                                                   , inj.connection
                                                   , connreq
-                                                  , _shutdown_signal
+                                                  , cancel
                                                   , yield[ec]);
                     if (connres.result() != http::status::ok) {
                         // This error code is quite fake, so log the error too.
@@ -391,7 +500,7 @@ Response Client::State::fetch_fresh( const Request& request
                     // Send the request to the origin.
                     auto res = fetch_http_origin( _ios , inj.connection
                                                 , url, request
-                                                , _shutdown_signal
+                                                , cancel
                                                 , yield[ec]);
                     if (ec) {
                         last_error = ec;
@@ -406,29 +515,16 @@ Response Client::State::fetch_fresh( const Request& request
                 if (r == responder::injector && !_front_end.is_injector_proxying_enabled())
                     continue;
 
-                // Connect to the injector.
-                sys::error_code ec;
-                auto inj = _injector->connect(yield[ec], _shutdown_signal);
-                if (ec) {
-                    last_error = ec;
-                    continue;
-                }
-
                 // Build the actual request to send to the injector.
                 Request injreq(request);
                 if (r == responder::injector)
                     // Add first a Ouinet version header
                     // to hint it to behave like an injector instead of a proxy.
                     injreq.set(request_version_hdr, request_version_hdr_latest);
-                if (auto credentials = _config.credentials_for(inj.remote_endpoint))
-                    injreq = authorize(injreq, *credentials);
 
                 // Send the request to the injector/proxy.
-                auto res = fetch_http_page( _ios
-                                          , inj.connection
-                                          , injreq
-                                          , _shutdown_signal
-                                          , yield[ec]);
+                sys::error_code ec;
+                auto res = fetch_from_injector(injreq, cancel, yield[ec]);
                 if (ec) {
                     last_error = ec;
                     continue;
@@ -445,6 +541,7 @@ Response Client::State::fetch_fresh( const Request& request
                 return _front_end.serve( _config.injector_endpoint()
                                        , request
                                        , _ipfs_cache.get()
+                                       , _negative_cache.get()
                                        , *_ca_certificate);
             }
         }
@@ -455,17 +552,20 @@ Response Client::State::fetch_fresh( const Request& request
 
 //------------------------------------------------------------------------------
 CacheControl
-Client::State::build_cache_control(request_route::Config& request_config)
+Client::State::build_cache_control( request_route::Config& request_config
+                                  , Streaming& streaming)
 {
-    CacheControl cache_control;
+    CacheControl cache_control(_ios);
 
     cache_control.fetch_stored =
-        [&] (const Request& request, asio::yield_context yield) {
+        [&] (const Request& request, Signal<void()>& cancel, asio::yield_context yield) {
 
             cerr << "Fetching from cache " << request.target() << endl;
 
+            auto on_shutdown = _shutdown_signal.connect([&] { cancel(); });
+
             sys::error_code ec;
-            auto r = ASYNC_DEBUG( fetch_stored(request, request_config, yield[ec])
+            auto r = ASYNC_DEBUG( fetch_stored(request, request_config, cancel, yield[ec])
                               , "Fetch from cache: " , request.target());
 
             cerr << "Fetched from cache " << request.target()
@@ -476,13 +576,38 @@ Client::State::build_cache_control(request_route::Config& request_config)
         };
 
     cache_control.fetch_fresh =
-        [&] (const Request& request, asio::yield_context yield) {
+        [&] (const Request& request, Signal<void()>& cancel, asio::yield_context yield) {
 
             cerr << "Fetching fresh " << request.target() << endl;
 
+            auto on_shutdown = _shutdown_signal.connect([&] { cancel(); });
+
+            // Fresh responses can be forwarded while they are fetched
+            // unless they may not be used in the end: when racing against
+            // the cache, or when revalidating (a "304 Not Modified"
+            // is not for the user agent).
+            bool stream = streaming.con && !streaming.head_sent
+                       && _config.hedge_delay() <= posix_time::seconds(0)
+                       && request.find(http::field::if_none_match) == request.end()
+                       && request.find(http::field::if_modified_since) == request.end();
+
             sys::error_code ec;
-            auto r = ASYNC_DEBUG( fetch_fresh(request, request_config, yield[ec])
-                              , "Fetch from origin: ", request.target());
+            Response r;
+
+            if (stream) {
+                r = ASYNC_DEBUG( stream_fresh( *streaming.con, request
+                                             , request_config
+                                             , streaming.head_sent
+                                             , streaming.body_kept
+                                             , cancel, yield[ec])
+                               , "Stream from origin: ", request.target());
+
+                if (streaming.head_sent) streaming.ec = ec;
+            }
+            else {
+                r = ASYNC_DEBUG( fetch_fresh(request, request_config, cancel, yield[ec])
+                               , "Fetch from origin: ", request.target());
+            }
 
             cerr << "Fetched fresh " << request.target()
                  << " " << ec.message() << " " << r.result()
@@ -491,11 +616,57 @@ Client::State::build_cache_control(request_route::Config& request_config)
             return or_throw(yield, ec, move(r));
         };
 
+    // The injector keeps the cache, so the client just has it revalidate
+    // its entry (the request carries the entry's validators).
+    cache_control.revalidate =
+        [&] (const Request& request, const CacheControl::CacheEntry&) {
+            revalidate_in_background(request, request_config);
+        };
+
     cache_control.max_cached_age(_config.max_cached_age());
+    cache_control.stale_while_revalidate(_config.stale_while_revalidate());
+    cache_control.stale_if_error(_config.stale_if_error());
+    cache_control.heuristic_freshness(_config.heuristic_freshness());
+    cache_control.max_heuristic_freshness(_config.max_heuristic_freshness());
+    cache_control.hedge_delay(_config.hedge_delay());
+    cache_control.hedge_percentile(_config.hedge_percentile());
+    cache_control.latencies(_fetch_latencies);
+    cache_control.negative_cache(_negative_cache);
 
     return cache_control;
 }
 
+//------------------------------------------------------------------------------
+void Client::State::revalidate_in_background( const Request& request
+                                            , const request_route::Config& request_config)
+{
+    auto key = request.target().to_string();
+
+    // Only one revalidation per target at a time.
+    if (!_revalidating.insert(key).second) return;
+
+    asio::spawn(_ios, [ this
+                      , self = shared_from_this()
+                      , rq = request
+                      , config = request_config
+                      , key = move(key)
+                      ] (asio::yield_context yield) mutable {
+        auto on_exit = defer([&] { _revalidating.erase(key); });
+
+        if (was_stopped()) return;
+
+        cerr << "Revalidating " << key << endl;
+
+        sys::error_code ec;
+        auto res = ASYNC_DEBUG( fetch_fresh(rq, config, _shutdown_signal, yield[ec])
+                              , "Revalidate: ", key);
+
+        cerr << "Revalidated " << key
+             << " " << ec.message() << " " << res.result()
+             << endl;
+    });
+}
+
 //------------------------------------------------------------------------------
 //static
 //Response bad_gateway(const Request& req)
@@ -507,6 +678,12 @@ Client::State::build_cache_control(request_route::Config& request_config)
 //}
 
 //------------------------------------------------------------------------------
+// Sessions with IDs cached by each MitM TLS context,
+// user agents resuming with tickets need none.
+static const long max_tls_sessions_per_context = 32;
+
+// An empty `dh` means that the key is an EC one,
+// so only ECDHE key exchange is used.
 void setup_ssl_context( asio::ssl::context& ssl_context
                       , const string& cert_chain
                       , const string& private_key
@@ -525,7 +702,37 @@ void setup_ssl_context( asio::ssl::context& ssl_context
                                              , private_key.size())
                                , ssl::context::file_format::pem);
 
-    ssl_context.use_tmp_dh(asio::buffer(dh.data(), dh.size()));
+    auto ctx = ssl_context.native_handle();
+
+    if (!dh.empty()) {
+        ssl_context.use_tmp_dh(asio::buffer(dh.data(), dh.size()));
+    }
+    else {
+        // TLS 1.3 suites always use (EC)DHE,
+        // these are the TLS 1.2 ones with ECDHE and ECDSA.
+        // Without them the ECDSA certificate may not be usable at all,
+        // so do not let OpenSSL silently keep its defaults.
+        if (!SSL_CTX_set_cipher_list( ctx, "ECDHE-ECDSA-AES128-GCM-SHA256"
+                                          ":ECDHE-ECDSA-CHACHA20-POLY1305"
+                                          ":ECDHE-ECDSA-AES256-GCM-SHA384")
+            || !SSL_CTX_set1_curves_list(ctx, "X25519:P-256")) {
+            throw sys::system_error
+                ( static_cast<int>(::ERR_get_error())
+                , asio::error::get_ssl_category()
+                , "setup_ssl_context");
+        }
+    }
+
+    // Contexts are reused, so let user agents resume their TLS sessions
+    // (with tickets or session IDs) instead of doing full handshakes.
+    // Each context has its own session cache, which OpenSSL lets grow
+    // to 20480 sessions by default.
+    static const unsigned char session_id_context[] = "ouinet";
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, max_tls_sessions_per_context);
+    SSL_CTX_set_session_id_context( ctx, session_id_context
+                                  , sizeof(session_id_context) - 1);
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
 
     ssl_context.set_password_callback(
         [](std::size_t, ssl::context_base::password_purpose)
@@ -548,50 +755,86 @@ string base_domain_from_target(const beast::string_view& target)
 }
 
 //------------------------------------------------------------------------------
-GenericConnection Client::State::ssl_mitm_handshake( GenericConnection&& con
-                                                   , const Request& con_req
-                                                   , asio::yield_context yield)
+// The context to impersonate the origins in the given base domain,
+// built once (with a certificate signed by our CA) and then reused.
+shared_ptr<asio::ssl::context>
+Client::State::ssl_server_context( const string& base_domain
+                                 , asio::yield_context yield)
 {
-    namespace ssl = boost::asio::ssl;
+    using ContextPtr = shared_ptr<asio::ssl::context>;
 
-    ssl::context ssl_context{ssl::context::tls_server};
-
-    // TODO: We really should be waiting for
-    // the TLS Client Hello message to arrive at the clear text connection
-    // (after we send back 200 OK),
-    // then retrieve the value of the Server Name Indication (SNI) field
-    // and rewind the Hello message,
-    // but for the moment we will assume that the browser sends
-    // a host name instead of an IP address or its reverse resolution.
-    auto base_domain = base_domain_from_target(con_req.target());
-
-    string crt_chain;
-    // TODO: ASan gets confused when an exception is thrown inside a coroutine,
-    // the alternative is to check ``_ssl_certificate_cache.exists(base_domain)``
-    // (i.e. an additional lookup) then take one branch or the other.
-    try {
-        crt_chain = _ssl_certificate_cache.get(base_domain);
-    } catch(const std::range_error&) {
-        DummyCertificate dummy_crt(*_ca_certificate, base_domain);
+    if (_ssl_server_contexts.exists(base_domain)) {
+        return _ssl_server_contexts.get(base_domain);
+    }
 
-        crt_chain = dummy_crt.pem_certificate()
-                  + _ca_certificate->pem_certificate();
+    sys::error_code ec;
+    auto crt = _certificate_store->get(base_domain, yield[ec]);
+    if (ec) return or_throw<ContextPtr>(yield, ec);
 
-        _ssl_certificate_cache.put(move(base_domain), crt_chain);
+    // Another connection may have done it while we waited.
+    if (_ssl_server_contexts.exists(base_domain)) {
+        return _ssl_server_contexts.get(base_domain);
     }
 
-    setup_ssl_context( ssl_context
-                     , crt_chain
+    auto ssl_context = make_shared<asio::ssl::context>
+        (asio::ssl::context::tls_server);
+
+    setup_ssl_context( *ssl_context
+                     , crt + _ca_certificate->pem_certificate()
                      , _ca_certificate->pem_private_key()
                      , _ca_certificate->pem_dh_param());
 
+    _ssl_server_contexts.put(base_domain, ssl_context);
+
+    return ssl_context;
+}
+
+//------------------------------------------------------------------------------
+GenericConnection Client::State::ssl_mitm_handshake( GenericConnection&& con
+                                                   , tcp::socket::native_handle_type socket
+                                                   , const Request& con_req
+                                                   , asio::yield_context yield)
+{
+    namespace ssl = boost::asio::ssl;
+
     // Send back OK to let the UA know we have the "tunnel"
     http::response<http::string_body> res{http::status::ok, con_req.version()};
     http::async_write(con, res, yield);
 
     sys::error_code ec;
 
-    auto ssl_sock = make_unique<ssl::stream<GenericConnection>>(move(con), ssl_context);
+    // Peek at the TLS Client Hello message for the Server Name Indication
+    // (SNI) field, so that the certificate matches the host that the UA
+    // is actually going to talk to.  The message is then rewound
+    // for the TLS server.  If the UA sends no name
+    // (e.g. because it connects to an IP address),
+    // use the host in the CONNECT request.
+    string server_name;
+    auto client_hello = ouinet::ssl::read_client_hello(con, server_name, yield[ec]);
+    if (ec) return or_throw<GenericConnection>(yield, ec);
+
+    auto base_domain = base_domain_from_target( server_name.empty()
+                                              ? con_req.target()
+                                              : server_name);
+
+    auto ssl_context = ssl_server_context(base_domain, yield[ec]);
+    if (ec) return or_throw<GenericConnection>(yield, ec);
+
+    if (_tls_workers) {
+        // The TLS session goes on in a worker thread,
+        // we get the plain text side (and `con` is to be dropped).
+        auto plain_con = _tls_workers->serve( _ios, socket
+                                            , move(client_hello)
+                                            , move(ssl_context)
+                                            , ec);
+        return or_throw(yield, ec, move(plain_con));
+    }
+
+    GenericConnection hello_con(PrefixedConnection( move(con)
+                                                  , move(client_hello)));
+
+    auto ssl_sock = make_unique<ssl::stream<GenericConnection>>
+        (move(hello_con), *ssl_context);
     ssl_sock->async_handshake(ssl::stream_base::server, yield[ec]);
     if (ec) return or_throw<GenericConnection>(yield, ec);
 
@@ -606,6 +849,7 @@ GenericConnection Client::State::ssl_mitm_handshake( GenericConnection&& con
 
 //------------------------------------------------------------------------------
 void Client::State::serve_request( GenericConnection&& con
+                                 , tcp::socket::native_handle_type socket
                                  , asio::yield_context yield)
 {
     LOG_DEBUG("Request received ");
@@ -623,65 +867,13 @@ void Client::State::serve_request( GenericConnection&& con
         , queue<responder>({responder::injector})};
 
     rr::Config request_config;
+    Streaming streaming;
 
-    CacheControl cache_control = build_cache_control(request_config);
+    CacheControl cache_control = build_cache_control(request_config, streaming);
 
     sys::error_code ec;
     beast::flat_buffer buffer;
 
-    // Expressions to test the request against and mechanisms to be used.
-    // TODO: Create once and reuse.
-    using Match = pair<const ouinet::reqexpr::reqex, const rr::Config>;
-
-    auto method_getter([](const Request& r) {return r.method_string();});
-    auto host_getter([](const Request& r) {return r["Host"];});
-    auto x_oui_dest_getter([](const Request& r) {return r["X-Oui-Destination"];});
-    auto target_getter([](const Request& r) {return r.target();});
-
-    const vector<Match> matches({
-        // Handle requests to <http://localhost/> internally.
-        Match( reqexpr::from_regex(host_getter, "localhost")
-             , {false, queue<responder>({responder::_front_end})} ),
-
-        Match( reqexpr::from_regex(x_oui_dest_getter, "OuiClient")
-             , {false, queue<responder>({responder::_front_end})} ),
-
-        // NOTE: The matching of HTTP methods below can be simplified,
-        // leaving expanded for readability.
-
-        // NOTE: The injector mechanism is temporarily used in some matches
-        // instead of the mechanisms following it (commented out)
-        // since the later are not implemented yet.
-
-        // Send unsafe HTTP method requests to the origin server
-        // (or the proxy if that does not work).
-        // NOTE: The cache need not be disabled as it should know not to
-        // fetch requests in these cases.
-        Match( !reqexpr::from_regex(method_getter, "(GET|HEAD|OPTIONS|TRACE)")
-             , {false, queue<responder>({responder::origin, responder::proxy})} ),
-        // Do not use cache for safe but uncacheable HTTP method requests.
-        // NOTE: same as above.
-        Match( reqexpr::from_regex(method_getter, "(OPTIONS|TRACE)")
-             , {false, queue<responder>({responder::origin, responder::proxy})} ),
-        // Do not use cache for validation HEADs.
-        // Caching these is not yet supported.
-        Match( reqexpr::from_regex(method_getter, "HEAD")
-             , {false, queue<responder>({responder::origin, responder::proxy})} ),
-
-        // Disable cache and always go to origin for this site.
-        Match( reqexpr::from_regex(target_getter, "https?://ident.me/.*")
-             , {false, queue<responder>({responder::origin})} ),
-        // Disable cache and always go to proxy for this site.
-        Match( reqexpr::from_regex(target_getter, "https?://ifconfig.co/.*")
-             , {false, queue<responder>({responder::proxy})} ),
-        // Force cache and default mechanisms for this site.
-        Match( reqexpr::from_regex(target_getter, "https?://(www\\.)?example.com/.*")
-             , {true, queue<responder>()} ),
-        // Force cache and particular mechanisms for this site.
-        Match( reqexpr::from_regex(target_getter, "https?://(www\\.)?example.net/.*")
-             , {true, queue<responder>({responder::injector})} ),
-    });
-
     // Is MitM active?
     bool mitm(false);
     // Saved host/port from CONNECT request.
@@ -715,7 +907,7 @@ void Client::State::serve_request( GenericConnection&& con
         if (!mitm && req.method() == http::verb::connect) {
             try {
                 // Subsequent access to the connection will use the encrypted channel.
-                con = ssl_mitm_handshake(move(con), req, yield);
+                con = ssl_mitm_handshake(move(con), socket, req, yield);
             }
             catch(const std::exception& e) {
                 cerr << "Mitm exception: " << e.what() << endl;
@@ -747,13 +939,51 @@ void Client::State::serve_request( GenericConnection&& con
         //    auto res = bad_gateway(req);
         //    http::async_write(con, res, yield[ec]);
         //}
-        request_config = route_choose_config(req, matches, default_request_config);
+        request_config = _routing_table.route(req, default_request_config);
+
+        // Fresh responses are forwarded as they arrive instead of being
+        // read whole first, also when they go through the cache control
+        // (e.g. on cache misses).
+        bool head_sent = false;
+        bool need_eof = false;
+
+        Response res;
+
+        if (!is_cache_enabled(request_config)) {
+            need_eof = ASYNC_DEBUG( stream_uncached( con, req, request_config
+                                                   , head_sent, _shutdown_signal
+                                                   , yield[ec])
+                                  , "Stream "
+                                  , req.target());
+        }
+        else {
+            streaming = Streaming();
+            streaming.con = &con;
+
+            res = ASYNC_DEBUG( cache_control.fetch(req, yield[ec])
+                             , "Fetch "
+                             , req.target());
+
+            streaming.con = nullptr;
+            head_sent = streaming.head_sent;
+
+            if (head_sent) {
+                // Whatever happened afterwards, the user agent got
+                // a broken response.
+                if (streaming.ec) ec = streaming.ec;
+                need_eof = res.need_eof();
+
+                // Only the head is left, do not replay it as the error.
+                if ( !ec && !streaming.body_kept && _negative_cache
+                  && NegativeCache::is_negative(res)) {
+                    _negative_cache->erase(req.target().to_string());
+                }
+            }
 
-        auto res = ASYNC_DEBUG( cache_control.fetch(req, yield[ec])
-                              , "Fetch "
-                              , req.target());
+            cout << "Sending back response: " << req.target() << " " << res.result() << endl;
+        }
 
-        cout << "Sending back response: " << req.target() << " " << res.result() << endl;
+        if (ec && head_sent) return fail(ec, "stream");
 
         if (ec) {
 #ifndef NDEBUG
@@ -769,6 +999,15 @@ void Client::State::serve_request( GenericConnection&& con
             else return;
         }
 
+        if (head_sent) {
+            if (need_eof) {
+                LOG_DEBUG("request streamed. Connection closed");
+                break;
+            }
+            LOG_DEBUG("request streamed");
+            continue;
+        }
+
         cout << req.base() << res.base() << endl;
         // Forward the response back
         ASYNC_DEBUG(http::async_write(con, res, yield[ec]), "Write response ", req.target());
@@ -843,7 +1082,7 @@ void Client::State::setup_ipfs_cache()
 void Client::State::listen_tcp
         ( asio::yield_context yield
         , tcp::endpoint local_endpoint
-        , function<void(GenericConnection, asio::yield_context)> handler)
+        , ConnectionHandler handler)
 {
     sys::error_code ec;
 
@@ -889,17 +1128,19 @@ void Client::State::listen_tcp
                 s.close(ec);
             };
 
+            auto native = socket.native_handle();
             GenericConnection connection(move(socket) , move(tcp_shutter));
 
             asio::spawn( _ios
                        , [ this
                          , self = shared_from_this()
                          , c = move(connection)
+                         , native
                          , handler
                          , lock = wait_condition.lock()
                          ](asio::yield_context yield) mutable {
                              if (was_stopped()) return;
-                             handler(move(c), yield);
+                             handler(move(c), native, yield);
                          });
         }
     }
@@ -917,6 +1158,23 @@ void Client::State::start(int argc, char* argv[])
         LOG_ABORT(e.what());
     }
 
+    _negative_cache = make_shared<NegativeCache>(_config.negative_cache_config());
+    _origin_pool = make_unique<OriginPool>(_config.origin_pool_config());
+    _dns_cache = make_unique<DnsCache>(_ios, _config.dns_cache_config());
+
+    try {
+        if (_config.routing_file().empty()) {
+            _routing_table = request_route::RoutingTable::parse
+                (request_route::RoutingTable::default_rules);
+        }
+        else {
+            boost::filesystem::ifstream in(_config.routing_file());
+            _routing_table = request_route::RoutingTable::parse(in);
+        }
+    } catch(std::exception const& e) {
+        LOG_ABORT(e.what());
+    }
+
 #ifndef __ANDROID__
     auto pid_path = get_pid_path();
     if (exists(pid_path)) {
@@ -933,7 +1191,8 @@ void Client::State::start(int argc, char* argv[])
     auto ca_cert_path = _config.repo_root() / OUINET_CA_CERT_FILE;
     auto ca_key_path = _config.repo_root() / OUINET_CA_KEY_FILE;
     auto ca_dh_path = _config.repo_root() / OUINET_CA_DH_FILE;
-    if (exists(ca_cert_path) && exists(ca_key_path) && exists(ca_dh_path)) {
+    // Certificates with EC keys have no DH parameters file.
+    if (exists(ca_cert_path) && exists(ca_key_path)) {
         cout << "Loading existing CA certificate..." << endl;
         auto read_pem = [](auto path) {
             std::stringstream ss;
@@ -942,19 +1201,35 @@ void Client::State::start(int argc, char* argv[])
         };
         auto cert = read_pem(ca_cert_path);
         auto key = read_pem(ca_key_path);
-        auto dh = read_pem(ca_dh_path);
+        auto dh = exists(ca_dh_path) ? read_pem(ca_dh_path) : string();
         _ca_certificate = make_unique<CACertificate>(cert, key, dh);
     } else {
         cout << "Generating and storing CA certificate..." << endl;
-        _ca_certificate = make_unique<CACertificate>();
+        _ca_certificate = make_unique<CACertificate>(_config.ca_key_type());
         boost::filesystem::ofstream(ca_cert_path)
             << _ca_certificate->pem_certificate();
         boost::filesystem::ofstream(ca_key_path)
             << _ca_certificate->pem_private_key();
-        boost::filesystem::ofstream(ca_dh_path)
-            << _ca_certificate->pem_dh_param();
+        if (!_ca_certificate->pem_dh_param().empty()) {
+            boost::filesystem::ofstream(ca_dh_path)
+                << _ca_certificate->pem_dh_param();
+        }
+        else {
+            boost::filesystem::remove(ca_dh_path);
+        }
     }
 
+    if (_config.threads() > 1) {
+        _tls_workers = make_unique<TlsWorkers>(_config.threads() - 1);
+    }
+
+    // Keep a core for the rest of the client.
+    auto cert_threads = max(1u, thread::hardware_concurrency()) - 1;
+    _certificate_store = make_unique<CertificateStore>
+        ( _ios, *_ca_certificate
+        , _config.repo_root() / OUINET_CERT_STORE_FILE
+        , max(1u, min(cert_threads, 4u)));
+
     asio::spawn
         ( _ios
         , [this, self = shared_from_this()]
@@ -973,8 +1248,10 @@ void Client::State::start(int argc, char* argv[])
               listen_tcp( yield[ec]
                         , _config.local_endpoint()
                         , [this, self]
-                          (GenericConnection c, asio::yield_context yield) {
-                      serve_request(move(c), yield);
+                          ( GenericConnection c
+                          , tcp::socket::native_handle_type native
+                          , asio::yield_context yield) {
+                      serve_request(move(c), native, yield);
                   });
           });
 
@@ -993,7 +1270,9 @@ void Client::State::start(int argc, char* argv[])
                   listen_tcp( yield[ec]
                             , ep
                             , [this, self]
-                              (GenericConnection c, asio::yield_context yield) {
+                              ( GenericConnection c
+                              , tcp::socket::native_handle_type
+                              , asio::yield_context yield) {
                         sys::error_code ec;
                         Request rq;
                         beast::flat_buffer buffer;
@@ -1004,6 +1283,7 @@ void Client::State::start(int argc, char* argv[])
                         auto rs = _front_end.serve( _config.injector_endpoint()
                                                   , rq
                                                   , _ipfs_cache.get()
+                                                  , _negative_cache.get()
                                                   , *_ca_certificate);
 
                         http::async_write(c, rs, yield[ec]);
@@ -1012,10 +1292,320 @@ void Client::State::start(int argc, char* argv[])
     }
 }
 
+//------------------------------------------------------------------------------
+// Send the request to the injector over an idle connection to it
+// if there is one, and get the response with
+// `exchange(con, injreq, responded, yield)` (see `with_origin_connection`).
+template<class Exchange>
+auto Client::State::with_injector_connection( const Request& request
+                                            , Signal<void()>& cancel
+                                            , Exchange exchange
+                                            , bool& responded
+                                            , asio::yield_context yield)
+{
+    using Res = decltype(exchange( declval<GenericConnection&>()
+                                 , request, responded, yield));
+
+    // Reused connections may have been closed by the injector
+    // (or the tunnel to it), so only send requests which can be retried.
+    bool idempotent = is_idempotent(request.method());
+
+    for (;;) {
+        sys::error_code ec;
+        bool reused = false;
+
+        auto inj = idempotent
+                 ? _injector->connect_pooled(yield[ec], cancel, reused)
+                 : _injector->connect(yield[ec], cancel);
+
+        if (ec) return or_throw<Res>(yield, ec);
+
+        Request injreq(request);
+        injreq.keep_alive(true);
+        if (auto credentials = _config.credentials_for(inj.remote_endpoint))
+            injreq = authorize(injreq, *credentials);
+
+        auto res = exchange(inj.connection, injreq, responded, yield[ec]);
+
+        if (ec && reused && !responded && !cancel.call_count()) {
+            _injector->on_stale();
+            continue;
+        }
+
+        if (ec) return or_throw(yield, ec, move(res));
+
+        _injector->release(move(inj), injreq, res);
+
+        return res;
+    }
+}
+
+Response Client::State::fetch_from_injector( const Request& request
+                                           , Signal<void()>& cancel
+                                           , asio::yield_context yield)
+{
+    bool responded = false;
+
+    return with_injector_connection
+        ( request, cancel
+        , [&] ( GenericConnection& con, const Request& rq
+              , bool&, asio::yield_context yield) {
+              return fetch_http_page(_ios, con, rq, cancel, yield);
+          }
+        , responded, yield);
+}
+
+//------------------------------------------------------------------------------
+bool Client::State::is_cache_enabled(const request_route::Config& request_config) const
+{
+    return request_config.enable_cache
+        && _ipfs_cache
+        && _front_end.is_ipfs_cache_enabled();
+}
+
+//------------------------------------------------------------------------------
+// Bodies of streamed responses up to this size are kept while forwarding them
+// so that they can be seeded or remembered as errors afterwards.
+static const size_t max_kept_body_size = 8 * 1024 * 1024;
+
+// Send the whole response `res` to `con`.
+// Returns whether `con` must be closed to end the response.
+static
+bool write_response( GenericConnection& con
+                   , Response& res
+                   , asio::yield_context yield)
+{
+    sys::error_code ec;
+    http::async_write(con, res, yield[ec]);
+    if (ec == http::error::end_of_stream) return true;
+    return or_throw(yield, ec, res.need_eof());
+}
+
+// Like `fetch_fresh`, but the response is forwarded to `con` as it arrives
+// (see `forward_http_page`), so that the user agent gets the beginning
+// of big responses early and they never need to fit in memory.
+// Once the head is sent, `head_sent` is set and the returned response
+// must not be sent again.
+//
+// The body is only kept in the returned response (`body_kept`) if it is
+// seeded or may be remembered as an error, and up to `max_kept_body_size`.
+//
+// Mechanisms which can not stream their responses (the front end,
+// HTTPS over a tunnel through the proxy) are left to `fetch_fresh`.
+Response Client::State::stream_fresh( GenericConnection& con
+                                    , const Request& request
+                                    , request_route::Config& request_config
+                                    , bool& head_sent
+                                    , bool& body_kept
+                                    , Signal<void()>& cancel
+                                    , asio::yield_context yield)
+{
+    using namespace asio::error;
+    using request_route::responder;
+
+    // Like `CacheControl`, only remember errors for GET requests.
+    bool negative = _negative_cache && request.method() == http::verb::get;
+
+    sys::error_code last_error = operation_not_supported;
+
+    while (!request_config.responders.empty()) {
+        if (cancel.call_count()) {
+            return or_throw<Response>(yield, operation_aborted);
+        }
+
+        auto r = request_config.responders.front();
+
+        bool can_stream
+            = r == responder::origin
+           || r == responder::injector
+           || (r == responder::proxy && !request.target().starts_with("https://"));
+
+        if (!can_stream) {
+            sys::error_code ec;
+            auto res = fetch_fresh(request, request_config, cancel, yield[ec]);
+            if (ec) return or_throw(yield, ec, move(res));
+
+            head_sent = true;
+            body_kept = true;
+            write_response(con, res, yield[ec]);
+            return or_throw(yield, ec, move(res));
+        }
+
+        request_config.responders.pop();
+
+        if (r == responder::origin && !_front_end.is_origin_access_enabled())
+            continue;
+        if (r == responder::proxy && !_front_end.is_proxy_access_enabled())
+            continue;
+        if (r == responder::injector && !_front_end.is_injector_proxying_enabled())
+            continue;
+
+        bool seed = r == responder::injector && _ipfs_cache;
+
+        string body;
+        body_kept = true;
+
+        auto keep_body = [&] ( const http::response_header<>& head
+                             , asio::const_buffer piece) {
+            if (!body_kept) return;
+
+            if (!seed && !(negative && NegativeCache::is_negative(head))) {
+                body_kept = false;
+                return;
+            }
+
+            auto size = asio::buffer_size(piece);
+
+            if (body.size() + size > max_kept_body_size) {
+                body_kept = false;
+                string().swap(body);
+                return;
+            }
+
+            body.append(asio::buffer_cast<const char*>(piece), size);
+        };
+
+        auto forward = [&] ( GenericConnection& c, const Request& rq
+                           , bool& responded, asio::yield_context yield) {
+            return forward_http_page(c, rq, con, keep_body, responded, cancel, yield);
+        };
+
+        sys::error_code ec;
+        http::response<http::empty_body> head;
+
+        if (r == responder::origin) {
+            head = with_origin_connection( *_origin_pool, *_dns_cache
+                                         , request, cancel
+                                         , forward, head_sent, yield[ec]);
+        }
+        else {
+            // Both the injector and the proxy with plain HTTP,
+            // see `fetch_fresh`.
+            Request injreq(request);
+            if (r == responder::injector)
+                injreq.set(request_version_hdr, request_version_hdr_latest);
+
+            head = with_injector_connection( injreq, cancel
+                                           , forward, head_sent, yield[ec]);
+        }
+
+        if (ec) {
+            // Too late to try other mechanisms.
+            if (head_sent) return or_throw<Response>(yield, ec);
+
+            // Failing to reach the injector or proxy says nothing
+            // about the origin.
+            if (r == responder::origin) remember_origin_error(request, ec);
+
+            last_error = ec;
+            continue;
+        }
+
+        Response res(head.base());
+
+        if (!body_kept) return res;
+
+        res.body().commit(asio::buffer_copy( res.body().prepare(body.size())
+                                           , asio::buffer(body)));
+
+        if (!seed) return res;
+
+        // Only errors need their body afterwards.
+        if (negative && NegativeCache::is_negative(res)) {
+            seed_in_background(request, res);
+            return res;
+        }
+
+        body_kept = false;
+        seed_in_background(request, move(res));
+        return Response(head.base());
+    }
+
+    return or_throw<Response>(yield, last_error);
+}
+
+// Stream the response to `request` to `con` (see `stream_fresh`)
+// without the cache, but still with the negative cache.
+//
+// Returns whether `con` must be closed to end the response sent over it.
+bool Client::State::stream_uncached( GenericConnection& con
+                                   , const Request& request
+                                   , request_route::Config& request_config
+                                   , bool& head_sent
+                                   , Signal<void()>& cancel
+                                   , asio::yield_context yield)
+{
+    auto key = request.target().to_string();
+
+    // Like `CacheControl`, only remember errors for GET requests.
+    auto negative = request.method() == http::verb::get
+                  ? _negative_cache.get()
+                  : nullptr;
+
+    // A reload gets past remembered errors (but still updates them).
+    if (negative && !CacheControl::must_revalidate(request)) {
+        if (auto error = negative->find_error(key)) {
+            if (error->ec) return or_throw(yield, error->ec, false);
+
+            Response res = error->response;
+            head_sent = true;
+            return write_response(con, res, yield);
+        }
+    }
+
+    sys::error_code ec;
+    bool body_kept = false;
+
+    auto res = stream_fresh( con, request, request_config
+                           , head_sent, body_kept, cancel, yield[ec]);
+
+    if (ec) return or_throw(yield, ec, head_sent);
+
+    if (negative) {
+        if (!NegativeCache::is_negative(res)) {
+            negative->erase(key);
+        }
+        else if (body_kept) {
+            negative->insert_error(key, {sys::error_code(), res});
+        }
+    }
+
+    return res.need_eof();
+}
+
+//------------------------------------------------------------------------------
+void Client::State::remember_origin_error( const Request& request
+                                         , const sys::error_code& ec)
+{
+    // Like `CacheControl`, only remember errors for GET requests.
+    if (!_negative_cache || request.method() != http::verb::get) return;
+    if (!NegativeCache::is_negative(ec)) return;
+
+    _negative_cache->insert_error( request.target().to_string()
+                                 , {ec, Response()});
+}
+
+//------------------------------------------------------------------------------
+void Client::State::seed_in_background(const Request& request, Response response)
+{
+    asio::spawn(_ios, [ this
+                      , self = shared_from_this()
+                      , rq = request
+                      , rs = move(response)
+                      ] (asio::yield_context yield) {
+        if (was_stopped()) return;
+
+        sys::error_code ec;
+        maybe_start_seeding(rq, rs, yield[ec]);
+    });
+}
+
 //------------------------------------------------------------------------------
 void Client::State::setup_injector(asio::yield_context yield)
 {
-    _injector = std::make_unique<OuiServiceClient>(_ios);
+    _injector = std::make_unique<OuiServiceClient>( _ios
+                                                  , _config.injector_pool_config()
+                                                  , _config.multiplex_injector());
 
     auto injector_ep = _config.injector_endpoint();
 
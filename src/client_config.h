@@ -3,7 +3,11 @@
 #include <boost/program_options.hpp>
 #include <boost/filesystem.hpp>
 
+#include "cache/negative_cache.h"
+#include "dns_cache.h"
+#include "origin_pool.h"
 #include "namespaces.h"
+#include "ssl/ca_certificate.h"
 #include "util.h"
 
 namespace ouinet {
@@ -46,6 +50,46 @@ public:
         return _max_cached_age;
     }
 
+    boost::posix_time::time_duration stale_while_revalidate() const {
+        return _stale_while_revalidate;
+    }
+
+    boost::posix_time::time_duration stale_if_error() const {
+        return _stale_if_error;
+    }
+
+    unsigned heuristic_freshness() const {
+        return _heuristic_freshness;
+    }
+
+    boost::posix_time::time_duration max_heuristic_freshness() const {
+        return _max_heuristic_freshness;
+    }
+
+    boost::posix_time::time_duration hedge_delay() const {
+        return _hedge_delay;
+    }
+
+    unsigned hedge_percentile() const {
+        return _hedge_percentile;
+    }
+
+    const NegativeCache::Config& negative_cache_config() const {
+        return _negative_cache_config;
+    }
+
+    const OriginPool::Config& origin_pool_config() const {
+        return _origin_pool_config;
+    }
+
+    const DnsCache::Config& dns_cache_config() const {
+        return _dns_cache_config;
+    }
+
+    const OriginPool::Config& injector_pool_config() const {
+        return _injector_pool_config;
+    }
+
     boost::optional<std::string>
     credentials_for(const std::string& injector) const {
         auto i = _injector_credentials.find(injector);
@@ -62,10 +106,31 @@ public:
         return _enable_http_connect_requests;
     }
 
+    bool multiplex_injector() const {
+        return _multiplex_injector;
+    }
+
     asio::ip::tcp::endpoint front_end_endpoint() const {
         return _front_end_endpoint;
     }
 
+    // Empty if the built-in routing rules are to be used.
+    const Path& routing_file() const {
+        return _routing_file;
+    }
+
+    // Threads running the client: one for most of the work
+    // and the rest for the TLS sessions with user agents.
+    unsigned threads() const {
+        return _threads;
+    }
+
+    // The key type of a new CA certificate
+    // (an existing one is used whatever its type).
+    CACertificate::KeyType ca_key_type() const {
+        return _ca_key_type;
+    }
+
 private:
     Path _repo_root;
     Path _ouinet_conf_file = "ouinet-client.conf";
@@ -73,11 +138,36 @@ private:
     boost::optional<Endpoint> _injector_ep;
     std::string _ipns;
     bool _enable_http_connect_requests = false;
+    bool _multiplex_injector = false;
     asio::ip::tcp::endpoint _front_end_endpoint;
+    Path _routing_file;
+    CACertificate::KeyType _ca_key_type = CACertificate::KeyType::ec;
+    unsigned _threads = 1;
 
     boost::posix_time::time_duration _max_cached_age
         = boost::posix_time::hours(7*24);  // one week
 
+    boost::posix_time::time_duration _stale_while_revalidate
+        = boost::posix_time::seconds(0);
+    boost::posix_time::time_duration _stale_if_error
+        = boost::posix_time::seconds(-1);  // no limit
+
+    unsigned _heuristic_freshness = 10;  // percent
+    boost::posix_time::time_duration _max_heuristic_freshness
+        = boost::posix_time::hours(24);
+
+    boost::posix_time::time_duration _hedge_delay
+        = boost::posix_time::milliseconds(0);  // no hedging
+    unsigned _hedge_percentile = 0;
+
+    NegativeCache::Config _negative_cache_config;
+
+    OriginPool::Config _origin_pool_config;
+
+    DnsCache::Config _dns_cache_config;
+
+    OriginPool::Config _injector_pool_config;
+
     std::map<std::string, std::string> _injector_credentials;
 };
 
@@ -107,6 +197,72 @@ ClientConfig::ClientConfig(int argc, char* argv[])
          , po::value<int>()->default_value(_max_cached_age.total_seconds())
          , "Discard cached content older than this many seconds "
            "(0: discard all; -1: discard none)")
+        ("stale-while-revalidate"
+         , po::value<int>()->default_value(_stale_while_revalidate.total_seconds())
+         , "Serve expired content for up to this many seconds "
+           "while it is revalidated in the background (0: never)")
+        ("stale-if-error"
+         , po::value<int>()->default_value(_stale_if_error.total_seconds())
+         , "Serve expired content for up to this many seconds "
+           "if it cannot be revalidated (-1: no limit)")
+        ("heuristic-freshness"
+         , po::value<unsigned>()->default_value(_heuristic_freshness)
+         , "Consider content without explicit expiration fresh for this "
+           "percentage of the time since it was last modified (0: never)")
+        ("max-heuristic-freshness"
+         , po::value<unsigned>()->default_value(_max_heuristic_freshness.total_seconds())
+         , "Maximum seconds for which heuristic freshness applies")
+        ("hedge-delay"
+         , po::value<unsigned>()->default_value(_hedge_delay.total_milliseconds())
+         , "If the cache (or the origin when revalidating) has not answered "
+           "after this many milliseconds, try the other one at the same time "
+           "and use the first response (0: never)")
+        ("hedge-percentile"
+         , po::value<unsigned>()->default_value(_hedge_percentile)
+         , "Learn the hedging delay as this percentile of recent latencies, "
+           "using hedge-delay until enough are known (0: do not learn)")
+        ("negative-error-ttl"
+         , po::value<unsigned int>()->default_value(
+               std::chrono::duration_cast<std::chrono::seconds>(
+                   _negative_cache_config.error_ttl).count())
+         , "Seconds to remember error responses and unreachable hosts "
+           "for URLs fetched from the origin (0: never)")
+        ("negative-miss-ttl"
+         , po::value<unsigned int>()->default_value(
+               std::chrono::duration_cast<std::chrono::seconds>(
+                   _negative_cache_config.miss_ttl).count())
+         , "Seconds to remember URLs missing from the cache (0: never)")
+        ("negative-cache-size"
+         , po::value<size_t>()->default_value(_negative_cache_config.max_size)
+         , "Approximate bytes of memory used to remember failed fetches")
+        ("max-idle-origin-connections"
+         , po::value<size_t>()->default_value(_origin_pool_config.max_idle_per_origin)
+         , "Keep-alive connections kept open per origin for later requests "
+           "(0: do not reuse connections)")
+        ("origin-idle-timeout"
+         , po::value<unsigned int>()->default_value(
+               std::chrono::duration_cast<std::chrono::seconds>(
+                   _origin_pool_config.idle_timeout).count())
+         , "Seconds after which idle connections to origins are closed")
+        ("dns-ttl"
+         , po::value<unsigned int>()->default_value(
+               std::chrono::duration_cast<std::chrono::seconds>(
+                   _dns_cache_config.ttl).count())
+         , "Seconds to remember the addresses of a host name")
+        ("dns-negative-ttl"
+         , po::value<unsigned int>()->default_value(
+               std::chrono::duration_cast<std::chrono::seconds>(
+                   _dns_cache_config.negative_ttl).count())
+         , "Seconds to remember that a host name could not be looked up")
+        ("max-idle-injector-connections"
+         , po::value<size_t>()->default_value(_injector_pool_config.max_idle_per_origin)
+         , "Connections to the injector kept open for later requests "
+           "(0: do not reuse connections)")
+        ("injector-idle-timeout"
+         , po::value<unsigned int>()->default_value(
+               std::chrono::duration_cast<std::chrono::seconds>(
+                   _injector_pool_config.idle_timeout).count())
+         , "Seconds after which idle connections to the injector are closed")
         ("open-file-limit"
          , po::value<unsigned int>()
          , "To increase the maximum number of open files")
@@ -114,9 +270,24 @@ ClientConfig::ClientConfig(int argc, char* argv[])
          , "<username>:<password> authentication pair for the injector")
         ("enable-http-connect-requests", po::bool_switch(&_enable_http_connect_requests)
          , "Enable HTTP CONNECT requests")
+        ("multiplex-injector", po::bool_switch(&_multiplex_injector)
+         , "Send concurrent requests to the injector as streams "
+           "over a single connection (if the injector supports it)")
         ("front-end-ep"
          , po::value<string>()
          , "Front-end's endpoint (in <IP>:<PORT> format)")
+        ("routing-file"
+         , po::value<string>()
+         , "File with request routing rules, relative to the repository root "
+           "(default: built-in rules)")
+        ("threads"
+         , po::value<unsigned>()
+         , "Number of threads; all but one handle TLS sessions "
+           "with user agents (default: 1)")
+        ("ca-key-type"
+         , po::value<string>()->default_value("ec")
+         , "Key type of the CA certificate generated when the repository "
+           "has none: \"ec\" (faster, ECDSA signatures) or \"rsa\"")
         ;
 
     po::variables_map vm;
@@ -164,6 +335,83 @@ ClientConfig::ClientConfig(int argc, char* argv[])
         _max_cached_age = boost::posix_time::seconds(vm["max-cached-age"].as<int>());
     }
 
+    if (vm.count("stale-while-revalidate")) {
+        _stale_while_revalidate
+            = boost::posix_time::seconds(vm["stale-while-revalidate"].as<int>());
+    }
+
+    if (vm.count("stale-if-error")) {
+        _stale_if_error
+            = boost::posix_time::seconds(vm["stale-if-error"].as<int>());
+    }
+
+    if (vm.count("heuristic-freshness")) {
+        _heuristic_freshness = vm["heuristic-freshness"].as<unsigned>();
+    }
+
+    if (vm.count("max-heuristic-freshness")) {
+        _max_heuristic_freshness = boost::posix_time::seconds(
+                vm["max-heuristic-freshness"].as<unsigned>());
+    }
+
+    if (vm.count("hedge-delay")) {
+        _hedge_delay = boost::posix_time::milliseconds(
+                vm["hedge-delay"].as<unsigned>());
+    }
+
+    if (vm.count("hedge-percentile")) {
+        _hedge_percentile = vm["hedge-percentile"].as<unsigned>();
+    }
+
+    auto& nc = _negative_cache_config;
+
+    if (vm.count("negative-error-ttl")) {
+        nc.error_ttl = std::chrono::seconds(
+                vm["negative-error-ttl"].as<unsigned int>());
+    }
+
+    if (vm.count("negative-miss-ttl")) {
+        nc.miss_ttl = std::chrono::seconds(
+                vm["negative-miss-ttl"].as<unsigned int>());
+    }
+
+    if (vm.count("negative-cache-size")) {
+        nc.max_size = vm["negative-cache-size"].as<size_t>();
+    }
+
+    auto& op = _origin_pool_config;
+
+    if (vm.count("max-idle-origin-connections")) {
+        op.max_idle_per_origin = vm["max-idle-origin-connections"].as<size_t>();
+    }
+
+    if (vm.count("origin-idle-timeout")) {
+        op.idle_timeout = std::chrono::seconds(
+                vm["origin-idle-timeout"].as<unsigned int>());
+    }
+
+    auto& dns = _dns_cache_config;
+
+    if (vm.count("dns-ttl")) {
+        dns.ttl = std::chrono::seconds(vm["dns-ttl"].as<unsigned int>());
+    }
+
+    if (vm.count("dns-negative-ttl")) {
+        dns.negative_ttl = std::chrono::seconds(
+                vm["dns-negative-ttl"].as<unsigned int>());
+    }
+
+    auto& ip = _injector_pool_config;
+
+    if (vm.count("max-idle-injector-connections")) {
+        ip.max_idle_per_origin = vm["max-idle-injector-connections"].as<size_t>();
+    }
+
+    if (vm.count("injector-idle-timeout")) {
+        ip.idle_timeout = std::chrono::seconds(
+                vm["injector-idle-timeout"].as<unsigned int>());
+    }
+
     if (!vm.count("listen-on-tcp")) {
         throw std::runtime_error(
                 util::str( "The parameter 'listen-on-tcp' is missing.\n"
@@ -201,6 +449,36 @@ ClientConfig::ClientConfig(int argc, char* argv[])
         }
     }
 
+    if (vm.count("routing-file")) {
+        _routing_file = fs::absolute( vm["routing-file"].as<string>()
+                                    , _repo_root);
+
+        if (!fs::is_regular_file(_routing_file)) {
+            throw std::runtime_error(
+                    util::str("The routing file ", _routing_file
+                             , " does not exist.\n"));
+        }
+    }
+
+    if (vm.count("threads")) {
+        _threads = std::max(1u, vm["threads"].as<unsigned>());
+    }
+
+    if (vm.count("ca-key-type")) {
+        auto type = vm["ca-key-type"].as<string>();
+
+        if (type == "ec") {
+            _ca_key_type = CACertificate::KeyType::ec;
+        }
+        else if (type == "rsa") {
+            _ca_key_type = CACertificate::KeyType::rsa;
+        }
+        else {
+            throw std::runtime_error(util::str(
+                "Unknown CA key type \"", type, "\"; use \"ec\" or \"rsa\""));
+        }
+    }
+
     if (vm.count("injector-ipns")) {
         _ipns = vm["injector-ipns"].as<string>();
     }
@@ -1,6 +1,8 @@
 #include "client_front_end.h"
 #include "generic_connection.h"
 #include "cache/cache_client.h"
+#include "cache/negative_cache.h"
+#include "ssl/client_context.h"
 #include "util.h"
 #include <boost/optional/optional_io.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
@@ -72,7 +74,8 @@ void ClientFrontEnd::handle_ca_pem( const Request& req, Response& res, stringstr
 
 void ClientFrontEnd::handle_portal( const Request& req, Response& res, stringstream& ss
                                   , const boost::optional<Endpoint>& injector_ep
-                                  , CacheClient* cache_client)
+                                  , CacheClient* cache_client
+                                  , const NegativeCache* negative_cache)
 {
     res.set(http::field::content_type, "text/html");
 
@@ -170,6 +173,14 @@ void ClientFrontEnd::handle_portal( const Request& req, Response& res, stringstr
         ss << "        IPFS: " << cache_client->ipfs() << "<br>\n";
     }
 
+    if (negative_cache) {
+        ss << "        <h2>Negative cache</h2>\n";
+        ss << "        " << negative_cache->stats() << "<br>\n";
+    }
+
+    ss << "        <h2>Origin TLS</h2>\n";
+    ss << "        " << ssl::ClientContext::shared().stats() << "<br>\n";
+
     ss << "    </body>\n"
           "</html>\n";
 }
@@ -177,6 +188,7 @@ void ClientFrontEnd::handle_portal( const Request& req, Response& res, stringstr
 Response ClientFrontEnd::serve( const boost::optional<Endpoint>& injector_ep
                               , const Request& req
                               , CacheClient* cache_client
+                              , const NegativeCache* negative_cache
                               , const CACertificate& ca)
 {
     Response res{http::status::ok, req.version()};
@@ -190,7 +202,7 @@ Response ClientFrontEnd::serve( const boost::optional<Endpoint>& injector_ep
     if (url.path == "/ca.pem")
         handle_ca_pem(req, res, ss, ca);
     else
-        handle_portal(req, res, ss, injector_ep, cache_client);
+        handle_portal(req, res, ss, injector_ep, cache_client, negative_cache);
 
     Response::body_type::reader reader(res, res.body());
     sys::error_code ec;
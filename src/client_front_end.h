@@ -9,7 +9,7 @@
 #include "endpoint.h"
 #include "ssl/ca_certificate.h"
 
-namespace ouinet { class CacheClient; }
+namespace ouinet { class CacheClient; class NegativeCache; }
 
 namespace ouinet {
 
@@ -50,7 +50,8 @@ public:
 public:
     Response serve( const boost::optional<Endpoint>& injector_ep
                   , const http::request<http::string_body>&
-                  , CacheClient*, const CACertificate&);
+                  , CacheClient*, const NegativeCache*
+                  , const CACertificate&);
 
     bool is_origin_access_enabled() const
     {
@@ -96,7 +97,8 @@ private:
                       , const CACertificate& );
 
     void handle_portal( const Request&, Response&, std::stringstream&
-                      , const boost::optional<Endpoint>&, CacheClient*);
+                      , const boost::optional<Endpoint>&, CacheClient*
+                      , const NegativeCache*);
 };
 
 } // ouinet namespace
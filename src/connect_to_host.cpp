@@ -1,14 +1,24 @@
 #include "connect_to_host.h"
 
+#include "dns_cache.h"
 #include "util.h"
+#include "util/condition_variable.h"
 
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/connect.hpp>
 #include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/optional.hpp>
+#include <list>
 
 using namespace std;
 using namespace ouinet;
 
+using tcp = asio::ip::tcp;
+
+// Recommended by RFC 8305 (section 5).
+static const auto connection_attempt_delay = chrono::milliseconds(250);
+
 GenericConnection
 ouinet::connect_to_host( asio::io_service& ios
                        , const string& host
@@ -16,9 +26,6 @@ ouinet::connect_to_host( asio::io_service& ios
                        , Signal<void()>& cancel_signal
                        , asio::yield_context yield)
 {
-    using namespace std;
-    using tcp = asio::ip::tcp;
-
     sys::error_code ec;
 
     auto const lookup = util::tcp_async_resolve( host, port
@@ -26,16 +33,144 @@ ouinet::connect_to_host( asio::io_service& ios
                                                , yield[ec]);
     if (ec) return or_throw(yield, ec, GenericConnection());
 
-    tcp::socket socket(ios);
-    auto disconnect_slot = cancel_signal.connect([&socket] {
-        socket.shutdown(tcp::socket::shutdown_both);
-        socket.close();
-    });
+    vector<tcp::endpoint> endpoints;
+
+#if BOOST_VERSION >= 106700
+    for (auto r : lookup) endpoints.push_back(r.endpoint());
+#else
+    for (auto i = lookup; i != tcp::resolver::iterator(); ++i)
+        endpoints.push_back(i->endpoint());
+#endif
+
+    return connect_to_any(ios, move(endpoints), cancel_signal, yield);
+}
 
-    // Make the connection on the IP address we get from a lookup
-    asio::async_connect(socket, lookup, yield[ec]);
+GenericConnection
+ouinet::connect_to_host( DnsCache& dns
+                       , const string& host
+                       , const string& port
+                       , Signal<void()>& cancel_signal
+                       , asio::yield_context yield)
+{
+    sys::error_code ec;
+
+    auto port_n = util::parse_num<uint16_t>(port, 0);
+    if (port_n == 0) {
+        return or_throw(yield, asio::error::invalid_argument, GenericConnection());
+    }
+
+    auto addresses = dns.resolve(host, cancel_signal, yield[ec]);
     if (ec) return or_throw(yield, ec, GenericConnection());
 
-    return GenericConnection(move(socket));
+    vector<tcp::endpoint> endpoints;
+    for (auto& a : addresses) endpoints.emplace_back(a, port_n);
+
+    return connect_to_any( dns.get_io_service(), move(endpoints)
+                         , cancel_signal, yield);
+}
+
+// Alternate address families, keeping the order within each family.
+static vector<tcp::endpoint> interleave(vector<tcp::endpoint> endpoints)
+{
+    vector<tcp::endpoint> v6, v4, result;
+
+    for (auto& ep : endpoints) {
+        (ep.address().is_v6() ? v6 : v4).push_back(ep);
+    }
+
+    for (size_t i = 0; i < max(v6.size(), v4.size()); ++i) {
+        if (i < v6.size()) result.push_back(v6[i]);
+        if (i < v4.size()) result.push_back(v4[i]);
+    }
+
+    return result;
 }
 
+GenericConnection
+ouinet::connect_to_any( asio::io_service& ios
+                      , vector<tcp::endpoint> endpoints
+                      , Signal<void()>& cancel_signal
+                      , asio::yield_context yield)
+{
+    endpoints = interleave(move(endpoints));
+
+    // Shared with the attempts, which may finish after we return.
+    struct State {
+        State(asio::io_service& ios) : on_change(ios), timer(ios) {}
+
+        ConditionVariable on_change;
+        asio::steady_timer timer;
+        list<tcp::socket> attempts;
+        boost::optional<tcp::socket> connected;
+        // Either an attempt failed or the delay since the last one passed.
+        bool start_next = true;
+        sys::error_code last_error = asio::error::host_not_found;
+    };
+
+    auto state = make_shared<State>(ios);
+
+    auto close_attempts = [state] {
+        state->timer.cancel();
+        for (auto& s : state->attempts) s.close();
+    };
+
+    auto cancel_slot = cancel_signal.connect([&] {
+        close_attempts();
+        state->on_change.notify();
+    });
+
+    auto start = [&] (const tcp::endpoint& ep) {
+        state->attempts.emplace_back(ios);
+        auto socket = prev(state->attempts.end());
+
+        asio::spawn(ios, [state, socket, ep] (asio::yield_context yield) {
+            sys::error_code ec;
+            socket->async_connect(ep, yield[ec]);
+
+            if (!ec && !state->connected) {
+                state->connected = move(*socket);
+            }
+            else if (ec) {
+                state->last_error = ec;
+                state->start_next = true;
+            }
+
+            state->attempts.erase(socket);
+            state->on_change.notify();
+        });
+
+        state->start_next = false;
+        state->timer.expires_from_now(connection_attempt_delay);
+        state->timer.async_wait([state] (const sys::error_code& ec) {
+            if (ec) return;
+            state->start_next = true;
+            state->on_change.notify();
+        });
+    };
+
+    size_t next = 0;
+
+    while (!state->connected && !cancel_signal.call_count()) {
+        if (next < endpoints.size() && state->start_next) {
+            start(endpoints[next++]);
+            continue;
+        }
+
+        if (next == endpoints.size() && state->attempts.empty()) break;
+
+        state->on_change.wait(yield);
+    }
+
+    close_attempts();
+
+    if (cancel_signal.call_count()) {
+        return or_throw( yield, asio::error::operation_aborted
+                       , GenericConnection());
+    }
+
+    if (!state->connected) {
+        return or_throw(yield, state->last_error, GenericConnection());
+    }
+
+    return GenericConnection(move(*state->connected));
+}
@@ -5,10 +5,14 @@
 #include "or_throw.h"
 #include "util/signal.h"
 
+#include <boost/asio/ip/tcp.hpp>
 #include <boost/beast/core/string.hpp>
+#include <vector>
 
 namespace ouinet {
 
+class DnsCache;
+
 GenericConnection
 connect_to_host( asio::io_service& ios
                , const std::string& host
@@ -16,4 +20,22 @@ connect_to_host( asio::io_service& ios
                , Signal<void()>& cancel_signal
                , asio::yield_context yield);
 
+// Like the above, but looking `host` up in `dns`.
+GenericConnection
+connect_to_host( DnsCache& dns
+               , const std::string& host
+               , const std::string& port
+               , Signal<void()>& cancel_signal
+               , asio::yield_context yield);
+
+// Connect to whichever of the `endpoints` answers first
+// ("Happy Eyeballs", RFC 8305): IPv6 and IPv4 addresses are tried
+// alternately (IPv6 first), each attempt starting when the previous one
+// fails or after a short delay, whatever happens first.
+GenericConnection
+connect_to_any( asio::io_service& ios
+              , std::vector<asio::ip::tcp::endpoint> endpoints
+              , Signal<void()>& cancel_signal
+              , asio::yield_context yield);
+
 } // ouinet namespace
@@ -0,0 +1,189 @@
+#include <iostream>
+
+#include "dns_cache.h"
+#include "or_throw.h"
+#include "util/condition_variable.h"
+
+using namespace std;
+using namespace ouinet;
+
+using tcp = asio::ip::tcp;
+
+struct DnsCache::Lookup {
+    Lookup(asio::io_service& ios) : resolver(ios), done_cv(ios) {}
+
+    tcp::resolver resolver;
+    ConditionVariable done_cv;
+    bool done = false;
+    Addresses addresses;
+    sys::error_code ec;
+};
+
+DnsCache::DnsCache(asio::io_service& ios, Config config)
+    : _ios(ios)
+    , _config(move(config))
+    , _was_destroyed(make_shared<bool>(false))
+{
+}
+
+DnsCache::~DnsCache()
+{
+    *_was_destroyed = true;
+
+    for (auto& l : _lookups) l.second->resolver.cancel();
+}
+
+// Returns true if `host` is an IP address, which is then put in `address`.
+static bool parse_address(const string& host, asio::ip::address& address)
+{
+    sys::error_code ec;
+
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+        address = asio::ip::address::from_string
+            (host.substr(1, host.size() - 2), ec);
+    }
+    else {
+        address = asio::ip::address::from_string(host, ec);
+    }
+
+    return !ec;
+}
+
+DnsCache::Addresses
+DnsCache::resolve( const string& host
+                 , Signal<void()>& cancel
+                 , asio::yield_context yield)
+{
+    asio::ip::address address;
+    if (parse_address(host, address)) return Addresses{address};
+
+    auto i = _entries.find(host);
+
+    if (i != _entries.end()) {
+        auto& e = i->second;
+
+        if (e.expiry > Clock::now()) {
+            _lru.splice(_lru.end(), _lru, e.lru);
+
+            if (e.ec) {
+                ++_stats.negative_hits;
+                return or_throw<Addresses>(yield, e.ec);
+            }
+
+            ++_stats.hits;
+            return e.addresses;
+        }
+
+        _lru.erase(e.lru);
+        _entries.erase(i);
+        --_stats.entries;
+    }
+
+    if (cancel.call_count()) {
+        return or_throw<Addresses>(yield, asio::error::operation_aborted);
+    }
+
+    shared_ptr<Lookup> lookup;
+
+    auto l = _lookups.find(host);
+
+    if (l != _lookups.end()) {
+        ++_stats.joined;
+        lookup = l->second;
+    }
+    else {
+        lookup = make_shared<Lookup>(_ios);
+        start_lookup(host, lookup);
+    }
+
+    // This wakes up other callers waiting for the same lookup too,
+    // they just go back to waiting.
+    auto on_cancel = cancel.connect([&] { lookup->done_cv.notify(); });
+
+    sys::error_code ec;
+    while (!lookup->done && !ec && !cancel.call_count()) {
+        lookup->done_cv.wait(yield[ec]);
+    }
+
+    if (!lookup->done) {
+        return or_throw<Addresses>(yield, asio::error::operation_aborted);
+    }
+
+    return or_throw(yield, lookup->ec, lookup->addresses);
+}
+
+void DnsCache::start_lookup(const string& host, shared_ptr<Lookup> lookup)
+{
+    ++_stats.lookups;
+    _lookups[host] = lookup;
+
+    asio::spawn(_ios, [ this, wd = _was_destroyed, host, lookup ]
+                      (asio::yield_context yield) {
+        sys::error_code ec;
+
+        // Not interested in the port.
+        auto results = lookup->resolver.async_resolve({host, "0"}, yield[ec]);
+
+        if (!ec) {
+#if BOOST_VERSION >= 106700
+            for (auto r : results)
+                lookup->addresses.push_back(r.endpoint().address());
+#else
+            for (; results != tcp::resolver::iterator(); ++results)
+                lookup->addresses.push_back(results->endpoint().address());
+#endif
+            if (lookup->addresses.empty()) ec = asio::error::host_not_found;
+        }
+
+        lookup->ec = ec;
+        lookup->done = true;
+        lookup->done_cv.notify();
+
+        if (*wd) return;
+
+        _lookups.erase(host);
+
+        if (ec) ++_stats.failures;
+
+        // Do not remember that the lookup was interrupted.
+        if (ec != asio::error::operation_aborted) {
+            insert(host, lookup->addresses, ec);
+        }
+    });
+}
+
+void DnsCache::insert(const string& host, Addresses addresses, sys::error_code ec)
+{
+    auto ttl = ec ? _config.negative_ttl : _config.ttl;
+
+    if (_config.max_entries == 0 || ttl <= Clock::duration::zero()) return;
+
+    auto i = _entries.find(host);
+
+    if (i != _entries.end()) {
+        _lru.erase(i->second.lru);
+        _entries.erase(i);
+        --_stats.entries;
+    }
+
+    while (_stats.entries >= _config.max_entries) {
+        _entries.erase(_lru.front());
+        _lru.pop_front();
+        --_stats.entries;
+    }
+
+    _lru.push_back(host);
+    _entries[host] = Entry{ move(addresses), ec, Clock::now() + ttl
+                          , prev(_lru.end()) };
+    ++_stats.entries;
+}
+
+std::ostream& ouinet::operator<<(std::ostream& os, const DnsCache::Stats& s)
+{
+    return os << "entries:" << s.entries
+              << " hits:" << s.hits
+              << " negative_hits:" << s.negative_hits
+              << " lookups:" << s.lookups
+              << " joined:" << s.joined
+              << " failures:" << s.failures;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/spawn.hpp>
+#include <chrono>
+#include <iosfwd>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "namespaces.h"
+#include "util/signal.h"
+
+namespace ouinet {
+
+/*
+ * Host name lookups shared by everything which connects to origins.
+ *
+ * Successful lookups are kept for `ttl`, failed ones for `negative_ttl`.
+ * Concurrent lookups of the same name are done only once: later callers
+ * wait for the result of the first one.  A caller which is cancelled
+ * stops waiting, but the lookup goes on for the others (and the cache).
+ *
+ * Numeric addresses (with or without IPv6 brackets) are not looked up.
+ */
+class DnsCache {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Addresses = std::vector<asio::ip::address>;
+
+    struct Config {
+        // The system resolver does not tell the TTL of records,
+        // so this one applies to all names.
+        Clock::duration ttl = std::chrono::seconds(60);
+        Clock::duration negative_ttl = std::chrono::seconds(10);
+        size_t max_entries = 1024;
+    };
+
+    struct Stats {
+        size_t hits = 0;
+        size_t negative_hits = 0;
+        // Lookups which waited for one already in progress.
+        size_t joined = 0;
+        size_t lookups = 0;
+        size_t failures = 0;
+        size_t entries = 0;
+    };
+
+public:
+    DnsCache(asio::io_service&, Config);
+
+    DnsCache(const DnsCache&) = delete;
+    DnsCache& operator=(const DnsCache&) = delete;
+
+    ~DnsCache();
+
+    // The addresses of `host`, in the order given by the resolver.
+    Addresses resolve( const std::string& host
+                     , Signal<void()>& cancel
+                     , asio::yield_context);
+
+    asio::io_service& get_io_service() { return _ios; }
+
+    const Config& config() const { return _config; }
+    const Stats& stats() const { return _stats; }
+
+private:
+    struct Entry {
+        Addresses addresses;
+        sys::error_code ec;
+        Clock::time_point expiry;
+        std::list<std::string>::iterator lru;
+    };
+
+    struct Lookup;
+
+    void start_lookup(const std::string& host, std::shared_ptr<Lookup>);
+    void insert(const std::string& host, Addresses, sys::error_code);
+
+private:
+    asio::io_service& _ios;
+    Config _config;
+    std::unordered_map<std::string, Entry> _entries;
+    // Least recently used first.
+    std::list<std::string> _lru;
+    std::unordered_map<std::string, std::shared_ptr<Lookup>> _lookups;
+    Stats _stats;
+    std::shared_ptr<bool> _was_destroyed;
+};
+
+std::ostream& operator<<(std::ostream&, const DnsCache::Stats&);
+
+} // ouinet namespace
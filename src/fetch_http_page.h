@@ -2,6 +2,8 @@
 
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/spawn.hpp>
+#include <limits>
+#include <vector>
 
 #include "fail.h"
 #include "or_throw.h"
@@ -9,6 +11,8 @@
 #include "util/signal.h"
 #include "util.h"
 #include "connect_to_host.h"
+#include "dns_cache.h"
+#include "origin_pool.h"
 #include "ssl/util.h"
 
 namespace ouinet {
@@ -106,6 +110,113 @@ _recv_http_response( GenericConnection& con
     res = move(crph.get());
 }
 
+// How much of a response body is read at a time when forwarding it.
+static const size_t forward_buffer_size = 16 * 1024;
+
+// Send the HTTP request `req` over the connection `con` *as is*
+// and forward the response to `out` as it arrives:
+// the head as soon as it has been read, then the body
+// in pieces of at most `forward_buffer_size` bytes,
+// so that the whole response is never held in memory.
+// Each piece is also passed to `on_body(head, buffer)`
+// once it has been read.
+//
+// `head_sent` is set once the head has been written to `out`,
+// after which no other response may be sent to it.
+// Returns the response head.  If its `need_eof()` is true,
+// the end of the response is only told by closing `out`,
+// so no other response may be sent over it.
+template<class RequestType, class OnBody>
+inline
+http::response<http::empty_body>
+forward_http_page( GenericConnection& con
+                 , RequestType req
+                 , GenericConnection& out
+                 , OnBody&& on_body
+                 , bool& head_sent
+                 , Signal<void()>& abort_signal
+                 , asio::yield_context yield)
+{
+    using Head = http::response<http::empty_body>;
+
+    sys::error_code ec;
+
+    auto close_con_slot = abort_signal.connect([&con] {
+        con.close();
+    });
+
+    http::async_write(con, req, yield[ec]);
+
+    // See `fetch_http` above.
+    if (ec == http::error::end_of_stream) {
+        ec = sys::error_code();
+    }
+
+    if (ec) return or_throw<Head>(yield, ec);
+
+    beast::flat_buffer buffer;
+
+    http::response_parser<http::buffer_body> parser;
+    // The body is not kept, so there is no reason to limit it.
+    parser.body_limit(std::numeric_limits<std::uint64_t>::max());
+    // Responses to HEAD have no body even if they tell its length.
+    if (req.method() == http::verb::head) parser.skip(true);
+
+    http::async_read_header(con, buffer, parser, yield[ec]);
+    if (ec) return or_throw<Head>(yield, ec);
+
+    Head head(parser.get().base());
+
+    http::response_serializer<http::buffer_body> serializer(parser.get());
+
+    http::async_write_header(out, serializer, yield[ec]);
+    if (ec) return or_throw(yield, ec, move(head));
+
+    head_sent = true;
+
+    auto& body = parser.get().body();
+    // Not on the stack, coroutine stacks are small.
+    std::vector<char> buffer_data(forward_buffer_size);
+    auto data = buffer_data.data();
+
+    do {
+        if (!parser.is_done()) {
+            body.data = data;
+            body.size = buffer_data.size();
+
+            http::async_read(con, buffer, parser, yield[ec]);
+
+            // The parser ran out of room in `data`.
+            if (ec == http::error::need_buffer) ec = sys::error_code();
+            if (ec) return or_throw(yield, ec, move(head));
+
+            body.size = buffer_data.size() - body.size;
+            body.data = data;
+            body.more = !parser.is_done();
+
+            if (body.size) {
+                on_body(head.base(), asio::const_buffer(data, body.size));
+            }
+        }
+        else {
+            body.data = nullptr;
+            body.size = 0;
+        }
+
+        http::async_write(out, serializer, yield[ec]);
+
+        // The serializer wrote everything in `data`.
+        if (ec == http::error::need_buffer) ec = sys::error_code();
+        // The whole response was written, but it ends with the connection
+        // (see `need_eof()` above).
+        if (ec == http::error::end_of_stream) ec = sys::error_code();
+        if (ec) return or_throw(yield, ec, move(head));
+    }
+    while (!parser.is_done() && !serializer.is_done());
+
+    return head;
+}
+
 // Retrieve the HTTP/HTTPS URL in the proxy request `req`
 // (i.e. with a target like ``https://x.y/z``, not just ``/z``)
 // *from the origin* and return the HTTP response.
@@ -136,6 +247,21 @@ fetch_http_page( asio::io_service& ios
     return fetch_http_origin(ios, con, url, req, abort_signal, yield);
 }
 
+// Turn the proxy request `req` for the pre-parsed `url`
+// into a non-proxy request to be sent to the origin
+// (i.e. with target "/foo..." and not "http://example.com/foo...").
+// Actually some web servers do not like the full form.
+template<class RequestType>
+RequestType origin_request(const util::url_match& url, RequestType req)
+{
+    auto target = req.target().to_string();
+    req.target(target.substr(target.find( url.path
+                                        // Length of "http://" or "https://",
+                                        // do not fail on "http(s)://FOO/FOO".
+                                        , url.scheme.length() + 3)));
+    return req;
+}
+
 // Retrieve the pre-parsed HTTP/HTTPS `url` for the given proxy request `req`
 // (i.e. with a target like ``https://x.y/z``, not just ``/z``)
 // over an existing connection `con` *to the origin*
@@ -152,7 +278,6 @@ fetch_http_origin( asio::io_service& ios
     using namespace std;
     using Response = http::response<http::dynamic_body>;
 
-    auto target = req.target().to_string();
     sys::error_code ec;
 
     if (url.scheme == "https") {
@@ -166,15 +291,133 @@ fetch_http_origin( asio::io_service& ios
     }
 
     // Now that we have a connection to the origin
-    // we can send a non-proxy request to it
-    // (i.e. with target "/foo..." and not "http://example.com/foo...").
-    // Actually some web servers do not like the full form.
-    RequestType origin_req(req);
-    origin_req.target(target.substr(target.find( url.path
-                                               // Length of "http://" or "https://",
-                                               // do not fail on "http(s)://FOO/FOO".
-                                               , url.scheme.length() + 3)));
-    return fetch_http_page(ios, con, origin_req, abort_signal, yield);
+    // we can send a non-proxy request to it.
+    return fetch_http_page(ios, con, origin_request(url, req), abort_signal, yield);
+}
+
+// Whether a request with the given method may be safely sent again,
+// e.g. when a reused connection turns out to have been closed.
+inline
+bool is_idempotent(http::verb method)
+{
+    switch (method) {
+        case http::verb::get:
+        case http::verb::head:
+        case http::verb::options:
+        case http::verb::trace:
+        case http::verb::put:
+        case http::verb::delete_:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Send the proxy request `req` to the origin of its target
+// over an idle connection from `pool` if there is one,
+// or else over a new one to the addresses of the origin in `dns`,
+// and get the response with `exchange(con, origin_req, responded, yield)`,
+// which returns at least the head of the response.
+// The connection is left in the pool afterwards if possible.
+//
+// If a reused connection fails, the exchange is retried over another one,
+// unless `exchange` set `responded` to tell that
+// part of the response was already passed on.
+template<class RequestType, class Exchange>
+auto
+with_origin_connection( OriginPool& pool
+                      , DnsCache& dns
+                      , RequestType req
+                      , Signal<void()>& abort_signal
+                      , Exchange exchange
+                      , bool& responded
+                      , asio::yield_context yield)
+{
+    using namespace std;
+    using Response = decltype(exchange( declval<GenericConnection&>()
+                                      , req, responded, yield));
+
+    sys::error_code ec;
+
+    util::url_match url;
+    if (!util::match_http_url(req.target().to_string(), url)) {
+        ec = asio::error::operation_not_supported;  // unsupported URL
+        return or_throw<Response>(yield, ec);
+    }
+    bool ssl(url.scheme == "https");
+    if (url.port.empty())
+        url.port = ssl ? "443" : "80";
+
+    auto key = OriginPool::key(url.scheme, url.host, url.port);
+
+    auto origin_req = origin_request(url, move(req));
+    origin_req.keep_alive(true);
+
+    // Only retry requests which the origin may safely get twice.
+    bool idempotent = is_idempotent(origin_req.method());
+
+    for (;;) {
+        boost::optional<GenericConnection> pooled;
+        if (idempotent) pooled = pool.take(key);
+
+        GenericConnection con;
+
+        if (pooled) {
+            con = move(*pooled);
+        }
+        else {
+            con = connect_to_host(dns, url.host, url.port, abort_signal, yield[ec]);
+            if (ec) return or_throw<Response>(yield, ec);
+
+            if (ssl) {
+                con = ssl::util::client_handshake(move(con), url.host, yield[ec]);
+                if (ec) {
+                    cerr << "SSL client handshake error: "
+                         << url.host << ": " << ec.message() << endl;
+                    return or_throw<Response>(yield, ec);
+                }
+            }
+        }
+
+        auto res = exchange(con, origin_req, responded, yield[ec]);
+
+        if (ec && pooled && !responded && !abort_signal.call_count()) {
+            // The origin probably closed the idle connection,
+            // try with another one.
+            pool.on_stale();
+            continue;
+        }
+
+        if (ec) return or_throw(yield, ec, move(res));
+
+        pool.put(key, move(con), origin_req, res);
+
+        return res;
+    }
+}
+
+// Like `fetch_http_page` above, but reusing an idle connection
+// to the origin from `pool` if there is one,
+// and leaving the connection there afterwards if possible.
+// New connections are made to the addresses of the origin in `dns`.
+template<class RequestType>
+http::response<http::dynamic_body>
+fetch_http_page( asio::io_service& ios
+               , OriginPool& pool
+               , DnsCache& dns
+               , RequestType req
+               , Signal<void()>& abort_signal
+               , asio::yield_context yield)
+{
+    bool responded = false;
+
+    return with_origin_connection
+        ( pool, dns, std::move(req), abort_signal
+        , [&] ( GenericConnection& con, const RequestType& rq
+              , bool&, asio::yield_context yield) {
+              return fetch_http_page(ios, con, rq, abort_signal, yield);
+          }
+        , responded, yield);
 }
 
 }
@@ -8,10 +8,12 @@
 #include <boost/filesystem.hpp>
 #include <iostream>
 #include <fstream>
+#include <set>
 #include <string>
 #include <cstdlib>  // for atexit()
 
 #include "cache/cache_injector.h"
+#include "cache/admission_filter.h"
 
 #include "namespaces.h"
 #include "util.h"
@@ -27,11 +29,15 @@
 #include "authenticate.h"
 #include "force_exit_on_signal.h"
 #include "request_routing.h"
+#include "subresource_prefetcher.h"
+#include "defer.h"
+#include "ssl/client_context.h"
 
 #include "ouiservice.h"
 #include "ouiservice/i2p.h"
 #include "ouiservice/tcp.h"
 
+#include "util/run_detached.h"
 #include "util/signal.h"
 
 using namespace std;
@@ -67,6 +73,7 @@ void handle_bad_request( GenericConnection& con
 static
 void handle_connect_request( GenericConnection& client_c
                            , const Request& req
+                           , DnsCache& dns_cache
                            , Signal<void()>& disconnect_signal
                            , asio::yield_context yield)
 {
@@ -93,15 +100,34 @@ void handle_connect_request( GenericConnection& client_c
     }
     // Restrict connections towards certain hosts and ports.
     // TODO: Enhance this filter.
-    if (util::is_localhost(host, ios, disconnect_signal, yield[ec])
-        || (port != "80" && port != "443" && port != "8080" && port != "8443")) {
+    if (port != "80" && port != "443" && port != "8080" && port != "8443") {
         ec = asio::error::invalid_argument;
         return handle_bad_request( client_c, req
                                  , "Illegal CONNECT target: " + port
                                  , yield[ec]);
     }
 
-    auto origin_c = connect_to_host(ios, host, port, disconnect_signal, yield[ec]);
+    // The same addresses are checked and connected to,
+    // so the name is only looked up once.
+    auto addresses = dns_cache.resolve(host, disconnect_signal, yield[ec]);
+
+    if (!ec && util::is_localhost(addresses)) {
+        ec = asio::error::invalid_argument;
+        return handle_bad_request( client_c, req
+                                 , "Illegal CONNECT target: " + host
+                                 , yield[ec]);
+    }
+
+    GenericConnection origin_c;
+
+    if (!ec) {
+        vector<asio::ip::tcp::endpoint> endpoints;
+        auto port_n = util::parse_num<uint16_t>(port, 0);
+        for (auto& a : addresses) endpoints.emplace_back(a, port_n);
+
+        origin_c = connect_to_any( ios, move(endpoints)
+                                 , disconnect_signal, yield[ec]);
+    }
 
     if (ec) {
         return handle_bad_request( client_c, req
@@ -127,65 +153,435 @@ void handle_connect_request( GenericConnection& client_c
 }
 
 //------------------------------------------------------------------------------
-struct InjectorCacheControl {
+// Responses with "Vary" are stored as variants of the URL.
+static
+Variant cache_variant(const Request& rq, const http::response_header<>& rs)
+{
+    Variant variant;
+    variant.vary = CacheMeta::parse(rs).vary;
+    if (!variant.vary.empty()) variant.key = variant_key(rq, variant.vary);
+    return variant;
+}
+
+static
+CacheInjector::OnInsert on_insert(string key)
+{
+    return [key = move(key)] (const sys::error_code& ec, auto) {
+        if (ec) {
+            cout << "!Insert failed: " << key
+                 << " " << ec.message() << endl;
+        }
+    };
+}
+
+//------------------------------------------------------------------------------
+static
+void store_in_cache( CacheInjector& injector
+                   , const Request& rq
+                   , const Response& rs)
+{
+    auto key = rq.target().to_string();
+    auto insertion = injector.begin_insert(key, cache_variant(rq, rs));
+
+    // Serialize the response right into the insertion,
+    // without an intermediate copy of the whole of it.
+    http::response_serializer<Response::body_type> sr(rs);
+    sys::error_code ec;
+
+    do {
+        sr.next(ec, [&] (sys::error_code&, const auto& buffers) {
+            for ( auto b = asio::buffer_sequence_begin(buffers)
+                ; b != asio::buffer_sequence_end(buffers); ++b) {
+                insertion->append(*b);
+            }
+            sr.consume(asio::buffer_size(buffers));
+        });
+    } while (!ec && !sr.is_done());
+
+    if (ec) return;
+
+    insertion->commit(on_insert(move(key)));
+}
+
+//------------------------------------------------------------------------------
+// Writes a response to be stored in the cache as it is received:
+// first its head, then pieces of its body.  Bodies whose length is not known
+// from the head are framed in chunks so that the stored response
+// can be parsed back.
+class CacheWriter {
 public:
-    // TODO: Replace this with cancellation support in which fetch_ operations
-    // get a signal parameter
-    InjectorCacheControl( asio::io_service& ios
-                        , unique_ptr<CacheInjector>& injector
-                        , Signal<void()>& abort_signal)
+    CacheWriter( unique_ptr<CacheInjector::Insertion> insertion
+               , http::response<http::empty_body> head)
+        : _insertion(move(insertion))
+    {
+        auto status = head.result_int();
+        bool has_body = !(status / 100 == 1 || status == 204 || status == 304);
+
+        _chunked = has_body && (head.chunked() || !head.has_content_length());
+        if (_chunked) head.chunked(true);
+
+        // Like complete responses, keep private headers out of the cache.
+        auto h = util::str(CacheControl::filter_before_store
+                              (Response(move(head.base()))).base());
+        _insertion->append(asio::buffer(h));
+    }
+
+    void append(asio::const_buffer piece)
+    {
+        auto size = asio::buffer_size(piece);
+        if (size == 0) return;
+
+        _body_size += size;
+
+        if (!_chunked) return _insertion->append(piece);
+
+        auto chunk_size = util::str(hex, size, "\r\n");
+        _insertion->append(asio::buffer(chunk_size));
+        _insertion->append(piece);
+        _insertion->append(asio::buffer("\r\n", 2));
+    }
+
+    size_t body_size() const { return _body_size; }
+
+    void commit(CacheInjector::OnInsert on_insert)
+    {
+        if (_chunked) _insertion->append(asio::buffer("0\r\n\r\n", 5));
+        _insertion->commit(move(on_insert));
+    }
+
+private:
+    unique_ptr<CacheInjector::Insertion> _insertion;
+    bool _chunked;
+    size_t _body_size = 0;
+};
+
+//------------------------------------------------------------------------------
+// What all the requests served by the injector share.
+struct InjectorServices {
+    InjectorServices( asio::io_service& ios
+                    , InjectorConfig& config
+                    , unique_ptr<CacheInjector>& cache_injector
+                    , Signal<void()>& shutdown_signal)
         : ios(ios)
-        , injector(injector)
+        , config(config)
+        , cache_injector(cache_injector)
+        , origin_pool(config.origin_pool_config())
+        , dns_cache(ios, config.dns_cache_config())
+        , admission(config.admission_config())
+        , prefetcher(ios, config.prefetch_config())
+        , latencies(make_shared<CacheControl::Latencies>())
+        , negative_cache(make_shared<NegativeCache>(config.negative_cache_config()))
+        , shutdown_signal(shutdown_signal)
+    {}
+
+    asio::io_service& ios;
+    InjectorConfig& config;
+    unique_ptr<CacheInjector>& cache_injector;
+    // Keys of stale entries currently being revalidated.
+    set<string> revalidating;
+    // Idle connections to origins, for both proxied and injected requests.
+    OriginPool origin_pool;
+    DnsCache dns_cache;
+    AdmissionFilter admission;
+    SubresourcePrefetcher prefetcher;
+    // Shared by all requests to learn hedging delays.
+    shared_ptr<CacheControl::Latencies> latencies;
+    shared_ptr<NegativeCache> negative_cache;
+    Signal<void()>& shutdown_signal;
+};
+
+//------------------------------------------------------------------------------
+struct InjectorCacheControl {
+public:
+    InjectorCacheControl(InjectorServices& services)
+        : services(services)
+        , max_cached_response_size(services.config.max_cached_response_size())
+        , hedging(services.config.hedge_delay() > boost::posix_time::seconds(0))
+        , cc(services.ios)
     {
-        cc.fetch_fresh = [&ios, &abort_signal]
-                         (const Request& rq, asio::yield_context yield) {
-            return fetch_http_page(ios, rq, abort_signal, yield);
+        cc.fetch_fresh = [this] ( const Request& rq
+                                , Signal<void()>& cancel
+                                , asio::yield_context yield) {
+            auto on_abort = this->services.shutdown_signal.connect([&] { cancel(); });
+
+            sys::error_code ec;
+            auto rs = can_stream(rq) ? this->stream_fresh(rq, cancel, yield[ec])
+                                     : this->fetch_fresh(rq, cancel, yield[ec]);
+
+            // Only the origin is contacted, so errors are its own.
+            if ( ec && rq.method() == http::verb::get
+              && NegativeCache::is_negative(ec)) {
+                this->services.negative_cache->insert_error
+                    (rq.target().to_string(), {ec, Response()});
+            }
+
+            return or_throw(yield, ec, move(rs));
         };
 
-        cc.fetch_stored = [this](const Request& rq, asio::yield_context yield) {
-            return this->fetch_stored(rq, yield);
+        // The stale response is served right away, this refreshes the cache
+        // without holding the client (at most once per key at a time).
+        cc.revalidate = [&services] ( const Request& rq
+                                    , CacheControl::CacheEntry entry) {
+            auto key = rq.target().to_string();
+            if (!services.revalidating.insert(key).second) return;
+
+            asio::spawn(services.ios, [ &services, rq
+                                      , entry = move(entry), key = move(key)]
+                                      (asio::yield_context yield) mutable {
+                auto on_exit = defer([&] { services.revalidating.erase(key); });
+
+                InjectorCacheControl cc(services);
+                sys::error_code ec;
+                cc.revalidate(rq, move(entry), yield[ec]);
+
+                if (ec) {
+                    cout << "!Revalidation failed: " << key
+                         << " " << ec.message() << endl;
+                }
+            });
+        };
+
+        cc.stale_while_revalidate(services.config.stale_while_revalidate());
+        cc.stale_if_error(services.config.stale_if_error());
+        cc.heuristic_freshness(services.config.heuristic_freshness());
+        cc.max_heuristic_freshness(services.config.max_heuristic_freshness());
+        cc.hedge_delay(services.config.hedge_delay());
+        cc.hedge_percentile(services.config.hedge_percentile());
+        cc.latencies(services.latencies);
+        cc.negative_cache(services.negative_cache);
+
+        cc.fetch_stored = [this] ( const Request& rq
+                                 , Signal<void()>& cancel
+                                 , asio::yield_context yield) {
+            auto on_abort = this->services.shutdown_signal.connect([&] { cancel(); });
+            return this->fetch_stored(rq, cancel, yield);
         };
 
         cc.store = [this](const Request& rq, const Response& rs) {
+            if (head_only) return;
             this->insert_content(rq, rs);
         };
     }
 
     Response fetch(const Request& rq, asio::yield_context yield)
     {
+        services.admission.record(rq.target().to_string());
+        head_only = false;
         return cc.fetch(rq, yield);
     }
 
+    // Like `fetch` above, but if the response comes from the origin as is
+    // (e.g. on a cache miss), it is forwarded to `con` as it arrives
+    // and only stored once complete.  In that case `streamed` is set,
+    // and the returned response must not be sent again.
+    Response fetch( const Request& rq
+                  , GenericConnection& con
+                  , bool& streamed
+                  , asio::yield_context yield)
+    {
+        stream_con = &con;
+        auto on_exit = defer([&] { stream_con = nullptr; });
+
+        sys::error_code ec;
+        auto rs = fetch(rq, yield[ec]);
+
+        streamed = head_sent;
+        // Whatever happened afterwards, the client got a broken response.
+        if (streamed && stream_ec) ec = stream_ec;
+
+        // `CacheControl` remembers error responses, not just their heads.
+        if ( !ec && head_only
+          && NegativeCache::is_negative(rs)) {
+            services.negative_cache->erase(rq.target().to_string());
+        }
+
+        return or_throw(yield, ec, move(rs));
+    }
+
+    // Fetch the response to the revalidation request `rq` of the stored
+    // `entry` from the origin and store it (or the entry updated with it)
+    // if appropriate.
+    void revalidate( const Request& rq
+                   , CacheControl::CacheEntry entry
+                   , asio::yield_context yield)
+    {
+        sys::error_code ec;
+        auto rs = fetch_fresh(rq, services.shutdown_signal, yield[ec]);
+        if (ec) return or_throw(yield, ec);
+        cc.revalidated(rq, move(entry), rs);
+    }
+
 private:
+    Response fetch_fresh( const Request& rq
+                        , Signal<void()>& cancel
+                        , asio::yield_context yield)
+    {
+        auto start = AdmissionFilter::Clock::now();
+        sys::error_code ec;
+        auto rs = fetch_http_page( services.ios, services.origin_pool
+                                 , services.dns_cache, rq
+                                 , cancel, yield[ec]);
+        fetch_cost = AdmissionFilter::Clock::now() - start;
+        return or_throw(yield, ec, move(rs));
+    }
+
+    // Fresh responses can be forwarded while they are fetched
+    // unless they may not be used in the end: when racing against the cache,
+    // or when revalidating (a "304 Not Modified" is not for the client).
+    bool can_stream(const Request& rq) const
+    {
+        return stream_con && !head_sent && !hedging
+            && rq.find(http::field::if_none_match) == rq.end()
+            && rq.find(http::field::if_modified_since) == rq.end();
+    }
+
+    // Like `fetch_fresh`, but forwarding the response to `stream_con`
+    // as it arrives.  The body also goes piece by piece to the cache
+    // (see `CacheWriter`), unless it is bigger than `max_cached_response_size`
+    // or it may not be stored at all.  It is only kept in the returned
+    // response if something else needs it (error responses, pages to
+    // prefetch subresources from).
+    Response stream_fresh( const Request& rq
+                         , Signal<void()>& cancel
+                         , asio::yield_context yield)
+    {
+        bool started = false;
+        bool keep_body = false;
+        bool too_big = false;
+        size_t body_size = 0;
+        string body;
+
+        auto start_storing = [&] (const http::response_header<>& head) {
+            started = true;
+
+            keep_body = NegativeCache::is_negative(head)
+                     || services.prefetcher.wants_page(head);
+
+            const char* reason = "";
+
+            if ( !services.cache_injector || rq.method() != http::verb::get
+              || !CacheControl::ok_to_cache(rq, head, &reason)) return;
+
+            auto key = rq.target().to_string();
+            writer = make_unique<CacheWriter>
+                ( services.cache_injector->begin_insert(key, cache_variant(rq, head))
+                , http::response<http::empty_body>(head));
+        };
+
+        auto on_body = [&] ( const http::response_header<>& head
+                           , asio::const_buffer piece) {
+            if (!started) start_storing(head);
+            if (too_big) return;
+
+            auto size = asio::buffer_size(piece);
+            body_size += size;
+
+            if (body_size > max_cached_response_size) {
+                too_big = true;
+                writer.reset();
+                string().swap(body);
+                return;
+            }
+
+            if (writer) writer->append(piece);
+
+            if (keep_body) {
+                body.append(asio::buffer_cast<const char*>(piece), size);
+            }
+        };
+
+        auto start = AdmissionFilter::Clock::now();
+        sys::error_code ec;
+
+        auto head = with_origin_connection
+            ( services.origin_pool, services.dns_cache, rq, cancel
+            , [&] ( GenericConnection& con, const Request& orq
+                  , bool& responded, asio::yield_context yield) {
+                  return forward_http_page( con, orq, *stream_con, on_body
+                                          , responded, cancel, yield);
+              }
+            , head_sent, yield[ec]);
+
+        fetch_cost = AdmissionFilter::Clock::now() - start;
+        stream_ec = ec;
+
+        if (ec) {
+            // Do not store what the client did not get either.
+            writer.reset();
+            return or_throw<Response>(yield, ec);
+        }
+
+        if (!started) start_storing(head);
+
+        Response rs(move(head.base()));
+
+        if (keep_body && !too_big) {
+            rs.body().commit(asio::buffer_copy( rs.body().prepare(body.size())
+                                              , asio::buffer(body)));
+        }
+        else if (!writer) {
+            head_only = true;
+        }
+
+        return rs;
+    }
+
     void insert_content(const Request& rq, const Response& rs)
     {
-        if (!injector) return;
+        if (!services.cache_injector) return;
 
-        stringstream ss;
-        ss << rs;
         auto key = rq.target().to_string();
 
-        injector->insert_content(key, ss.str(),
-            [key] (const sys::error_code& ec, auto) {
-                if (ec) {
-                    cout << "!Insert failed: " << key
-                         << " " << ec.message() << endl;
-                }
-            });
+        // A streamed response was already being written to the cache.
+        auto writer = move(this->writer);
+
+        auto size = writer ? writer->body_size() : rs.body().size();
+
+        if (size > max_cached_response_size) return;
+
+        if (!services.admission.admit(key, size, fetch_cost)) {
+            return;
+        }
+
+        if (writer) {
+            writer->commit(on_insert(move(key)));
+        }
+        else {
+            store_in_cache(*services.cache_injector, rq, rs);
+        }
+
+        // Get the resources needed to render the page into the cache too.
+        services.prefetcher.on_page(rq, rs);
     }
 
     CacheControl::CacheEntry
-    fetch_stored(const Request& rq, asio::yield_context yield)
+    fetch_stored( const Request& rq
+                , Signal<void()>& cancel
+                , asio::yield_context yield)
     {
         using CacheEntry = CacheControl::CacheEntry;
 
-        if (!injector)
+        if (!services.cache_injector)
             return or_throw<CacheEntry>( yield
                                        , asio::error::operation_not_supported);
 
         sys::error_code ec;
 
-        auto content = injector->get_content(rq.target().to_string(), yield[ec]);
+        // IPFS lookups can not be cancelled, so stop waiting for it instead.
+        auto content = run_detached<CachedContent>(services.ios, cancel,
+            [ &injector = services.cache_injector
+            , key = rq.target().to_string()
+            , rh = rq.base()
+            ] (asio::yield_context yield) {
+                if (!injector) {
+                    return or_throw<CachedContent>(yield, asio::error::operation_aborted);
+                }
+                return injector->get_content( key
+                                            , [&rh] (auto& vary) {
+                                                  return variant_key(rh, vary);
+                                              }
+                                            , yield);
+            }, yield[ec]);
 
         if (ec) return or_throw<CacheEntry>(yield, ec);
 
@@ -207,20 +603,36 @@ private:
     }
 
 private:
-    asio::io_service& ios;
-    unique_ptr<CacheInjector>& injector;
+    InjectorServices& services;
+    // How long the last fresh response took to be fetched.
+    AdmissionFilter::Clock::duration fetch_cost
+        = AdmissionFilter::Clock::duration::zero();
+    size_t max_cached_response_size;
+    bool hedging;
+    // Where the response to the current request is forwarded to,
+    // null if it must be returned whole.
+    GenericConnection* stream_con = nullptr;
+    bool head_sent = false;
+    sys::error_code stream_ec;
+    // Set when only the head of the streamed response was kept,
+    // so that it is neither stored nor remembered as an error.
+    bool head_only = false;
+    // The streamed response going to the cache, until it is complete
+    // and `CacheControl` decides to store it.
+    unique_ptr<CacheWriter> writer;
     CacheControl cc;
     //RateLimiter _rate_limiter;
 };
 
 //------------------------------------------------------------------------------
 static
-void serve( InjectorConfig& config
+void serve( InjectorServices& services
           , GenericConnection con
-          , unique_ptr<CacheInjector>& injector
-          , Signal<void()>& close_connection_signal
           , asio::yield_context yield)
 {
+    auto& config = services.config;
+    auto& close_connection_signal = services.shutdown_signal;
+
     auto close_connection_slot = close_connection_signal.connect([&con] {
         con.close();
     });
@@ -239,12 +651,17 @@ void serve( InjectorConfig& config
         }
 
         if (req.method() == http::verb::connect) {
-            return handle_connect_request(con, req, close_connection_signal, yield);
+            return handle_connect_request( con, req, services.dns_cache
+                                         , close_connection_signal, yield);
         }
 
         // Check for a Ouinet version header hinting us on
         // whether to behave like an injector or a proxy.
         Response res;
+        // Whether the response was forwarded as it arrived.
+        bool streamed = false;
+        // Whether the forwarded response ends with the connection.
+        bool need_eof = false;
         auto req2(req);
         auto ouinet_version_hdr = req2.find(request_version_hdr);
         if (ouinet_version_hdr == req2.end()) {
@@ -252,12 +669,31 @@ void serve( InjectorConfig& config
             // TODO: Maybe reject requests for HTTPS URLS:
             // we are perfectly able to handle them (and do verification locally),
             // but the client should be using a CONNECT request instead!
-            res = fetch_http_page(con.get_io_service(), req2, close_connection_signal, yield[ec]);
+            auto head = with_origin_connection
+                ( services.origin_pool, services.dns_cache
+                , req2, close_connection_signal
+                , [&] ( GenericConnection& origin_c, const Request& rq
+                      , bool& responded, asio::yield_context yield) {
+                      return forward_http_page( origin_c, rq, con
+                                              , [] (auto&&...) {}
+                                              , responded
+                                              , close_connection_signal
+                                              , yield);
+                  }
+                , streamed, yield[ec]);
+            need_eof = head.need_eof();
         } else {
             // Ouinet header found, behave like a Ouinet injector.
             req2.erase(ouinet_version_hdr);  // do not propagate or cache the header
-            InjectorCacheControl cc(con.get_io_service(), injector, close_connection_signal);
-            res = cc.fetch(req2, yield[ec]);
+            InjectorCacheControl cc(services);
+            res = cc.fetch(req2, con, streamed, yield[ec]);
+            need_eof = res.need_eof();
+        }
+        if (streamed) {
+            // Nothing else may be sent after a broken response,
+            // nor after one which ends with the connection.
+            if (ec || need_eof) break;
+            continue;
         }
         if (ec) {
             handle_bad_request( con, req
@@ -276,12 +712,12 @@ void serve( InjectorConfig& config
 
 //------------------------------------------------------------------------------
 static
-void listen( InjectorConfig& config
+void listen( InjectorServices& services
            , OuiServiceServer& proxy_server
-           , unique_ptr<CacheInjector>& cache_injector
-           , Signal<void()>& shutdown_signal
            , asio::yield_context yield)
 {
+    auto& shutdown_signal = services.shutdown_signal;
+
     auto stop_proxy_slot = shutdown_signal.connect([&proxy_server] {
         proxy_server.stop_listen();
     });
@@ -310,16 +746,10 @@ void listen( InjectorConfig& config
 
         asio::spawn(ios, [
             connection = std::move(connection),
-            &cache_injector,
-            &shutdown_signal,
-            &config,
+            &services,
             lock = shutdown_connections.lock()
         ] (boost::asio::yield_context yield) mutable {
-            serve( config
-                 , std::move(connection)
-                 , cache_injector
-                 , shutdown_signal
-                 , yield);
+            serve(services, std::move(connection), yield);
         });
     }
 }
@@ -371,6 +801,16 @@ int main(int argc, const char* argv[])
     auto cache_injector
         = make_unique<CacheInjector>(ios, (config.repo_root()/"ipfs").native());
 
+    cache_injector->set_db_commit_window( config.db_commit_window()
+                                        , config.db_commit_max_updates());
+
+    {
+        auto queue_config = config.insert_queue_config();
+        queue_config.spill_dir = config.repo_root()/"insert-queue";
+        cache_injector->set_queue_config(move(queue_config));
+        cache_injector->set_storage_config(config.storage_config());
+    }
+
     auto shutdown_ipfs_slot = shutdown_signal.connect([&] {
         cache_injector = nullptr;
     });
@@ -404,17 +844,61 @@ int main(int argc, const char* argv[])
         proxy_server.add(std::move(i2p_server));
     }
 
-    asio::spawn(ios, [
-        &proxy_server,
-        &cache_injector,
-        &config,
-        &shutdown_signal
-    ] (asio::yield_context yield) {
-        listen( config
-              , proxy_server
-              , cache_injector
-              , shutdown_signal
-              , yield);
+    InjectorServices services(ios, config, cache_injector, shutdown_signal);
+
+    auto& prefetcher = services.prefetcher;
+
+    if (config.prefetch_subresources()) {
+        prefetcher.fetch = [&services]
+                           (const Request& rq, asio::yield_context yield) {
+            return fetch_http_page( services.ios, services.origin_pool
+                                  , services.dns_cache, rq
+                                  , services.shutdown_signal, yield);
+        };
+
+        // Only pages which were admitted into the cache get their
+        // subresources prefetched (see `insert_content`), and these are
+        // admitted along with them: they are seldom requested on their own
+        // before the page is rendered from the cache.
+        prefetcher.store = [&cache_injector]
+                           (const Request& rq, const Response& rs) {
+            if (!cache_injector) return;
+            if (!CacheControl::ok_to_cache(rq, rs)) return;
+            store_in_cache( *cache_injector
+                          , rq
+                          , CacheControl::filter_before_store(rs));
+        };
+    }
+
+    auto stop_prefetcher_slot = shutdown_signal.connect([&prefetcher] {
+        prefetcher.stop();
+    });
+
+    asio::spawn(ios, [&services, &proxy_server] (asio::yield_context yield) {
+        listen(services, proxy_server, yield);
+    });
+
+    // Periodically report the state of the insert queue.
+    asio::spawn(ios, [&services] (asio::yield_context yield) {
+        auto& cache_injector = services.cache_injector;
+
+        while (async_sleep( services.ios, chrono::minutes(1)
+                          , services.shutdown_signal, yield)) {
+            if (!cache_injector) break;
+            cout << "Insert queue: " << cache_injector->insert_queue_stats()
+                 << endl;
+            cout << "Cache admission: " << services.admission.stats() << endl;
+            cout << "Negative cache: " << services.negative_cache->stats() << endl;
+            cout << "Origin connections: " << services.origin_pool.stats() << endl;
+            cout << "DNS cache: " << services.dns_cache.stats() << endl;
+            cout << "Origin TLS: " << ssl::ClientContext::shared().stats()
+                 << endl;
+            cout << "Pinned storage: " << cache_injector->storage_stats() << endl;
+            if (services.config.prefetch_subresources()) {
+                cout << "Subresource prefetch: " << services.prefetcher.stats()
+                     << endl;
+            }
+        }
     });
 
     asio::signal_set signals(ios, SIGINT, SIGTERM);
@@ -1,5 +1,12 @@
 #pragma once
 
+#include "cache/cache_injector.h"
+#include "cache/admission_filter.h"
+#include "cache/negative_cache.h"
+#include "dns_cache.h"
+#include "origin_pool.h"
+#include "subresource_prefetcher.h"
+
 namespace ouinet {
 
 class InjectorConfig {
@@ -34,6 +41,58 @@ public:
     std::string credentials() const
     { return _credentials; }
 
+    std::chrono::milliseconds db_commit_window() const
+    { return _db_commit_window; }
+
+    size_t db_commit_max_updates() const
+    { return _db_commit_max_updates; }
+
+    // The spill directory is left empty, it depends on the repository root.
+    const CacheInjector::QueueConfig& insert_queue_config() const
+    { return _insert_queue_config; }
+
+    boost::posix_time::time_duration stale_while_revalidate() const
+    { return _stale_while_revalidate; }
+
+    boost::posix_time::time_duration stale_if_error() const
+    { return _stale_if_error; }
+
+    unsigned heuristic_freshness() const
+    { return _heuristic_freshness; }
+
+    boost::posix_time::time_duration max_heuristic_freshness() const
+    { return _max_heuristic_freshness; }
+
+    boost::posix_time::time_duration hedge_delay() const
+    { return _hedge_delay; }
+
+    unsigned hedge_percentile() const
+    { return _hedge_percentile; }
+
+    size_t max_cached_response_size() const
+    { return _max_cached_response_size; }
+
+    bool prefetch_subresources() const
+    { return _prefetch_subresources; }
+
+    const SubresourcePrefetcher::Config& prefetch_config() const
+    { return _prefetch_config; }
+
+    const AdmissionFilter::Config& admission_config() const
+    { return _admission_config; }
+
+    const NegativeCache::Config& negative_cache_config() const
+    { return _negative_cache_config; }
+
+    const OriginPool::Config& origin_pool_config() const
+    { return _origin_pool_config; }
+
+    const DnsCache::Config& dns_cache_config() const
+    { return _dns_cache_config; }
+
+    const StorageManager::Config& storage_config() const
+    { return _storage_config; }
+
 private:
     bool _is_help = false;
     boost::filesystem::path _repo_root;
@@ -42,6 +101,28 @@ private:
     boost::optional<asio::ip::tcp::endpoint> _tcp_endpoint;
     boost::filesystem::path OUINET_CONF_FILE = "ouinet-injector.conf";
     std::string _credentials;
+    std::chrono::milliseconds _db_commit_window = std::chrono::seconds(1);
+    size_t _db_commit_max_updates = 256;
+    CacheInjector::QueueConfig _insert_queue_config;
+    boost::posix_time::time_duration _stale_while_revalidate
+        = boost::posix_time::seconds(0);
+    boost::posix_time::time_duration _stale_if_error
+        = boost::posix_time::seconds(-1);  // no limit
+    unsigned _heuristic_freshness = 10;  // percent
+    boost::posix_time::time_duration _max_heuristic_freshness
+        = boost::posix_time::hours(24);
+
+    boost::posix_time::time_duration _hedge_delay
+        = boost::posix_time::milliseconds(0);  // no hedging
+    unsigned _hedge_percentile = 0;
+    size_t _max_cached_response_size = 8 * 1024 * 1024;
+    bool _prefetch_subresources = false;
+    SubresourcePrefetcher::Config _prefetch_config;
+    AdmissionFilter::Config _admission_config;
+    NegativeCache::Config _negative_cache_config;
+    OriginPool::Config _origin_pool_config;
+    DnsCache::Config _dns_cache_config;
+    StorageManager::Config _storage_config;
 };
 
 inline
@@ -66,6 +147,123 @@ InjectorConfig::options_description()
         ("credentials", po::value<string>()
          , "<username>:<password> authentication pair. "
            "If unused, this injector shall behave as an open proxy.")
+        ("db-commit-window"
+         , po::value<unsigned int>()
+         , "Milliseconds to wait for more cache index updates "
+           "before storing and publishing them together (0: no waiting)")
+        ("db-commit-max-updates"
+         , po::value<unsigned int>()
+         , "Maximum number of cache index updates to commit together")
+        ("insert-queue-max-bytes"
+         , po::value<size_t>()
+         , "Maximum size of contents waiting in memory to be added to IPFS")
+        ("insert-queue-overflow"
+         , po::value<string>()
+         , "What to do with new contents when the insert queue is full: "
+           "drop, defer (keep them on disk) or block")
+        ("insert-spill-max-bytes"
+         , po::value<size_t>()
+         , "Maximum size of contents deferred on disk")
+        ("insert-max-concurrency"
+         , po::value<unsigned int>()
+         , "Maximum number of simultaneous additions to IPFS")
+        ("insert-target-latency"
+         , po::value<unsigned int>()
+         , "Milliseconds that an IPFS addition should take, "
+           "simultaneous additions are reduced when exceeded "
+           "(0: always use the maximum)")
+        ("stale-while-revalidate"
+         , po::value<int>()
+         , "Serve expired content for up to this many seconds "
+           "while it is revalidated in the background (0: never)")
+        ("stale-if-error"
+         , po::value<int>()
+         , "Serve expired content for up to this many seconds "
+           "if it cannot be revalidated (-1: no limit)")
+        ("heuristic-freshness"
+         , po::value<unsigned>()
+         , "Consider content without explicit expiration fresh for this "
+           "percentage of the time since it was last modified (0: never)")
+        ("max-heuristic-freshness"
+         , po::value<unsigned>()
+         , "Maximum seconds for which heuristic freshness applies")
+        ("hedge-delay"
+         , po::value<unsigned>()
+         , "If the cache (or the origin when revalidating) has not answered "
+           "after this many milliseconds, try the other one at the same time "
+           "and use the first response (0: never)")
+        ("hedge-percentile"
+         , po::value<unsigned>()
+         , "Learn the hedging delay as this percentile of recent latencies, "
+           "using hedge-delay until enough are known (0: do not learn)")
+        ("max-cached-response-size"
+         , po::value<size_t>()
+         , "Responses with bigger bodies (in bytes) are sent to clients "
+           "but not cached")
+        ("prefetch-subresources"
+         , po::value<bool>()
+         , "Whether to fetch and cache the images, scripts and stylesheets "
+           "of HTML pages when caching them (true/false)")
+        ("prefetch-max-per-page"
+         , po::value<size_t>()
+         , "Maximum number of subresources to prefetch from a single page")
+        ("prefetch-max-queued"
+         , po::value<size_t>()
+         , "Maximum number of subresources waiting to be prefetched, "
+           "further ones are dropped")
+        ("prefetch-max-concurrency"
+         , po::value<unsigned int>()
+         , "Maximum number of simultaneous subresource fetches")
+        ("prefetch-max-per-host"
+         , po::value<unsigned int>()
+         , "Maximum number of simultaneous subresource fetches "
+           "from the same host")
+        ("prefetch-host-delay"
+         , po::value<unsigned int>()
+         , "Milliseconds between starting subresource fetches "
+           "from the same host")
+        ("admission-min-hits"
+         , po::value<unsigned int>()
+         , "Only store contents requested at least this many times recently "
+           "(1: store everything)")
+        ("admission-min-cost"
+         , po::value<unsigned int>()
+         , "Store contents requested fewer times anyway if they took "
+           "at least this many milliseconds per KiB to fetch (0: never)")
+        ("admission-sketch-width"
+         , po::value<size_t>()
+         , "Number of counters per row used to estimate request frequencies")
+        ("negative-error-ttl"
+         , po::value<unsigned int>()
+         , "Seconds to remember error responses and unreachable hosts "
+           "for URLs fetched from the origin (0: never)")
+        ("negative-miss-ttl"
+         , po::value<unsigned int>()
+         , "Seconds to remember URLs missing from the cache (0: never)")
+        ("negative-cache-size"
+         , po::value<size_t>()
+         , "Approximate bytes of memory used to remember failed fetches")
+        ("max-idle-origin-connections"
+         , po::value<size_t>()
+         , "Keep-alive connections kept open per origin for later requests "
+           "(0: do not reuse connections)")
+        ("origin-idle-timeout"
+         , po::value<unsigned int>()
+         , "Seconds after which idle connections to origins are closed")
+        ("dns-ttl"
+         , po::value<unsigned int>()
+         , "Seconds to remember the addresses of a host name")
+        ("dns-negative-ttl"
+         , po::value<unsigned int>()
+         , "Seconds to remember that a host name could not be looked up")
+        ("max-pinned-bytes"
+         , po::value<size_t>()
+         , "Unpin the least recently used contents when their total size "
+           "exceeds this (0: no limit)")
+        ("pin-gc-interval"
+         , po::value<unsigned int>()
+         , "Seconds between unpinning objects no longer reachable "
+           "from the database root (0: never)")
         ;
 
     return desc;
@@ -118,6 +316,183 @@ InjectorConfig::InjectorConfig(int argc, const char**argv)
         _open_file_limit = vm["open-file-limit"].as<unsigned int>();
     }
 
+    if (vm.count("db-commit-window")) {
+        _db_commit_window = std::chrono::milliseconds(
+                vm["db-commit-window"].as<unsigned int>());
+    }
+
+    if (vm.count("db-commit-max-updates")) {
+        _db_commit_max_updates = vm["db-commit-max-updates"].as<unsigned int>();
+
+        if (_db_commit_max_updates == 0) {
+            throw std::runtime_error(
+                "The 'db-commit-max-updates' argument must be positive");
+        }
+    }
+
+    auto& qc = _insert_queue_config;
+
+    if (vm.count("insert-queue-max-bytes")) {
+        qc.max_queued_bytes = vm["insert-queue-max-bytes"].as<size_t>();
+    }
+
+    if (vm.count("insert-queue-overflow")) {
+        auto value = vm["insert-queue-overflow"].as<string>();
+
+        if      (value == "drop")  qc.overflow = CacheInjector::QueueOverflow::drop;
+        else if (value == "defer") qc.overflow = CacheInjector::QueueOverflow::defer;
+        else if (value == "block") qc.overflow = CacheInjector::QueueOverflow::block;
+        else {
+            throw std::runtime_error(
+                "The insert-queue-overflow parameter may be either "
+                "'drop', 'defer' or 'block'");
+        }
+    }
+
+    if (vm.count("insert-spill-max-bytes")) {
+        qc.max_spilled_bytes = vm["insert-spill-max-bytes"].as<size_t>();
+    }
+
+    if (vm.count("insert-max-concurrency")) {
+        qc.max_concurrency = vm["insert-max-concurrency"].as<unsigned int>();
+
+        if (qc.max_concurrency == 0) {
+            throw std::runtime_error(
+                "The 'insert-max-concurrency' argument must be positive");
+        }
+    }
+
+    if (vm.count("insert-target-latency")) {
+        qc.target_add_latency = std::chrono::milliseconds(
+                vm["insert-target-latency"].as<unsigned int>());
+    }
+
+    if (vm.count("stale-while-revalidate")) {
+        _stale_while_revalidate = boost::posix_time::seconds(
+                vm["stale-while-revalidate"].as<int>());
+    }
+
+    if (vm.count("stale-if-error")) {
+        _stale_if_error = boost::posix_time::seconds(
+                vm["stale-if-error"].as<int>());
+    }
+
+    if (vm.count("heuristic-freshness")) {
+        _heuristic_freshness = vm["heuristic-freshness"].as<unsigned>();
+    }
+
+    if (vm.count("max-heuristic-freshness")) {
+        _max_heuristic_freshness = boost::posix_time::seconds(
+                vm["max-heuristic-freshness"].as<unsigned>());
+    }
+
+    if (vm.count("hedge-delay")) {
+        _hedge_delay = boost::posix_time::milliseconds(
+                vm["hedge-delay"].as<unsigned>());
+    }
+
+    if (vm.count("hedge-percentile")) {
+        _hedge_percentile = vm["hedge-percentile"].as<unsigned>();
+    }
+
+    if (vm.count("max-cached-response-size")) {
+        _max_cached_response_size = vm["max-cached-response-size"].as<size_t>();
+    }
+
+    if (vm.count("prefetch-subresources")) {
+        _prefetch_subresources = vm["prefetch-subresources"].as<bool>();
+    }
+
+    auto& pc = _prefetch_config;
+
+    if (vm.count("prefetch-max-per-page")) {
+        pc.max_per_page = vm["prefetch-max-per-page"].as<size_t>();
+    }
+
+    if (vm.count("prefetch-max-queued")) {
+        pc.max_queued = vm["prefetch-max-queued"].as<size_t>();
+    }
+
+    if (vm.count("prefetch-max-concurrency")) {
+        pc.max_concurrency = vm["prefetch-max-concurrency"].as<unsigned int>();
+    }
+
+    if (vm.count("prefetch-max-per-host")) {
+        pc.max_per_host = vm["prefetch-max-per-host"].as<unsigned int>();
+    }
+
+    if (pc.max_concurrency == 0 || pc.max_per_host == 0) {
+        throw std::runtime_error(
+            "The 'prefetch-max-concurrency' and 'prefetch-max-per-host' "
+            "arguments must be positive");
+    }
+
+    if (vm.count("prefetch-host-delay")) {
+        pc.host_delay = std::chrono::milliseconds(
+                vm["prefetch-host-delay"].as<unsigned int>());
+    }
+
+    auto& ac = _admission_config;
+
+    if (vm.count("admission-min-hits")) {
+        ac.min_hits = vm["admission-min-hits"].as<unsigned int>();
+    }
+
+    if (vm.count("admission-min-cost")) {
+        ac.min_cost_ms_per_kib = vm["admission-min-cost"].as<unsigned int>();
+    }
+
+    if (vm.count("admission-sketch-width")) {
+        ac.width = vm["admission-sketch-width"].as<size_t>();
+    }
+
+    auto& nc = _negative_cache_config;
+
+    if (vm.count("negative-error-ttl")) {
+        nc.error_ttl = std::chrono::seconds(
+                vm["negative-error-ttl"].as<unsigned int>());
+    }
+
+    if (vm.count("negative-miss-ttl")) {
+        nc.miss_ttl = std::chrono::seconds(
+                vm["negative-miss-ttl"].as<unsigned int>());
+    }
+
+    if (vm.count("negative-cache-size")) {
+        nc.max_size = vm["negative-cache-size"].as<size_t>();
+    }
+
+    auto& op = _origin_pool_config;
+
+    if (vm.count("max-idle-origin-connections")) {
+        op.max_idle_per_origin = vm["max-idle-origin-connections"].as<size_t>();
+    }
+
+    if (vm.count("origin-idle-timeout")) {
+        op.idle_timeout = std::chrono::seconds(
+                vm["origin-idle-timeout"].as<unsigned int>());
+    }
+
+    auto& dns = _dns_cache_config;
+
+    if (vm.count("dns-ttl")) {
+        dns.ttl = std::chrono::seconds(vm["dns-ttl"].as<unsigned int>());
+    }
+
+    if (vm.count("dns-negative-ttl")) {
+        dns.negative_ttl = std::chrono::seconds(
+                vm["dns-negative-ttl"].as<unsigned int>());
+    }
+
+    if (vm.count("max-pinned-bytes")) {
+        _storage_config.max_bytes = vm["max-pinned-bytes"].as<size_t>();
+    }
+
+    if (vm.count("pin-gc-interval")) {
+        _storage_config.gc_interval = std::chrono::seconds(
+                vm["pin-gc-interval"].as<unsigned int>());
+    }
+
     if (vm.count("credentials")) {
         _credentials = vm["credentials"].as<string>();
         if (!_credentials.empty() && _credentials.find(':') == string::npos) {
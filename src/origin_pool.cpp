@@ -0,0 +1,148 @@
+#include <boost/algorithm/string/predicate.hpp>
+#include <iostream>
+
+#include "origin_pool.h"
+#include "split_string.h"
+
+using namespace std;
+using namespace ouinet;
+
+OriginPool::OriginPool(Config config)
+    : _config(move(config))
+{
+}
+
+string OriginPool::key( const string& scheme
+                      , const string& host
+                      , const string& port)
+{
+    return scheme + "://" + host + ":" + port;
+}
+
+boost::optional<GenericConnection> OriginPool::take(const string& key)
+{
+    remove_expired();
+
+    auto i = _idle.find(key);
+
+    if (i == _idle.end()) {
+        ++_stats.missed;
+        return boost::none;
+    }
+
+    // The most recently used connection is the least likely to be closed.
+    auto con = move(i->second.back().connection);
+    i->second.pop_back();
+    if (i->second.empty()) _idle.erase(i);
+
+    --_stats.idle;
+    ++_stats.reused;
+
+    return boost::optional<GenericConnection>(move(con));
+}
+
+void OriginPool::put( const string& key
+                    , GenericConnection connection
+                    , Clock::duration timeout)
+{
+    if (_config.max_idle_per_origin == 0 || timeout <= Clock::duration::zero()) {
+        return;
+    }
+
+    remove_expired();
+
+    auto& idle = _idle[key];
+
+    if (idle.size() >= _config.max_idle_per_origin) {
+        idle.pop_front();
+        --_stats.idle;
+        ++_stats.evicted;
+    }
+
+    idle.push_back(Idle{move(connection), Clock::now() + timeout});
+    ++_stats.idle;
+
+    while (_stats.idle > _config.max_idle) evict_oldest();
+}
+
+void OriginPool::clear()
+{
+    _idle.clear();
+    _stats.idle = 0;
+}
+
+void OriginPool::remove_expired()
+{
+    auto now = Clock::now();
+
+    for (auto i = _idle.begin(); i != _idle.end();) {
+        auto& idle = i->second;
+
+        // Connections for an origin are sorted by the time they were put,
+        // but timeouts may differ.
+        for (auto j = idle.begin(); j != idle.end();) {
+            if (j->expiry > now) { ++j; continue; }
+            j = idle.erase(j);
+            --_stats.idle;
+            ++_stats.expired;
+        }
+
+        if (idle.empty()) i = _idle.erase(i);
+        else ++i;
+    }
+}
+
+void OriginPool::evict_oldest()
+{
+    auto oldest = _idle.end();
+
+    for (auto i = _idle.begin(); i != _idle.end(); ++i) {
+        if (oldest == _idle.end()
+            || i->second.front().expiry < oldest->second.front().expiry) {
+            oldest = i;
+        }
+    }
+
+    if (oldest == _idle.end()) return;
+
+    oldest->second.pop_front();
+    if (oldest->second.empty()) _idle.erase(oldest);
+
+    --_stats.idle;
+    ++_stats.evicted;
+}
+
+boost::optional<OriginPool::Clock::duration>
+ouinet::keep_alive_timeout(beast::string_view keep_alive)
+{
+    for (auto param : SplitString(keep_alive, ',')) {
+        beast::string_view name, value;
+        std::tie(name, value) = split_string_pair(param, '=');
+
+        if (!boost::iequals(name, "timeout")) continue;
+
+        unsigned secs = 0;
+        if (value.empty()) return boost::none;
+
+        for (char c : value) {
+            if (c < '0' || c > '9') return boost::none;
+            secs = secs * 10 + (c - '0');
+            if (secs > 3600) break;
+        }
+
+        return OriginPool::Clock::duration(chrono::seconds(secs));
+    }
+
+    return boost::none;
+}
+
+std::ostream&
+ouinet::operator<<(std::ostream& os, const OriginPool::Stats& s)
+{
+    return os << "reused:"   << s.reused
+              << " missed:"  << s.missed
+              << " stale:"   << s.stale
+              << " expired:" << s.expired
+              << " evicted:" << s.evicted
+              << " idle:"    << s.idle;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <boost/beast/http/message.hpp>
+#include <boost/optional.hpp>
+#include <chrono>
+#include <deque>
+#include <iosfwd>
+#include <string>
+#include <unordered_map>
+
+#include "generic_connection.h"
+#include "namespaces.h"
+
+namespace ouinet {
+
+/*
+ * Idle keep-alive connections to origins, so that further requests
+ * to the same origin need no DNS lookup nor TCP and TLS handshakes.
+ *
+ * Connections are kept by (scheme, host, port), already encrypted for
+ * HTTPS.  The most recently used one is reused first.  Idle connections
+ * expire after a timeout (shortened by the origin's "Keep-Alive" header),
+ * and the oldest ones are dropped when there are too many.
+ */
+class OriginPool {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Config {
+        // Idle connections kept per origin (zero disables the pool).
+        size_t max_idle_per_origin = 4;
+        // Idle connections kept in total.
+        size_t max_idle = 64;
+        Clock::duration idle_timeout = std::chrono::seconds(15);
+    };
+
+    struct Stats {
+        // Connections taken from the pool.
+        size_t reused = 0;
+        // Times that no idle connection was available.
+        size_t missed = 0;
+        // Reused connections found to be closed by the origin.
+        size_t stale = 0;
+        size_t expired = 0;
+        size_t evicted = 0;
+        size_t idle = 0;
+    };
+
+public:
+    OriginPool(Config);
+
+    OriginPool(const OriginPool&) = delete;
+    OriginPool& operator=(const OriginPool&) = delete;
+
+    static std::string key( const std::string& scheme
+                          , const std::string& host
+                          , const std::string& port);
+
+    // An idle connection to the origin, if any.
+    boost::optional<GenericConnection> take(const std::string& key);
+
+    // Keep the connection for later use if the exchange allows it.
+    template<class Request, class Response>
+    void put( const std::string& key
+            , GenericConnection
+            , const Request&
+            , const Response&);
+
+    // A reused connection failed before getting a response.
+    void on_stale() { ++_stats.stale; }
+
+    // Close all idle connections.
+    void clear();
+
+    const Config& config() const { return _config; }
+    const Stats& stats() const { return _stats; }
+
+private:
+    struct Idle {
+        GenericConnection connection;
+        Clock::time_point expiry;
+    };
+
+    void put(const std::string& key, GenericConnection, Clock::duration);
+    void remove_expired();
+    void evict_oldest();
+
+private:
+    Config _config;
+    std::unordered_map<std::string, std::deque<Idle>> _idle;
+    Stats _stats;
+};
+
+// The "timeout" parameter of a "Keep-Alive" header, if any.
+boost::optional<OriginPool::Clock::duration>
+keep_alive_timeout(beast::string_view keep_alive);
+
+template<class Request, class Response>
+void OriginPool::put( const std::string& key
+                    , GenericConnection connection
+                    , const Request& rq
+                    , const Response& rs)
+{
+    // The response must have a known length for the connection to be reused.
+    if (!rq.keep_alive() || !rs.keep_alive() || rs.need_eof()) return;
+
+    auto timeout = _config.idle_timeout;
+
+    auto ka = rs.find(http::field::keep_alive);
+    if (ka != rs.end()) {
+        auto t = keep_alive_timeout(ka->value());
+        // Leave a margin to avoid racing with the origin closing it.
+        if (t) timeout = std::min(timeout, *t - std::chrono::seconds(1));
+    }
+
+    put(key, std::move(connection), timeout);
+}
+
+std::ostream& operator<<(std::ostream&, const OriginPool::Stats&);
+
+} // ouinet namespace
@@ -5,6 +5,8 @@
 
 #include "util/condition_variable.h"
 #include "util/success_condition.h"
+#include "ouiservice/multiplex.h"
+#include "defer.h"
 
 using namespace std;
 using namespace ouinet;
@@ -56,8 +58,10 @@ void OuiServiceServer::start_listen(asio::yield_context yield)
                     break;
                 }
 
-                _connection_queue.push_back(std::move(connection));
-                _connection_available.notify();
+                asio::spawn(_ios, [this, connection = std::move(connection)]
+                                  (asio::yield_context yield) mutable {
+                    add_connection(std::move(connection), yield);
+                });
             }
         });
     }
@@ -69,6 +73,42 @@ void OuiServiceServer::start_listen(asio::yield_context yield)
     }
 }
 
+void OuiServiceServer::add_connection( GenericConnection connection
+                                     , asio::yield_context yield)
+{
+    sys::error_code ec;
+    bool multiplexed = false;
+
+    connection = ouiservice::detect_multiplexing( std::move(connection)
+                                                , multiplexed
+                                                , yield[ec]);
+
+    if (ec || _stop_listen.call_count()) return;
+
+    if (!multiplexed) return queue_connection(std::move(connection));
+
+    auto session = ouiservice::MuxSession::start(std::move(connection), false);
+
+    auto stop_slot = _stop_listen.connect([session] { session->close(); });
+
+    while (true) {
+        auto stream = session->accept(yield[ec]);
+        if (ec) break;
+        queue_connection(std::move(stream));
+    }
+}
+
+void OuiServiceServer::queue_connection(GenericConnection connection)
+{
+    if (_stop_listen.call_count()) {
+        connection.close();
+        return;
+    }
+
+    _connection_queue.push_back(std::move(connection));
+    _connection_available.notify();
+}
+
 void OuiServiceServer::stop_listen()
 {
     _stop_listen();
@@ -103,9 +143,16 @@ void OuiServiceServer::cancel_accept()
 // OuiServiceClient
 //--------------------------------------------------------------------
 
-OuiServiceClient::OuiServiceClient(asio::io_service& ios):
+OuiServiceClient::OuiServiceClient( asio::io_service& ios
+                                  , OriginPool::Config pool_config
+                                  , bool multiplex):
+    _ios(ios),
     _started(false),
-    _started_condition(ios)
+    _started_condition(ios),
+    _pool(move(pool_config)),
+    _multiplex_enabled(multiplex),
+    _multiplex(multiplex),
+    _session_changed(ios)
 {}
 
 void OuiServiceClient::add(std::unique_ptr<OuiServiceImplementationClient> implementation)
@@ -117,6 +164,11 @@ void OuiServiceClient::add(std::unique_ptr<OuiServiceImplementationClient> imple
         _implementation->stop();
     }
 
+    _pool.clear();
+    _remote_endpoint.clear();
+    if (_session) _session->close();
+    _session = nullptr;
+    _multiplex = _multiplex_enabled;
     _implementation = std::move(implementation);
 }
 
@@ -147,6 +199,9 @@ void OuiServiceClient::stop()
     assert(_implementation);
 
     _started = false;
+    _pool.clear();
+    if (_session) _session->close();
+    _session = nullptr;
     _implementation->stop();
     _started_condition.notify();
 }
@@ -169,6 +224,23 @@ OuiServiceClient::connect(asio::yield_context yield, Signal<void()>& cancel)
         }
     }
 
+    if (_multiplex) {
+        sys::error_code ec;
+        auto info = connect_multiplexed(yield[ec], cancel);
+
+        // Otherwise fall back to a plain connection.
+        if (!ec || cancel.call_count()) {
+            return or_throw(yield, ec, move(info));
+        }
+    }
+
+    return connect_implementation(yield, cancel);
+}
+
+OuiServiceImplementationClient::ConnectInfo
+OuiServiceClient::connect_implementation( asio::yield_context yield
+                                        , Signal<void()>& cancel)
+{
     ConnectInfo retval;
     sys::error_code ec;
     decltype(_implementation) impl;
@@ -180,5 +252,88 @@ OuiServiceClient::connect(asio::yield_context yield, Signal<void()>& cancel)
     }
     while (_implementation && impl != _implementation);
 
+    if (!ec) _remote_endpoint = retval.remote_endpoint;
+
     return or_throw(yield, ec, move(retval));
 }
+
+OuiServiceImplementationClient::ConnectInfo
+OuiServiceClient::connect_pooled( asio::yield_context yield
+                                , Signal<void()>& cancel
+                                , bool& reused)
+{
+    reused = false;
+
+    if (_started && !_remote_endpoint.empty()) {
+        auto con = _pool.take(_remote_endpoint);
+
+        if (con) {
+            reused = true;
+            return ConnectInfo{move(*con), _remote_endpoint};
+        }
+    }
+
+    return connect(yield, cancel);
+}
+
+OuiServiceImplementationClient::ConnectInfo
+OuiServiceClient::connect_multiplexed( asio::yield_context yield
+                                     , Signal<void()>& cancel)
+{
+    sys::error_code ec;
+
+    // Only one session is set up at a time.  A cancelled waiter must not
+    // stay blocked until the session being set up is acknowledged.
+    {
+        auto cancel_slot = cancel.connect([this] { _session_changed.notify(); });
+
+        while (_session_connecting) {
+            if (cancel.call_count()) {
+                return or_throw<ConnectInfo>(yield, asio::error::operation_aborted);
+            }
+            _session_changed.wait(yield[ec]);
+        }
+    }
+
+    if (!_multiplex) {
+        return or_throw<ConnectInfo>(yield, asio::error::operation_not_supported);
+    }
+
+    if (_session && _session->is_open()) {
+        auto stream = _session->open_stream(ec);
+        if (!ec) return ConnectInfo{move(stream), _session_endpoint};
+    }
+
+    _session_connecting = true;
+
+    auto on_exit = defer([&] {
+        _session_connecting = false;
+        _session_changed.notify();
+    });
+
+    auto info = connect_implementation(yield[ec], cancel);
+    if (ec) return or_throw<ConnectInfo>(yield, ec);
+
+    auto session = ouiservice::MuxSession::start(move(info.connection), true);
+
+    auto stream = session->open_stream(ec);
+    assert(!ec);
+
+    // The server answers the first stream only if it supports multiplexing,
+    // otherwise it closes the connection.  Other failures (e.g. a reset
+    // connection) may be transient, so multiplexing is tried again later.
+    auto cancel_slot = cancel.connect([session] { session->close(); });
+    session->wait_acknowledged(yield[ec]);
+
+    if (ec) {
+        session->close();
+        if (ec == asio::error::operation_not_supported) _multiplex = false;
+        return or_throw<ConnectInfo>(yield, ec);
+    }
+
+    if (_session) _session->close();
+    _session = move(session);
+    _session_endpoint = info.remote_endpoint;
+
+    return ConnectInfo{move(stream), _session_endpoint};
+}
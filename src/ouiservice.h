@@ -7,11 +7,14 @@
 #include <boost/asio/spawn.hpp>
 
 #include "generic_connection.h"
+#include "origin_pool.h"
 #include "util/condition_variable.h"
 #include "util/signal.h"
 
 namespace ouinet {
 
+namespace ouiservice { class MuxSession; }
+
 class OuiServiceImplementationServer
 {
     public:
@@ -42,6 +45,11 @@ class OuiServiceServer
     GenericConnection accept(asio::yield_context yield);
     void cancel_accept();
 
+    private:
+    // Queue the connection, or the streams multiplexed over it.
+    void add_connection(GenericConnection, asio::yield_context);
+    void queue_connection(GenericConnection);
+
     private:
     asio::io_service& _ios;
 
@@ -73,24 +81,82 @@ class OuiServiceImplementationClient
  * This temporary version supports only a single active implementation, and
  * therefore is just an empty shell. Later versions will support functionality
  * like trying multiple parallel implementations.
+ *
+ * Since establishing a connection may be very slow (e.g. over I2P),
+ * connections used for plain HTTP requests can be given back once done
+ * and kept idle for later requests to the same remote endpoint.
+ *
+ * If multiplexing is enabled, connections are streams over a single
+ * connection made by the implementation, as long as the server
+ * acknowledges the first stream; otherwise plain connections are used.
  */
 class OuiServiceClient
 {
     public:
-    OuiServiceClient(asio::io_service& ios);
+    using ConnectInfo = OuiServiceImplementationClient::ConnectInfo;
+
+    public:
+    OuiServiceClient( asio::io_service& ios
+                    , OriginPool::Config = {}
+                    , bool multiplex = false);
 
     void add(std::unique_ptr<OuiServiceImplementationClient> implementation);
 
     void start(asio::yield_context yield);
     void stop();
 
-    OuiServiceImplementationClient::ConnectInfo
-    connect(asio::yield_context yield, Signal<void()>& cancel);
+    // A new connection for exclusive use (e.g. as a CONNECT tunnel).
+    ConnectInfo connect(asio::yield_context yield, Signal<void()>& cancel);
+
+    // Like `connect`, but reusing an idle connection if there is any,
+    // in which case `reused` is set.  Since the other end may have closed it
+    // in the meantime, only requests which can be retried should be sent.
+    ConnectInfo connect_pooled( asio::yield_context yield
+                              , Signal<void()>& cancel
+                              , bool& reused);
+
+    // Keep the connection for later requests if the exchange allows it.
+    template<class Request, class Response>
+    void release(ConnectInfo, const Request&, const Response&);
+
+    // A reused connection failed before getting a response.
+    void on_stale() { _pool.on_stale(); }
+
+    const OriginPool::Stats& pool_stats() const { return _pool.stats(); }
+
+    private:
+    ConnectInfo connect_implementation( asio::yield_context yield
+                                      , Signal<void()>& cancel);
+
+    ConnectInfo connect_multiplexed( asio::yield_context yield
+                                   , Signal<void()>& cancel);
 
     private:
+    asio::io_service& _ios;
     std::shared_ptr<OuiServiceImplementationClient> _implementation;
     bool _started;
     ConditionVariable _started_condition;
+    // Keyed by remote endpoint.
+    OriginPool _pool;
+    // That of the last connection made by the current implementation.
+    std::string _remote_endpoint;
+
+    bool _multiplex_enabled;
+    // Cleared if the server does not support multiplexing.
+    bool _multiplex;
+    std::shared_ptr<ouiservice::MuxSession> _session;
+    std::string _session_endpoint;
+    bool _session_connecting = false;
+    ConditionVariable _session_changed;
 };
 
+template<class Request, class Response>
+void OuiServiceClient::release( ConnectInfo info
+                              , const Request& rq
+                              , const Response& rs)
+{
+    if (!_started) return;
+    _pool.put(info.remote_endpoint, std::move(info.connection), rq, rs);
+}
+
 } // ouinet namespace
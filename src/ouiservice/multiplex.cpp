@@ -0,0 +1,560 @@
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <array>
+
+#include "multiplex.h"
+#include "../or_throw.h"
+#include "../prefixed_connection.h"
+
+using namespace std;
+using namespace ouinet;
+using namespace ouinet::ouiservice;
+
+using Handler = function<void(sys::error_code, size_t)>;
+
+namespace {
+
+// Frame types and flags, as in the yamux specification.
+enum : uint8_t {
+    type_data          = 0,
+    type_window_update = 1,
+    type_ping          = 2,
+    type_go_away       = 3,
+};
+
+enum : uint16_t {
+    flag_syn = 1,
+    flag_ack = 2,
+    flag_fin = 4,
+    flag_rst = 8,
+};
+
+const uint8_t protocol_version = 0;
+const size_t header_size = 12;
+
+// Larger writes are split so that streams share the transport fairly.
+const uint32_t max_data_frame = 64 * 1024;
+
+void put_u16(uint8_t* p, uint16_t v) { p[0] = v >> 8; p[1] = v; }
+
+void put_u32(uint8_t* p, uint32_t v)
+{
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+uint16_t get_u16(const uint8_t* p) { return uint16_t(p[0]) << 8 | p[1]; }
+
+uint32_t get_u32(const uint8_t* p)
+{
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16
+         | uint32_t(p[2]) << 8  | uint32_t(p[3]);
+}
+
+} // namespace
+
+//------------------------------------------------------------------------------
+struct MuxSession::Stream {
+    Stream(uint32_t id) : id(id) {}
+
+    uint32_t id;
+
+    // Received data not yet read by the application.
+    string rx;
+    size_t rx_pos = 0;
+
+    // Bytes which the peer may still send us, and those we read
+    // but did not yet tell the peer about.
+    uint32_t recv_window = initial_window;
+    uint32_t consumed = 0;
+
+    // Bytes which we may still send.
+    uint32_t send_window = initial_window;
+
+    bool remote_fin = false;
+    bool reset = false;
+    bool closed = false;
+
+    vector<asio::mutable_buffer> read_buffers;
+    Handler on_read;
+
+    vector<asio::const_buffer> write_buffers;
+    Handler on_write;
+};
+
+struct MuxSession::Frame {
+    string bytes;
+    function<void(sys::error_code)> on_sent;
+};
+
+// What is moved into the `GenericConnection` of each stream.
+class MuxSession::StreamHandle {
+public:
+    StreamHandle(shared_ptr<MuxSession> session, shared_ptr<Stream> stream)
+        : _session(move(session)), _stream(move(stream))
+    {}
+
+    StreamHandle(StreamHandle&&) = default;
+    StreamHandle& operator=(StreamHandle&&) = default;
+
+    ~StreamHandle() { close(); }
+
+    asio::io_service& get_io_service() { return _session->_ios; }
+
+#if BOOST_VERSION >= 106700
+    asio::io_context::executor_type get_executor()
+    {
+        return _session->_ios.get_executor();
+    }
+#endif
+
+    void async_read_some(const vector<asio::mutable_buffer>& bs, Handler h)
+    {
+        if (_stream->on_read) {
+            return post(move(h), asio::error::in_progress);
+        }
+        if (_stream->closed) {
+            return post(move(h), asio::error::operation_aborted);
+        }
+        _stream->read_buffers = bs;
+        _stream->on_read = move(h);
+        _session->stream_read(_stream);
+    }
+
+    void async_write_some(const vector<asio::const_buffer>& bs, Handler h)
+    {
+        if (_stream->on_write) {
+            return post(move(h), asio::error::in_progress);
+        }
+        if (_stream->closed) {
+            return post(move(h), asio::error::operation_aborted);
+        }
+        _stream->write_buffers = bs;
+        _stream->on_write = move(h);
+        _session->stream_write(_stream);
+    }
+
+    void close()
+    {
+        if (!_stream) return;  // moved from
+        _session->stream_close(_stream);
+    }
+
+private:
+    void post(Handler h, sys::error_code ec)
+    {
+        _session->_ios.post([h = move(h), ec] { h(ec, 0); });
+    }
+
+private:
+    shared_ptr<MuxSession> _session;
+    shared_ptr<Stream> _stream;
+};
+
+//------------------------------------------------------------------------------
+shared_ptr<MuxSession>
+MuxSession::start(GenericConnection transport, bool is_client)
+{
+    shared_ptr<MuxSession> self(new MuxSession(move(transport), is_client));
+
+    asio::spawn(self->_ios, [self] (asio::yield_context yield) {
+        self->read_loop(yield);
+    });
+
+    asio::spawn(self->_ios, [self] (asio::yield_context yield) {
+        self->write_loop(yield);
+    });
+
+    return self;
+}
+
+MuxSession::MuxSession(GenericConnection transport, bool is_client)
+    : _ios(transport.get_io_service())
+    , _transport(move(transport))
+    , _is_client(is_client)
+    , _next_id(is_client ? 1 : 2)
+    , _on_accept(_ios)
+    , _on_acknowledged(_ios)
+    , _on_write(_ios)
+{
+}
+
+MuxSession::~MuxSession()
+{
+    close();
+}
+
+GenericConnection MuxSession::open_stream(sys::error_code& ec)
+{
+    if (_closed) {
+        ec = asio::error::not_connected;
+        return GenericConnection();
+    }
+
+    auto id = _next_id;
+    _next_id += 2;
+
+    auto stream = add_stream(id);
+    send(type_window_update, flag_syn, id, 0);
+    ++_stats.opened;
+
+    return GenericConnection(StreamHandle(shared_from_this(), move(stream)));
+}
+
+void MuxSession::wait_acknowledged(asio::yield_context yield)
+{
+    sys::error_code ec;
+
+    while (!_acknowledged && !_closed) _on_acknowledged.wait(yield[ec]);
+
+    if (_refused) {
+        return or_throw(yield, asio::error::operation_not_supported);
+    }
+
+    if (!_acknowledged) {
+        return or_throw(yield, asio::error::connection_aborted);
+    }
+}
+
+GenericConnection MuxSession::accept(asio::yield_context yield)
+{
+    sys::error_code ec;
+
+    while (_accept_queue.empty() && !_closed) _on_accept.wait(yield[ec]);
+
+    if (_accept_queue.empty()) {
+        return or_throw<GenericConnection>(yield, asio::error::operation_aborted);
+    }
+
+    auto stream = move(_accept_queue.front());
+    _accept_queue.pop_front();
+    ++_stats.accepted;
+
+    return GenericConnection(StreamHandle(shared_from_this(), move(stream)));
+}
+
+void MuxSession::close()
+{
+    if (_closed) return;
+    _closed = true;
+
+    _transport.close();
+
+    auto streams = move(_streams);
+    _streams.clear();
+
+    for (auto& s : streams) {
+        s.second->reset = true;
+        stream_read(s.second);
+        stream_write(s.second);
+    }
+
+    _accept_queue.clear();
+
+    for (auto& f : _write_queue) {
+        if (!f.on_sent) continue;
+        _ios.post([h = move(f.on_sent)] { h(asio::error::operation_aborted); });
+    }
+    _write_queue.clear();
+
+    _stats.open = 0;
+
+    _on_accept.notify();
+    _on_acknowledged.notify();
+    _on_write.notify();
+}
+
+//------------------------------------------------------------------------------
+shared_ptr<MuxSession::Stream> MuxSession::add_stream(uint32_t id)
+{
+    auto stream = make_shared<Stream>(id);
+    _streams[id] = stream;
+    _stats.open = _streams.size();
+    return stream;
+}
+
+void MuxSession::remove_stream(uint32_t id)
+{
+    _streams.erase(id);
+    _stats.open = _streams.size();
+}
+
+void MuxSession::send( uint8_t type, uint16_t flags, uint32_t id
+                     , uint32_t length
+                     , string payload
+                     , function<void(sys::error_code)> on_sent)
+{
+    if (_closed) {
+        if (on_sent) {
+            _ios.post([h = move(on_sent)] { h(asio::error::operation_aborted); });
+        }
+        return;
+    }
+
+    Frame frame;
+    frame.bytes.resize(header_size);
+
+    auto h = reinterpret_cast<uint8_t*>(&frame.bytes[0]);
+    h[0] = protocol_version;
+    h[1] = type;
+    put_u16(h + 2, flags);
+    put_u32(h + 4, id);
+    put_u32(h + 8, length);
+
+    frame.bytes += payload;
+    frame.on_sent = move(on_sent);
+
+    _write_queue.push_back(move(frame));
+    _on_write.notify();
+}
+
+void MuxSession::write_loop(asio::yield_context yield)
+{
+    auto self = shared_from_this();
+
+    while (!_closed) {
+        sys::error_code ec;
+
+        if (_write_queue.empty()) {
+            _on_write.wait(yield[ec]);
+            continue;
+        }
+
+        // Send all queued frames at once.
+        auto frames = move(_write_queue);
+        _write_queue.clear();
+
+        vector<asio::const_buffer> buffers;
+        for (auto& f : frames) buffers.push_back(asio::buffer(f.bytes));
+
+        asio::async_write(_transport, buffers, yield[ec]);
+
+        for (auto& f : frames) {
+            if (!f.on_sent) continue;
+            _ios.post([h = move(f.on_sent), ec] { h(ec); });
+        }
+
+        if (ec) break;
+    }
+
+    close();
+}
+
+void MuxSession::read_loop(asio::yield_context yield)
+{
+    auto self = shared_from_this();
+
+    array<uint8_t, header_size> header;
+    string payload;
+
+    while (!_closed) {
+        sys::error_code ec;
+
+        asio::async_read(_transport, asio::buffer(header), yield[ec]);
+
+        if (ec) {
+            if (ec == asio::error::eof && !_received_frame) _refused = true;
+            break;
+        }
+
+        if (header[0] != protocol_version) {
+            if (!_received_frame) _refused = true;
+            break;
+        }
+
+        _received_frame = true;
+
+        auto type   = header[1];
+        auto flags  = get_u16(&header[2]);
+        auto id     = get_u32(&header[4]);
+        auto length = get_u32(&header[8]);
+
+        if (type == type_data) {
+            if (length > initial_window) break;  // more than any window
+            payload.resize(length);
+            asio::async_read(_transport, asio::buffer(&payload[0], length), yield[ec]);
+            if (ec) break;
+        }
+
+        if (type == type_ping) {
+            if (flags & flag_syn) send(type_ping, flag_ack, 0, length);
+            continue;
+        }
+
+        if (type == type_go_away) break;
+
+        if (type != type_data && type != type_window_update) break;
+
+        shared_ptr<Stream> stream;
+
+        if (flags & flag_syn) {
+            // Streams opened by the peer have the other parity.
+            bool peer_id = (id % 2 == 1) != _is_client;
+            if (!peer_id || _streams.count(id)) break;
+
+            if (_streams.size() >= max_streams
+                || _accept_queue.size() >= max_accept_backlog) {
+                send(type_window_update, flag_rst, id, 0);
+                ++_stats.refused;
+                continue;
+            }
+
+            stream = add_stream(id);
+            _accept_queue.push_back(stream);
+            _on_accept.notify();
+
+            send(type_window_update, flag_ack, id, 0);
+        }
+        else {
+            auto i = _streams.find(id);
+            // Frames for streams which we already closed are dropped.
+            if (i != _streams.end()) stream = i->second;
+        }
+
+        if (flags & flag_ack) {
+            _acknowledged = true;
+            _on_acknowledged.notify();
+        }
+
+        if (!stream) continue;
+
+        if (type == type_data && length) {
+            if (length > stream->recv_window) break;
+            stream->recv_window -= length;
+            stream->rx.append(payload);
+        }
+
+        if (type == type_window_update) {
+            stream->send_window += length;
+        }
+
+        if (flags & flag_fin) stream->remote_fin = true;
+
+        if (flags & flag_rst) {
+            stream->reset = true;
+            remove_stream(id);
+        }
+
+        stream_read(stream);
+        stream_write(stream);
+    }
+
+    close();
+}
+
+//------------------------------------------------------------------------------
+void MuxSession::stream_read(const shared_ptr<Stream>& s)
+{
+    if (!s->on_read) return;
+
+    auto available = s->rx.size() - s->rx_pos;
+    sys::error_code ec;
+    size_t n = 0;
+
+    if (available) {
+        n = asio::buffer_copy( s->read_buffers
+                             , asio::buffer(&s->rx[s->rx_pos], available));
+        s->rx_pos += n;
+
+        if (s->rx_pos == s->rx.size()) {
+            s->rx.clear();
+            s->rx_pos = 0;
+        }
+
+        // Let the peer send more once half of the window is used up.
+        s->consumed += n;
+        if (s->consumed >= initial_window / 2 && !s->remote_fin && !s->closed) {
+            send(type_window_update, 0, s->id, s->consumed);
+            s->recv_window += s->consumed;
+            s->consumed = 0;
+        }
+    }
+    else if (asio::buffer_size(s->read_buffers) == 0) {
+        // Nothing to read into.
+    }
+    else if (s->reset) {
+        ec = asio::error::connection_reset;
+    }
+    else if (s->remote_fin) {
+        ec = asio::error::eof;
+    }
+    else {
+        return;  // wait for data
+    }
+
+    _ios.post([h = move(s->on_read), ec, n] { h(ec, n); });
+    s->on_read = nullptr;
+}
+
+void MuxSession::stream_write(const shared_ptr<Stream>& s)
+{
+    if (!s->on_write) return;
+
+    auto h = move(s->on_write);
+    s->on_write = nullptr;
+
+    if (s->reset) {
+        _ios.post([h = move(h)] { h(asio::error::connection_reset, 0); });
+        return;
+    }
+
+    auto size = asio::buffer_size(s->write_buffers);
+
+    if (size == 0) {
+        _ios.post([h = move(h)] { h(sys::error_code(), 0); });
+        return;
+    }
+
+    uint32_t n = min<size_t>({size, s->send_window, max_data_frame});
+
+    if (n == 0) {
+        // Wait for the peer to enlarge the window.
+        s->on_write = move(h);
+        return;
+    }
+
+    string payload(n, '\0');
+    asio::buffer_copy(asio::buffer(&payload[0], n), s->write_buffers);
+    s->send_window -= n;
+
+    // Completing the write once the frame is sent keeps a single
+    // fast writer from filling the queue.
+    send( type_data, 0, s->id, n, move(payload)
+        , [h = move(h), n] (sys::error_code ec) { h(ec, ec ? 0 : n); });
+}
+
+void MuxSession::stream_close(const shared_ptr<Stream>& s)
+{
+    if (s->closed) return;
+    s->closed = true;
+
+    auto abort = [this] (Handler& h) {
+        if (!h) return;
+        _ios.post([h = move(h)] { h(asio::error::operation_aborted, 0); });
+        h = nullptr;
+    };
+
+    abort(s->on_read);
+    abort(s->on_write);
+
+    if (!s->reset) send(type_window_update, flag_fin, s->id, 0);
+
+    remove_stream(s->id);
+}
+
+//------------------------------------------------------------------------------
+GenericConnection
+ouiservice::detect_multiplexing( GenericConnection transport
+                               , bool& multiplexed
+                               , asio::yield_context yield)
+{
+    sys::error_code ec;
+    char first;
+
+    asio::async_read(transport, asio::buffer(&first, 1), yield[ec]);
+    if (ec) return or_throw<GenericConnection>(yield, ec);
+
+    multiplexed = (first == protocol_version);
+
+    return GenericConnection(PrefixedConnection(move(transport), string(1, first)));
+}
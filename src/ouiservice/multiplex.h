@@ -0,0 +1,133 @@
+#pragma once
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/spawn.hpp>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../generic_connection.h"
+#include "../namespaces.h"
+#include "../util/condition_variable.h"
+
+namespace ouinet {
+namespace ouiservice {
+
+/*
+ * Many logical streams over a single transport connection, using the framing
+ * of yamux (https://github.com/hashicorp/yamux/blob/master/spec.md):
+ * each frame has a 12 byte header (version, type, flags, stream id, length)
+ * and each stream has a receive window which the receiver enlarges with
+ * window updates as the application consumes data, so that a slow stream
+ * does not block the others.
+ *
+ * Streams opened by the client side have odd ids, those opened by the
+ * server side even ones.  Each stream is used as a `GenericConnection`:
+ * closing it sends a FIN (the peer reads an end of stream after pending
+ * data) and aborts local pending operations.
+ *
+ * Since the first byte of a yamux frame is always zero (the version)
+ * and no HTTP request starts like that, a server can tell multiplexed
+ * connections from plain ones (see `detect_multiplexing`).
+ */
+class MuxSession : public std::enable_shared_from_this<MuxSession> {
+private:
+    struct Stream;
+    struct Frame;
+    class StreamHandle;
+
+public:
+    struct Stats {
+        size_t opened = 0;
+        size_t accepted = 0;
+        size_t open = 0;
+        size_t refused = 0;
+    };
+
+    // Bytes which a stream may receive before the application reads them.
+    static const uint32_t initial_window = 256 * 1024;
+
+    // Streams which the peer may have open in a session, and opened streams
+    // which may wait to be accepted.  Further streams are reset, so that
+    // a peer cannot make us buffer `initial_window` bytes for any number
+    // of them.
+    static const size_t max_streams = 256;
+    static const size_t max_accept_backlog = 64;
+
+public:
+    static std::shared_ptr<MuxSession>
+    start(GenericConnection transport, bool is_client);
+
+    ~MuxSession();
+
+    asio::io_service& get_io_service() { return _ios; }
+
+    // Open a new stream.  Data may be written to it right away.
+    GenericConnection open_stream(sys::error_code&);
+
+    // Wait until the peer acknowledges any stream, i.e. until we know that
+    // it speaks the protocol.  Fails with `operation_not_supported`
+    // if the peer closed the transport (or sent something else)
+    // before any frame, i.e. if we know that it does not.
+    void wait_acknowledged(asio::yield_context);
+
+    // Wait for the peer to open a stream.
+    GenericConnection accept(asio::yield_context);
+
+    // Abort all streams and close the transport.
+    void close();
+
+    bool is_open() const { return !_closed; }
+
+    const Stats& stats() const { return _stats; }
+
+private:
+    MuxSession(GenericConnection transport, bool is_client);
+
+    void read_loop(asio::yield_context);
+    void write_loop(asio::yield_context);
+
+    std::shared_ptr<Stream> add_stream(uint32_t id);
+    void remove_stream(uint32_t id);
+
+    void send( uint8_t type, uint16_t flags, uint32_t id, uint32_t length
+             , std::string payload = std::string()
+             , std::function<void(sys::error_code)> on_sent = nullptr);
+
+    void stream_read(const std::shared_ptr<Stream>&);
+    void stream_write(const std::shared_ptr<Stream>&);
+    void stream_close(const std::shared_ptr<Stream>&);
+
+private:
+    asio::io_service& _ios;
+    GenericConnection _transport;
+    bool _is_client;
+    bool _closed = false;
+    bool _acknowledged = false;
+    bool _received_frame = false;
+    // The peer does not speak the protocol (see `wait_acknowledged`).
+    bool _refused = false;
+    uint32_t _next_id;
+
+    std::map<uint32_t, std::shared_ptr<Stream>> _streams;
+    std::deque<std::shared_ptr<Stream>> _accept_queue;
+    std::deque<Frame> _write_queue;
+
+    ConditionVariable _on_accept;
+    ConditionVariable _on_acknowledged;
+    ConditionVariable _on_write;
+
+    Stats _stats;
+};
+
+// Read the first byte of `transport` to tell whether the peer wants to
+// multiplex streams over it.  The byte is not lost to readers of
+// the returned connection.
+GenericConnection detect_multiplexing( GenericConnection transport
+                                     , bool& multiplexed
+                                     , asio::yield_context);
+
+} // ouiservice namespace
+} // ouinet namespace
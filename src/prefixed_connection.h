@@ -0,0 +1,53 @@
+#pragma once
+
+#include <boost/asio/buffer.hpp>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "generic_connection.h"
+
+namespace ouinet {
+
+// A connection whose reads first return the given `prefix`,
+// e.g. bytes already read from `inner` to peek at what follows.
+class PrefixedConnection {
+private:
+    using Handler = std::function<void(sys::error_code, size_t)>;
+
+public:
+    PrefixedConnection(GenericConnection inner, std::string prefix)
+        : _inner(std::move(inner)), _prefix(std::move(prefix))
+    {}
+
+    asio::io_service& get_io_service() { return _inner.get_io_service(); }
+
+#if BOOST_VERSION >= 106700
+    asio::io_context::executor_type get_executor()
+    {
+        return _inner.get_executor();
+    }
+#endif
+
+    void async_read_some(const std::vector<asio::mutable_buffer>& bs, Handler h)
+    {
+        if (_prefix.empty()) return _inner.async_read_some(bs, std::move(h));
+
+        auto n = asio::buffer_copy(bs, asio::buffer(_prefix));
+        _prefix.erase(0, n);
+        get_io_service().post([h = std::move(h), n] { h(sys::error_code(), n); });
+    }
+
+    void async_write_some(const std::vector<asio::const_buffer>& bs, Handler h)
+    {
+        _inner.async_write_some(bs, std::move(h));
+    }
+
+    void close() { _inner.close(); }
+
+private:
+    GenericConnection _inner;
+    std::string _prefix;
+};
+
+} // ouinet namespace
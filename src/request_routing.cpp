@@ -1,3 +1,8 @@
+#include <bitset>
+#include <sstream>
+#include <stdexcept>
+#include <boost/optional.hpp>
+
 #include "request_routing.h"
 #include "error.h"
 
@@ -159,3 +164,305 @@ route_choose_config( const http::request<http::string_body>& req
 }
 } // request_route namespace
 } // ouinet namespace
+
+//------------------------------------------------------------------------------
+namespace ouinet { namespace request_route {
+
+const char* RoutingTable::default_rules =
+    "# Handle requests to <http://localhost/> internally.\n"
+    "host=localhost -> nocache front-end\n"
+    "header:X-Oui-Destination=OuiClient -> nocache front-end\n"
+    "\n"
+    "# Send unsafe HTTP method requests to the origin server\n"
+    "# (or the proxy if that does not work).\n"
+    "# NOTE: The cache need not be disabled as it should know not to\n"
+    "# fetch requests in these cases.\n"
+    "!method=GET,HEAD,OPTIONS,TRACE -> nocache origin proxy\n"
+    "# Do not use cache for safe but uncacheable HTTP method requests,\n"
+    "# nor for validation HEADs (caching these is not yet supported).\n"
+    "method=HEAD,OPTIONS,TRACE -> nocache origin proxy\n"
+    "\n"
+    "# Disable cache and always go to origin for this site.\n"
+    "target=https?://ident.me/.* -> nocache origin\n"
+    "# Disable cache and always go to proxy for this site.\n"
+    "target=https?://ifconfig.co/.* -> nocache proxy\n"
+    "# Force cache and default mechanisms for this site.\n"
+    "target=https?://(www\\.)?example.com/.* -> cache\n"
+    "# Force cache and particular mechanisms for this site.\n"
+    "target=https?://(www\\.)?example.net/.* -> cache injector\n";
+
+// Enough for every `http::verb`.
+static const size_t verb_count = size_t(http::verb::unlink) + 1;
+
+struct RoutingTable::RuleSpec {
+    std::bitset<verb_count> methods;
+    std::vector<std::string> hosts;
+    std::vector<std::pair<std::string, std::string>> headers;
+    boost::optional<std::string> target;
+    Config config;
+};
+
+static std::string lower(beast::string_view s)
+{
+    std::string r(s.data(), s.size());
+    for (auto& c : r) if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+    return r;
+}
+
+// Whether the regex refers to its own groups (e.g. `\1`, `\k<name>`,
+// `(?(1)...)`), which does not work once it is wrapped in the combined regex.
+static bool has_backreferences(const std::string& rx)
+{
+    for (size_t i = 0; i + 1 < rx.size(); ++i) {
+        if (rx.compare(i, 3, "(?(") == 0) return true;
+        if (rx[i] != '\\') continue;
+        auto c = rx[++i];  // skip the escaped character
+        if ((c >= '1' && c <= '9') || c == 'g' || c == 'k') return true;
+    }
+    return false;
+}
+
+static std::vector<std::string> split(const std::string& s, char sep)
+{
+    std::vector<std::string> parts;
+    std::string part;
+    std::istringstream in(s);
+    while (std::getline(in, part, sep)) if (!part.empty()) parts.push_back(part);
+    return parts;
+}
+
+static responder parse_responder(const std::string& name)
+{
+    if (name == "origin")    return responder::origin;
+    if (name == "proxy")     return responder::proxy;
+    if (name == "injector")  return responder::injector;
+    if (name == "front-end") return responder::_front_end;
+    throw std::runtime_error("unknown responder: " + name);
+}
+
+RoutingTable::RuleSpec RoutingTable::parse_rule(const std::string& line)
+{
+    RuleSpec rule;
+    rule.methods.set();
+
+    auto arrow = line.rfind("->");
+    if (arrow == std::string::npos) throw std::runtime_error("missing \"->\"");
+
+    std::istringstream conditions(line.substr(0, arrow));
+    std::string cond;
+
+    while (conditions >> cond) {
+        auto eq = cond.find('=');
+        if (eq == std::string::npos) throw std::runtime_error("bad condition: " + cond);
+
+        auto key   = cond.substr(0, eq);
+        auto value = cond.substr(eq + 1);
+
+        if (key == "host") {
+            for (auto& h : split(value, ',')) rule.hosts.push_back(lower(h));
+        }
+        else if (key == "method" || key == "!method") {
+            rule.methods.reset();
+            for (auto& m : split(value, ',')) {
+                auto verb = http::string_to_verb(m);
+                if (verb == http::verb::unknown) throw std::runtime_error("unknown method: " + m);
+                rule.methods.set(size_t(verb));
+            }
+            if (key[0] == '!') rule.methods.flip();
+        }
+        else if (key.compare(0, 7, "header:") == 0 && key.size() > 7) {
+            rule.headers.emplace_back(key.substr(7), value);
+        }
+        else if (key == "target") {
+            rule.target = value;
+        }
+        else {
+            throw std::runtime_error("unknown condition: " + key);
+        }
+    }
+
+    std::istringstream actions(line.substr(arrow + 2));
+    std::string action;
+
+    if (!(actions >> action) || (action != "cache" && action != "nocache"))
+        throw std::runtime_error("expected \"cache\" or \"nocache\" after \"->\"");
+
+    rule.config.enable_cache = (action == "cache");
+
+    while (actions >> action) rule.config.responders.push(parse_responder(action));
+
+    return rule;
+}
+
+RoutingTable::RoutingTable()
+    : _method_rules(verb_count)
+{
+}
+
+RoutingTable RoutingTable::parse(std::istream& in)
+{
+    std::vector<RuleSpec> rules;
+    std::string line;
+    size_t line_n = 0;
+
+    while (std::getline(in, line)) {
+        ++line_n;
+
+        auto start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos || line[start] == '#') continue;
+
+        try {
+            rules.push_back(parse_rule(line));
+        }
+        catch (const std::exception& e) {
+            throw std::runtime_error( "Routing rule at line " + std::to_string(line_n)
+                                    + ": " + e.what());
+        }
+    }
+
+    RoutingTable table;
+    table.build(rules);
+    return table;
+}
+
+RoutingTable RoutingTable::parse(const std::string& rules)
+{
+    std::istringstream in(rules);
+    return parse(in);
+}
+
+void RoutingTable::build(const std::vector<RuleSpec>& rules)
+{
+    auto n = rules.size();
+
+    for (auto& r : _method_rules) r.resize(n);
+    _any_host.resize(n);
+    _has_target.resize(n);
+
+    auto host_set = [n] (std::unordered_map<std::string, Rules>& map, const std::string& key) -> Rules& {
+        auto& rs = map[key];
+        rs.resize(n);
+        return rs;
+    };
+
+    std::string targets;
+    size_t next_group = 1;
+
+    for (size_t i = 0; i < n; ++i) {
+        auto& rule = rules[i];
+
+        _configs.push_back(rule.config);
+
+        for (size_t v = 0; v < verb_count; ++v) {
+            if (rule.methods[v]) _method_rules[v].set(i);
+        }
+
+        if (rule.hosts.empty()) _any_host.set(i);
+
+        for (auto& h : rule.hosts) {
+            if (h.compare(0, 2, "*.") == 0) host_set(_host_suffixes, h.substr(2)).set(i);
+            else                            host_set(_exact_hosts, h).set(i);
+        }
+
+        for (auto& h : rule.headers) _header_rules.push_back({i, h.first, h.second});
+
+        if (rule.target) {
+            boost::regex rx(*rule.target);
+            bool combined = !has_backreferences(*rule.target);
+            size_t group = 0;
+
+            if (combined) {
+                if (!targets.empty()) targets += '|';
+                targets += "(" + *rule.target + ")";
+                group = next_group;
+                next_group += 1 + rx.mark_count();
+            }
+
+            _target_rules.push_back({i, std::move(rx), combined, group});
+            _has_target.set(i);
+        }
+    }
+
+    if (!_target_rules.empty()) _targets = boost::regex(targets);
+}
+
+const Config&
+RoutingTable::route(const Request& req, const Config& default_config) const
+{
+    const auto npos = Rules::npos;
+
+    auto verb = size_t(req.method());
+    if (verb >= verb_count) verb = size_t(http::verb::unknown);
+
+    Rules candidates = _method_rules[verb];
+
+    if (!candidates.any()) return default_config;
+
+    auto host = lower(req[http::field::host]);
+    Rules hosts = _any_host;
+
+    auto exact = _exact_hosts.find(host);
+    if (exact != _exact_hosts.end()) hosts |= exact->second;
+
+    // Look up every parent domain for "*." rules.
+    for (auto dot = host.find('.'); dot != std::string::npos; dot = host.find('.', dot + 1)) {
+        auto suffix = _host_suffixes.find(host.substr(dot + 1));
+        if (suffix != _host_suffixes.end()) hosts |= suffix->second;
+    }
+
+    candidates &= hosts;
+
+    for (auto& h : _header_rules) {
+        if (candidates[h.rule] && req[h.name] != h.value) candidates.reset(h.rule);
+    }
+
+    // The first candidate which does not depend on the target.
+    auto first_plain = (candidates - _has_target).find_first();
+    auto first_target = (candidates & _has_target).find_first();
+
+    auto result = [&] (size_t rule) -> const Config& {
+        return rule == npos ? default_config : _configs[rule];
+    };
+
+    if (first_target == npos || first_target > first_plain) {
+        return result(first_plain);
+    }
+
+    auto target = req.target();
+
+    // The first rule in the combined regex which matches the target
+    // (the combined rules before it do not match).
+    size_t first_combined = _target_rules.size();
+    boost::cmatch m;
+
+    if ( !_targets.empty()
+      && boost::regex_match(target.begin(), target.end(), m, _targets)) {
+        first_combined = 0;
+        while (true) {
+            auto& t = _target_rules[first_combined];
+            if (t.combined && m[t.group].matched) break;
+            ++first_combined;
+        }
+    }
+
+    for (size_t k = 0; k < _target_rules.size(); ++k) {
+        auto& t = _target_rules[k];
+        if (t.rule > first_plain) break;
+        if (!candidates[t.rule]) continue;
+
+        if (t.combined) {
+            if (k < first_combined) continue;
+            if (k == first_combined) return _configs[t.rule];
+        }
+
+        // A rule left out of the combined regex,
+        // or one after the first combined match.
+        if (boost::regex_match(target.begin(), target.end(), t.regex)) {
+            return _configs[t.rule];
+        }
+    }
+
+    return result(first_plain);
+}
+
+}} // ouinet::request_route namespaces
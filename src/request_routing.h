@@ -8,7 +8,10 @@
 #include <boost/asio/error.hpp>
 #include <boost/beast/core/string.hpp>
 #include <boost/beast/http.hpp>
+#include <boost/dynamic_bitset.hpp>
 #include <boost/regex.hpp>
+#include <iosfwd>
+#include <unordered_map>
 
 #include "namespaces.h"
 
@@ -105,4 +108,92 @@ route_choose_config( const http::request<http::string_body>& req
 } // request_route namespace
 //------------------------------------------------------------------------------
 
+//------------------------------------------------------------------------------
+namespace request_route {
+// Routing rules compiled once into lookup structures, so that a request
+// is matched against all of them in a single pass.
+//
+// Rules are read one per line from a text file, the first matching rule
+// in file order applies:
+//
+//     # Comment.
+//     [CONDITION...] -> cache|nocache [RESPONDER...]
+//
+// Conditions (all of which must hold) are:
+//
+//   - `host=NAME[,NAME...]`: the whole "Host" header (including any port)
+//     is one of the names, where "*.example.com" matches
+//     any subdomain of example.com.
+//   - `method=VERB[,VERB...]` or `!method=...`: the request method is
+//     (not) one of those.
+//   - `header:NAME=VALUE`: the given header has exactly that value.
+//   - `target=REGEX`: the whole request target matches the regex.
+//
+// Responders are `origin`, `proxy`, `injector` and `front-end`.
+// A rule without conditions matches every request.
+class RoutingTable {
+public:
+    using Request = http::request<http::string_body>;
+
+    // The rules used when none are configured.
+    static const char* default_rules;
+
+    RoutingTable();
+
+    // Throws `std::runtime_error` on syntax errors.
+    static RoutingTable parse(std::istream&);
+    static RoutingTable parse(const std::string&);
+
+    // The configuration of the first rule matching the request,
+    // or `default_config` if none does.
+    const Config& route(const Request&, const Config& default_config) const;
+
+    size_t size() const { return _configs.size(); }
+
+private:
+    using Rules = boost::dynamic_bitset<>;
+
+    struct HeaderRule {
+        size_t rule;
+        std::string name;
+        std::string value;
+    };
+
+    struct TargetRule {
+        size_t rule;
+        boost::regex regex;
+        // Whether it is part of the combined regex, regexes with
+        // backreferences are not since their groups would be renumbered.
+        bool combined;
+        // Number of the group wrapping this rule in the combined regex.
+        size_t group;
+    };
+
+    struct RuleSpec;
+
+    static RuleSpec parse_rule(const std::string& line);
+    void build(const std::vector<RuleSpec>&);
+
+private:
+    std::vector<Config> _configs;
+
+    // Rules by the request methods they accept.
+    std::vector<Rules> _method_rules;
+
+    // Rules by exact host and by "*." suffix, and those for any host.
+    std::unordered_map<std::string, Rules> _exact_hosts;
+    std::unordered_map<std::string, Rules> _host_suffixes;
+    Rules _any_host;
+
+    std::vector<HeaderRule> _header_rules;
+
+    // Rules with a target condition, most of them also combined into
+    // a single regex of alternatives, the first one of which matches.
+    std::vector<TargetRule> _target_rules;
+    Rules _has_target;
+    boost::regex _targets;
+};
+} // request_route namespace
+//------------------------------------------------------------------------------
+
 } // ouinet namespace
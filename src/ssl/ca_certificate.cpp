@@ -7,6 +7,7 @@
 #include <openssl/conf.h>
 #include <openssl/x509v3.h>
 #include <openssl/rand.h>
+#include <openssl/ec.h>
 
 #include "ca_certificate.h"
 #include "util.h"
@@ -49,12 +50,37 @@ static string g_default_dh_param =
 static const int CERT_SERNUM_SCALE = 1000;
 
 
-CACertificate::CACertificate()
+static void generate_ec_key(EVP_PKEY* pk)
+{
+    EC_KEY* ec = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    if (!ec) {
+        throw runtime_error("Failed to allocate new EC key");
+    }
+
+    // Name the curve in certificates instead of listing its parameters,
+    // as TLS requires.
+    EC_KEY_set_asn1_flag(ec, OPENSSL_EC_NAMED_CURVE);
+
+    if (!EC_KEY_generate_key(ec)) {
+        EC_KEY_free(ec);
+        throw runtime_error("Failed to generate new EC key");
+    }
+
+    if (!EVP_PKEY_assign_EC_KEY(pk, ec)) {
+        EC_KEY_free(ec);
+        throw runtime_error("Failed in EVP_PKEY_assign_EC_KEY");
+    }
+}
+
+CACertificate::CACertificate(KeyType key_type)
     : _x(X509_new())
     , _pk(EVP_PKEY_new())
     , _next_serial_number(std::time(nullptr) * CERT_SERNUM_SCALE)
 {
-    {
+    if (key_type == KeyType::ec) {
+        generate_ec_key(_pk);
+    }
+    else {
         // Feed time to the random number generator.  According to
         // <https://www.openssl.org/docs/man1.1.0/crypto/RSA_generate_key.html>,
         // "The pseudo-random number generator must be seeded prior to calling
@@ -142,7 +168,7 @@ CACertificate::CACertificate()
         BIO_free_all(bio);
     }
 
-    _pem_dh_param = g_default_dh_param;
+    if (key_type == KeyType::rsa) _pem_dh_param = g_default_dh_param;
 }
 
 CACertificate::CACertificate(std::string pem_cert, std::string pem_key, std::string pem_dh)
@@ -167,7 +193,10 @@ CACertificate::CACertificate(std::string pem_cert, std::string pem_key, std::str
             throw runtime_error("Failed to parse CA PEM certificate");
         _x = cert;
     }
-    {
+    if (_pem_dh_param.empty()) {
+        if (key_type() == KeyType::rsa) _pem_dh_param = g_default_dh_param;
+    }
+    else {
         BIO* bio = BIO_new_mem_buf((void*) _pem_dh_param.data(), _pem_dh_param.size());
         DH* dh = PEM_read_bio_DHparams(bio, nullptr, nullptr, nullptr);
         BIO_free_all(bio);
@@ -190,6 +219,12 @@ EVP_PKEY* CACertificate::get_private_key() const
 }
 
 
+CACertificate::KeyType CACertificate::key_type() const
+{
+    return EVP_PKEY_base_id(_pk) == EVP_PKEY_EC ? KeyType::ec : KeyType::rsa;
+}
+
+
 CACertificate::~CACertificate() {
     if (_x) X509_free(_x);
     if (_pk) EVP_PKEY_free(_pk);
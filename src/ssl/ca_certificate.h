@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <string>
 #include <openssl/x509v3.h>
 
@@ -7,13 +8,22 @@ namespace ouinet {
 
 class CACertificate {
 public:
-    CACertificate();
+    // With an EC key (on the P-256 curve) certificates are signed with ECDSA,
+    // which is much cheaper than RSA, and TLS servers only use ECDHE
+    // key exchange, so there are no DH parameters.
+    enum class KeyType { rsa, ec };
+
+    CACertificate(KeyType = KeyType::rsa);
+    // `pem_dh` may be empty: RSA keys then get default DH parameters.
     CACertificate(std::string pem_cert, std::string pem_key, std::string pem_dh);
 
     const std::string& pem_private_key() const { return _pem_private_key; }
     const std::string& pem_certificate() const { return _pem_certificate; }
+    // Empty for EC keys.
     const std::string& pem_dh_param()    const { return _pem_dh_param;    }
 
+    KeyType key_type() const;
+
     ~CACertificate();
 
     // Which is version 3 according to
@@ -26,6 +36,7 @@ private:
     X509_NAME* get_subject_name() const;
     EVP_PKEY*  get_private_key() const;
 
+    // Certificates may be generated from several threads.
     unsigned long next_serial_number() {
         return _next_serial_number++;
     }
@@ -38,7 +49,7 @@ private:
     std::string _pem_certificate;
     std::string _pem_dh_param;
 
-    unsigned long _next_serial_number;
+    std::atomic<unsigned long> _next_serial_number;
 };
 
 } // namespace
@@ -0,0 +1,237 @@
+#include <boost/filesystem/fstream.hpp>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include <openssl/sha.h>
+
+#include "certificate_store.h"
+#include "ca_certificate.h"
+#include "dummy_certificate.h"
+#include "util.h"
+#include "../or_throw.h"
+#include "../util/condition_variable.h"
+
+using namespace std;
+using namespace ouinet;
+
+namespace fs = boost::filesystem;
+
+// Dummy certificates are valid for three years,
+// mint them again a while before that.
+static const time_t max_certificate_age = 2 * ssl::util::ONE_YEAR;
+
+struct CertificateStore::Minting {
+    Minting(asio::io_service& ios) : done_cv(ios) {}
+
+    ConditionVariable done_cv;
+    bool done = false;
+    string pem;
+    exception_ptr error;
+};
+
+// A line identifying the format and the CA which signed the certificates.
+static string file_header(const CACertificate& ca)
+{
+    auto& pem = ca.pem_certificate();
+
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char*) pem.data(), pem.size(), digest);
+
+    stringstream ss;
+    ss << "ouinet-certificates 1 ";
+    for (auto c : digest) ss << hex << setw(2) << setfill('0') << int(c);
+    return ss.str();
+}
+
+CertificateStore::CertificateStore( asio::io_service& ios
+                                  , CACertificate& ca
+                                  , fs::path file
+                                  , size_t threads)
+    : _ios(ios)
+    , _ca(ca)
+    , _file(move(file))
+    , _header(file_header(ca))
+    , _workers_work(new asio::io_service::work(_workers_ios))
+    , _was_destroyed(make_shared<bool>(false))
+{
+    load();
+
+    for (size_t i = 0; i < max<size_t>(threads, 1); ++i) {
+        _workers.emplace_back([this] { _workers_ios.run(); });
+    }
+}
+
+CertificateStore::~CertificateStore()
+{
+    *_was_destroyed = true;
+
+    // Let workers finish what they are signing
+    // (they use the CA certificate), drop the rest.
+    _workers_work.reset();
+    _workers_ios.stop();
+    for (auto& t : _workers) t.join();
+}
+
+void CertificateStore::load()
+{
+    fs::ifstream in(_file, ios::binary);
+    if (!in) return;
+
+    string line;
+    if (!getline(in, line) || line != _header) {
+        // A different CA or format, start anew.
+        in.close();
+        sys::error_code ec;
+        fs::remove(_file, ec);
+        return;
+    }
+
+    auto good_size = in.tellg();
+
+    while (getline(in, line)) {
+        stringstream ss(line);
+        string domain;
+        Entry e;
+        if (!(ss >> domain >> e.minted >> e.size)) break;
+
+        e.offset = in.tellg();
+        if (!in.seekg(e.size, ios::cur)) break;
+        if (uintmax_t(in.tellg()) > fs::file_size(_file)) break;
+
+        _entries[domain] = e;  // later entries replace earlier ones
+        good_size = in.tellg();
+    }
+
+    _stats.entries = _entries.size();
+
+    // Drop a partially written entry so that appending works.
+    in.close();
+    sys::error_code ec;
+    if (uintmax_t(good_size) != fs::file_size(_file, ec) && !ec) {
+        fs::resize_file(_file, good_size, ec);
+    }
+}
+
+boost::optional<string> CertificateStore::read(const string& base_domain)
+{
+    auto i = _entries.find(base_domain);
+    if (i == _entries.end()) return boost::none;
+
+    auto& e = i->second;
+    if (time(nullptr) - e.minted > max_certificate_age) return boost::none;
+
+    fs::ifstream in(_file, ios::binary);
+    string pem(e.size, '\0');
+    if (!in.seekg(e.offset) || !in.read(&pem[0], pem.size())) {
+        return boost::none;
+    }
+
+    ++_stats.read;
+    return pem;
+}
+
+string CertificateStore::get(const string& base_domain, asio::yield_context yield)
+{
+    if (auto pem = read(base_domain)) return move(*pem);
+
+    shared_ptr<Minting> minting;
+
+    auto m = _mintings.find(base_domain);
+
+    if (m != _mintings.end()) {
+        ++_stats.joined;
+        minting = m->second;
+    }
+    else {
+        minting = make_shared<Minting>(_ios);
+        start_minting(base_domain, minting);
+    }
+
+    sys::error_code ec;
+    while (!minting->done && !ec) minting->done_cv.wait(yield[ec]);
+
+    if (!minting->done) {
+        return or_throw<string>(yield, asio::error::operation_aborted);
+    }
+
+    if (minting->error) rethrow_exception(minting->error);
+
+    return minting->pem;
+}
+
+void CertificateStore::start_minting( const string& base_domain
+                                    , shared_ptr<Minting> minting)
+{
+    _mintings[base_domain] = minting;
+
+    // Keep the loop running while the certificate is minted.
+    asio::io_service::work work(_ios);
+
+    _workers_ios.post([ this, wd = _was_destroyed, base_domain, minting
+                      , work ] {
+        string pem;
+        exception_ptr error;
+
+        try {
+            pem = DummyCertificate(_ca, base_domain).pem_certificate();
+        }
+        catch (...) {
+            error = current_exception();
+        }
+
+        _ios.post([ this, wd, base_domain, minting
+                  , pem = move(pem), error ] {
+            minting->pem = pem;
+            minting->error = error;
+            minting->done = true;
+            minting->done_cv.notify();
+
+            if (*wd) return;
+
+            _mintings.erase(base_domain);
+
+            if (error) return;
+
+            ++_stats.minted;
+            append(base_domain, pem);
+        });
+    });
+}
+
+void CertificateStore::append(const string& base_domain, const string& pem)
+{
+    sys::error_code ec;
+    bool is_new = !fs::exists(_file, ec);
+    auto offset = is_new ? streamoff(0) : streamoff(fs::file_size(_file, ec));
+
+    fs::ofstream out(_file, ios::binary | ios::app);
+    if (is_new) {
+        out << _header << '\n';
+        offset += _header.size() + 1;
+    }
+
+    stringstream line;
+    line << base_domain << ' ' << time(nullptr) << ' ' << pem.size() << '\n';
+    out << line.str() << pem << flush;
+
+    if (!out) {
+        cerr << "Failed to store certificate for " << base_domain
+             << " in " << _file << endl;
+        return;
+    }
+
+    _entries[base_domain] = Entry{ time(nullptr)
+                                 , offset + streamoff(line.str().size())
+                                 , pem.size() };
+    _stats.entries = _entries.size();
+}
+
+std::ostream& ouinet::operator<<( std::ostream& os
+                                , const CertificateStore::Stats& s)
+{
+    return os << "minted:" << s.minted
+              << " joined:" << s.joined
+              << " read:" << s.read
+              << " entries:" << s.entries;
+}
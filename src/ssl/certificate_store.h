@@ -0,0 +1,96 @@
+#pragma once
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/optional.hpp>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../namespaces.h"
+
+namespace ouinet {
+
+class CACertificate;
+
+/*
+ * Certificates signed by our CA to impersonate origins, by base domain
+ * (see `DummyCertificate`).
+ *
+ * Signing takes long enough to stall every other connection,
+ * so certificates are minted by a pool of worker threads.
+ * Concurrent requests for the same domain wait for the same certificate.
+ *
+ * Minted certificates are appended to a file so that they survive restarts.
+ * The file starts with a header identifying the CA
+ * (so that certificates of a previous CA are not used),
+ * then each entry is a line with the domain, the time of minting
+ * and the size of the PEM certificate which follows.
+ * Only an index of entries is kept in memory, certificates are read
+ * when needed.  Certificates close to expiration are minted again.
+ */
+class CertificateStore {
+public:
+    struct Stats {
+        size_t minted = 0;
+        // Requests which waited for a certificate already being minted.
+        size_t joined = 0;
+        // Certificates read from the file.
+        size_t read = 0;
+        size_t entries = 0;
+    };
+
+public:
+    CertificateStore( asio::io_service&
+                    , CACertificate&
+                    , boost::filesystem::path file
+                    , size_t threads);
+
+    CertificateStore(const CertificateStore&) = delete;
+    CertificateStore& operator=(const CertificateStore&) = delete;
+
+    // Waits for certificates being minted.
+    ~CertificateStore();
+
+    // The PEM certificate for `base_domain`.
+    std::string get(const std::string& base_domain, asio::yield_context);
+
+    const Stats& stats() const { return _stats; }
+
+private:
+    struct Entry {
+        std::time_t minted;
+        std::streamoff offset;
+        size_t size;
+    };
+
+    struct Minting;
+
+    void load();
+    boost::optional<std::string> read(const std::string& base_domain);
+    void start_minting(const std::string&, std::shared_ptr<Minting>);
+    void append(const std::string& base_domain, const std::string& pem);
+
+private:
+    asio::io_service& _ios;
+    CACertificate& _ca;
+    boost::filesystem::path _file;
+    std::string _header;
+    std::unordered_map<std::string, Entry> _entries;
+    std::unordered_map<std::string, std::shared_ptr<Minting>> _mintings;
+    Stats _stats;
+
+    asio::io_service _workers_ios;
+    std::unique_ptr<asio::io_service::work> _workers_work;
+    std::vector<std::thread> _workers;
+
+    std::shared_ptr<bool> _was_destroyed;
+};
+
+std::ostream& operator<<(std::ostream&, const CertificateStore::Stats&);
+
+} // ouinet namespace
@@ -0,0 +1,152 @@
+#include <iostream>
+
+#include "client_context.h"
+
+using namespace std;
+using namespace ouinet;
+using namespace ouinet::ssl;
+
+// Where the context keeps a pointer to its `ClientContext`
+// (Asio already uses the "app data" of contexts).
+static int ex_data_index()
+{
+    static int index = SSL_CTX_get_ex_new_index
+        (0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+// OpenSSL marks the session of a connection not resumable
+// if it is freed without a TLS shutdown (as our connections are),
+// so connections get their own copy where possible.
+// `SSL_SESSION_dup` and `SSL_SESSION_is_resumable` are only available
+// since OpenSSL 1.1.1 (Android builds use 1.1.0), older versions
+// just share the session.
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+static SSL_SESSION* copy_session(SSL_SESSION* session)
+{
+    return SSL_SESSION_dup(session);
+}
+
+static bool is_resumable(const SSL_SESSION* session)
+{
+    return SSL_SESSION_is_resumable(session);
+}
+#else
+static SSL_SESSION* copy_session(SSL_SESSION* session)
+{
+    if (!SSL_SESSION_up_ref(session)) return nullptr;
+    return session;
+}
+
+static bool is_resumable(const SSL_SESSION*)
+{
+    return true;
+}
+#endif
+
+ClientContext& ClientContext::shared()
+{
+    static ClientContext context;
+    return context;
+}
+
+ClientContext::ClientContext(size_t max_sessions)
+    : _context(asio::ssl::context::tls_client)
+    , _max_sessions(max_sessions)
+{
+    _context.set_default_verify_paths();
+    _context.set_verify_mode(asio::ssl::verify_peer);
+
+    auto ctx = _context.native_handle();
+    SSL_CTX_set_ex_data(ctx, ex_data_index(), this);
+    // Sessions are kept here (by host) instead of in OpenSSL's cache
+    // (which is only looked up by servers anyway).
+    SSL_CTX_set_session_cache_mode( ctx, SSL_SESS_CACHE_CLIENT
+                                       | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    // With TLS 1.3 sessions arrive after the handshake,
+    // so they are taken when OpenSSL gets them.
+    SSL_CTX_sess_set_new_cb(ctx, on_new_session);
+}
+
+bool ClientContext::prepare(SSL* ssl, const string& host)
+{
+    // Set Server Name Indication (SNI).
+    // As seen in ``http_client_async_ssl.cpp`` Boost Beast example.
+    if (!SSL_set_tlsext_host_name(ssl, host.c_str())) return false;
+
+    auto i = _sessions.find(host);
+    if (i == _sessions.end()) return true;
+
+    auto session = i->second.session.get();
+
+    if (!is_resumable(session)) {
+        erase(i);
+        return true;
+    }
+
+    Session offer(copy_session(session));
+    if (!offer || !SSL_set_session(ssl, offer.get())) return false;
+    ++_stats.offered;
+
+#ifdef TLS1_3_VERSION
+    if (SSL_SESSION_get_protocol_version(session) >= TLS1_3_VERSION) {
+        erase(i);
+        return true;
+    }
+#endif
+
+    _lru.splice(_lru.end(), _lru, i->second.lru);
+    return true;
+}
+
+void ClientContext::on_handshake(SSL* ssl)
+{
+    if (SSL_session_reused(ssl)) ++_stats.resumed_handshakes;
+    else                         ++_stats.full_handshakes;
+}
+
+int ClientContext::on_new_session(SSL* ssl, SSL_SESSION* session)
+{
+    auto self = static_cast<ClientContext*>
+        (SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ex_data_index()));
+
+    const char* host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (!self || !host) return 0;
+
+    Session copy(copy_session(session));
+    if (copy) self->insert(host, move(copy));
+
+    return 0;  // the connection keeps its own reference
+}
+
+void ClientContext::insert(const string& host, Session session)
+{
+    if (_max_sessions == 0) return;
+
+    auto i = _sessions.find(host);
+    if (i != _sessions.end()) erase(i);
+
+    while (_sessions.size() >= _max_sessions) {
+        erase(_sessions.find(_lru.front()));
+    }
+
+    _lru.push_back(host);
+    _sessions[host] = Entry{move(session), prev(_lru.end())};
+    _stats.sessions = _sessions.size();
+}
+
+void ClientContext::erase(unordered_map<string, Entry>::iterator i)
+{
+    _lru.erase(i->second.lru);
+    _sessions.erase(i);
+    _stats.sessions = _sessions.size();
+}
+
+std::ostream& ouinet::ssl::operator<<( std::ostream& os
+                                     , const ClientContext::Stats& s)
+{
+    return os << "full_handshakes:" << s.full_handshakes
+              << " resumed_handshakes:" << s.resumed_handshakes
+              << " offered:" << s.offered
+              << " sessions:" << s.sessions;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <boost/asio/ssl/context.hpp>
+#include <iosfwd>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <openssl/ssl.h>
+
+#include "../namespaces.h"
+
+namespace ouinet { namespace ssl {
+
+/*
+ * The TLS context for connections to origins, shared by all of them
+ * so that the system trust store is loaded only once.
+ *
+ * It also keeps the last TLS session given by each host
+ * (a session ID or ticket with TLS 1.2, a ticket with TLS 1.3),
+ * so that further connections to it may resume the session
+ * with an abbreviated handshake.  TLS 1.3 sessions are used only once,
+ * as recommended; servers send new ones on each connection.
+ * The least recently used sessions are dropped when there are too many.
+ */
+class ClientContext {
+public:
+    struct Stats {
+        size_t full_handshakes = 0;
+        size_t resumed_handshakes = 0;
+        // Handshakes which offered a saved session
+        // (the server may still choose to do a full one).
+        size_t offered = 0;
+        size_t sessions = 0;
+    };
+
+public:
+    // The context used by `ssl::util::client_handshake`.
+    static ClientContext& shared();
+
+    ClientContext(size_t max_sessions = 256);
+
+    ClientContext(const ClientContext&) = delete;
+    ClientContext& operator=(const ClientContext&) = delete;
+
+    asio::ssl::context& context() { return _context; }
+
+    // Set the SNI of a new connection to `host`
+    // and offer a saved session with it if there is one.
+    // Returns false on error.
+    bool prepare(SSL*, const std::string& host);
+
+    // Account for a completed handshake.
+    void on_handshake(SSL*);
+
+    const Stats& stats() const { return _stats; }
+
+private:
+    struct SessionDeleter {
+        void operator()(SSL_SESSION* s) const { SSL_SESSION_free(s); }
+    };
+
+    using Session = std::unique_ptr<SSL_SESSION, SessionDeleter>;
+
+    struct Entry {
+        Session session;
+        std::list<std::string>::iterator lru;
+    };
+
+    static int on_new_session(SSL*, SSL_SESSION*);
+
+    void insert(const std::string& host, Session);
+    void erase(std::unordered_map<std::string, Entry>::iterator);
+
+private:
+    asio::ssl::context _context;
+    size_t _max_sessions;
+    std::unordered_map<std::string, Entry> _sessions;
+    // Least recently used first.
+    std::list<std::string> _lru;
+    Stats _stats;
+};
+
+std::ostream& operator<<(std::ostream&, const ClientContext::Stats&);
+
+}} // namespaces
@@ -0,0 +1,153 @@
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/read.hpp>
+
+#include "client_hello.h"
+#include "../or_throw.h"
+
+using namespace std;
+using namespace ouinet;
+
+// See RFC 5246 (sections 6.2.1 and 7.4.1.2) and RFC 6066 (section 3).
+static const size_t record_header_size = 5;
+static const uint8_t record_type_handshake = 22;
+static const uint8_t handshake_type_client_hello = 1;
+static const uint16_t extension_server_name = 0;
+static const uint8_t name_type_host_name = 0;
+// Records may be a bit bigger than their plain text limit.
+static const size_t max_record_size = (1 << 14) + 2048;
+
+namespace {
+
+// Reads big-endian numbers and byte strings from a buffer,
+// failing (for good) as soon as something goes past its end.
+class Reader {
+public:
+    Reader(beast::string_view data) : _data(data) {}
+
+    bool ok() const { return _ok; }
+
+    unsigned number(size_t bytes)
+    {
+        if (!_ok || _data.size() < bytes) return fail();
+
+        unsigned n = 0;
+        for (size_t i = 0; i < bytes; ++i) {
+            n = (n << 8) | uint8_t(_data[i]);
+        }
+
+        _data.remove_prefix(bytes);
+        return n;
+    }
+
+    beast::string_view bytes(size_t size)
+    {
+        if (!_ok || _data.size() < size) {
+            fail();
+            return {};
+        }
+
+        auto b = _data.substr(0, size);
+        _data.remove_prefix(size);
+        return b;
+    }
+
+    // Bytes preceded by their length in `length_bytes` bytes.
+    beast::string_view vector(size_t length_bytes)
+    {
+        return bytes(number(length_bytes));
+    }
+
+private:
+    unsigned fail() { _ok = false; return 0; }
+
+private:
+    beast::string_view _data;
+    bool _ok = true;
+};
+
+} // namespace
+
+static size_t record_size(beast::string_view data)
+{
+    Reader r(data);
+    r.number(3);  // content type and version
+    return record_header_size + r.number(2);
+}
+
+boost::optional<string>
+ssl::client_hello_server_name(beast::string_view data)
+{
+    if (data.size() < record_header_size) return boost::none;
+
+    auto size = record_size(data);
+    if (data.size() < size) return boost::none;
+
+    Reader record(data.substr(0, size));
+
+    if (record.number(1) != record_type_handshake) return string();
+    record.number(2);  // version
+    Reader handshake(record.vector(2));
+
+    if (handshake.number(1) != handshake_type_client_hello) return string();
+    // If the message goes on in another record, this fails below.
+    Reader hello(handshake.vector(3));
+
+    hello.number(2);   // client version
+    hello.bytes(32);   // random
+    hello.vector(1);   // session id
+    hello.vector(2);   // cipher suites
+    hello.vector(1);   // compression methods
+
+    Reader extensions(hello.vector(2));
+
+    while (extensions.ok()) {
+        auto type = extensions.number(2);
+        auto body = extensions.vector(2);
+
+        if (!extensions.ok()) break;
+        if (type != extension_server_name) continue;
+
+        Reader names(Reader(body).vector(2));
+
+        while (names.ok()) {
+            auto name_type = names.number(1);
+            auto name = names.vector(2);
+
+            if (names.ok() && name_type == name_type_host_name) {
+                return name.to_string();
+            }
+        }
+
+        break;
+    }
+
+    return string();
+}
+
+string ssl::read_client_hello( GenericConnection& con
+                             , string& server_name
+                             , asio::yield_context yield)
+{
+    sys::error_code ec;
+    string data(record_header_size, '\0');
+
+    asio::async_read(con, asio::buffer(&data[0], data.size()), yield[ec]);
+    if (ec) return or_throw<string>(yield, ec);
+
+    auto size = record_size(data);
+
+    if (size <= max_record_size) {
+        data.resize(size);
+        asio::async_read( con
+                        , asio::buffer( &data[record_header_size]
+                                      , size - record_header_size)
+                        , yield[ec]);
+        if (ec) return or_throw<string>(yield, ec);
+    }
+
+    // Whatever it is, it is for the TLS server to deal with.
+    auto name = client_hello_server_name(data);
+    server_name = name ? *name : string();
+
+    return data;
+}
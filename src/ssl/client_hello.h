@@ -0,0 +1,33 @@
+#pragma once
+
+#include <boost/asio/spawn.hpp>
+#include <boost/beast/core/string.hpp>
+#include <boost/optional.hpp>
+#include <string>
+
+#include "../generic_connection.h"
+#include "../namespaces.h"
+
+namespace ouinet { namespace ssl {
+
+// The host name in the Server Name Indication extension
+// of the TLS ClientHello at the beginning of `data`.
+//
+// Returns none if `data` does not hold the whole first TLS record yet,
+// and an empty string if there is no such name (or `data` is not
+// a ClientHello, or it does not fit in its first record).
+boost::optional<std::string>
+client_hello_server_name(beast::string_view data);
+
+// Read the first TLS record sent by a client over `con`
+// (which should carry its ClientHello) and return its bytes,
+// so that they can be given back to the TLS server
+// (e.g. with a `PrefixedConnection`).
+//
+// The name in its Server Name Indication extension (if any)
+// is put in `server_name`.
+std::string read_client_hello( GenericConnection& con
+                             , std::string& server_name
+                             , asio::yield_context);
+
+}} // namespaces
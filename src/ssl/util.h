@@ -9,6 +9,7 @@
 
 #include "../generic_connection.h"
 #include "../or_throw.h"
+#include "client_context.h"
 
 
 namespace ouinet { namespace ssl { namespace util {
@@ -46,6 +47,8 @@ static inline std::string read_bio(BIO* bio) {
 // and return an SSL-tunneled connection using it as a lower layer.
 //
 // The verification is done for the given `host` name, using SNI.
+// The shared client context is used, so the session may be resumed
+// if there was a previous connection to `host`.
 static inline
 ouinet::GenericConnection
 client_handshake( ouinet::GenericConnection&& con
@@ -56,23 +59,21 @@ client_handshake( ouinet::GenericConnection&& con
     using namespace ouinet;
     namespace ssl = boost::asio::ssl;
 
-    // SSL contexts do not seem to be reusable.
-    ssl::context ssl_context{ssl::context::tls_client};
-    ssl_context.set_default_verify_paths();
-    ssl_context.set_verify_mode(ssl::verify_peer);
-    ssl_context.set_verify_callback(ssl::rfc2818_verification(host));
+    auto& client_context = ouinet::ssl::ClientContext::shared();
 
     boost::system::error_code ec;
 
-    auto ssl_sock = make_unique<ssl::stream<GenericConnection>>(move(con), ssl_context);
-    // Set Server Name Indication (SNI).
-    // As seen in ``http_client_async_ssl.cpp`` Boost Beast example.
-    if (!::SSL_set_tlsext_host_name(ssl_sock->native_handle(), host.c_str()))
+    auto ssl_sock = make_unique<ssl::stream<GenericConnection>>
+        (move(con), client_context.context());
+    ssl_sock->set_verify_callback(ssl::rfc2818_verification(host), ec);
+    if (!ec && !client_context.prepare(ssl_sock->native_handle(), host))
         ec = {static_cast<int>(::ERR_get_error()), boost::asio::error::get_ssl_category()};
     if (!ec)
         ssl_sock->async_handshake(ssl::stream_base::client, yield[ec]);
     if (ec) return or_throw<GenericConnection>(yield, ec);
 
+    client_context.on_handshake(ssl_sock->native_handle());
+
     static const auto ssl_shutter = [](ssl::stream<GenericConnection>& s) {
         // Just close the underlying connection
         // (TLS has no message exchange for shutdown).
@@ -0,0 +1,344 @@
+#include <boost/algorithm/string.hpp>
+#include <boost/asio/buffers_iterator.hpp>
+#include <boost/regex.hpp>
+#include <iostream>
+
+#include "subresource_prefetcher.h"
+#include "async_sleep.h"
+#include "util.h"
+
+using namespace std;
+using namespace ouinet;
+
+using Request  = SubresourcePrefetcher::Request;
+using Response = SubresourcePrefetcher::Response;
+
+//------------------------------------------------------------------------------
+static string origin_of(const util::url_match& url)
+{
+    return url.scheme + "://" + url.host
+         + (url.port.empty() ? "" : ":" + url.port);
+}
+
+// Remove "." and ".." segments from an absolute path.
+static string normalize_path(const string& path)
+{
+    vector<string> segments;
+
+    for (size_t b = 1;;) {
+        auto e = path.find('/', b);
+        bool last = (e == string::npos);
+        auto segment = path.substr(b, last ? string::npos : e - b);
+
+        if (segment == ".") {
+            if (last) segments.push_back("");
+        }
+        else if (segment == "..") {
+            if (!segments.empty()) segments.pop_back();
+            if (last) segments.push_back("");
+        }
+        else {
+            segments.push_back(move(segment));
+        }
+
+        if (last) break;
+        b = e + 1;
+    }
+
+    string ret;
+    for (auto& s : segments) ret += "/" + s;
+    return ret.empty() ? "/" : ret;
+}
+
+// Make the reference found in the page at `base` an absolute HTTP(S) URL
+// without fragment, return the empty string if that is not possible.
+static string resolve_url(const util::url_match& base, string ref)
+{
+    boost::trim(ref);
+    boost::replace_all(ref, "&amp;", "&");
+
+    auto hash = ref.find('#');
+    if (hash != string::npos) ref.resize(hash);
+
+    if (ref.empty()) return "";
+
+    string url;
+
+    if (boost::starts_with(ref, "//")) {
+        url = base.scheme + ":" + ref;
+    }
+    else if ( boost::istarts_with(ref, "http://")
+           || boost::istarts_with(ref, "https://")) {
+        url = ref;
+    }
+    else if (ref.find(':') < ref.find_first_of("/?")) {
+        return "";  // other schemes like "data:" or "javascript:"
+    }
+    else if (ref[0] == '/') {
+        url = origin_of(base) + ref;
+    }
+    else if (ref[0] == '?') {
+        url = origin_of(base) + base.path + ref;
+    }
+    else {
+        url = origin_of(base) + base.path.substr(0, base.path.rfind('/') + 1)
+            + ref;
+    }
+
+    util::url_match m;
+    if (!util::match_http_url(url, m)) return "";
+
+    return origin_of(m) + normalize_path(m.path)
+         + (m.query.empty() ? "" : "?" + m.query);
+}
+
+std::vector<std::string>
+ouinet::extract_subresources( const std::string& page_url
+                            , beast::string_view html
+                            , size_t max)
+{
+    static const boost::regex tag_rx
+        ( "<(img|script|link|source|video|audio|embed)\\b([^>]*)>"
+        , boost::regex::icase);
+
+    static const boost::regex attr_rx
+        ( "(?:^|\\s)(src|href|poster|rel)\\s*=\\s*"
+          "(?:\"([^\"]*)\"|'([^']*)'|([^\\s\"'>]+))"
+        , boost::regex::icase);
+
+    vector<string> ret;
+
+    util::url_match base;
+    if (!util::match_http_url(page_url, base)) return ret;
+
+    set<string> seen;
+
+    auto add = [&] (string ref) {
+        auto url = resolve_url(base, move(ref));
+        if (url.empty() || url == page_url) return;
+        if (!seen.insert(url).second) return;
+        ret.push_back(move(url));
+    };
+
+    using It = beast::string_view::const_iterator;
+
+    boost::regex_iterator<It> tag_i(html.begin(), html.end(), tag_rx), end;
+
+    for (; tag_i != end && ret.size() < max; ++tag_i) {
+        auto tag = boost::to_lower_copy((*tag_i)[1].str());
+        const auto& attrs = (*tag_i)[2];
+
+        map<string, string> values;
+
+        boost::regex_iterator<It> attr_i(attrs.first, attrs.second, attr_rx);
+
+        for (; attr_i != end; ++attr_i) {
+            const auto& m = *attr_i;
+            auto name = boost::to_lower_copy(m[1].str());
+            values[name] = m[2].matched ? m[2].str()
+                         : m[3].matched ? m[3].str()
+                         : m[4].str();
+        }
+
+        if (tag == "link") {
+            // Only links which are needed to render the page.
+            const auto& rel = values["rel"];
+            if ( !boost::icontains(rel, "stylesheet")
+              && !boost::icontains(rel, "icon")
+              && !boost::icontains(rel, "preload")) continue;
+
+            add(values["href"]);
+            continue;
+        }
+
+        if (values.count("src"))    add(values["src"]);
+        if (values.count("poster")) add(values["poster"]);
+    }
+
+    if (ret.size() > max) ret.resize(max);
+
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+SubresourcePrefetcher::SubresourcePrefetcher(asio::io_service& ios, Config config)
+    : _ios(ios)
+    , _config(move(config))
+    , _was_destroyed(make_shared<bool>(false))
+{}
+
+bool SubresourcePrefetcher::was_seen(const string& url)
+{
+    if (!_seen.insert(url).second) return true;
+
+    _seen_order.push_back(url);
+
+    // Remember a few times as many URLs as may be waiting.
+    while (_seen_order.size() > 4 * max<size_t>(_config.max_queued, 1)) {
+        _seen.erase(_seen_order.front());
+        _seen_order.pop_front();
+    }
+
+    return false;
+}
+
+bool SubresourcePrefetcher::wants_page(const http::response_header<>& rs) const
+{
+    if (_stopped || !fetch || !store) return false;
+
+    if (rs.result() != http::status::ok) return false;
+
+    auto content_type = rs[http::field::content_type];
+    if (!boost::istarts_with(content_type, "text/html")) return false;
+
+    // Encoded (e.g. compressed) documents cannot be scanned.
+    auto content_encoding = rs[http::field::content_encoding];
+    if (!content_encoding.empty() && !boost::iequals(content_encoding, "identity"))
+        return false;
+
+    return true;
+}
+
+void SubresourcePrefetcher::on_page(const Request& rq, const Response& rs)
+{
+    if (!wants_page(rs)) return;
+
+    auto page_url = rq.target().to_string();
+    auto body = rs.body().data();
+    string html(asio::buffers_begin(body), asio::buffers_end(body));
+
+    for (auto& url : extract_subresources(page_url, html, _config.max_per_page)) {
+        if (was_seen(url)) continue;
+
+        if (_queue.size() >= _config.max_queued) {
+            ++_stats.dropped;
+            continue;
+        }
+
+        util::url_match m;
+        if (!util::match_http_url(url, m)) continue;
+
+        Job job{url, m.host, Request{http::verb::get, url, 11}};
+
+        job.request.set( http::field::host
+                       , m.host + (m.port.empty() ? "" : ":" + m.port));
+        job.request.set(http::field::referer, page_url);
+
+        auto user_agent = rq[http::field::user_agent];
+        if (!user_agent.empty())
+            job.request.set(http::field::user_agent, user_agent);
+
+        _queue.push_back(move(job));
+    }
+
+    start_jobs();
+}
+
+void SubresourcePrefetcher::start_jobs()
+{
+    for (auto i = _queue.begin(); i != _queue.end();) {
+        if (_stats.running >= _config.max_concurrency) break;
+
+        auto& host = _hosts[i->host];
+
+        if (host.running >= _config.max_per_host) {
+            ++i;
+            continue;
+        }
+
+        ++host.running;
+        ++_stats.running;
+
+        auto job = move(*i);
+        i = _queue.erase(i);
+
+        asio::spawn(_ios, [this, job = move(job)]
+                          (asio::yield_context yield) mutable {
+            run_job(move(job), yield);
+        });
+    }
+
+    _stats.queued = _queue.size();
+
+    if (!_queue.empty()) return;
+
+    // Forget idle hosts whose delay is over.
+    auto now = Clock::now();
+
+    for (auto i = _hosts.begin(); i != _hosts.end();) {
+        if (i->second.running == 0 && i->second.next_start <= now) {
+            i = _hosts.erase(i);
+        }
+        else {
+            ++i;
+        }
+    }
+}
+
+void SubresourcePrefetcher::run_job(Job job, asio::yield_context yield)
+{
+    auto wd = _was_destroyed;
+
+    // Space out the fetches from the same host.
+    auto now = Clock::now();
+    auto& next_start = _hosts[job.host].next_start;
+    auto start = max(now, next_start);
+    next_start = start + _config.host_delay;
+
+    bool ok = true;
+
+    if (start > now) {
+        ok = async_sleep(_ios, start - now, _abort, yield);
+        if (*wd) return;
+    }
+
+    if (ok && !_stopped) {
+        sys::error_code ec;
+        auto rs = fetch(job.request, yield[ec]);
+        if (*wd) return;
+
+        if (!ec) {
+            ++_stats.fetched;
+            store(job.request, rs);
+        }
+        else {
+            ++_stats.failed;
+        }
+    }
+
+    auto host_i = _hosts.find(job.host);
+    assert(host_i != _hosts.end());
+
+    if ( --host_i->second.running == 0
+      && host_i->second.next_start <= Clock::now()) {
+        _hosts.erase(host_i);
+    }
+
+    --_stats.running;
+
+    if (!_stopped) start_jobs();
+}
+
+void SubresourcePrefetcher::stop()
+{
+    _stopped = true;
+    _queue.clear();
+    _stats.queued = 0;
+    _abort();
+}
+
+SubresourcePrefetcher::~SubresourcePrefetcher()
+{
+    *_was_destroyed = true;
+    _abort();
+}
+
+std::ostream&
+ouinet::operator<<(std::ostream& os, const SubresourcePrefetcher::Stats& s)
+{
+    return os << "queued:"   << s.queued
+              << " running:" << s.running
+              << " fetched:" << s.fetched
+              << " failed:"  << s.failed
+              << " dropped:" << s.dropped;
+}
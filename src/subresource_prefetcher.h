@@ -0,0 +1,121 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <iosfwd>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/beast/http.hpp>
+
+#include "namespaces.h"
+#include "util/signal.h"
+
+namespace ouinet {
+
+// Extract the URLs of subresources (images, scripts, stylesheets...)
+// referenced by the given HTML document, made absolute using the URL
+// of the document.  Duplicates and non-HTTP(S) URLs are skipped,
+// and at most `max` URLs are returned.
+std::vector<std::string>
+extract_subresources( const std::string& page_url
+                    , beast::string_view html
+                    , size_t max);
+
+// Fetches the subresources of HTML pages in the background
+// so that they get cached along with the page.
+class SubresourcePrefetcher {
+public:
+    using Request  = http::request<http::string_body>;
+    using Response = http::response<http::dynamic_body>;
+    using Clock    = std::chrono::steady_clock;
+
+    using Fetch = std::function<Response(const Request&, asio::yield_context)>;
+    using Store = std::function<void(const Request&, const Response&)>;
+
+    struct Config {
+        // Subresources taken from a single page.
+        size_t max_per_page = 64;
+        // Subresources waiting to be fetched from all pages (global budget),
+        // further ones are dropped.
+        size_t max_queued = 1024;
+        // Simultaneous fetches, overall and for a single host.
+        unsigned max_concurrency = 8;
+        unsigned max_per_host = 2;
+        // Minimum time between starting fetches from the same host.
+        Clock::duration host_delay = std::chrono::milliseconds(250);
+    };
+
+    struct Stats {
+        size_t queued = 0;
+        size_t running = 0;
+        size_t fetched = 0;
+        size_t failed = 0;
+        size_t dropped = 0;
+    };
+
+public:
+    SubresourcePrefetcher(asio::io_service&, Config);
+
+    SubresourcePrefetcher(const SubresourcePrefetcher&) = delete;
+    SubresourcePrefetcher& operator=(const SubresourcePrefetcher&) = delete;
+
+    // Both must be set for the prefetcher to do anything.
+    Fetch fetch;
+    Store store;
+
+    // Schedule the fetching of the subresources of the given response
+    // if it is an HTML document.
+    void on_page(const Request&, const Response&);
+
+    // Whether `on_page` would look into the body of a response
+    // with the given head.
+    bool wants_page(const http::response_header<>&) const;
+
+    // Cancel running fetches and forget queued ones.
+    void stop();
+
+    const Stats& stats() const { return _stats; }
+
+    ~SubresourcePrefetcher();
+
+private:
+    struct Job {
+        std::string url;
+        std::string host;
+        Request request;
+    };
+
+    struct Host {
+        unsigned running = 0;
+        Clock::time_point next_start;
+    };
+
+    void start_jobs();
+    void run_job(Job, asio::yield_context);
+    bool was_seen(const std::string& url);
+
+private:
+    asio::io_service& _ios;
+    Config _config;
+    Signal<void()> _abort;
+    std::list<Job> _queue;
+    std::map<std::string, Host> _hosts;
+    // Recently scheduled URLs, oldest first.
+    std::list<std::string> _seen_order;
+    std::set<std::string> _seen;
+    Stats _stats;
+    bool _stopped = false;
+    std::shared_ptr<bool> _was_destroyed;
+};
+
+std::ostream& operator<<(std::ostream&, const SubresourcePrefetcher::Stats&);
+
+} // namespace
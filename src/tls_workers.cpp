@@ -0,0 +1,193 @@
+#include <boost/asio/local/connect_pair.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/ssl/stream.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "tls_workers.h"
+#include "prefixed_connection.h"
+#include "util/wait_condition.h"
+
+using namespace std;
+using namespace ouinet;
+
+using tcp = asio::ip::tcp;
+using local = asio::local::stream_protocol;
+
+TlsWorkers::TlsWorkers(size_t threads)
+{
+    for (size_t i = 0; i < threads; ++i) {
+        auto w = make_unique<Worker>();
+        w->work = make_unique<asio::io_service::work>(w->ios);
+        w->thread = thread([w = w.get()] { w->ios.run(); });
+        _workers.push_back(move(w));
+    }
+}
+
+TlsWorkers::~TlsWorkers()
+{
+    for (auto& w : _workers) {
+        w->work.reset();
+        w->ios.stop();
+    }
+
+    for (auto& w : _workers) w->thread.join();
+}
+
+void TlsWorkers::stop()
+{
+    for (auto& w : _workers) {
+        w->ios.post([w = w.get()] { w->work.reset(); });
+    }
+}
+
+// Copy data between `c1` and `c2` until either of them is closed,
+// then close the other one.
+static void relay( GenericConnection& c1
+                 , GenericConnection& c2
+                 , asio::yield_context yield)
+{
+    static const auto half_duplex
+        = []( GenericConnection& in
+            , GenericConnection& out
+            , asio::yield_context yield)
+    {
+        sys::error_code ec;
+        // Fits a whole TLS record.
+        std::vector<uint8_t> data(16 * 1024);
+
+        for (;;) {
+            // Not `async_read_some`, see `full_duplex`.
+            size_t length = asio::async_read
+                ( in
+                , asio::buffer(data)
+                , [](const sys::error_code& ec, size_t size) -> size_t {
+                    if (ec) return 0;
+                    return size ? 0 : ~size_t(0);
+                  }
+                , yield[ec]);
+
+            if (ec) break;
+
+            asio::async_write(out, asio::buffer(data, length), yield[ec]);
+            if (ec) break;
+        }
+
+        in.close();
+        out.close();
+    };
+
+    WaitCondition wait_condition(c1.get_io_service());
+
+    asio::spawn
+        ( yield
+        , [&, lock = wait_condition.lock()](asio::yield_context yield) {
+              half_duplex(c1, c2, yield);
+          });
+
+    asio::spawn
+        ( yield
+        , [&, lock = wait_condition.lock()](asio::yield_context yield) {
+              half_duplex(c2, c1, yield);
+          });
+
+    wait_condition.wait(yield);
+}
+
+GenericConnection
+TlsWorkers::serve( asio::io_service& ios
+                 , tcp::socket::native_handle_type socket
+                 , string prefix
+                 , shared_ptr<asio::ssl::context> context
+                 , sys::error_code& ec)
+{
+    ec = sys::error_code();
+
+    if (_workers.empty()) {
+        ec = asio::error::operation_not_supported;
+        return GenericConnection();
+    }
+
+    auto& worker = *_workers[_next++ % _workers.size()];
+
+    int fd = ::dup(socket);
+
+    if (fd == -1) {
+        ec = sys::error_code(errno, sys::system_category());
+        return GenericConnection();
+    }
+
+    sockaddr_storage address;
+    socklen_t address_length = sizeof(address);
+    if (::getsockname(fd, (sockaddr*) &address, &address_length) == -1) {
+        ec = sys::error_code(errno, sys::system_category());
+        ::close(fd);
+        return GenericConnection();
+    }
+
+    auto protocol = address.ss_family == AF_INET6 ? tcp::v6() : tcp::v4();
+
+    // Sockets may be set up from any thread,
+    // but they must only be used by the thread running their I/O service.
+    tcp::socket tls_socket(worker.ios);
+    tls_socket.assign(protocol, fd, ec);
+
+    if (ec) {
+        ::close(fd);
+        return GenericConnection();
+    }
+
+    local::socket plain(ios);
+    local::socket worker_plain(worker.ios);
+    asio::local::connect_pair(plain, worker_plain, ec);
+
+    if (ec) return GenericConnection();
+
+    // This only schedules the coroutine, it runs in the worker.
+    asio::spawn(worker.ios, [ tls_socket = move(tls_socket)
+                            , worker_plain = move(worker_plain)
+                            , prefix = move(prefix)
+                            , context = move(context)
+                            ] (asio::yield_context yield) mutable {
+        namespace ssl = boost::asio::ssl;
+
+        GenericConnection plain_con(move(worker_plain));
+
+        GenericConnection tcp_con(move(tls_socket));
+        GenericConnection hello_con(PrefixedConnection( move(tcp_con)
+                                                      , move(prefix)));
+
+        auto ssl_sock = make_unique<ssl::stream<GenericConnection>>
+            (move(hello_con), *context);
+
+        sys::error_code ec;
+        ssl_sock->async_handshake(ssl::stream_base::server, yield[ec]);
+
+        if (ec) {
+            ssl_sock->next_layer().close();
+            plain_con.close();
+            return;
+        }
+
+        static const auto ssl_shutter = [](ssl::stream<GenericConnection>& s) {
+            // Just close the underlying connection
+            // (TLS has no message exchange for shutdown).
+            s.next_layer().close();
+        };
+
+        GenericConnection tls_con(move(ssl_sock), ssl_shutter);
+
+        relay(tls_con, plain_con, yield);
+    });
+
+    static const auto local_shutter = [](local::socket& s) {
+        sys::error_code ec; // Don't throw
+        s.shutdown(local::socket::shutdown_both, ec);
+        s.close(ec);
+    };
+
+    return GenericConnection(move(plain), local_shutter);
+}
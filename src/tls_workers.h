@@ -0,0 +1,66 @@
+#pragma once
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ssl/context.hpp>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "generic_connection.h"
+#include "namespaces.h"
+
+namespace ouinet {
+
+/*
+ * Threads, each running its own I/O service, which take over the TLS
+ * sessions used to impersonate origins to user agents: handshakes and
+ * record encryption are the most CPU-intensive work of the client.
+ *
+ * Everything else keeps running in the I/O service of the client,
+ * so its state needs no locking.  A connection is given to a worker
+ * (in turn) as a raw socket, and the client gets back the plain text
+ * side of the TLS session as a local socket connected to the worker.
+ * Closing either side ends the session.
+ */
+class TlsWorkers {
+public:
+    TlsWorkers(size_t threads);
+
+    TlsWorkers(const TlsWorkers&) = delete;
+    TlsWorkers& operator=(const TlsWorkers&) = delete;
+
+    // Abandons sessions still running.
+    ~TlsWorkers();
+
+    // Run a TLS server session with `context` in a worker,
+    // over a duplicate of the TCP socket `socket`
+    // (the caller should close its own descriptor),
+    // whose first bytes from the client, `prefix`, were already read.
+    //
+    // Returns the plain text side of the session,
+    // which uses the given I/O service.
+    GenericConnection serve( asio::io_service&
+                           , asio::ip::tcp::socket::native_handle_type socket
+                           , std::string prefix
+                           , std::shared_ptr<asio::ssl::context> context
+                           , sys::error_code&);
+
+    size_t size() const { return _workers.size(); }
+
+    // Let workers exit once their sessions are over.
+    void stop();
+
+private:
+    struct Worker {
+        asio::io_service ios;
+        std::unique_ptr<asio::io_service::work> work;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> _workers;
+    size_t _next = 0;
+};
+
+} // ouinet namespace
@@ -103,6 +103,31 @@ auto tcp_async_resolve( const std::string& host
     return resolver.async_resolve({host, port}, yield);
 }
 
+// Return whether the `address` is a loopback one,
+// also as an IPv4-mapped or IPv4-compatible IPv6 address.
+inline
+bool is_loopback(const asio::ip::address& address)
+{
+    if (address.is_loopback()) return true;
+    if (!address.is_v6()) return false;
+
+    // ::ffff:127.x.y.z or ::127.x.y.z
+    auto b = address.to_v6().to_bytes();
+    for (size_t i = 0; i < 10; ++i) if (b[i] != 0) return false;
+    if (!(b[10] == 0xff && b[11] == 0xff) && !(b[10] == 0 && b[11] == 0))
+        return false;
+    return b[12] == 127;
+}
+
+// Return whether any of the (already resolved) `addresses` is a loopback one.
+template<class Addresses>
+inline
+bool is_localhost(const Addresses& addresses)
+{
+    for (auto& a : addresses) if (is_loopback(a)) return true;
+    return false;
+}
+
 // Return whether the given `host` points to a loopback address.
 // Please note that this implies a DNS lookup
 // to spot names that point to a loopback address.
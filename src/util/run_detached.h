@@ -0,0 +1,60 @@
+#pragma once
+
+#include <boost/asio/error.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/spawn.hpp>
+#include <memory>
+
+#include "../namespaces.h"
+#include "../or_throw.h"
+#include "condition_variable.h"
+#include "signal.h"
+
+namespace ouinet {
+
+// Run `f(yield)` in its own coroutine and wait for its result.
+//
+// This is meant for operations which cannot be cancelled themselves:
+// if `cancel` is called first, `operation_aborted` is reported right away
+// and the result of `f` is dropped whenever it finishes, so `f` must not
+// refer to anything which the caller may destroy in the meantime.
+template<class T, class F>
+T run_detached( asio::io_service& ios
+              , Signal<void()>& cancel
+              , F f
+              , asio::yield_context yield)
+{
+    if (cancel.call_count()) {
+        return or_throw<T>(yield, asio::error::operation_aborted);
+    }
+
+    struct State {
+        State(asio::io_service& ios) : done_cv(ios) {}
+
+        ConditionVariable done_cv;
+        bool done = false;
+        sys::error_code ec;
+        T result;
+    };
+
+    auto state = std::make_shared<State>(ios);
+
+    asio::spawn(ios, [state, f = std::move(f)] (asio::yield_context y) mutable {
+        state->result = f(y[state->ec]);
+        state->done = true;
+        state->done_cv.notify();
+    });
+
+    auto on_cancel = cancel.connect([&] {
+        state->done_cv.notify(asio::error::operation_aborted);
+    });
+
+    sys::error_code ec;
+    while (!state->done && !ec) state->done_cv.wait(yield[ec]);
+
+    if (!state->done) return or_throw<T>(yield, ec);
+
+    return or_throw(yield, state->ec, std::move(state->result));
+}
+
+} // ouinet namespace
@@ -0,0 +1,99 @@
+// Compare the performance of `parse_http_date` with that of the locale
+// based parser it replaced.
+//
+// Usage: bench-parse-date [ITERATIONS]
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <chrono>
+#include <iostream>
+#include <locale>
+#include <string>
+
+#include <cache_meta.h>
+
+using namespace std;
+using namespace ouinet;
+
+namespace bt = boost::posix_time;
+
+// The former `CacheControl::parse_date`, kept here as a reference.
+static bt::ptime parse_date_with_locale(beast::string_view s)
+{
+    while (s.starts_with('"')) s.remove_prefix(1);
+
+    static const auto format = [](const char* fmt) {
+        using std::locale;
+        return locale(locale::classic(), new bt::time_input_facet(fmt));
+    };
+
+    static const std::locale formats[] = {
+        format("%a, %d %b %Y %H:%M:%S"),
+        format("%A, %d-%b-%y %H:%M:%S"),
+    };
+
+    const size_t formats_n = sizeof(formats)/sizeof(formats[0]);
+
+    bt::ptime pt;
+
+    struct membuf: std::streambuf {
+        membuf(char const* base, size_t size) {
+            char* p(const_cast<char*>(base));
+            this->setg(p, p, p + size);
+        }
+    };
+
+    struct imemstream: virtual membuf, std::istream {
+        imemstream(beast::string_view s)
+            : membuf(s.data(), s.size())
+            , std::istream(static_cast<std::streambuf*>(this)) {
+        }
+    };
+
+    for(size_t i=0; i<formats_n; ++i) {
+        imemstream is(s);
+        is.istream::imbue(formats[i]);
+        is >> pt;
+        if(pt != bt::ptime()) return pt;
+    }
+
+    return pt;
+}
+
+static const char* dates[] = {
+    "Sun, 06 Nov 1994 08:49:37 GMT",
+    "Wed, 21 Oct 2015 07:28:00 GMT",
+    "Sunday, 06-Nov-94 08:49:37 GMT",
+    "Sun Nov  6 08:49:37 1994",  // not supported by the reference parser
+    "0",
+};
+
+template<class Parse>
+static void run(const char* name, Parse parse, size_t iterations)
+{
+    using Clock = chrono::steady_clock;
+
+    size_t valid = 0;
+    auto start = Clock::now();
+
+    for (size_t i = 0; i < iterations; ++i) {
+        for (auto d : dates) {
+            if (!parse(d).is_not_a_date_time()) ++valid;
+        }
+    }
+
+    auto n = iterations * (sizeof(dates) / sizeof(dates[0]));
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count();
+
+    cout << name << ": " << (ns / n) << " ns/date"
+         << " (" << valid << "/" << n << " valid)" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t iterations = argc > 1 ? stoul(argv[1]) : 100000;
+
+    run("parse_http_date", [](const char* s) { return parse_http_date(s); }
+       , iterations);
+    run("locale facets  ", [](const char* s) { return parse_date_with_locale(s); }
+       , iterations);
+}
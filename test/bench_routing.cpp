@@ -0,0 +1,139 @@
+// Compare the performance of `RoutingTable::route` with that of
+// `route_choose_config` over the request expressions it replaced,
+// and check that both choose the same routes.
+//
+// Usage: bench-routing [ITERATIONS]
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include <request_routing.h>
+
+using namespace std;
+using namespace ouinet;
+
+namespace rr = request_route;
+using rr::responder;
+using Request = http::request<http::string_body>;
+using Match = pair<const reqexpr::reqex, const rr::Config>;
+
+// The rules formerly built by `Client::State::serve_request`.
+static vector<Match> reference_matches()
+{
+    static const rr::Config nocache_front_end
+        {false, queue<responder>({responder::_front_end})};
+    static const rr::Config nocache_origin_proxy
+        {false, queue<responder>({responder::origin, responder::proxy})};
+
+    static const reqexpr::field_getter method_getter
+        = [](const Request& r) {return r.method_string();};
+    static const reqexpr::field_getter host_getter
+        = [](const Request& r) {return r["Host"];};
+    static const reqexpr::field_getter x_oui_dest_getter
+        = [](const Request& r) {return r["X-Oui-Destination"];};
+    static const reqexpr::field_getter target_getter
+        = [](const Request& r) {return r.target();};
+
+    return {
+        Match( reqexpr::from_regex(host_getter, "localhost"), nocache_front_end),
+        Match( reqexpr::from_regex(x_oui_dest_getter, "OuiClient"), nocache_front_end),
+        Match( !reqexpr::from_regex(method_getter, "(GET|HEAD|OPTIONS|TRACE)")
+             , nocache_origin_proxy),
+        Match( reqexpr::from_regex(method_getter, "(OPTIONS|TRACE)")
+             , nocache_origin_proxy),
+        Match( reqexpr::from_regex(method_getter, "HEAD"), nocache_origin_proxy),
+        Match( reqexpr::from_regex(target_getter, "https?://ident.me/.*")
+             , {false, queue<responder>({responder::origin})} ),
+        Match( reqexpr::from_regex(target_getter, "https?://ifconfig.co/.*")
+             , {false, queue<responder>({responder::proxy})} ),
+        Match( reqexpr::from_regex(target_getter, "https?://(www\\.)?example.com/.*")
+             , {true, queue<responder>()} ),
+        Match( reqexpr::from_regex(target_getter, "https?://(www\\.)?example.net/.*")
+             , {true, queue<responder>({responder::injector})} ),
+    };
+}
+
+static Request request(http::verb method, const string& target, const string& host)
+{
+    Request rq{method, target, 11};
+    rq.set(http::field::host, host);
+    return rq;
+}
+
+static vector<Request> requests()
+{
+    vector<Request> rqs = {
+        request(http::verb::get,  "http://localhost/", "localhost"),
+        request(http::verb::post, "http://example.org/form", "example.org"),
+        request(http::verb::head, "http://example.org/", "example.org"),
+        request(http::verb::get,  "https://ident.me/", "ident.me"),
+        request(http::verb::get,  "http://ifconfig.co/ip", "ifconfig.co"),
+        request(http::verb::get,  "https://www.example.com/index.html", "www.example.com"),
+        request(http::verb::get,  "http://example.net/style.css", "example.net"),
+        request(http::verb::get,  "https://en.wikipedia.org/wiki/Main_Page", "en.wikipedia.org"),
+        request(http::verb::get,  "http://tracker.example.org/pixel.gif?id=42", "tracker.example.org"),
+    };
+
+    auto rq = request(http::verb::get, "http://ouinet/", "ouinet");
+    rq.set("X-Oui-Destination", "OuiClient");
+    rqs.push_back(rq);
+
+    return rqs;
+}
+
+template<class Route>
+static void run(const char* name, Route route, size_t iterations)
+{
+    using Clock = chrono::steady_clock;
+
+    auto rqs = requests();
+    size_t cached = 0;
+    auto start = Clock::now();
+
+    for (size_t i = 0; i < iterations; ++i) {
+        for (auto& rq : rqs) {
+            if (route(rq).enable_cache) ++cached;
+        }
+    }
+
+    auto n = iterations * rqs.size();
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count();
+
+    cout << name << ": " << (ns / n) << " ns/request"
+         << " (" << cached << "/" << n << " cached)" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t iterations = argc > 1 ? stoul(argv[1]) : 100000;
+
+    const rr::Config default_config{true, queue<responder>({responder::injector})};
+
+    auto matches = reference_matches();
+    auto table = rr::RoutingTable::parse(rr::RoutingTable::default_rules);
+
+    int mismatches = 0;
+
+    for (auto& rq : requests()) {
+        auto& expected = rr::route_choose_config(rq, matches, default_config);
+        auto& actual = table.route(rq, default_config);
+
+        if ( expected.enable_cache != actual.enable_cache
+          || expected.responders != actual.responders) {
+            cerr << "Routes differ for " << rq.method_string()
+                 << " " << rq.target() << endl;
+            ++mismatches;
+        }
+    }
+
+    run("RoutingTable::route", [&](const Request& rq) -> const rr::Config& {
+            return table.route(rq, default_config);
+        }, iterations);
+
+    run("route_choose_config", [&](const Request& rq) -> const rr::Config& {
+            return rr::route_choose_config(rq, matches, default_config);
+        }, iterations);
+
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,150 @@
+// Measure how fast `TlsWorkers` take over TLS sessions from user agents:
+// CONNECTIONS concurrent clients each do a handshake and a short exchange,
+// served first by a single worker thread and then by THREADS of them.
+//
+// Usage: bench-tls-workers [CONNECTIONS] [THREADS]
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/asio/write.hpp>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include <ssl/ca_certificate.h>
+#include <ssl/client_hello.h>
+#include <ssl/dummy_certificate.h>
+#include <tls_workers.h>
+
+using namespace std;
+using namespace ouinet;
+
+using tcp = asio::ip::tcp;
+
+static const char* server_name = "www.example.com";
+
+// Serve `connections` user agents with `threads` workers, returns
+// the number of complete exchanges.
+static size_t run( size_t threads
+                 , size_t connections
+                 , const CACertificate& ca
+                 , shared_ptr<asio::ssl::context> server_context)
+{
+    using Clock = chrono::steady_clock;
+
+    TlsWorkers workers(threads);
+
+    asio::io_service ios;
+    tcp::acceptor acceptor(ios, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    acceptor.listen(connections);
+    auto endpoint = acceptor.local_endpoint();
+
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+        for (size_t i = 0; i < connections; ++i) {
+            sys::error_code ec;
+            tcp::socket socket(ios);
+            acceptor.async_accept(socket, yield[ec]);
+            if (ec) break;
+
+            auto native = socket.native_handle();
+
+            asio::spawn(ios, [ &, native, con = GenericConnection(move(socket)) ]
+                             (asio::yield_context yield) mutable {
+                sys::error_code ec;
+                string name;
+                auto hello = ssl::read_client_hello(con, name, yield[ec]);
+                if (ec) return;
+
+                auto plain = workers.serve( ios, native, move(hello)
+                                          , server_context, ec);
+                con = GenericConnection();
+                if (ec) return;
+
+                string data(5, '\0');
+                asio::async_read(plain, asio::buffer(&data[0], data.size()), yield[ec]);
+                if (!ec) asio::async_write(plain, asio::buffer(data), yield[ec]);
+                plain.close();
+            });
+        }
+    });
+
+    // The user agents, with enough threads for their handshakes
+    // not to be the bottleneck.
+    asio::io_service client_ios;
+    asio::ssl::context context(asio::ssl::context::tls_client);
+    context.add_certificate_authority(asio::buffer(ca.pem_certificate()));
+    context.set_verify_mode(asio::ssl::verify_peer);
+
+    atomic<size_t> done(0);
+
+    for (size_t i = 0; i < connections; ++i) {
+        asio::spawn(client_ios, [&] (asio::yield_context yield) {
+            sys::error_code ec;
+            asio::ssl::stream<tcp::socket> stream(client_ios, context);
+            stream.next_layer().async_connect(endpoint, yield[ec]);
+            if (ec) return;
+
+            stream.set_verify_callback(asio::ssl::rfc2818_verification(server_name));
+            SSL_set_tlsext_host_name(stream.native_handle(), server_name);
+            stream.async_handshake(asio::ssl::stream_base::client, yield[ec]);
+            if (ec) return;
+
+            string data("hello");
+            asio::async_write(stream, asio::buffer(data), yield[ec]);
+            if (!ec) asio::async_read(stream, asio::buffer(&data[0], data.size()), yield[ec]);
+            if (!ec) ++done;
+        });
+    }
+
+    auto start = Clock::now();
+
+    vector<thread> clients;
+    auto client_threads = max(2u, thread::hardware_concurrency());
+    for (unsigned i = 0; i < client_threads; ++i) {
+        clients.emplace_back([&] { client_ios.run(); });
+    }
+
+    thread server([&] { ios.run(); });
+
+    for (auto& t : clients) t.join();
+
+    // Some user agents may have failed before connecting.
+    ios.post([&] { acceptor.close(); });
+    server.join();
+
+    auto ms = chrono::duration_cast<chrono::milliseconds>(Clock::now() - start).count();
+
+    cout << threads << " worker(s): " << done << "/" << connections
+         << " sessions in " << ms << " ms";
+    if (done) cout << " (" << (ms * 1000 / done) << " us/session)";
+    cout << endl;
+
+    return done;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t connections = argc > 1 ? stoul(argv[1]) : 200;
+    size_t threads = argc > 2 ? stoul(argv[2]) : thread::hardware_concurrency();
+    if (threads == 0) threads = 1;
+
+    CACertificate ca(CACertificate::KeyType::ec);
+    DummyCertificate crt(ca, "example.com");
+
+    auto chain = crt.pem_certificate() + ca.pem_certificate();
+    auto server_context = make_shared<asio::ssl::context>
+        (asio::ssl::context::tls_server);
+    server_context->use_certificate_chain(asio::buffer(chain));
+    server_context->use_private_key( asio::buffer(ca.pem_private_key())
+                                   , asio::ssl::context::pem);
+
+    bool ok = run(1, connections, ca, server_context) == connections;
+    if (threads > 1) {
+        ok = run(threads, connections, ca, server_context) == connections && ok;
+    }
+
+    return ok ? 0 : 1;
+}
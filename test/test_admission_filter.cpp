@@ -0,0 +1,75 @@
+#define BOOST_TEST_MODULE admission_filter
+#include <boost/test/included/unit_test.hpp>
+
+#include <cache/admission_filter.h>
+
+BOOST_AUTO_TEST_SUITE(ouinet_admission_filter)
+
+using namespace std;
+using namespace ouinet;
+using std::chrono::milliseconds;
+
+BOOST_AUTO_TEST_CASE(test_admit_everything)
+{
+    AdmissionFilter filter({});
+
+    BOOST_CHECK(filter.admit("foo", 1000, milliseconds(0)));
+    BOOST_CHECK_EQUAL(filter.stats().admitted, 1u);
+    BOOST_CHECK_EQUAL(filter.stats().rejected, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(test_min_hits)
+{
+    AdmissionFilter::Config config;
+    config.min_hits = 3;
+    AdmissionFilter filter(config);
+
+    for (unsigned i = 0; i < 2; ++i) {
+        filter.record("foo");
+        BOOST_CHECK(!filter.admit("foo", 1000, milliseconds(0)));
+    }
+
+    filter.record("foo");
+    BOOST_CHECK(filter.admit("foo", 1000, milliseconds(0)));
+    BOOST_CHECK(!filter.admit("bar", 1000, milliseconds(0)));
+
+    BOOST_CHECK_EQUAL(filter.stats().admitted, 1u);
+    BOOST_CHECK_EQUAL(filter.stats().rejected, 3u);
+}
+
+BOOST_AUTO_TEST_CASE(test_min_cost)
+{
+    AdmissionFilter::Config config;
+    config.min_hits = 2;
+    config.min_cost_ms_per_kib = 100;
+    AdmissionFilter filter(config);
+
+    filter.record("foo");
+    BOOST_CHECK(!filter.admit("foo", 10 * 1024, milliseconds(500)));
+    BOOST_CHECK( filter.admit("foo", 10 * 1024, milliseconds(1000)));
+
+    BOOST_CHECK_EQUAL(filter.stats().admitted_by_cost, 1u);
+}
+
+BOOST_AUTO_TEST_CASE(test_aging)
+{
+    AdmissionFilter::Config config;
+    config.min_hits = 2;
+    config.width = 1024;
+    config.sample_size = 100;
+    AdmissionFilter filter(config);
+
+    filter.record("foo");
+    filter.record("foo");
+    BOOST_CHECK_EQUAL(filter.estimate("foo"), 2u);
+
+    // Fill the sample with other keys so that counters get halved.
+    for (unsigned i = 0; i < 98; ++i) {
+        filter.record("key" + to_string(i));
+    }
+
+    BOOST_CHECK_EQUAL(filter.stats().resets, 1u);
+    BOOST_CHECK_EQUAL(filter.estimate("foo"), 1u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
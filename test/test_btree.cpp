@@ -253,4 +253,88 @@ BOOST_AUTO_TEST_CASE(test_4)
     ios.run();
 }
 
+// Test that a batch insert stores the tree once and that later values
+// of a key override earlier ones.
+BOOST_AUTO_TEST_CASE(test_5)
+{
+    asio::io_service ios;
+
+    MockStorage storage(ios);
+
+    BTree db(storage.cat_op(), storage.add_op(), storage.remove_op(), 512);
+
+    asio::spawn(ios, [&](asio::yield_context yield) {
+        sys::error_code ec;
+
+        db.insert("key", "old", yield[ec]);
+        BOOST_REQUIRE(!ec);
+
+        map<string, string> batch;
+        for (int i = 0; i < 100; ++i) {
+            stringstream ss;
+            ss << i;
+            batch[ss.str()] = "v" + ss.str();
+        }
+        batch["key"] = "new";
+
+        storage.clear();
+
+        db.insert(move(batch), yield[ec]);
+        BOOST_REQUIRE(!ec);
+        BOOST_REQUIRE(db.check_invariants());
+
+        // The node size is large enough for the whole tree to fit in a
+        // single node, which is only stored once for the whole batch.
+        BOOST_REQUIRE_EQUAL(storage.size(), 1u);
+
+        auto v = db.find("key", yield[ec]);
+        BOOST_REQUIRE(!ec);
+        BOOST_REQUIRE_EQUAL(v, "new");
+
+        v = db.find("42", yield[ec]);
+        BOOST_REQUIRE(!ec);
+        BOOST_REQUIRE_EQUAL(v, "v42");
+    });
+
+    ios.run();
+}
+
+BOOST_AUTO_TEST_CASE(test_6)
+{
+    asio::io_service ios;
+
+    MockStorage storage(ios);
+
+    BTree db(storage.cat_op(), storage.add_op(), storage.remove_op(), 16);
+
+    asio::spawn(ios, [&](asio::yield_context yield) {
+        sys::error_code ec;
+
+        map<string, string> batch;
+        for (int i = 0; i < 500; ++i) {
+            batch[random_key(6)] = "v";
+        }
+
+        db.insert(batch, yield[ec]);
+        BOOST_REQUIRE(!ec);
+
+        set<string> nodes;
+        map<string, string> entries;
+
+        db.walk( [&] (const BTree::Hash& h) { nodes.insert(h); }
+               , [&] (const BTree::Key& k, const BTree::Value& v) { entries[k] = v; }
+               , yield[ec]);
+        BOOST_REQUIRE(!ec);
+
+        // Every node still in storage is reachable from the root
+        // (replaced ones were removed).
+        BOOST_REQUIRE_EQUAL(nodes.size(), storage.size());
+        for (auto& n : nodes) BOOST_REQUIRE(storage.count(n));
+
+        BOOST_REQUIRE(entries == batch);
+    });
+
+    ios.run();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
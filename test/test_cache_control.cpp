@@ -4,6 +4,7 @@
 #include <boost/asio/io_service.hpp>
 #include <boost/optional.hpp>
 
+#include <async_sleep.h>
 #include <cache_control.h>
 #include <util.h>
 #include <or_throw.h>
@@ -27,6 +28,17 @@ static posix_time::ptime current_time() {
     return posix_time::second_clock::universal_time();
 }
 
+static string format_time(posix_time::ptime t) {
+    using namespace boost::posix_time;
+    static const locale loc( locale::classic()
+                           , new time_facet("%a, %d %b %Y %H:%M:%S"));
+
+    stringstream ss;
+    ss.imbue(loc);
+    ss << t;
+    return ss.str();
+}
+
 static optional<string_view> get(const Request& rq, http::field f)
 {
     auto i = rq.find(f);
@@ -59,8 +71,95 @@ BOOST_AUTO_TEST_CASE(test_parse_date)
     // https://tools.ietf.org/html/rfc7234#section-5.3
     BOOST_CHECK_EQUAL(p("Sun, 06 Nov 1994 08:49:37 GMT"),   "1994-Nov-06 08:49:37");
     BOOST_CHECK_EQUAL(p("\" Sun, 06 Nov 1994 08:49:37 GMT"),"1994-Nov-06 08:49:37");
-    BOOST_CHECK_EQUAL(p("Sunday, 06-Nov-94 08:49:37 GMT"),  "2094-Nov-06 08:49:37");
-    BOOST_CHECK_EQUAL(p(" Sunday, 06-Nov-94 08:49:37 GMT"), "2094-Nov-06 08:49:37");
+    // Two digit years more than 50 years in the future are in the past
+    // (https://tools.ietf.org/html/rfc7231#section-7.1.1.1).
+    BOOST_CHECK_EQUAL(p("Sunday, 06-Nov-94 08:49:37 GMT"),  "1994-Nov-06 08:49:37");
+    BOOST_CHECK_EQUAL(p(" Sunday, 06-Nov-94 08:49:37 GMT"), "1994-Nov-06 08:49:37");
+    BOOST_CHECK_EQUAL(p("Sun Nov  6 08:49:37 1994"),        "1994-Nov-06 08:49:37");
+    BOOST_CHECK_EQUAL(p("Sun Nov 16 08:49:37 1994"),        "1994-Nov-16 08:49:37");
+    BOOST_CHECK_EQUAL(p("sun, 06 nov 1994 08:49:37 gmt"),   "1994-Nov-06 08:49:37");
+
+    BOOST_CHECK_EQUAL(p(""),                                "not-a-date-time");
+    BOOST_CHECK_EQUAL(p("Sun, 31 Nov 1994 08:49:37 GMT"),   "not-a-date-time");
+    BOOST_CHECK_EQUAL(p("Sun, 06 Nov 1994 24:49:37 GMT"),   "not-a-date-time");
+    BOOST_CHECK_EQUAL(p("Sun, 06 Foo 1994 08:49:37 GMT"),   "not-a-date-time");
+    BOOST_CHECK_EQUAL(p("Sun Nov  6 08:49 1994"),           "not-a-date-time");
+}
+
+BOOST_AUTO_TEST_CASE(test_cache_meta)
+{
+    Response rs{http::status::ok, 11};
+    rs.set(http::field::cache_control, "public, max-age=60, s-maxage=\"30\"");
+    rs.insert(http::field::cache_control, "max-age=120, stale-if-error=bad");
+    rs.set(http::field::expires, "Sun, 06 Nov 1994 08:49:37 GMT");
+    rs.set(http::field::age, "10");
+    rs.set(http::field::etag, "\"abc\"");
+
+    auto meta = CacheMeta::parse(rs);
+
+    BOOST_REQUIRE(meta.max_age);
+    BOOST_CHECK_EQUAL(*meta.max_age, 120u);
+    BOOST_REQUIRE(meta.shared_max_age());
+    BOOST_CHECK_EQUAL(*meta.shared_max_age(), 30u);
+    BOOST_CHECK(!meta.stale_if_error);
+    BOOST_CHECK(meta.is_public);
+    BOOST_CHECK(!meta.is_private);
+    BOOST_CHECK(!meta.no_store);
+    BOOST_CHECK(!meta.expires.is_not_a_date_time());
+    BOOST_CHECK(meta.date.is_not_a_date_time());
+    BOOST_REQUIRE(meta.age);
+    BOOST_CHECK_EQUAL(*meta.age, 10u);
+    BOOST_CHECK_EQUAL(meta.etag, "\"abc\"");
+}
+
+// Values too large for the parser are taken as 2^31 (RFC 7234 section 1.2.1).
+BOOST_AUTO_TEST_CASE(test_delta_seconds_overflow)
+{
+    const auto max_age = [](const char* v) {
+        CacheMeta meta;
+        meta.parse_cache_control(string("max-age=") + v);
+        BOOST_REQUIRE(meta.max_age);
+        return *meta.max_age;
+    };
+
+    BOOST_CHECK_EQUAL(max_age("2147483647"),  2147483647u);
+    BOOST_CHECK_EQUAL(max_age("2147483648"),  2147483648u);
+    BOOST_CHECK_EQUAL(max_age("2147483649"),  2147483648u);
+    BOOST_CHECK_EQUAL(max_age("4294967296"),  2147483648u);
+    BOOST_CHECK_EQUAL(max_age("4294967300"),  2147483648u);
+    BOOST_CHECK_EQUAL(max_age("99999999999"), 2147483648u);
+    BOOST_CHECK_EQUAL(max_age("0000000000000000000060"), 60u);
+}
+
+BOOST_AUTO_TEST_CASE(test_vary)
+{
+    Response rs{http::status::ok, 11};
+    rs.set(http::field::vary, "Accept-Encoding, ,accept-language");
+
+    auto vary = CacheMeta::parse(rs).vary;
+
+    BOOST_REQUIRE_EQUAL(vary.size(), 2u);
+    BOOST_CHECK_EQUAL(vary[0], "accept-encoding");
+    BOOST_CHECK_EQUAL(vary[1], "accept-language");
+
+    Request rq1{http::verb::get, "foo", 11};
+    rq1.set(http::field::accept_encoding, "gzip, deflate");
+    rq1.set(http::field::accept_language, "en");
+
+    Request rq2{http::verb::get, "foo", 11};
+    rq2.set(http::field::accept_encoding, "gzip,deflate");
+    rq2.set(http::field::accept_language, "en");
+    rq2.set(http::field::user_agent, "test");
+
+    Request rq3{http::verb::get, "foo", 11};
+    rq3.set(http::field::accept_encoding, "gzip, deflate");
+
+    BOOST_CHECK_EQUAL(variant_key(rq1, vary), "gzip,deflate en");
+    BOOST_CHECK_EQUAL(variant_key(rq1, vary), variant_key(rq2, vary));
+    BOOST_CHECK_NE(variant_key(rq1, vary), variant_key(rq3, vary));
+
+    rs.set(http::field::vary, "*");
+    BOOST_CHECK(!CacheControl::ok_to_cache(rq1, rs));
 }
 
 BOOST_AUTO_TEST_CASE(test_cache_origin_fail)
@@ -70,13 +169,13 @@ BOOST_AUTO_TEST_CASE(test_cache_origin_fail)
     unsigned cache_check = 0;
     unsigned origin_check = 0;
 
-    cc.fetch_stored = [&](auto rq, auto y) {
+    cc.fetch_stored = [&](auto rq, auto&, auto y) {
         cache_check++;
         Response rs{http::status::ok, rq.version()};
         return Entry{current_time(), rs};
     };
 
-    cc.fetch_fresh = [&](auto rq, auto y) {
+    cc.fetch_fresh = [&](auto rq, auto&, auto y) {
         origin_check++;
         return or_throw<Response>(y, asio::error::connection_reset);
     };
@@ -98,7 +197,7 @@ BOOST_AUTO_TEST_CASE(test_max_cached_age)
     unsigned cache_check = 0;
     unsigned origin_check = 0;
 
-    cc.fetch_stored = [&](auto rq, auto y) {
+    cc.fetch_stored = [&](auto rq, auto&, auto y) {
         cache_check++;
 
         Response rs{http::status::ok, rq.version()};
@@ -113,7 +212,7 @@ BOOST_AUTO_TEST_CASE(test_max_cached_age)
         return Entry{created, rs};
     };
 
-    cc.fetch_fresh = [&](auto rq, auto y) {
+    cc.fetch_fresh = [&](auto rq, auto&, auto y) {
         origin_check++;
         BOOST_CHECK_EQUAL(rq.target(), "old");
         return Response{http::status::ok, rq.version()};
@@ -141,7 +240,7 @@ BOOST_AUTO_TEST_CASE(test_maxage)
     unsigned cache_check = 0;
     unsigned origin_check = 0;
 
-    cc.fetch_stored = [&](auto rq, auto y) {
+    cc.fetch_stored = [&](auto rq, auto&, auto y) {
         cache_check++;
 
         Response rs{http::status::ok, rq.version()};
@@ -160,7 +259,7 @@ BOOST_AUTO_TEST_CASE(test_maxage)
         return Entry{created, rs};
     };
 
-    cc.fetch_fresh = [&](auto rq, auto y) {
+    cc.fetch_fresh = [&](auto rq, auto&, auto y) {
         origin_check++;
         Response rs{http::status::ok, rq.version()};
         return rs;
@@ -188,18 +287,7 @@ BOOST_AUTO_TEST_CASE(test_http10_expires)
     unsigned cache_check = 0;
     unsigned origin_check = 0;
 
-    const auto format_time = [](posix_time::ptime t) {
-        using namespace boost::posix_time;
-        static const locale loc( locale::classic()
-                               , new time_facet("%a, %d %b %Y %H:%M:%S"));
-
-        stringstream ss;
-        ss.imbue(loc);
-        ss << t;
-        return ss.str();
-    };
-
-    cc.fetch_stored = [&](auto rq, auto y) {
+    cc.fetch_stored = [&](auto rq, auto&, auto y) {
         cache_check++;
 
         Response rs{http::status::ok, rq.version()};
@@ -219,7 +307,7 @@ BOOST_AUTO_TEST_CASE(test_http10_expires)
         return Entry{created, rs};
     };
 
-    cc.fetch_fresh = [&](auto rq, auto y) {
+    cc.fetch_fresh = [&](auto rq, auto&, auto y) {
         origin_check++;
         Response rs{http::status::ok, rq.version()};
         return rs;
@@ -240,32 +328,165 @@ BOOST_AUTO_TEST_CASE(test_http10_expires)
     BOOST_CHECK_EQUAL(origin_check, 1u);
 }
 
-BOOST_AUTO_TEST_CASE(test_dont_load_cache_when_If_None_Match)
+BOOST_AUTO_TEST_CASE(test_age)
 {
     CacheControl cc;
 
     unsigned origin_check = 0;
 
-    cc.fetch_stored = [&](auto rq, auto y) {
-        BOOST_ERROR("Shouldn't go to cache");
-        return Entry{current_time(), Response{}};
+    cc.fetch_stored = [&](auto rq, auto&, auto y) {
+        Response rs{http::status::ok, rq.version()};
+        rs.set(http::field::cache_control, "max-age=60");
+
+        auto created = current_time() - seconds(30);
+
+        if (rq.target() == "old-age") {
+            // Already 40 seconds old when it was stored.
+            rs.set(http::field::age, "40");
+        }
+        else if (rq.target() == "old-date") {
+            rs.set(http::field::date, format_time(created - seconds(40)));
+        }
+        else {
+            BOOST_CHECK(rq.target() == "new");
+            rs.set(http::field::date, format_time(created));
+        }
+
+        return Entry{created, rs};
     };
 
-    cc.fetch_fresh = [&](auto rq, auto y) {
+    cc.fetch_fresh = [&](auto rq, auto&, auto y) {
         origin_check++;
+        BOOST_CHECK(rq.target() != "new");
+        return Response{http::status::ok, rq.version()};
+    };
+
+    run_spawned([&](auto yield) {
+            {
+                Request req{http::verb::get, "old-age", 11};
+                cc.fetch(req, yield);
+            }
+            {
+                Request req{http::verb::get, "old-date", 11};
+                cc.fetch(req, yield);
+            }
+            {
+                Request req{http::verb::get, "new", 11};
+                auto rs = cc.fetch(req, yield);
+                auto age = rs[http::field::age].to_string();
+                BOOST_CHECK(age == "30" || age == "31");
+            }
+        });
+
+    BOOST_CHECK_EQUAL(origin_check, 2u);
+}
+
+BOOST_AUTO_TEST_CASE(test_heuristic_freshness)
+{
+    CacheControl cc;
+
+    unsigned origin_check = 0;
+
+    cc.fetch_stored = [&](auto rq, auto&, auto y) {
+        auto created = current_time() - seconds(30);
+
         Response rs{http::status::ok, rq.version()};
-        rs.set("X-Test", "from-origin");
-        return rs;
+        rs.set(http::field::date, format_time(created));
+
+        if (rq.target() == "fresh") {
+            // Fresh for 10% of 1000s.
+            rs.set(http::field::last_modified, format_time(created - seconds(1000)));
+        }
+        else if (rq.target() == "stale") {
+            rs.set(http::field::last_modified, format_time(created - seconds(100)));
+        }
+        else {
+            BOOST_CHECK(rq.target() == "not-cacheable-by-default");
+            rs.result(http::status::found);
+            rs.set(http::field::last_modified, format_time(created - seconds(1000)));
+        }
+
+        return Entry{created, rs};
+    };
+
+    cc.fetch_fresh = [&](auto rq, auto&, auto y) {
+        origin_check++;
+        return Response{http::status::ok, rq.version()};
     };
 
     run_spawned([&](auto yield) {
-            Request req{http::verb::get, "foo", 11};
-            req.set(http::field::if_none_match, "abc");
-            auto rs = cc.fetch(req, yield);
-            BOOST_CHECK_EQUAL(rs.result(), http::status::ok);
+            for (auto target : { "fresh", "stale", "not-cacheable-by-default" }) {
+                Request req{http::verb::get, target, 11};
+                cc.fetch(req, yield);
+            }
         });
 
-    BOOST_CHECK_EQUAL(origin_check, 1u);
+    BOOST_CHECK_EQUAL(origin_check, 2u);
+
+    cc.heuristic_freshness(0);
+
+    run_spawned([&](auto yield) {
+            Request req{http::verb::get, "fresh", 11};
+            cc.fetch(req, yield);
+        });
+
+    BOOST_CHECK_EQUAL(origin_check, 3u);
+}
+
+BOOST_AUTO_TEST_CASE(test_answer_conditional_request_from_cache)
+{
+    CacheControl cc;
+
+    unsigned cache_check = 0;
+
+    cc.fetch_stored = [&](auto rq, auto&, auto y) {
+        cache_check++;
+        Response rs{http::status::ok, rq.version()};
+        rs.set(http::field::cache_control, "max-age=60");
+        rs.set(http::field::etag, "\"123\"");
+        rs.set(http::field::last_modified, "Sun, 06 Nov 1994 08:49:37 GMT");
+        rs.set("X-Test", "from-cache");
+        return Entry{current_time(), rs};
+    };
+
+    cc.fetch_fresh = [&](auto rq, auto&, auto y) {
+        BOOST_ERROR("Shouldn't go to origin");
+        return Response{};
+    };
+
+    run_spawned([&](auto yield) {
+            {
+                Request rq{http::verb::get, "foo", 11};
+                rq.set(http::field::if_none_match, "\"abc\", W/\"123\"");
+                auto rs = cc.fetch(rq, yield);
+                BOOST_CHECK_EQUAL(rs.result(), http::status::not_modified);
+                BOOST_CHECK_EQUAL(rs[http::field::etag], "\"123\"");
+                BOOST_CHECK(rs.find("X-Test") == rs.end());
+            }
+            {
+                Request rq{http::verb::get, "foo", 11};
+                rq.set(http::field::if_none_match, "\"abc\"");
+                // Ignored in the presence of If-None-Match.
+                rq.set(http::field::if_modified_since, "Sun, 06 Nov 1994 08:49:37 GMT");
+                auto rs = cc.fetch(rq, yield);
+                BOOST_CHECK_EQUAL(rs.result(), http::status::ok);
+                BOOST_CHECK_EQUAL(rs["X-Test"], "from-cache");
+            }
+            {
+                Request rq{http::verb::get, "foo", 11};
+                rq.set(http::field::if_modified_since, "Mon, 07 Nov 1994 08:49:37 GMT");
+                auto rs = cc.fetch(rq, yield);
+                BOOST_CHECK_EQUAL(rs.result(), http::status::not_modified);
+            }
+            {
+                Request rq{http::verb::get, "foo", 11};
+                rq.set(http::field::if_modified_since, "Sat, 05 Nov 1994 08:49:37 GMT");
+                auto rs = cc.fetch(rq, yield);
+                BOOST_CHECK_EQUAL(rs.result(), http::status::ok);
+            }
+        });
+
+    BOOST_CHECK_EQUAL(cache_check, 4u);
 }
 
 BOOST_AUTO_TEST_CASE(test_no_etag_override)
@@ -274,14 +495,14 @@ BOOST_AUTO_TEST_CASE(test_no_etag_override)
 
     unsigned origin_check = 0;
 
-    cc.fetch_stored = [&](auto rq, auto y) {
-        BOOST_ERROR("Shouldn't go to cache");
-        return Entry{current_time(), Response{}};
+    cc.fetch_stored = [&](auto rq, auto&, auto y) {
+        return or_throw<Entry>(y, asio::error::not_found);
     };
 
-    cc.fetch_fresh = [&](auto rq, auto y) {
+    cc.fetch_fresh = [&](auto rq, auto&, auto y) {
         origin_check++;
 
+        // Without a cached entry, the user agent's validators are kept.
         auto etag = get(rq, http::field::if_none_match);
         BOOST_CHECK(etag);
         BOOST_CHECK_EQUAL(*etag, "origin-etag");
@@ -305,7 +526,7 @@ BOOST_AUTO_TEST_CASE(test_request_no_store)
 
     unsigned origin_check = 0;
 
-    cc.fetch_fresh = [&](auto rq, auto y) {
+    cc.fetch_fresh = [&](auto rq, auto&, auto y) {
         origin_check++;
         return Response{http::status::ok, rq.version()};
     };
@@ -329,42 +550,53 @@ BOOST_AUTO_TEST_CASE(test_if_none_match)
 
     unsigned cache_check = 0;
     unsigned origin_check = 0;
+    unsigned store_check = 0;
 
-    cc.fetch_stored = [&](auto rq, auto y) {
+    cc.fetch_stored = [&](auto rq, auto&, auto y) {
         cache_check++;
 
         Response rs{http::status::ok, rq.version()};
         rs.set(http::field::cache_control, "max-age=10");
         rs.set(http::field::etag, "123");
+        rs.set(http::field::last_modified, "Sun, 06 Nov 1994 08:49:37 GMT");
         rs.set("X-Test", "from-cache");
 
         return Entry{current_time() - seconds(20), rs};
     };
 
-    cc.fetch_fresh = [&](auto rq, auto y) {
+    cc.fetch_fresh = [&](auto rq, auto&, auto y) {
         origin_check++;
 
+        // The validators of the cached entry are used,
+        // not those of the user agent.
         auto etag = get(rq, http::field::if_none_match);
         BOOST_REQUIRE(etag);
+        BOOST_CHECK_EQUAL(*etag, "123");
 
-        if (*etag == "123") {
-            Response rs{http::status::not_modified, rq.version()};
-            rs.set("X-Test", "from-origin-not-modified");
-            return rs;
-        }
-
-        Response rs{http::status::ok, rq.version()};
-        rs.set("X-Test", "from-origin-ok");
+        auto ims = get(rq, http::field::if_modified_since);
+        BOOST_REQUIRE(ims);
+        BOOST_CHECK_EQUAL(*ims, "Sun, 06 Nov 1994 08:49:37 GMT");
 
+        Response rs{http::status::not_modified, rq.version()};
+        rs.set(http::field::cache_control, "max-age=60");
+        rs.set(http::field::etag, "123");
         return rs;
     };
 
+    cc.store = [&](auto rq, auto rs) {
+        store_check++;
+        BOOST_CHECK_EQUAL(rs.result(), http::status::ok);
+        BOOST_CHECK_EQUAL(rs[http::field::cache_control], "max-age=60");
+        BOOST_CHECK_EQUAL(rs[http::field::last_modified], "Sun, 06 Nov 1994 08:49:37 GMT");
+    };
+
     run_spawned([&](auto yield) {
             {
                 Request rq{http::verb::get, "mypage", 11};
                 auto rs = cc.fetch(rq, yield);
                 BOOST_CHECK_EQUAL(rs.result(), http::status::ok);
                 BOOST_CHECK_EQUAL(rs["X-Test"], "from-cache");
+                BOOST_CHECK_EQUAL(rs[http::field::cache_control], "max-age=60");
             }
 
             {
@@ -373,12 +605,21 @@ BOOST_AUTO_TEST_CASE(test_if_none_match)
                 rq.set(http::field::if_none_match, "abc");
                 auto rs = cc.fetch(rq, yield);
                 BOOST_CHECK_EQUAL(rs.result(), http::status::ok);
-                BOOST_CHECK_EQUAL(rs["X-Test"], "from-origin-ok");
+                BOOST_CHECK_EQUAL(rs["X-Test"], "from-cache");
+            }
+
+            {
+                // The user agent has the same version as the cache.
+                Request rq{http::verb::get, "mypage", 11};
+                rq.set(http::field::if_none_match, "123");
+                auto rs = cc.fetch(rq, yield);
+                BOOST_CHECK_EQUAL(rs.result(), http::status::not_modified);
             }
         });
 
-    BOOST_CHECK_EQUAL(cache_check, 1u);
-    BOOST_CHECK_EQUAL(origin_check, 2u);
+    BOOST_CHECK_EQUAL(cache_check, 3u);
+    BOOST_CHECK_EQUAL(origin_check, 3u);
+    BOOST_CHECK_EQUAL(store_check, 3u);
 }
 
 BOOST_AUTO_TEST_CASE(test_req_no_cache_fresh_origin_ok)
@@ -388,7 +629,7 @@ BOOST_AUTO_TEST_CASE(test_req_no_cache_fresh_origin_ok)
     unsigned cache_check = 0;
     unsigned origin_check = 0;
 
-    cc.fetch_stored = [&](auto rq, auto y) {
+    cc.fetch_stored = [&](auto rq, auto&, auto y) {
         cache_check++;
         Response rs{http::status::ok, rq.version()};
         // Return a fresh cached version.
@@ -397,7 +638,7 @@ BOOST_AUTO_TEST_CASE(test_req_no_cache_fresh_origin_ok)
         return Entry{current_time(), rs};
     };
 
-    cc.fetch_fresh = [&](auto rq, auto y) {
+    cc.fetch_fresh = [&](auto rq, auto&, auto y) {
         origin_check++;
         // Force using version from origin instead of validated version from cache
         // (i.e. not returning "304 Not Modified" here).
@@ -433,4 +674,337 @@ BOOST_AUTO_TEST_CASE(test_req_no_cache_fresh_origin_ok)
     BOOST_CHECK_EQUAL(origin_check, 1u);
 }
 
+BOOST_AUTO_TEST_CASE(test_stale_while_revalidate)
+{
+    CacheControl cc;
+
+    unsigned origin_check = 0;
+    unsigned revalidate_check = 0;
+
+    cc.fetch_stored = [&](auto rq, auto&, auto y) {
+        Response rs{http::status::ok, rq.version()};
+        rs.set(http::field::cache_control, "max-age=10, stale-while-revalidate=60");
+
+        auto created = current_time() - seconds(20);
+        if (rq.target() == "too-old") created -= seconds(60);
+
+        return Entry{created, rs};
+    };
+
+    cc.fetch_fresh = [&](auto rq, auto&, auto y) {
+        origin_check++;
+        BOOST_CHECK_EQUAL(rq.target(), "too-old");
+        return Response{http::status::ok, rq.version()};
+    };
+
+    cc.revalidate = [&](auto rq, auto entry) {
+        revalidate_check++;
+        BOOST_CHECK_EQUAL(rq.target(), "stale");
+    };
+
+    run_spawned([&](auto yield) {
+            {
+                Request req{http::verb::get, "stale", 11};
+                auto rs = cc.fetch(req, yield);
+                BOOST_CHECK(rs.find(http::field::warning) != rs.end());
+            }
+            {
+                Request req{http::verb::get, "too-old", 11};
+                auto rs = cc.fetch(req, yield);
+                BOOST_CHECK(rs.find(http::field::warning) == rs.end());
+            }
+        });
+
+    BOOST_CHECK_EQUAL(origin_check, 1u);
+    BOOST_CHECK_EQUAL(revalidate_check, 1u);
+}
+
+BOOST_AUTO_TEST_CASE(test_stale_while_revalidate_not_modified)
+{
+    CacheControl cc;
+
+    unsigned store_check = 0;
+
+    cc.fetch_stored = [&](auto rq, auto&, auto y) {
+        Response rs{http::status::ok, rq.version()};
+        rs.set(http::field::cache_control, "max-age=10, stale-while-revalidate=60");
+        rs.set(http::field::etag, "\"stored\"");
+        rs.set(http::field::content_language, "en");
+        return Entry{current_time() - seconds(20), rs};
+    };
+
+    cc.fetch_fresh = [&](auto rq, auto&, auto y) {
+        // The validators of the stored entry, not those of the user agent.
+        auto etag = get(rq, http::field::if_none_match);
+        BOOST_CHECK(etag);
+        BOOST_CHECK_EQUAL(*etag, "\"stored\"");
+        Response rs{http::status::not_modified, rq.version()};
+        rs.set(http::field::cache_control, "max-age=100");
+        rs.set(http::field::etag, "\"stored\"");
+        return rs;
+    };
+
+    cc.store = [&](auto rq, auto rs) {
+        store_check++;
+        BOOST_CHECK_EQUAL(rs.result(), http::status::ok);
+        BOOST_CHECK_EQUAL(rs[http::field::cache_control], "max-age=100");
+        BOOST_CHECK_EQUAL(rs[http::field::content_language], "en");
+    };
+
+    run_spawned([&](auto yield) {
+            cc.revalidate = [&](auto rq, auto entry) {
+                Signal<void()> cancel;
+                auto rs = cc.fetch_fresh(rq, cancel, yield);
+                cc.revalidated(rq, move(entry), rs);
+            };
+
+            Request req{http::verb::get, "foo", 11};
+            req.set(http::field::if_none_match, "\"other\"");
+            auto rs = cc.fetch(req, yield);
+            BOOST_CHECK_EQUAL(rs.result(), http::status::ok);
+            BOOST_CHECK(rs.find(http::field::warning) != rs.end());
+        });
+
+    BOOST_CHECK_EQUAL(store_check, 1u);
+}
+
+BOOST_AUTO_TEST_CASE(test_stale_if_error)
+{
+    CacheControl cc;
+
+    cc.stale_if_error(seconds(60));
+
+    cc.fetch_stored = [&](auto rq, auto&, auto y) {
+        Response rs{http::status::ok, rq.version()};
+        rs.set(http::field::cache_control, "max-age=10");
+
+        auto created = current_time() - seconds(20);
+        if (rq.target() == "too-old") created -= seconds(60);
+
+        return Entry{created, rs};
+    };
+
+    cc.fetch_fresh = [&](auto rq, auto&, auto y) {
+        return or_throw<Response>(y, asio::error::connection_reset);
+    };
+
+    run_spawned([&](auto yield) {
+            {
+                Request req{http::verb::get, "stale", 11};
+                auto rs = cc.fetch(req, yield);
+                BOOST_CHECK_EQUAL(rs.result(), http::status::ok);
+            }
+            {
+                Request req{http::verb::get, "too-old", 11};
+                auto rs = cc.fetch(req, yield);
+                BOOST_CHECK_EQUAL(rs.result(), http::status::bad_gateway);
+            }
+        });
+}
+
+BOOST_AUTO_TEST_CASE(test_stale_if_server_error)
+{
+    CacheControl cc;
+
+    cc.stale_if_error(seconds(60));
+
+    cc.fetch_stored = [&](auto rq, auto&, auto y) {
+        Response rs{http::status::ok, rq.version()};
+        rs.set(http::field::cache_control, "max-age=10");
+
+        auto created = current_time() - seconds(20);
+        if (rq.target() == "too-old") created -= seconds(60);
+
+        return Entry{created, rs};
+    };
+
+    cc.fetch_fresh = [&](auto rq, auto&, auto y) {
+        return Response{http::status::service_unavailable, rq.version()};
+    };
+
+    run_spawned([&](auto yield) {
+            {
+                Request req{http::verb::get, "stale", 11};
+                auto rs = cc.fetch(req, yield);
+                BOOST_CHECK_EQUAL(rs.result(), http::status::ok);
+                BOOST_CHECK(rs.find(http::field::warning) != rs.end());
+            }
+            {
+                // The origin's own error is better than a made up one.
+                Request req{http::verb::get, "too-old", 11};
+                auto rs = cc.fetch(req, yield);
+                BOOST_CHECK_EQUAL(rs.result(), http::status::service_unavailable);
+            }
+        });
+}
+
+BOOST_AUTO_TEST_CASE(test_no_stale_if_must_revalidate)
+{
+    CacheControl cc;
+
+    cc.stale_while_revalidate(seconds(60));
+    cc.stale_if_error(seconds(60));
+
+    unsigned origin_check = 0;
+    unsigned revalidate_check = 0;
+
+    cc.fetch_stored = [&](auto rq, auto&, auto y) {
+        Response rs{http::status::ok, rq.version()};
+        rs.set(http::field::cache_control, "max-age=10, " + rq.target().to_string());
+        return Entry{current_time() - seconds(20), rs};
+    };
+
+    cc.fetch_fresh = [&](auto rq, auto&, auto y) {
+        origin_check++;
+        return or_throw<Response>(y, asio::error::connection_reset);
+    };
+
+    cc.revalidate = [&](auto rq, auto entry) {
+        revalidate_check++;
+    };
+
+    run_spawned([&](auto yield) {
+            for (auto directive : { "must-revalidate", "proxy-revalidate", "no-cache" }) {
+                Request req{http::verb::get, directive, 11};
+                auto rs = cc.fetch(req, yield);
+                BOOST_CHECK_EQUAL(rs.result(), http::status::bad_gateway);
+            }
+        });
+
+    BOOST_CHECK_EQUAL(origin_check, 3u);
+    BOOST_CHECK_EQUAL(revalidate_check, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(test_negative_cache)
+{
+    CacheControl cc;
+
+    cc.negative_cache(make_shared<NegativeCache>(NegativeCache::Config()));
+
+    unsigned cache_check = 0;
+    unsigned origin_check = 0;
+
+    cc.fetch_stored = [&](auto rq, auto&, auto y) {
+        cache_check++;
+        return or_throw<Entry>(y, asio::error::not_found);
+    };
+
+    cc.fetch_fresh = [&](auto rq, auto&, auto y) {
+        origin_check++;
+        return Response{http::status::not_found, rq.version()};
+    };
+
+    run_spawned([&](auto yield) {
+            Request req{http::verb::get, "foo", 11};
+
+            for (unsigned i = 0; i < 3; ++i) {
+                auto rs = cc.fetch(req, yield);
+                BOOST_CHECK_EQUAL(rs.result(), http::status::not_found);
+            }
+        });
+
+    BOOST_CHECK_EQUAL(cache_check, 1u);
+    BOOST_CHECK_EQUAL(origin_check, 1u);
+
+    // A reload goes to the origin again.
+    run_spawned([&](auto yield) {
+            Request req{http::verb::get, "foo", 11};
+            req.set(http::field::cache_control, "no-cache");
+            auto rs = cc.fetch(req, yield);
+            BOOST_CHECK_EQUAL(rs.result(), http::status::not_found);
+        });
+
+    BOOST_CHECK_EQUAL(origin_check, 2u);
+}
+
+// Error codes may come from reaching an injector or proxy,
+// so only the fetcher may remember them.
+BOOST_AUTO_TEST_CASE(test_negative_cache_error_codes)
+{
+    CacheControl cc;
+
+    auto negative = make_shared<NegativeCache>(NegativeCache::Config());
+    cc.negative_cache(negative);
+
+    unsigned origin_check = 0;
+
+    cc.fetch_stored = [&](auto rq, auto&, auto y) {
+        return or_throw<Entry>(y, asio::error::not_found);
+    };
+
+    cc.fetch_fresh = [&](auto rq, auto&, auto y) {
+        origin_check++;
+        return or_throw<Response>(y, asio::error::connection_refused);
+    };
+
+    run_spawned([&](auto yield) {
+            Request req{http::verb::get, "foo", 11};
+
+            for (unsigned i = 0; i < 2; ++i) {
+                auto rs = cc.fetch(req, yield);
+                BOOST_CHECK_EQUAL(rs.result(), http::status::bad_gateway);
+            }
+
+            BOOST_CHECK_EQUAL(origin_check, 2u);
+
+            // Once the fetcher knows the origin refused, it is replayed.
+            negative->insert_error("foo", {asio::error::connection_refused, Response()});
+
+            auto rs = cc.fetch(req, yield);
+            BOOST_CHECK_EQUAL(rs.result(), http::status::bad_gateway);
+        });
+
+    BOOST_CHECK_EQUAL(origin_check, 2u);
+}
+
+BOOST_AUTO_TEST_CASE(test_hedging)
+{
+    asio::io_service ios;
+    CacheControl cc(ios);
+
+    cc.hedge_delay(posix_time::milliseconds(100));
+
+    chrono::milliseconds cache_delay(0);
+    unsigned cache_aborted = 0;
+    unsigned origin_check = 0;
+
+    cc.fetch_stored = [&](auto rq, auto& cancel, auto y) {
+        if (!async_sleep(ios, cache_delay, cancel, y)) {
+            cache_aborted++;
+            return or_throw<Entry>(y, asio::error::operation_aborted);
+        }
+        Response rs{http::status::ok, rq.version()};
+        rs.set("X-Test", "from-cache");
+        rs.set(http::field::cache_control, "max-age=60");
+        return Entry{current_time(), rs};
+    };
+
+    cc.fetch_fresh = [&](auto rq, auto&, auto y) {
+        origin_check++;
+        Response rs{http::status::ok, rq.version()};
+        rs.set("X-Test", "from-origin");
+        return rs;
+    };
+
+    asio::spawn(ios, [&](auto yield) {
+            Request req{http::verb::get, "foo", 11};
+
+            // A fast cache is not hedged.
+            auto rs = cc.fetch(req, yield);
+            BOOST_CHECK_EQUAL(rs["X-Test"], "from-cache");
+            BOOST_CHECK_EQUAL(origin_check, 0u);
+
+            // A slow cache loses against the origin.
+            cache_delay = chrono::seconds(10);
+            auto start = chrono::steady_clock::now();
+            rs = cc.fetch(req, yield);
+            BOOST_CHECK_EQUAL(rs["X-Test"], "from-origin");
+            BOOST_CHECK_EQUAL(origin_check, 1u);
+            BOOST_CHECK_EQUAL(cache_aborted, 1u);
+            BOOST_CHECK(chrono::steady_clock::now() - start < chrono::seconds(1));
+        });
+
+    ios.run();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,116 @@
+#define BOOST_TEST_MODULE certificate_store
+#include <boost/test/included/unit_test.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/filesystem.hpp>
+
+#include <ssl/ca_certificate.h>
+#include <ssl/certificate_store.h>
+
+BOOST_AUTO_TEST_SUITE(ouinet_certificate_store)
+
+using namespace std;
+using namespace ouinet;
+
+namespace fs = boost::filesystem;
+
+struct TempFile {
+    fs::path path = fs::temp_directory_path() / fs::unique_path();
+    ~TempFile() { fs::remove(path); }
+};
+
+static string get( CACertificate& ca, const fs::path& file
+                 , const string& domain
+                 , CertificateStore::Stats& stats)
+{
+    asio::io_service ios;
+    CertificateStore store(ios, ca, file, 1);
+
+    string pem;
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+        pem = store.get(domain, yield);
+    });
+    ios.run();
+
+    stats = store.stats();
+    return pem;
+}
+
+BOOST_AUTO_TEST_CASE(test_joined)
+{
+    CACertificate ca;
+    TempFile file;
+
+    asio::io_service ios;
+    CertificateStore store(ios, ca, file.path, 2);
+
+    vector<string> pems;
+
+    for (int i = 0; i < 3; ++i) {
+        asio::spawn(ios, [&] (asio::yield_context yield) {
+            pems.push_back(store.get("example.com", yield));
+        });
+    }
+
+    ios.run();
+
+    BOOST_REQUIRE_EQUAL(pems.size(), 3u);
+    BOOST_CHECK(!pems[0].empty());
+    BOOST_CHECK(pems[0] == pems[1] && pems[1] == pems[2]);
+    BOOST_CHECK_EQUAL(store.stats().minted, 1u);
+    BOOST_CHECK_EQUAL(store.stats().joined, 2u);
+}
+
+BOOST_AUTO_TEST_CASE(test_persistence)
+{
+    CACertificate ca;
+    TempFile file;
+    CertificateStore::Stats stats;
+
+    auto pem = get(ca, file.path, "example.com", stats);
+    BOOST_CHECK_EQUAL(stats.minted, 1u);
+
+    BOOST_CHECK(get(ca, file.path, "example.com", stats) == pem);
+    BOOST_CHECK_EQUAL(stats.minted, 0u);
+    BOOST_CHECK_EQUAL(stats.read, 1u);
+
+    // A partially written entry is dropped.
+    get(ca, file.path, "example.org", stats);
+    fs::resize_file(file.path, fs::file_size(file.path) - 10);
+
+    get(ca, file.path, "example.org", stats);
+    BOOST_CHECK_EQUAL(stats.minted, 1u);
+    BOOST_CHECK(get(ca, file.path, "example.com", stats) == pem);
+
+    // Certificates from another CA are not used.
+    CACertificate other_ca;
+    BOOST_CHECK(get(other_ca, file.path, "example.com", stats) != pem);
+    BOOST_CHECK_EQUAL(stats.minted, 1u);
+}
+
+BOOST_AUTO_TEST_CASE(test_ec_key)
+{
+    using KeyType = CACertificate::KeyType;
+
+    CACertificate ec_ca(KeyType::ec);
+    BOOST_CHECK(ec_ca.key_type() == KeyType::ec);
+    BOOST_CHECK(ec_ca.pem_dh_param().empty());
+
+    CACertificate ec_loaded( ec_ca.pem_certificate()
+                           , ec_ca.pem_private_key(), "");
+    BOOST_CHECK(ec_loaded.key_type() == KeyType::ec);
+    BOOST_CHECK(ec_loaded.pem_dh_param().empty());
+
+    // RSA CAs stored without DH parameters get the default ones.
+    CACertificate rsa_ca(KeyType::rsa);
+    CACertificate rsa_loaded( rsa_ca.pem_certificate()
+                            , rsa_ca.pem_private_key(), "");
+    BOOST_CHECK(rsa_loaded.key_type() == KeyType::rsa);
+    BOOST_CHECK_EQUAL(rsa_loaded.pem_dh_param(), rsa_ca.pem_dh_param());
+
+    TempFile file;
+    CertificateStore::Stats stats;
+    BOOST_CHECK(!get(ec_loaded, file.path, "example.com", stats).empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
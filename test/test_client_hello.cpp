@@ -0,0 +1,90 @@
+#define BOOST_TEST_MODULE client_hello
+#include <boost/test/included/unit_test.hpp>
+
+#include <ssl/client_hello.h>
+
+BOOST_AUTO_TEST_SUITE(ouinet_client_hello)
+
+using namespace std;
+using namespace ouinet;
+using ouinet::ssl::client_hello_server_name;
+
+static string be(unsigned n, size_t bytes)
+{
+    string s;
+    while (bytes--) s += char((n >> (8 * bytes)) & 0xff);
+    return s;
+}
+
+// A byte string prefixed by its length.
+static string vec(const string& s, size_t len_bytes)
+{
+    return be(s.size(), len_bytes) + s;
+}
+
+static string sni_extension(const string& host)
+{
+    auto names = vec(be(0, 1) + vec(host, 2), 2);
+    return be(0, 2) + vec(names, 2);
+}
+
+// A TLS record with a ClientHello carrying the given extensions.
+static string client_hello(const string& extensions)
+{
+    auto body = be(0x0303, 2)               // client_version
+              + string(32, 'r')             // random
+              + vec("", 1)                  // session_id
+              + vec(be(0x1301, 2), 2)       // cipher_suites
+              + vec(be(0, 1), 1)            // compression_methods
+              + vec(extensions, 2);
+
+    auto handshake = be(1, 1) + vec(body, 3);
+
+    return be(22, 1) + be(0x0301, 2) + vec(handshake, 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_server_name)
+{
+    auto ext = be(0xff01, 2) + vec(be(0, 1), 2)  // renegotiation_info
+             + sni_extension("www.example.com");
+
+    auto hello = client_hello(ext);
+
+    auto name = client_hello_server_name(hello);
+    BOOST_REQUIRE(name);
+    BOOST_CHECK_EQUAL(*name, "www.example.com");
+
+    // Anything after the first record is ignored.
+    name = client_hello_server_name(hello + "garbage");
+    BOOST_REQUIRE(name);
+    BOOST_CHECK_EQUAL(*name, "www.example.com");
+}
+
+BOOST_AUTO_TEST_CASE(test_incomplete)
+{
+    auto hello = client_hello(sni_extension("example.com"));
+
+    for (size_t n = 0; n < hello.size(); ++n) {
+        BOOST_CHECK(!client_hello_server_name(hello.substr(0, n)));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_no_server_name)
+{
+    auto name = client_hello_server_name(client_hello(""));
+    BOOST_REQUIRE(name);
+    BOOST_CHECK_EQUAL(*name, "");
+
+    // Not a handshake record.
+    name = client_hello_server_name(be(23, 1) + be(0x0303, 2) + vec("xy", 2));
+    BOOST_REQUIRE(name);
+    BOOST_CHECK_EQUAL(*name, "");
+
+    // Truncated extension.
+    auto hello = client_hello(sni_extension("example.com").substr(0, 6));
+    name = client_hello_server_name(hello);
+    BOOST_REQUIRE(name);
+    BOOST_CHECK_EQUAL(*name, "");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
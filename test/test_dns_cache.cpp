@@ -0,0 +1,139 @@
+#define BOOST_TEST_MODULE dns_cache
+#include <boost/test/included/unit_test.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include <dns_cache.h>
+#include <util.h>
+
+BOOST_AUTO_TEST_SUITE(ouinet_dns_cache)
+
+using namespace std;
+using namespace ouinet;
+
+BOOST_AUTO_TEST_CASE(test_numeric_addresses)
+{
+    asio::io_service ios;
+    DnsCache dns(ios, {});
+
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+        Signal<void()> cancel;
+
+        auto v4 = dns.resolve("127.0.0.1", cancel, yield);
+        BOOST_REQUIRE_EQUAL(v4.size(), 1u);
+        BOOST_CHECK(util::is_localhost(v4));
+
+        auto v6 = dns.resolve("[::1]", cancel, yield);
+        BOOST_REQUIRE_EQUAL(v6.size(), 1u);
+        BOOST_CHECK(util::is_localhost(v6));
+
+        BOOST_CHECK(!util::is_localhost(dns.resolve("192.0.2.1", cancel, yield)));
+    });
+
+    ios.run();
+
+    BOOST_CHECK_EQUAL(dns.stats().lookups, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(test_is_loopback)
+{
+    using asio::ip::address;
+
+    BOOST_CHECK(util::is_loopback(address::from_string("127.1.2.3")));
+    BOOST_CHECK(util::is_loopback(address::from_string("::1")));
+    BOOST_CHECK(util::is_loopback(address::from_string("::ffff:127.0.0.1")));
+    BOOST_CHECK(util::is_loopback(address::from_string("::127.0.0.1")));
+    BOOST_CHECK(!util::is_loopback(address::from_string("::ffff:10.0.0.1")));
+    BOOST_CHECK(!util::is_loopback(address::from_string("2001:db8::7f00:1")));
+}
+
+BOOST_AUTO_TEST_CASE(test_cached_and_joined)
+{
+    asio::io_service ios;
+    DnsCache dns(ios, {});
+
+    size_t resolved = 0;
+
+    for (int i = 0; i < 3; ++i) {
+        asio::spawn(ios, [&] (asio::yield_context yield) {
+            Signal<void()> cancel;
+            sys::error_code ec;
+            auto addresses = dns.resolve("localhost", cancel, yield[ec]);
+            BOOST_REQUIRE(!ec);
+            BOOST_CHECK(util::is_localhost(addresses));
+            ++resolved;
+        });
+    }
+
+    ios.run();
+
+    BOOST_CHECK_EQUAL(resolved, 3u);
+    BOOST_CHECK_EQUAL(dns.stats().lookups, 1u);
+    BOOST_CHECK_EQUAL(dns.stats().joined, 2u);
+
+    ios.reset();
+
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+        Signal<void()> cancel;
+        dns.resolve("localhost", cancel, yield);
+    });
+
+    ios.run();
+
+    BOOST_CHECK_EQUAL(dns.stats().lookups, 1u);
+    BOOST_CHECK_EQUAL(dns.stats().hits, 1u);
+}
+
+BOOST_AUTO_TEST_CASE(test_negative)
+{
+    asio::io_service ios;
+    DnsCache dns(ios, {});
+
+    // Reserved by RFC 2606, never resolves.
+    static const string host = "nonexistent.invalid";
+
+    for (int i = 0; i < 2; ++i) {
+        asio::spawn(ios, [&] (asio::yield_context yield) {
+            Signal<void()> cancel;
+            sys::error_code ec;
+            dns.resolve(host, cancel, yield[ec]);
+            BOOST_CHECK(ec);
+        });
+
+        ios.run();
+        ios.reset();
+    }
+
+    BOOST_CHECK_EQUAL(dns.stats().lookups, 1u);
+    BOOST_CHECK_EQUAL(dns.stats().negative_hits, 1u);
+}
+
+BOOST_AUTO_TEST_CASE(test_cancel_waiter)
+{
+    asio::io_service ios;
+    DnsCache dns(ios, {});
+
+    bool other_resolved = false;
+
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+        Signal<void()> cancel;
+        sys::error_code ec;
+        dns.resolve("localhost", cancel, yield[ec]);
+        BOOST_CHECK(!ec);
+        other_resolved = true;
+    });
+
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+        Signal<void()> cancel;
+        ios.post([&] { cancel(); });
+        sys::error_code ec;
+        dns.resolve("localhost", cancel, yield[ec]);
+        BOOST_CHECK_EQUAL(ec, asio::error::operation_aborted);
+    });
+
+    ios.run();
+
+    BOOST_CHECK(other_resolved);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,223 @@
+#define BOOST_TEST_MODULE multiplex
+#include <boost/test/included/unit_test.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/write.hpp>
+
+#include <ouiservice/multiplex.h>
+
+BOOST_AUTO_TEST_SUITE(ouinet_multiplex)
+
+using namespace std;
+using namespace ouinet;
+using namespace ouinet::ouiservice;
+using tcp = asio::ip::tcp;
+
+// Two ends of a TCP connection over the loopback interface.
+static pair<GenericConnection, GenericConnection>
+connected_pair(asio::io_service& ios, asio::yield_context yield)
+{
+    tcp::acceptor acceptor(ios, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    tcp::socket s1(ios), s2(ios);
+
+    s1.async_connect(acceptor.local_endpoint(), [](sys::error_code) {});
+    acceptor.async_accept(s2, yield);
+
+    return { GenericConnection(move(s1)), GenericConnection(move(s2)) };
+}
+
+static string read_all(GenericConnection& c, asio::yield_context yield)
+{
+    string data;
+    array<char, 4096> buf;
+
+    for (;;) {
+        sys::error_code ec;
+        auto n = asio::async_read(c, asio::buffer(buf), yield[ec]);
+        data.append(buf.data(), n);
+        if (ec == asio::error::eof) return data;
+        BOOST_REQUIRE(!ec || ec == asio::error::eof);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_echo)
+{
+    asio::io_service ios;
+
+    // Larger than the receive window of a stream.
+    string big(MuxSession::initial_window * 2 + 7, '\0');
+    for (size_t i = 0; i < big.size(); ++i) big[i] = 'a' + i % 26;
+
+    size_t done = 0;
+
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+        auto p = connected_pair(ios, yield);
+
+        auto client = MuxSession::start(move(p.first), true);
+        auto server = MuxSession::start(move(p.second), false);
+
+        asio::spawn(ios, [&, server] (asio::yield_context yield) {
+            for (int i = 0; i < 3; ++i) {
+                auto s = server->accept(yield);
+                asio::spawn(ios, [s = move(s), &big] (asio::yield_context yield) mutable {
+                    string data(big.size(), '\0');
+                    asio::async_read(s, asio::buffer(&data[0], data.size()), yield);
+                    asio::async_write(s, asio::buffer(data), yield);
+                });
+            }
+        });
+
+        for (int i = 0; i < 3; ++i) {
+            asio::spawn(ios, [&, client] (asio::yield_context yield) {
+                sys::error_code ec;
+                auto s = client->open_stream(ec);
+                BOOST_REQUIRE(!ec);
+
+                asio::async_write(s, asio::buffer(big), yield);
+                BOOST_CHECK_EQUAL(read_all(s, yield), big);
+
+                if (++done == 3) client->close();
+            });
+        }
+    });
+
+    ios.run();
+
+    BOOST_CHECK_EQUAL(done, 3u);
+}
+
+BOOST_AUTO_TEST_CASE(test_plain_connection)
+{
+    asio::io_service ios;
+
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+        auto p = connected_pair(ios, yield);
+
+        asio::async_write(p.first, asio::buffer(string("GET / HTTP/1.1\r\n")), yield);
+
+        bool multiplexed = true;
+        auto c = detect_multiplexing(move(p.second), multiplexed, yield);
+        BOOST_CHECK(!multiplexed);
+
+        // The peeked byte is still there.
+        string line(16, '\0');
+        asio::async_read(c, asio::buffer(&line[0], line.size()), yield);
+        BOOST_CHECK_EQUAL(line, "GET / HTTP/1.1\r\n");
+    });
+
+    ios.run();
+}
+
+BOOST_AUTO_TEST_CASE(test_not_acknowledged)
+{
+    asio::io_service ios;
+
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+        sys::error_code ec;
+
+        // A plain server closing the connection right away.
+        {
+            auto p = connected_pair(ios, yield);
+            auto client = MuxSession::start(move(p.first), true);
+            client->open_stream(ec);
+
+            p.second.close();
+            client->wait_acknowledged(yield[ec]);
+            BOOST_CHECK(ec == asio::error::operation_not_supported);
+        }
+
+        // A plain server answering with an HTTP error.
+        {
+            auto p = connected_pair(ios, yield);
+            auto client = MuxSession::start(move(p.first), true);
+            client->open_stream(ec);
+
+            string rs("HTTP/1.1 400 Bad Request\r\n\r\n");
+            asio::async_write(p.second, asio::buffer(rs), yield);
+            p.second.close();
+
+            client->wait_acknowledged(yield[ec]);
+            BOOST_CHECK(ec == asio::error::operation_not_supported);
+        }
+
+        // Giving up says nothing about the server.
+        {
+            auto p = connected_pair(ios, yield);
+            auto client = MuxSession::start(move(p.first), true);
+            client->open_stream(ec);
+
+            ios.post([client] { client->close(); });
+            client->wait_acknowledged(yield[ec]);
+            BOOST_CHECK(ec == asio::error::connection_aborted);
+        }
+    });
+
+    ios.run();
+}
+
+BOOST_AUTO_TEST_CASE(test_close_aborts_streams)
+{
+    asio::io_service ios;
+
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+        auto p = connected_pair(ios, yield);
+
+        auto client = MuxSession::start(move(p.first), true);
+        auto server = MuxSession::start(move(p.second), false);
+
+        sys::error_code ec;
+        auto s = client->open_stream(ec);
+        BOOST_REQUIRE(!ec);
+
+        auto accepted = server->accept(yield);
+
+        ios.post([server] { server->close(); });
+
+        char c;
+        asio::async_read(s, asio::buffer(&c, 1), yield[ec]);
+        BOOST_CHECK(ec);
+
+        client->open_stream(ec);
+        BOOST_CHECK(ec);
+    });
+
+    ios.run();
+}
+
+BOOST_AUTO_TEST_CASE(test_accept_backlog)
+{
+    asio::io_service ios;
+
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+        auto p = connected_pair(ios, yield);
+
+        auto client = MuxSession::start(move(p.first), true);
+        auto server = MuxSession::start(move(p.second), false);
+
+        // Nobody accepts on the server, so streams past the backlog
+        // are reset.
+        vector<GenericConnection> streams;
+        size_t backlog = MuxSession::max_accept_backlog;
+
+        for (size_t i = 0; i <= backlog; ++i) {
+            sys::error_code ec;
+            streams.push_back(client->open_stream(ec));
+            BOOST_REQUIRE(!ec);
+        }
+
+        sys::error_code ec;
+        char c;
+        asio::async_read(streams.back(), asio::buffer(&c, 1), yield[ec]);
+        BOOST_CHECK_EQUAL(ec, asio::error::connection_reset);
+        BOOST_CHECK_EQUAL(server->stats().refused, 1u);
+        BOOST_CHECK_EQUAL(server->stats().open, backlog);
+
+        client->close();
+        server->close();
+    });
+
+    ios.run();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,126 @@
+#define BOOST_TEST_MODULE negative_cache
+#include <boost/test/included/unit_test.hpp>
+#include <boost/asio/error.hpp>
+#include <thread>
+
+#include <cache/negative_cache.h>
+
+BOOST_AUTO_TEST_SUITE(ouinet_negative_cache)
+
+using namespace std;
+using namespace ouinet;
+using Response = NegativeCache::Response;
+using std::chrono::milliseconds;
+
+static Response response(http::status status)
+{
+    return Response{status, 11};
+}
+
+BOOST_AUTO_TEST_CASE(test_is_negative)
+{
+    BOOST_CHECK(NegativeCache::is_negative(response(http::status::not_found)));
+    BOOST_CHECK(NegativeCache::is_negative(response(http::status::gone)));
+    BOOST_CHECK(!NegativeCache::is_negative(response(http::status::ok)));
+    BOOST_CHECK(!NegativeCache::is_negative(response(http::status::service_unavailable)));
+
+    for (auto cc : { "no-store", "private", "no-cache", "max-age=0"
+                   , "public, s-maxage=0" }) {
+        auto rs = response(http::status::not_found);
+        rs.set(http::field::cache_control, cc);
+        BOOST_CHECK(!NegativeCache::is_negative(rs));
+    }
+
+    auto rs = response(http::status::not_found);
+    rs.set(http::field::cache_control, "max-age=60");
+    BOOST_CHECK(NegativeCache::is_negative(rs));
+
+    rs = response(http::status::not_found);
+    rs.set(http::field::date,    "Sun, 06 Nov 1994 08:49:37 GMT");
+    rs.set(http::field::expires, "Sun, 06 Nov 1994 08:49:37 GMT");
+    BOOST_CHECK(!NegativeCache::is_negative(rs));
+
+    rs.set(http::field::expires, "Sun, 06 Nov 1994 08:50:37 GMT");
+    BOOST_CHECK(NegativeCache::is_negative(rs));
+
+    rs.erase(http::field::date);
+    rs.set(http::field::expires, "0");
+    BOOST_CHECK(!NegativeCache::is_negative(rs));
+
+    BOOST_CHECK(NegativeCache::is_negative(asio::error::host_not_found));
+    BOOST_CHECK(!NegativeCache::is_negative(asio::error::operation_aborted));
+}
+
+BOOST_AUTO_TEST_CASE(test_errors_and_misses)
+{
+    NegativeCache nc({});
+
+    BOOST_CHECK(!nc.find_error("foo"));
+    BOOST_CHECK(!nc.is_miss("foo"));
+
+    nc.insert_error("foo", {{}, response(http::status::gone)});
+    nc.insert_error("bar", {asio::error::host_not_found, {}});
+    nc.insert_miss("foo");
+
+    auto e = nc.find_error("foo");
+    BOOST_REQUIRE(e);
+    BOOST_CHECK(!e->ec);
+    BOOST_CHECK_EQUAL(e->response.result(), http::status::gone);
+    BOOST_CHECK(nc.is_miss("foo"));
+
+    e = nc.find_error("bar");
+    BOOST_REQUIRE(e);
+    BOOST_CHECK_EQUAL(e->ec, asio::error::host_not_found);
+    BOOST_CHECK(!nc.is_miss("bar"));
+
+    nc.erase("foo");
+    BOOST_CHECK(!nc.find_error("foo"));
+    BOOST_CHECK(!nc.is_miss("foo"));
+
+    BOOST_CHECK_EQUAL(nc.stats().error_hits, 2u);
+    BOOST_CHECK_EQUAL(nc.stats().miss_hits, 1u);
+    BOOST_CHECK_EQUAL(nc.stats().inserted, 2u);
+    BOOST_CHECK_EQUAL(nc.stats().entries, 1u);
+}
+
+BOOST_AUTO_TEST_CASE(test_expiry)
+{
+    NegativeCache::Config config;
+    config.error_ttl = milliseconds(10);
+    config.miss_ttl = milliseconds(0);  // disabled
+    NegativeCache nc(config);
+
+    nc.insert_error("foo", {asio::error::connection_refused, {}});
+    nc.insert_miss("bar");
+
+    BOOST_CHECK(nc.find_error("foo"));
+    BOOST_CHECK(!nc.is_miss("bar"));
+
+    this_thread::sleep_for(milliseconds(20));
+
+    BOOST_CHECK(!nc.find_error("foo"));
+    BOOST_CHECK_EQUAL(nc.stats().expired, 1u);
+    BOOST_CHECK_EQUAL(nc.stats().entries, 0u);
+    BOOST_CHECK_EQUAL(nc.stats().size, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(test_memory_bound)
+{
+    NegativeCache::Config config;
+    config.max_size = 4096;
+    NegativeCache nc(config);
+
+    for (unsigned i = 0; i < 1000; ++i) {
+        nc.insert_miss("http://example.com/" + to_string(i));
+        // Keep the first one in use.
+        BOOST_CHECK(nc.is_miss("http://example.com/0"));
+    }
+
+    BOOST_CHECK_LE(nc.stats().size, config.max_size);
+    BOOST_CHECK_GT(nc.stats().evicted, 0u);
+    BOOST_CHECK_EQUAL(nc.stats().entries + nc.stats().evicted, 1000u);
+    BOOST_CHECK(nc.is_miss("http://example.com/999"));
+    BOOST_CHECK(!nc.is_miss("http://example.com/1"));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,147 @@
+#define BOOST_TEST_MODULE origin_pool
+#include <boost/test/included/unit_test.hpp>
+#include <boost/beast/http/empty_body.hpp>
+#include <boost/beast/http/message.hpp>
+#include <thread>
+
+#include <origin_pool.h>
+
+BOOST_AUTO_TEST_SUITE(ouinet_origin_pool)
+
+using namespace std;
+using namespace ouinet;
+using Request  = http::request<http::empty_body>;
+using Response = http::response<http::empty_body>;
+
+static const string origin = OriginPool::key("http", "example.com", "80");
+
+static Request request()
+{
+    Request rq{http::verb::get, "/", 11};
+    rq.set(http::field::host, "example.com");
+    return rq;
+}
+
+// A keep-alive response with a known length.
+static Response response()
+{
+    Response rs{http::status::ok, 11};
+    rs.set(http::field::content_length, "0");
+    return rs;
+}
+
+BOOST_AUTO_TEST_CASE(test_keep_alive)
+{
+    OriginPool pool({});
+
+    pool.put(origin, GenericConnection(), request(), response());
+    BOOST_CHECK_EQUAL(pool.stats().idle, 1u);
+
+    BOOST_CHECK(!pool.take(OriginPool::key("https", "example.com", "443")));
+    BOOST_CHECK(pool.take(origin));
+    BOOST_CHECK(!pool.take(origin));
+
+    BOOST_CHECK_EQUAL(pool.stats().reused, 1u);
+    BOOST_CHECK_EQUAL(pool.stats().missed, 2u);
+    BOOST_CHECK_EQUAL(pool.stats().idle, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(test_connection_close)
+{
+    OriginPool pool({});
+
+    auto rq = request();
+    rq.keep_alive(false);
+    pool.put(origin, GenericConnection(), rq, response());
+
+    auto rs = response();
+    rs.keep_alive(false);
+    pool.put(origin, GenericConnection(), request(), rs);
+
+    // HTTP/1.0 without "Connection: keep-alive".
+    auto rs10 = response();
+    rs10.version(10);
+    pool.put(origin, GenericConnection(), request(), rs10);
+
+    BOOST_CHECK_EQUAL(pool.stats().idle, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(test_need_eof)
+{
+    OriginPool pool({});
+
+    // The end of the body is only known when the origin closes.
+    Response rs{http::status::ok, 11};
+    BOOST_REQUIRE(rs.need_eof());
+
+    pool.put(origin, GenericConnection(), request(), rs);
+    BOOST_CHECK_EQUAL(pool.stats().idle, 0u);
+
+    rs.set(http::field::transfer_encoding, "chunked");
+    pool.put(origin, GenericConnection(), request(), rs);
+    BOOST_CHECK_EQUAL(pool.stats().idle, 1u);
+}
+
+BOOST_AUTO_TEST_CASE(test_keep_alive_timeout)
+{
+    BOOST_CHECK(keep_alive_timeout("timeout=5, max=100")
+                == OriginPool::Clock::duration(chrono::seconds(5)));
+    BOOST_CHECK(keep_alive_timeout("max=100, Timeout=7")
+                == OriginPool::Clock::duration(chrono::seconds(7)));
+    BOOST_CHECK(!keep_alive_timeout("max=100"));
+    BOOST_CHECK(!keep_alive_timeout("timeout="));
+    BOOST_CHECK(!keep_alive_timeout("timeout=5s"));
+
+    OriginPool pool({});
+
+    // The origin closes it about when it would be reused.
+    auto rs = response();
+    rs.set(http::field::keep_alive, "timeout=1");
+    pool.put(origin, GenericConnection(), request(), rs);
+    BOOST_CHECK_EQUAL(pool.stats().idle, 0u);
+
+    rs.set(http::field::keep_alive, "timeout=5");
+    pool.put(origin, GenericConnection(), request(), rs);
+    BOOST_CHECK_EQUAL(pool.stats().idle, 1u);
+}
+
+BOOST_AUTO_TEST_CASE(test_expiry_and_limits)
+{
+    OriginPool::Config config;
+    config.max_idle_per_origin = 2;
+    config.max_idle = 3;
+    config.idle_timeout = chrono::milliseconds(20);
+
+    OriginPool pool(config);
+
+    for (int i = 0; i < 3; ++i) {
+        pool.put(origin, GenericConnection(), request(), response());
+    }
+    BOOST_CHECK_EQUAL(pool.stats().idle, 2u);
+    BOOST_CHECK_EQUAL(pool.stats().evicted, 1u);
+
+    auto other = OriginPool::key("http", "example.org", "80");
+    pool.put(other, GenericConnection(), request(), response());
+    pool.put(other, GenericConnection(), request(), response());
+    BOOST_CHECK_EQUAL(pool.stats().idle, 3u);
+    BOOST_CHECK_EQUAL(pool.stats().evicted, 2u);
+
+    this_thread::sleep_for(chrono::milliseconds(40));
+
+    BOOST_CHECK(!pool.take(other));
+    BOOST_CHECK_EQUAL(pool.stats().expired, 3u);
+    BOOST_CHECK_EQUAL(pool.stats().idle, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(test_clear)
+{
+    OriginPool pool({});
+
+    pool.put(origin, GenericConnection(), request(), response());
+    pool.clear();
+
+    BOOST_CHECK_EQUAL(pool.stats().idle, 0u);
+    BOOST_CHECK(!pool.take(origin));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,49 @@
+#define BOOST_TEST_MODULE subresources
+#include <boost/test/included/unit_test.hpp>
+
+#include <subresource_prefetcher.h>
+
+BOOST_AUTO_TEST_SUITE(ouinet_subresources)
+
+using namespace std;
+using namespace ouinet;
+
+BOOST_AUTO_TEST_CASE(test_extract_subresources)
+{
+    const string html =
+        "<html><head>"
+        "<link rel=\"stylesheet\" href=\"/css/main.css\">"
+        "<link rel='alternate' href='/feed.xml'>"
+        "<LINK REL=icon HREF=favicon.ico>"
+        "<script src=\"../js/app.js?v=1&amp;x=2\"></script>"
+        "</head><body>"
+        "<img alt=\"x\" src=\"//cdn.example.net/a.png#frag\">"
+        "<img src=\"data:image/png;base64,AAAA\">"
+        "<img src=\"https://example.org/b.jpg\">"
+        "<img src=\"/css/main.css\">"
+        "<a href=\"/other.html\">link</a>"
+        "<video poster=\"./p.jpg\"><source src=\"v.mp4\"></video>"
+        "</body></html>";
+
+    auto urls = extract_subresources( "https://example.com/dir/page.html"
+                                    , html, 100);
+
+    vector<string> expected{
+        "https://example.com/css/main.css",
+        "https://example.com/dir/favicon.ico",
+        "https://example.com/js/app.js?v=1&x=2",
+        "https://cdn.example.net/a.png",
+        "https://example.org/b.jpg",
+        "https://example.com/dir/p.jpg",
+        "https://example.com/dir/v.mp4",
+    };
+
+    BOOST_CHECK_EQUAL_COLLECTIONS( urls.begin(), urls.end()
+                                 , expected.begin(), expected.end());
+
+    auto limited = extract_subresources( "https://example.com/dir/page.html"
+                                       , html, 2);
+    BOOST_CHECK_EQUAL(limited.size(), 2u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,112 @@
+#define BOOST_TEST_MODULE tls_workers
+#include <boost/test/included/unit_test.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/asio/write.hpp>
+#include <thread>
+
+#include <ssl/ca_certificate.h>
+#include <ssl/client_hello.h>
+#include <ssl/dummy_certificate.h>
+#include <tls_workers.h>
+
+BOOST_AUTO_TEST_SUITE(ouinet_tls_workers)
+
+using namespace std;
+using namespace ouinet;
+
+using tcp = asio::ip::tcp;
+
+BOOST_AUTO_TEST_CASE(test_serve)
+{
+    const int connections = 4;
+
+    CACertificate ca(CACertificate::KeyType::ec);
+    DummyCertificate crt(ca, "example.com");
+
+    auto chain = crt.pem_certificate() + ca.pem_certificate();
+    auto server_context = make_shared<asio::ssl::context>
+        (asio::ssl::context::tls_server);
+    server_context->use_certificate_chain(asio::buffer(chain));
+    server_context->use_private_key( asio::buffer(ca.pem_private_key())
+                                   , asio::ssl::context::pem);
+
+    TlsWorkers workers(2);
+
+    asio::io_service ios;
+    tcp::acceptor acceptor(ios, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    auto endpoint = acceptor.local_endpoint();
+
+    int served = 0;
+
+    asio::spawn(ios, [&] (asio::yield_context yield) {
+        for (int i = 0; i < connections; ++i) {
+            tcp::socket socket(ios);
+            acceptor.async_accept(socket, yield);
+
+            auto native = socket.native_handle();
+
+            asio::spawn(ios, [ &, native, con = GenericConnection(move(socket)) ]
+                             (asio::yield_context yield) mutable {
+                string server_name;
+                auto hello = ssl::read_client_hello(con, server_name, yield);
+                BOOST_CHECK_EQUAL(server_name, "www.example.com");
+
+                sys::error_code ec;
+                auto plain = workers.serve( ios, native, move(hello)
+                                          , server_context, ec);
+                BOOST_REQUIRE(!ec);
+                con = GenericConnection();
+
+                string data(5, '\0');
+                asio::async_read(plain, asio::buffer(&data[0], data.size()), yield);
+                asio::async_write(plain, asio::buffer(data + " back"), yield);
+                plain.close();
+                ++served;
+            });
+        }
+    });
+
+    vector<string> replies;
+
+    // The user agent.
+    thread client([&] {
+        asio::io_service client_ios;
+        asio::ssl::context context(asio::ssl::context::tls_client);
+        context.add_certificate_authority(asio::buffer(ca.pem_certificate()));
+        context.set_verify_mode(asio::ssl::verify_peer);
+
+        for (int i = 0; i < connections; ++i) {
+            asio::spawn(client_ios, [&] (asio::yield_context yield) {
+                tcp::socket socket(client_ios);
+                socket.async_connect(endpoint, yield);
+
+                asio::ssl::stream<tcp::socket> stream(move(socket), context);
+                stream.set_verify_callback
+                    (asio::ssl::rfc2818_verification("www.example.com"));
+                SSL_set_tlsext_host_name(stream.native_handle(), "www.example.com");
+                stream.async_handshake(asio::ssl::stream_base::client, yield);
+
+                asio::async_write(stream, asio::buffer(string("hello")), yield);
+
+                sys::error_code ec;
+                string reply(10, '\0');
+                asio::async_read(stream, asio::buffer(&reply[0], reply.size()), yield[ec]);
+                replies.push_back(reply);
+            });
+        }
+
+        client_ios.run();
+    });
+
+    ios.run();
+    client.join();
+
+    BOOST_CHECK_EQUAL(served, connections);
+    BOOST_REQUIRE_EQUAL(replies.size(), size_t(connections));
+    for (auto& r : replies) BOOST_CHECK_EQUAL(r, "hello back");
+}
+
+BOOST_AUTO_TEST_SUITE_END()